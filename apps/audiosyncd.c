@@ -0,0 +1,262 @@
+// audiosyncd keeps audiosync loaded in a long-running process, so that the
+// FFTW plans, the arena buffers, the reference cache and the PulseAudio sink
+// are only set up once. The requests are received through a Unix domain
+// socket with the protocol in client.h.
+//
+// Each connection is handled in its own thread, so that the status and abort
+// requests can be answered while a sync is running. Only one sync can run at
+// once, so the rest wait for it to finish.
+
+#define _GNU_SOURCE  // ppoll()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/client.h>
+#include <audiosync/reference_cache.h>
+
+
+// Only one audiosync_run can be running at once.
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Set by the signal handler to stop accepting connections.
+static volatile sig_atomic_t stop = 0;
+
+
+static void handle_stop(int sig) {
+    UNUSED(sig);
+    stop = 1;
+}
+
+// Reads exactly `len` bytes from the connection.
+//
+// Returns 0 on success, or -1 on error or if it was closed.
+static int recv_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, (char *) buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Runs a single request, filling its reply.
+static void handle_request(const struct audiosyncd_header *header,
+                           const char *title,
+                           struct audiosyncd_reply *reply) {
+    long lag = 0;
+
+    switch (header->type) {
+    case AUDIOSYNCD_SYNC:
+        pthread_mutex_lock(&sync_mutex);
+        reply->ret = audiosync_run(title, &lag);
+        pthread_mutex_unlock(&sync_mutex);
+        // The values of the protocol are independent from the library's.
+        if (reply->ret == AUDIOSYNC_NO_SIGNAL) {
+            reply->ret = AUDIOSYNCD_NO_SIGNAL;
+        } else if (reply->ret < 0) {
+            reply->ret = -1;
+        }
+        reply->lag = lag;
+        break;
+    case AUDIOSYNCD_PREFETCH:
+        reply->ret = refcache_prefetch(title);
+        break;
+    case AUDIOSYNCD_STATUS:
+        reply->status = audiosync_status();
+        reply->ret = 0;
+        break;
+    case AUDIOSYNCD_ABORT:
+        // Aborting while idle would leave the status as aborting, so it's
+        // only done if there's a sync in progress. It's checked atomically,
+        // so a queued sync that starts in the meantime isn't aborted.
+        audiosync_abort_running();
+        reply->ret = 0;
+        break;
+    default:
+        log("unknown request type %d", header->type);
+        reply->ret = -1;
+        break;
+    }
+}
+
+// Thread serving the requests of a connection until it's closed.
+static void *handle_connection(void *arg) {
+    const int fd = (int) (long) arg;
+    struct audiosyncd_header header;
+    char title[AUDIOSYNCD_MAX_PAYLOAD + 1];
+
+    while (recv_all(fd, &header, sizeof(header)) == 0) {
+        if (header.magic != AUDIOSYNCD_MAGIC
+                || header.version != AUDIOSYNCD_VERSION
+                || header.len > AUDIOSYNCD_MAX_PAYLOAD) {
+            log("invalid request, closing connection");
+            break;
+        }
+        if (recv_all(fd, title, header.len) < 0) {
+            break;
+        }
+        title[header.len] = '\0';
+
+        struct audiosyncd_reply reply = {
+            .magic = AUDIOSYNCD_MAGIC,
+            .ret = -1,
+        };
+        handle_request(&header, title, &reply);
+        if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL)
+                != sizeof(reply)) {
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+// Creates the listening socket at `path`, replacing a previous one.
+//
+// Returns its file descriptor, or -1 on error.
+static int listen_at(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log("socket path is too long");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // It's non-blocking, so that accept() doesn't block if the client left
+    // after ppoll() reported it.
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("audiosyncd: socket failed");
+        return -1;
+    }
+
+    // A socket left by a previous daemon that didn't exit cleanly is
+    // removed. Other kinds of files are never removed.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    // Only the current user can connect.
+    mode_t old_mask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if (ret < 0) {
+        perror("audiosyncd: bind failed");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, 16) < 0) {
+        perror("audiosyncd: listen failed");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+    const char *sink_name = NULL;
+    int opt;
+
+    if (audiosyncd_default_path(path, sizeof(path)) < 0) {
+        path[0] = '\0';
+    }
+    while ((opt = getopt(argc, argv, "s:k:")) != -1) {
+        switch (opt) {
+        case 's':
+            snprintf(path, sizeof(path), "%s", optarg);
+            break;
+        case 'k':
+            sink_name = optarg;
+            break;
+        default:
+            printf("Usage: %s [-s SOCKET] [-k SINK_NAME]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // The signals interrupt the wait for connections so that the socket can
+    // be removed. They're blocked before any thread is created, so that
+    // every thread inherits the mask, including the library's, and they're
+    // only unblocked by ppoll() while waiting. Otherwise, they could be
+    // delivered to another thread, and the daemon wouldn't notice them
+    // until the next connection.
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    struct sigaction sa = { .sa_handler = handle_stop };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Everything that can be done in advance is done before accepting
+    // requests.
+    if (sink_name && audiosync_setup(sink_name) < 0) {
+        log("couldn't set up the sink, recording the entire desktop");
+    }
+    if (audiosync_warmup() < 0) {
+        log("couldn't warm up audiosync");
+    }
+
+    int listen_fd = listen_at(path);
+    if (listen_fd < 0) {
+        exit(1);
+    }
+    log("listening at %s", path);
+
+    struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+    while (!stop) {
+        if (ppoll(&pfd, 1, NULL, &wait_mask) < 0) {
+            if (errno != EINTR) perror("audiosyncd: ppoll failed");
+            continue;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                    && errno != ECONNABORTED) {
+                perror("audiosyncd: accept failed");
+            }
+            continue;
+        }
+
+        pthread_t th;
+        if (pthread_create(&th, NULL, &handle_connection,
+                           (void *) (long) fd) != 0) {
+            perror("audiosyncd: pthread_create for connection failed");
+            close(fd);
+            continue;
+        }
+        pthread_detach(th);
+    }
+
+    // A sync in progress is stopped before exiting.
+    log("stopping daemon");
+    close(listen_fd);
+    unlink(path);
+    global_status_t status = audiosync_status();
+    if (status == RUNNING_ST || status == PAUSED_ST) {
+        audiosync_abort();
+    }
+    pthread_mutex_lock(&sync_mutex);
+    pthread_mutex_unlock(&sync_mutex);
+
+    return 0;
+}
@@ -0,0 +1,348 @@
+// Offline alignment of a batch of recording/reference pairs, used for QA
+// and to build tuning datasets. The pairs are read from a manifest, and
+// they're aligned in parallel by a work-stealing pool, where each worker has
+// its own buffers and cross-correlation workspace.
+//
+// The results are streamed as they're finished, as CSV or as JSON lines,
+// with the time spent in each stage. The throughput is printed at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/acceptance.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/periodicity.h>
+#include <audiosync/pool.h>
+#include <audiosync/sign_correlation.h>
+#include <audiosync/skew.h>
+#include "manifest.h"
+
+
+// The fields of each pair in the manifest.
+enum { RECORDING, REFERENCE, N_FIELDS };
+
+// The buffers of each worker.
+struct worker_data {
+    double *recording;    // The sample, preceded by its zero padding
+    double *sample;
+    double *source;
+    double *compensated;  // Only if the skew is estimated
+    struct xcorr_workspace ws;
+};
+
+struct batch {
+    struct manifest pairs;
+    struct worker_data *workers;
+    int json;
+    // Frames of the references searched entirely with long_correlation, or
+    // zero to only use their beginning like audiosync_run.
+    size_t long_len;
+    // The output is shared by all the workers.
+    pthread_mutex_t out_mutex;
+};
+
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Writes a string for the current output format, escaping the characters
+// that require it.
+static void write_string(const char *str, int json) {
+    if (json) {
+        putchar('"');
+        for (const char *c = str; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                printf("\\%c", *c);
+            } else if ((unsigned char) *c < 0x20) {
+                printf("\\u%04x", *c);
+            } else {
+                putchar(*c);
+            }
+        }
+        putchar('"');
+        return;
+    }
+
+    if (strpbrk(str, ",\"\n") == NULL) {
+        fputs(str, stdout);
+        return;
+    }
+    putchar('"');
+    for (const char *c = str; *c; c++) {
+        if (*c == '"') putchar('"');
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+// Aligns a pair with the intervals in the configuration, like audiosync_run
+// does, but with all the data available from the beginning. The skew is
+// only estimated if it's enabled in the configuration, and it's zero
+// otherwise. The seconds of recording that were needed are saved in
+// `seconds`, which is what a live run would have to wait for.
+//
+// If `long_len` isn't zero, the recording is searched anywhere inside that
+// many frames of the reference instead, and the lag is its position.
+//
+// Returns 0 on success, or -1 if no interval was accepted.
+static int align(struct worker_data *w, size_t long_len, long *lag,
+                 double *confidence, double *ppm, double *seconds) {
+    const struct derived_config *config = get_config();
+    struct xcorr_params params = {
+        .max_lag = config->max_lag,
+        .threads = 1,
+        .workspace = &w->ws,
+        .decimation = config->user.sample_rate / SIGN_COARSE_RATE,
+    };
+    struct xcorr_params padded = params;
+    padded.flags |= XCORR_PREPADDED;
+    struct acceptance acc;
+    struct periodicity per;
+
+    *lag = 0;
+    *confidence = 0.0;
+    *ppm = 0.0;
+    acceptance_init(&acc);
+    if (periodicity_analyze(w->source, config->len_source, &per) < 0) {
+        per.n_periods = 0;
+    }
+    for (size_t i = 0; i < config->user.n_intervals; i++) {
+        *seconds = config->user.intervals[i];
+        // The ambiguous intervals of repetitive references are skipped.
+        if (i + 1 < config->user.n_intervals
+                && periodicity_ambiguous(&per, config->interv_sample[i])) {
+            continue;
+        }
+        if (long_len > 0) {
+            size_t position;
+            if (long_correlation(w->source, long_len, w->sample,
+                                 config->interv_sample[i], &params,
+                                 &position, confidence) < 0) {
+                acceptance_fail(&acc);
+                continue;
+            }
+            *lag = position;
+        } else if (w->compensated) {
+            if (skew_correlation(w->source, w->sample,
+                                 config->interv_sample[i], &params,
+                                 w->compensated, lag, confidence, ppm) < 0) {
+                acceptance_fail(&acc);
+                continue;
+            }
+        } else if (config->user.engine == ENGINE_SIGN) {
+            if (sign_correlation(w->source, w->sample,
+                                 config->interv_sample[i], &params, lag,
+                                 confidence) < 0) {
+                acceptance_fail(&acc);
+                continue;
+            }
+        } else if (cross_correlation_ex(w->source, w->sample,
+                                        config->interv_sample[i], &padded,
+                                        lag, confidence) < 0) {
+            acceptance_fail(&acc);
+            continue;
+        }
+        if (acceptance_update(&acc, *lag, *confidence)) {
+            *lag = round((double) (*lag) * config->frames_to_ms);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Task run by the pool for each pair.
+static void run_pair(void *ctx, unsigned int worker, size_t task) {
+    struct batch *batch = ctx;
+    struct worker_data *w = &batch->workers[worker];
+    const char *recording = manifest_field(&batch->pairs, task, RECORDING);
+    const char *reference = manifest_field(&batch->pairs, task, REFERENCE);
+    const struct derived_config *config = get_config();
+    long lag = 0;
+    double confidence = 0.0;
+    double ppm = 0.0;
+    double seconds = 0.0;
+    int ret = -1;
+
+    const double start = now_ms();
+    const size_t source_len = batch->long_len > 0 ? batch->long_len
+        : config->len_source;
+    if (ffmpeg_decode(recording, w->sample, config->len_sample) == 0
+            && ffmpeg_decode(reference, w->source, source_len) == 0) {
+        ret = 0;
+    }
+    const double decoded = now_ms();
+    if (ret == 0) {
+        ret = align(w, batch->long_len, &lag, &confidence, &ppm, &seconds);
+    }
+    const double aligned = now_ms();
+
+    pthread_mutex_lock(&batch->out_mutex);
+    if (batch->json) {
+        printf("{\"index\":%zu,\"recording\":", task);
+        write_string(recording, 1);
+        printf(",\"reference\":");
+        write_string(reference, 1);
+        printf(",\"ret\":%d,\"lag_ms\":%ld,\"confidence\":%f,"
+               "\"skew_ppm\":%.3f,\"interval_s\":%g,\"decode_ms\":%.3f,"
+               "\"correlate_ms\":%.3f,\"total_ms\":%.3f}\n", ret, lag,
+               confidence, ppm, seconds, decoded - start, aligned - decoded,
+               aligned - start);
+    } else {
+        printf("%zu,", task);
+        write_string(recording, 0);
+        putchar(',');
+        write_string(reference, 0);
+        printf(",%d,%ld,%f,%.3f,%g,%.3f,%.3f,%.3f\n", ret, lag,
+               confidence, ppm, seconds, decoded - start, aligned - decoded,
+               aligned - start);
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&batch->out_mutex);
+}
+
+int main(int argc, char *argv[]) {
+    long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    struct batch batch = {
+        .out_mutex = PTHREAD_MUTEX_INITIALIZER,
+    };
+    struct audiosync_config user_config;
+    double long_seconds = 0.0;
+    int opt;
+
+    audiosync_get_config(&user_config);
+    while ((opt = getopt(argc, argv, "j:f:sa:e:t:l:")) != -1) {
+        switch (opt) {
+        case 'j':
+            n_workers = atol(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                batch.json = 1;
+            } else if (strcmp(optarg, "csv") != 0) {
+                n_workers = 0;
+            }
+            break;
+        case 's':
+            user_config.skew_compensation = 1;
+            break;
+        case 'a':
+            user_config.agreement_intervals = atoi(optarg);
+            break;
+        case 'e':
+            if (engine_from_string(optarg, &user_config.engine) < 0) {
+                n_workers = 0;
+            }
+            break;
+        case 't':
+            if (transport_from_string(optarg, &user_config.transport) < 0) {
+                n_workers = 0;
+            }
+            break;
+        case 'l':
+            long_seconds = atof(optarg);
+            if (!(long_seconds > 0.0)) n_workers = 0;
+            break;
+        default:
+            n_workers = 0;
+            break;
+        }
+    }
+    if (optind != argc - 1 || n_workers <= 0) {
+        printf("Usage: %s [-j WORKERS] [-f csv|json] [-s] [-a INTERVALS]"
+               " [-e fft|sign] [-t pipe|memfd] [-l SECONDS] MANIFEST\n"
+               "Each line of the manifest is a pair of files separated by a"
+               " tab: the recording and the reference. With -s, the clock"
+               " skew is estimated and compensated too. With -a, a lag is"
+               " also accepted when that many consecutive intervals agree on"
+               " it. With -e, the engine used for the lag is chosen, and"
+               " with -t, how the decoded audio is obtained from ffmpeg."
+               " With -l, the recording is searched anywhere inside the first"
+               " SECONDS of the reference, and the lag is its position.\n",
+               argv[0]);
+        exit(1);
+    }
+    if (audiosync_configure(&user_config) < 0) {
+        exit(1);
+    }
+    batch.long_len = long_seconds * user_config.sample_rate;
+    if (manifest_read(argv[optind], N_FIELDS, &batch.pairs) < 0) {
+        exit(1);
+    }
+    if ((size_t) n_workers > batch.pairs.n_lines && batch.pairs.n_lines > 0) {
+        n_workers = batch.pairs.n_lines;
+    }
+
+    // Each worker has its own buffers, so that they don't share anything
+    // while aligning.
+    const struct derived_config *config = get_config();
+    // With the memfd transport, ffmpeg decodes directly into the buffers.
+    void *(*alloc)(size_t) = config->user.transport == TRANSPORT_MEMFD
+        ? arena_alloc_shared : arena_alloc;
+    int ret = 1;
+    batch.workers = calloc(n_workers, sizeof(*batch.workers));
+    if (batch.workers == NULL) {
+        perror("batch: calloc for workers failed");
+        goto finish;
+    }
+    for (long i = 0; i < n_workers; i++) {
+        struct worker_data *w = &batch.workers[i];
+        w->recording = alloc(2 * config->len_sample * sizeof(*w->recording));
+        w->source = alloc((batch.long_len > 0 ? batch.long_len
+                           : config->len_source) * sizeof(*w->source));
+        if (w->recording == NULL || w->source == NULL
+                || xcorr_workspace_init(&w->ws, config->len_sample) < 0) {
+            fprintf(stderr, "batch: couldn't allocate the worker buffers\n");
+            goto finish;
+        }
+        // The padding is never overwritten, so it's only zeroed once.
+        memset(w->recording, 0, config->len_sample * sizeof(*w->recording));
+        w->sample = w->recording + config->len_sample;
+        if (config->user.skew_compensation) {
+            w->compensated = arena_alloc(config->len_sample
+                                         * sizeof(*w->compensated));
+            if (w->compensated == NULL) {
+                fprintf(stderr, "batch: couldn't allocate the worker"
+                        " buffers\n");
+                goto finish;
+            }
+        }
+    }
+
+    if (!batch.json) {
+        printf("index,recording,reference,ret,lag_ms,confidence,skew_ppm,"
+               "interval_s,decode_ms,correlate_ms,total_ms\n");
+    }
+    const double start = now_ms();
+    if (pool_run(batch.pairs.n_lines, n_workers, &run_pair, &batch) < 0) {
+        goto finish;
+    }
+    const double elapsed = (now_ms() - start) / 1000.0;
+    fprintf(stderr, "Aligned %zu pairs with %ld workers in %.3f s (%.2f"
+            " pairs/s)\n", batch.pairs.n_lines, n_workers, elapsed,
+            elapsed > 0 ? batch.pairs.n_lines / elapsed : 0.0);
+    ret = 0;
+
+finish:
+    for (long i = 0; batch.workers && i < n_workers; i++) {
+        arena_free(batch.workers[i].recording);
+        arena_free(batch.workers[i].source);
+        arena_free(batch.workers[i].compensated);
+        xcorr_workspace_free(&batch.workers[i].ws);
+    }
+    free(batch.workers);
+    manifest_free(&batch.pairs);
+
+    return ret;
+}
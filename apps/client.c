@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <audiosync/client.h>
+
+
+static void usage(const char *name) {
+    printf("Usage: %s [-s SOCKET] sync \"TITLE\" | prefetch \"TITLE\""
+           " | status | abort\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's') usage(argv[0]);
+        path = optarg;
+    }
+    if (optind >= argc) usage(argv[0]);
+    const char *command = argv[optind];
+    const char *title = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    int fd = audiosyncd_connect(path);
+    if (fd < 0) {
+        exit(1);
+    }
+
+    // The requests themselves log the errors.
+    int ret = -1;
+    if (strcmp(command, "sync") == 0 && title) {
+        long lag = 0;
+        ret = audiosyncd_sync(fd, title, &lag);
+        if (ret == AUDIOSYNCD_NO_SIGNAL) {
+            printf("Nothing is being played\n");
+        } else {
+            printf("Obtained lag (ret=%d): %ld\n", ret, lag);
+        }
+    } else if (strcmp(command, "prefetch") == 0 && title) {
+        ret = audiosyncd_prefetch(fd, title);
+        printf("Prefetched (ret=%d)\n", ret);
+    } else if (strcmp(command, "status") == 0) {
+        unsigned int status = 0;
+        ret = audiosyncd_status(fd, &status);
+        printf("Status (ret=%d): %s\n", ret,
+               audiosyncd_status_to_string(status));
+    } else if (strcmp(command, "abort") == 0) {
+        ret = audiosyncd_abort(fd);
+        printf("Aborted (ret=%d)\n", ret);
+    } else {
+        close(fd);
+        usage(argv[0]);
+    }
+
+    close(fd);
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+// Reading the manifests of batch and bench_run. See manifest.h for more
+// details.
+
+#define _GNU_SOURCE  // getline()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "manifest.h"
+
+
+// Splits a line into `n_fields` fields in place, saving them in `fields`.
+//
+// Returns 0 on success, or -1 if it has fewer fields.
+static int split_line(char *line, size_t n_fields, char **fields) {
+    fields[0] = line;
+    for (size_t i = 1; i < n_fields; i++) {
+        char *tab = strchr(fields[i - 1], '\t');
+        if (tab == NULL) return -1;
+        *tab = '\0';
+        fields[i] = tab + 1;
+    }
+
+    return 0;
+}
+
+// Reads the manifest at `path`, with `n_fields` per line.
+//
+// Returns 0 on success, or -1 on error. The manifest must be freed with
+// manifest_free in both cases.
+int manifest_read(const char *path, size_t n_fields,
+                  struct manifest *manifest) {
+    *manifest = (struct manifest) { .n_fields = n_fields };
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    int ret = 0;
+    char *split[n_fields];
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t cap = 0;
+    ssize_t len;
+    size_t lineno = 0;
+    while ((len = getline(&line, &line_size, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') continue;
+
+        if (split_line(line, n_fields, split) < 0) {
+            fprintf(stderr, "%s: line %zu doesn't have %zu fields, skipping"
+                    " it\n", path, lineno, n_fields);
+            continue;
+        }
+
+        if (manifest->n_lines == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(manifest->fields,
+                                   cap * n_fields * sizeof(*grown));
+            if (grown == NULL) {
+                perror("realloc for manifest failed");
+                ret = -1;
+                break;
+            }
+            manifest->fields = grown;
+        }
+        char **fields = &manifest->fields[manifest->n_lines * n_fields];
+        for (size_t i = 0; i < n_fields; i++) {
+            fields[i] = strdup(split[i]);
+        }
+        manifest->n_lines++;
+    }
+
+    free(line);
+    fclose(fp);
+    return ret;
+}
+
+// Frees the fields read by manifest_read.
+void manifest_free(struct manifest *manifest) {
+    for (size_t i = 0; i < manifest->n_lines * manifest->n_fields; i++) {
+        free(manifest->fields[i]);
+    }
+    free(manifest->fields);
+    *manifest = (struct manifest) { .n_fields = manifest->n_fields };
+}
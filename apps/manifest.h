@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Manifests of the tools that process many files, like batch and bench_run.
+// Each line has a fixed number of fields separated by tabs, and the last one
+// takes the rest of the line. Empty lines and lines starting with '#' are
+// ignored, and the ones with fewer fields are skipped with a warning.
+struct manifest {
+    char **fields;    // `n_fields` per line, one line after the other
+    size_t n_lines;
+    size_t n_fields;
+};
+
+// Reads the manifest at `path`, with `n_fields` per line.
+//
+// Returns 0 on success, or -1 on error. The manifest must be freed with
+// manifest_free in both cases.
+int manifest_read(const char *path, size_t n_fields,
+                  struct manifest *manifest);
+void manifest_free(struct manifest *manifest);
+
+// Returns a field of a line of the manifest.
+static inline const char *manifest_field(const struct manifest *manifest,
+                                         size_t line, size_t field) {
+    return manifest->fields[line * manifest->n_fields + field];
+}
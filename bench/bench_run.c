@@ -0,0 +1,333 @@
+// End-to-end benchmark of audiosync_run with a corpus of local recordings
+// and references, without PulseAudio, YouTube or a music player. The
+// recording is replayed by ffmpeg in real time, like if it was being played,
+// and the reference is decoded from its file instead of downloaded, so the
+// time-to-result is the one a user would see, minus the network.
+//
+// Each line of the manifest has the recording, the reference and the lag
+// expected from audiosync_run in milliseconds, separated by tabs. The
+// results are printed per track as CSV or JSON lines, with the
+// time-to-result, the intervals correlated, the error and the CPU time, and
+// their percentiles are printed at the end.
+//
+// The caches are disabled unless -c is used, in which case the repetitions
+// after the first one measure the runs with cached references.
+//
+// The time of a calibration loop is printed too, which only depends on the
+// speed of the machine, to normalize the CPU times with it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/capture/linux_capture.h>
+#include <audiosync/download/linux_download.h>
+#include "manifest.h"
+
+// Maximum error accepted by default, in milliseconds.
+#define DEFAULT_TOLERANCE_MS 20
+// Steps of the calibration loop, and times it's measured.
+#define CALIBRATION_STEPS 2000000
+#define CALIBRATION_RUNS 11
+
+
+// The fields of each track in the manifest.
+enum { RECORDING, REFERENCE, EXPECTED, N_FIELDS };
+
+struct track {
+    const char *recording;
+    const char *reference;
+    long expected;   // In milliseconds
+};
+
+// The measurements of a single run.
+struct result {
+    int ret;
+    long lag;
+    double time_ms;       // Time-to-result
+    double cpu_ms;        // CPU time of audiosync's threads
+    double ffmpeg_cpu_ms; // CPU time of the ffmpeg processes
+    struct audiosync_run_stats stats;
+    int correct;
+};
+
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static double cpu_ms(int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1e3
+        + usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// The nearest-rank percentile `p` of `n` sorted values.
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t rank = (size_t) (p / 100.0 * n + 0.999999);
+    if (rank == 0) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+// Returns the median time of a fixed chain of floating point operations, in
+// milliseconds. It's the same loop as bench_xcorr's.
+static double calibrate() {
+    double times[CALIBRATION_RUNS];
+    for (int run = 0; run < CALIBRATION_RUNS; run++) {
+        const double start = now_ms();
+        double x = 1.0, acc = 0.0;
+        for (int i = 0; i < CALIBRATION_STEPS; i++) {
+            x = x * 1.0000001 + 1e-7;
+            acc += x / (1.0 + acc * 1e-9);
+        }
+        volatile double sink = acc;
+        UNUSED(sink);
+        times[run] = now_ms() - start;
+    }
+    qsort(times, CALIBRATION_RUNS, sizeof(*times), compare_doubles);
+    return percentile(times, CALIBRATION_RUNS, 50.0);
+}
+
+// Obtains the tracks from the manifest, whose fields are kept in it, parsing
+// their lags.
+//
+// Returns the number of tracks, or -1 on error.
+static long read_tracks(const struct manifest *manifest,
+                        struct track **tracks) {
+    *tracks = calloc(manifest->n_lines, sizeof(**tracks));
+    if (*tracks == NULL && manifest->n_lines > 0) {
+        perror("bench_run: calloc for tracks failed");
+        return -1;
+    }
+
+    long n = 0;
+    for (size_t i = 0; i < manifest->n_lines; i++) {
+        const char *lag = manifest_field(manifest, i, EXPECTED);
+        char *end;
+        const long expected = strtol(lag, &end, 10);
+        if (end == lag || *end != '\0') {
+            fprintf(stderr, "bench_run: invalid lag '%s' in the manifest,"
+                    " skipping it\n", lag);
+            continue;
+        }
+
+        (*tracks)[n].recording = manifest_field(manifest, i, RECORDING);
+        (*tracks)[n].reference = manifest_field(manifest, i, REFERENCE);
+        (*tracks)[n].expected = expected;
+        n++;
+    }
+
+    return n;
+}
+
+// Runs audiosync with a track, measuring it.
+static void bench_track(const struct track *track, long tolerance,
+                        struct result *res) {
+    capture_replay(track->recording);
+    download_local(track->reference);
+
+    const double cpu_start = cpu_ms(RUSAGE_SELF);
+    const double ffmpeg_start = cpu_ms(RUSAGE_CHILDREN);
+    const double start = now_ms();
+    res->ret = audiosync_run(track->reference, &res->lag);
+    res->time_ms = now_ms() - start;
+    res->cpu_ms = cpu_ms(RUSAGE_SELF) - cpu_start;
+    res->ffmpeg_cpu_ms = cpu_ms(RUSAGE_CHILDREN) - ffmpeg_start;
+    if (audiosync_last_run(&res->stats) < 0) {
+        memset(&res->stats, 0, sizeof(res->stats));
+    }
+    res->correct = res->ret == 0
+        && labs(res->lag - track->expected) <= tolerance;
+}
+
+static void print_result(const struct track *track, const struct result *res,
+                         int json) {
+    if (json) {
+        // The paths are printed as they are, so they shouldn't need
+        // escaping.
+        printf("{\"recording\":\"%s\",\"ret\":%d,\"lag_ms\":%ld,"
+               "\"expected_ms\":%ld,\"correct\":%s,\"time_ms\":%.3f,"
+               "\"intervals\":%u,\"recorded_s\":%g,\"cpu_ms\":%.3f,"
+               "\"ffmpeg_cpu_ms\":%.3f}\n", track->recording, res->ret,
+               res->lag, track->expected, res->correct ? "true" : "false",
+               res->time_ms, res->stats.intervals, res->stats.recorded,
+               res->cpu_ms, res->ffmpeg_cpu_ms);
+    } else {
+        printf("%s,%d,%ld,%ld,%d,%.3f,%u,%g,%.3f,%.3f\n", track->recording,
+               res->ret, res->lag, track->expected, res->correct,
+               res->time_ms, res->stats.intervals, res->stats.recorded,
+               res->cpu_ms, res->ffmpeg_cpu_ms);
+    }
+    fflush(stdout);
+}
+
+// Prints the percentiles of a measurement of all the runs.
+static void print_percentiles(const char *name, double *values, size_t n,
+                              int json) {
+    qsort(values, n, sizeof(*values), compare_doubles);
+    const double p50 = percentile(values, n, 50.0);
+    const double p90 = percentile(values, n, 90.0);
+    const double p99 = percentile(values, n, 99.0);
+    if (json) {
+        printf(",\"%s\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,"
+               "\"max\":%.3f}", name, p50, p90, p99, values[n - 1]);
+    } else {
+        fprintf(stderr, "%-14s p50 %10.3f  p90 %10.3f  p99 %10.3f  max"
+                " %10.3f\n", name, p50, p90, p99, values[n - 1]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct audiosync_config user_config;
+    long tolerance = DEFAULT_TOLERANCE_MS;
+    int repeats = 1;
+    int json = 0;
+    int caches = 0;
+    int valid = 1;
+    int opt;
+
+    audiosync_get_config(&user_config);
+    while ((opt = getopt(argc, argv, "n:f:e:t:T:c")) != -1) {
+        switch (opt) {
+        case 'n':
+            repeats = atoi(optarg);
+            if (repeats <= 0) valid = 0;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                json = 1;
+            } else if (strcmp(optarg, "csv") != 0) {
+                valid = 0;
+            }
+            break;
+        case 'e':
+            if (engine_from_string(optarg, &user_config.engine) < 0) {
+                valid = 0;
+            }
+            break;
+        case 't':
+            if (transport_from_string(optarg, &user_config.transport) < 0) {
+                valid = 0;
+            }
+            break;
+        case 'T':
+            tolerance = atol(optarg);
+            if (tolerance < 0) valid = 0;
+            break;
+        case 'c':
+            caches = 1;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+    }
+    if (optind != argc - 1 || !valid) {
+        printf("Usage: %s [-n REPEATS] [-f csv|json] [-e fft|sign]"
+               " [-t pipe|memfd] [-T MILLISECONDS] [-c] MANIFEST\n"
+               "Each line of the manifest has the recording, the reference"
+               " and the expected lag in milliseconds, separated by tabs."
+               " The recording is replayed in real time, and the whole"
+               " corpus is run REPEATS times. A lag is correct if it's"
+               " within -T milliseconds of the expected one (%d by"
+               " default). With -c, the caches are enabled.\n", argv[0],
+               DEFAULT_TOLERANCE_MS);
+        exit(1);
+    }
+    user_config.reference_cache = caches;
+    user_config.result_cache = caches;
+    if (audiosync_configure(&user_config) < 0) {
+        exit(1);
+    }
+
+    struct manifest manifest;
+    struct track *tracks = NULL;
+    long n_tracks = -1;
+    if (manifest_read(argv[optind], N_FIELDS, &manifest) == 0) {
+        n_tracks = read_tracks(&manifest, &tracks);
+    }
+    if (n_tracks <= 0) {
+        fprintf(stderr, "bench_run: the manifest doesn't have any tracks\n");
+        exit(1);
+    }
+
+    int ret = 1;
+    const size_t n_runs = n_tracks * repeats;
+    struct result *results = calloc(n_runs, sizeof(*results));
+    double *values = malloc(n_runs * sizeof(*values));
+    if (results == NULL || values == NULL) {
+        perror("bench_run: calloc for results failed");
+        goto finish;
+    }
+    // The plans and buffers are prepared beforehand, so that the first run
+    // isn't slower than the rest.
+    if (audiosync_warmup() < 0) {
+        fprintf(stderr, "bench_run: warmup failed\n");
+        goto finish;
+    }
+
+    if (!json) {
+        printf("recording,ret,lag_ms,expected_ms,correct,time_ms,intervals,"
+               "recorded_s,cpu_ms,ffmpeg_cpu_ms\n");
+    }
+    for (size_t i = 0; i < n_runs; i++) {
+        const struct track *track = &tracks[i % n_tracks];
+        bench_track(track, tolerance, &results[i]);
+        print_result(track, &results[i], json);
+    }
+    capture_replay(NULL);
+    download_local(NULL);
+
+    // The aggregate results, as the last JSON line or in stderr.
+    size_t correct = 0;
+    double intervals = 0.0;
+    for (size_t i = 0; i < n_runs; i++) {
+        correct += results[i].correct;
+        intervals += results[i].stats.intervals;
+    }
+    const double calibration = calibrate();
+    if (json) {
+        printf("{\"runs\":%zu,\"correct\":%zu,\"accuracy\":%.4f,"
+               "\"mean_intervals\":%.3f,\"calibration_ms\":%.3f", n_runs,
+               correct, (double) correct / n_runs, intervals / n_runs,
+               calibration);
+    } else {
+        fprintf(stderr, "%zu runs, %zu correct (%.1f%%), %.2f intervals on"
+                " average, %.3f ms of calibration\n", n_runs, correct,
+                100.0 * correct / n_runs, intervals / n_runs, calibration);
+    }
+    for (size_t i = 0; i < n_runs; i++) values[i] = results[i].time_ms;
+    print_percentiles("time_ms", values, n_runs, json);
+    for (size_t i = 0; i < n_runs; i++) values[i] = results[i].cpu_ms;
+    print_percentiles("cpu_ms", values, n_runs, json);
+    for (size_t i = 0; i < n_runs; i++) values[i] = results[i].ffmpeg_cpu_ms;
+    print_percentiles("ffmpeg_cpu_ms", values, n_runs, json);
+    for (size_t i = 0; i < n_runs; i++) {
+        values[i] = results[i].stats.recorded;
+    }
+    print_percentiles("recorded_s", values, n_runs, json);
+    if (json) printf("}\n");
+    ret = 0;
+
+finish:
+    free(tracks);
+    manifest_free(&manifest);
+    free(results);
+    free(values);
+
+    return ret;
+}
@@ -0,0 +1,199 @@
+// Throughput of the transports used to obtain the decoded audio from ffmpeg:
+// the pipe, and the memfd shared with it. A WAV file of random noise is
+// decoded repeatedly into the same buffer with ffmpeg_decode, which is also
+// how the references are prefetched, and the median time of each transport
+// is printed.
+//
+// The file is already in the output format, so ffmpeg barely has to do any
+// work, and most of the time is spent moving the data. With -x, the file is
+// longer than the frames decoded, like most references, so ffmpeg has to
+// stop at the end of the buffer.
+
+#define _GNU_SOURCE  // mkstemp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/ffmpeg_pipe.h>
+
+#define DEFAULT_SECONDS 60
+#define DEFAULT_RUNS 9
+
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void put_u32(FILE *fp, uint32_t value) {
+    const unsigned char bytes[] = {
+        value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24
+    };
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+static void put_u16(FILE *fp, uint16_t value) {
+    const unsigned char bytes[] = { value & 0xff, value >> 8 };
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+// Writes `len` frames of noise into a mono WAV file of 64-bit floats.
+//
+// Returns 0 on success, or -1 on error.
+static int write_wav(const char *path, size_t len, unsigned int rate) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("bench_transport: fopen failed");
+        return -1;
+    }
+
+    const uint32_t data_size = len * sizeof(double);
+    fwrite("RIFF", 1, 4, fp);
+    put_u32(fp, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, fp);
+    put_u32(fp, 16);
+    put_u16(fp, 3);  // IEEE float
+    put_u16(fp, NUM_CHANNELS);
+    put_u32(fp, rate);
+    put_u32(fp, rate * sizeof(double));
+    put_u16(fp, sizeof(double));
+    put_u16(fp, 8 * sizeof(double));
+    fwrite("data", 1, 4, fp);
+    put_u32(fp, data_size);
+    for (size_t i = 0; i < len; i++) {
+        const double value = (double) rand() / RAND_MAX - 0.5;
+        fwrite(&value, sizeof(value), 1, fp);
+    }
+
+    if (fclose(fp) != 0) {
+        perror("bench_transport: fclose failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Decodes the file `runs` times into `buf`, printing the median time.
+//
+// Returns the median in milliseconds, or a negative value on error.
+static double bench(const char *name, const char *path, double *buf,
+                    size_t len, int runs) {
+    double *times = malloc(runs * sizeof(*times));
+    if (times == NULL) {
+        perror("bench_transport: malloc failed");
+        return -1.0;
+    }
+
+    // The first decode isn't measured, so that ffmpeg and the file are
+    // already in the page cache.
+    double median = -1.0;
+    if (ffmpeg_decode(path, buf, len) < 0) {
+        fprintf(stderr, "bench_transport: ffmpeg failed\n");
+        goto finish;
+    }
+    for (int i = 0; i < runs; i++) {
+        const double start = now_ms();
+        if (ffmpeg_decode(path, buf, len) < 0) {
+            fprintf(stderr, "bench_transport: ffmpeg failed\n");
+            goto finish;
+        }
+        times[i] = now_ms() - start;
+    }
+    qsort(times, runs, sizeof(*times), compare_doubles);
+    median = times[runs / 2];
+    printf("%-6s median %8.2f ms, min %8.2f ms, %8.1f MB/s\n", name,
+           median, times[0], len * sizeof(*buf) / median / 1000.0);
+
+finish:
+    free(times);
+    return median;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = DEFAULT_SECONDS;
+    double extra = 0.0;
+    int runs = DEFAULT_RUNS;
+    double *buf = NULL;
+    double *shared = NULL;
+    int ret = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:x:")) != -1) {
+        switch (opt) {
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'x':
+            extra = atof(optarg);
+            break;
+        default:
+            runs = 0;
+            break;
+        }
+    }
+    if (optind != argc || !(seconds > 0.0) || !(extra >= 0.0) || runs <= 0) {
+        printf("Usage: %s [-s SECONDS] [-n RUNS] [-x EXTRA]\n"
+               "Decodes SECONDS of audio with ffmpeg RUNS times through each"
+               " transport, and prints their median times. The file has"
+               " EXTRA more seconds that aren't decoded.\n", argv[0]);
+        exit(1);
+    }
+
+    const struct derived_config *config = get_config();
+    const size_t len = seconds * config->user.sample_rate;
+    char path[] = "/tmp/bench_transport_XXXXXX.wav";
+    const int fd = mkstemps(path, 4);
+    if (fd < 0) {
+        perror("bench_transport: mkstemps failed");
+        exit(1);
+    }
+    close(fd);
+    srand(1234);
+    const size_t file_len = len + extra * config->user.sample_rate;
+    if (write_wav(path, file_len, config->user.sample_rate) < 0) {
+        goto finish;
+    }
+
+    buf = arena_alloc(len * sizeof(*buf));
+    shared = arena_alloc_shared(len * sizeof(*shared));
+    if (buf == NULL || shared == NULL) {
+        fprintf(stderr, "bench_transport: couldn't allocate the buffers\n");
+        goto finish;
+    }
+
+    printf("Decoding %g seconds (%.1f MB) %d times\n", seconds,
+           len * sizeof(*buf) / 1e6, runs);
+    const double pipe_ms = bench("pipe", path, buf, len, runs);
+    const double memfd_ms = bench("memfd", path, shared, len, runs);
+    if (pipe_ms < 0.0 || memfd_ms < 0.0) {
+        goto finish;
+    }
+    if (memcmp(buf, shared, len * sizeof(*buf)) != 0) {
+        fprintf(stderr, "bench_transport: the transports differ\n");
+        goto finish;
+    }
+    printf("memfd speedup: %.2fx\n", pipe_ms / memfd_ms);
+    ret = 0;
+
+finish:
+    arena_free(buf);
+    arena_free(shared);
+    unlink(path);
+
+    return ret;
+}
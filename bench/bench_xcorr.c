@@ -0,0 +1,322 @@
+// Microbenchmarks of the correlation kernels: the forward transform, the
+// search of the peak with max_abs_index, pearson_coefficient, and the whole
+// cross_correlation_ex with precomputed plans and a workspace, like in the
+// runs. They're measured with the sample length of every interval in the
+// configuration, and with a sweep of other lengths, which by default
+// includes some that aren't powers of two or are prime.
+//
+// Each measurement is repeated after some warmup iterations, which aren't
+// counted, and the median, p99 and minimum are printed as JSON, so that the
+// results can be compared between commits and machines. Optionally, the
+// process is pinned to a CPU, which all the threads inherit.
+//
+// A calibration loop that doesn't depend on audiosync is measured the same
+// way, so that the results can be divided by it to compare them between
+// machines of different speeds, like in tests/perf_gate.py.
+
+#define _GNU_SOURCE  // sched_setaffinity()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <complex.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+
+#define DEFAULT_ITERATIONS 21
+#define DEFAULT_WARMUP 3
+#define MAX_SIZES 64
+// Steps of the calibration loop.
+#define CALIBRATION_STEPS 2000000
+
+// The sample lengths of the sweep, in frames, if none are provided.
+static const size_t default_sweep[] = {
+    1000, 4096, 10007, 65536, 100000, 262144, 1000003
+};
+
+
+// The state of a measurement.
+struct kernel_data {
+    size_t len;              // Sample length
+    double *source;          // Twice the sample length
+    double *recording;       // The sample, preceded by its padding
+    double *sample;
+    double *results;         // Twice the sample length
+    double complex *spectrum;
+    struct xcorr_workspace ws;
+    struct xcorr_params params;
+};
+
+typedef void (*kernel_fn)(struct kernel_data *data);
+
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// The nearest-rank percentile `p` of `n` sorted values.
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t rank = (size_t) (p / 100.0 * n + 0.999999);
+    if (rank == 0) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+// A chain of dependent floating point operations, which takes about the
+// same time as long as the CPU and the compiler are the same.
+static void calibration(struct kernel_data *data) {
+    UNUSED(data);
+    double x = 1.0, acc = 0.0;
+    for (int i = 0; i < CALIBRATION_STEPS; i++) {
+        x = x * 1.0000001 + 1e-7;
+        acc += x / (1.0 + acc * 1e-9);
+    }
+    volatile double sink = acc;
+    UNUSED(sink);
+}
+
+static void kernel_fft(struct kernel_data *data) {
+    xcorr_spectrum(data->source, data->len, data->spectrum);
+}
+
+static void kernel_peak(struct kernel_data *data) {
+    size_t index;
+    max_abs_index(data->results, 2 * data->len, NULL, &index);
+}
+
+static void kernel_pearson(struct kernel_data *data) {
+    pearson_coefficient(data->source, data->source + data->len, data->sample,
+                        data->sample + data->len);
+}
+
+static void kernel_xcorr(struct kernel_data *data) {
+    long lag;
+    double coef;
+    cross_correlation_ex(data->source, data->sample, data->len,
+                         &data->params, &lag, &coef);
+}
+
+// Allocates and fills the buffers for a sample length, with the sample
+// taken from the source.
+//
+// Returns 0 on success, or -1 on error.
+static int data_init(struct kernel_data *data, size_t len,
+                     unsigned int threads) {
+    memset(data, 0, sizeof(*data));
+    data->len = len;
+    data->source = arena_alloc(2 * len * sizeof(*data->source));
+    data->recording = arena_alloc(2 * len * sizeof(*data->recording));
+    data->results = arena_alloc(2 * len * sizeof(*data->results));
+    data->spectrum = arena_alloc((len + 1) * sizeof(*data->spectrum));
+    if (data->source == NULL || data->recording == NULL
+            || data->results == NULL || data->spectrum == NULL
+            || xcorr_workspace_init(&data->ws, len) < 0
+            || xcorr_prepare(len) < 0) {
+        fprintf(stderr, "bench_xcorr: couldn't allocate the buffers for"
+                " %zu frames\n", len);
+        return -1;
+    }
+
+    for (size_t i = 0; i < 2 * len; i++) {
+        data->source[i] = (double) rand() / RAND_MAX - 0.5;
+        data->results[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    memset(data->recording, 0, len * sizeof(*data->recording));
+    data->sample = data->recording + len;
+    for (size_t i = 0; i < len; i++) {
+        data->sample[i] = data->source[i + len / 3];
+    }
+    data->params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+    data->params.threads = threads;
+    data->params.workspace = &data->ws;
+    data->params.flags = XCORR_PREPADDED;
+
+    return 0;
+}
+
+static void data_free(struct kernel_data *data) {
+    arena_free(data->source);
+    arena_free(data->recording);
+    arena_free(data->results);
+    arena_free(data->spectrum);
+    xcorr_workspace_free(&data->ws);
+    // There's room for the plans of a limited number of lengths.
+    xcorr_clear_plans();
+}
+
+// Runs a kernel `iterations` times after the warmup, saving the sorted
+// times in microseconds.
+static void measure(kernel_fn fn, struct kernel_data *data, int iterations,
+                    int warmup, double *times) {
+    for (int i = 0; i < warmup; i++) {
+        fn(data);
+    }
+    for (int i = 0; i < iterations; i++) {
+        const double start = now_us();
+        fn(data);
+        times[i] = now_us() - start;
+    }
+    qsort(times, iterations, sizeof(*times), compare_doubles);
+}
+
+// Measures a kernel, printing its result as a JSON object.
+static void bench(const char *name, kernel_fn fn, struct kernel_data *data,
+                  int interval, int iterations, int warmup, double *times,
+                  int first) {
+    measure(fn, data, iterations, warmup, times);
+
+    printf("%s\n    {\"kernel\": \"%s\", \"size\": %zu, \"interval\": %s,"
+           " \"median_us\": %.3f, \"p99_us\": %.3f, \"min_us\": %.3f}",
+           first ? "" : ",", name, data->len, interval ? "true" : "false",
+           percentile(times, iterations, 50.0),
+           percentile(times, iterations, 99.0), times[0]);
+    fflush(stdout);
+}
+
+// Parses a comma-separated list of sizes.
+//
+// Returns the number of sizes, or -1 if it's invalid.
+static int parse_sizes(char *list, size_t *sizes) {
+    int n = 0;
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        char *end;
+        const long size = strtol(tok, &end, 10);
+        if (*end != '\0' || size <= 1 || n == MAX_SIZES) {
+            return -1;
+        }
+        sizes[n++] = size;
+    }
+
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    const struct derived_config *config = get_config();
+    int iterations = DEFAULT_ITERATIONS;
+    int warmup = DEFAULT_WARMUP;
+    int cpu = -1;
+    unsigned int threads = config->user.threads;
+    size_t sweep[MAX_SIZES];
+    int n_sweep = sizeof(default_sweep) / sizeof(*default_sweep);
+    int valid = 1;
+    int opt;
+
+    memcpy(sweep, default_sweep, sizeof(default_sweep));
+    while ((opt = getopt(argc, argv, "n:w:p:t:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            if (iterations <= 0) valid = 0;
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            if (warmup < 0) valid = 0;
+            break;
+        case 'p':
+            cpu = atoi(optarg);
+            if (cpu < 0) valid = 0;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 's':
+            n_sweep = parse_sizes(optarg, sweep);
+            if (n_sweep < 0) valid = 0;
+            break;
+        default:
+            valid = 0;
+            break;
+        }
+    }
+    if (optind != argc || !valid) {
+        printf("Usage: %s [-n ITERATIONS] [-w WARMUP] [-p CPU] [-t THREADS]"
+               " [-s SIZE,SIZE...]\n"
+               "Measures the correlation kernels with the sample length of"
+               " each interval and of each size in -s, ITERATIONS times (%d"
+               " by default) after WARMUP iterations, and prints the results"
+               " as JSON. With -p,"
+               " all the threads run in that CPU. With -t, the number of"
+               " threads of cross_correlation_ex is changed.\n", argv[0],
+               DEFAULT_ITERATIONS);
+        exit(1);
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("bench_xcorr: sched_setaffinity failed");
+            exit(1);
+        }
+    }
+
+    // The lengths of the intervals first, and then the sweep.
+    size_t sizes[MAX_INTERVALS + MAX_SIZES];
+    int is_interval[MAX_INTERVALS + MAX_SIZES];
+    size_t n_sizes = 0;
+    for (size_t i = 0; i < config->user.n_intervals; i++) {
+        sizes[n_sizes] = config->interv_sample[i];
+        is_interval[n_sizes++] = 1;
+    }
+    for (int i = 0; i < n_sweep; i++) {
+        sizes[n_sizes] = sweep[i];
+        is_interval[n_sizes++] = 0;
+    }
+
+    double *times = malloc(iterations * sizeof(*times));
+    if (times == NULL) {
+        perror("bench_xcorr: malloc failed");
+        exit(1);
+    }
+    const struct {
+        const char *name;
+        kernel_fn fn;
+    } kernels[] = {
+        { "fft", kernel_fft },
+        { "max_abs_index", kernel_peak },
+        { "pearson_coefficient", kernel_pearson },
+        { "cross_correlation", kernel_xcorr },
+    };
+    const size_t n_kernels = sizeof(kernels) / sizeof(*kernels);
+
+    srand(1234);
+    measure(calibration, NULL, iterations, warmup, times);
+    printf("{\n  \"sample_rate\": %u,\n  \"threads\": %u,\n"
+           "  \"iterations\": %d,\n  \"warmup\": %d,\n  \"cpu\": %d,\n"
+           "  \"calibration_us\": %.3f,\n  \"results\": [",
+           config->user.sample_rate, threads, iterations, warmup, cpu,
+           percentile(times, iterations, 50.0));
+    int ret = 0;
+    int first = 1;
+    for (size_t i = 0; i < n_sizes; i++) {
+        struct kernel_data data;
+        if (data_init(&data, sizes[i], threads) < 0) {
+            data_free(&data);
+            ret = 1;
+            break;
+        }
+        for (size_t k = 0; k < n_kernels; k++) {
+            bench(kernels[k].name, kernels[k].fn, &data, is_interval[i],
+                  iterations, warmup, times, first);
+            first = 0;
+        }
+        data_free(&data);
+    }
+    printf("\n  ]\n}\n");
+    free(times);
+
+    return ret;
+}
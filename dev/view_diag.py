@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+
+# Viewer for the diagnostics saved by audiosync when `diag_dir` is
+# configured. See include/audiosync/diag.h for the format.
+#
+#   view_diag.py DIR_OR_FILES...
+#       Lists the dumps, oldest first, with their lag and peak candidates.
+#   view_diag.py --plot DIR_OR_FILES...
+#       Plots the curves of each dump with matplotlib: the sample over the
+#       source at the lag obtained, and the correlation with its candidates.
+#       It needs numpy and matplotlib.
+
+import argparse
+import array
+import datetime
+import os
+import struct
+import sys
+
+MAGIC = b"ASYNCDIA"
+VERSION = 1
+HEADER = struct.Struct("=8sIIQqQIIqdII")
+PEAK = struct.Struct("=qd")
+CURVE = struct.Struct("=16sQ")
+
+
+def read_dump(path):
+    """Returns the header as a dict, the peak candidates as (lag, value)
+    pairs, and the curves as a dict of arrays of floats."""
+    with open(path, "rb") as f:
+        data = f.read()
+
+    fields = HEADER.unpack_from(data, 0)
+    header = dict(zip(["magic", "version", "sample_rate", "seq", "time_ns",
+                       "sample_len", "decimation", "n_peaks", "lag",
+                       "coefficient", "n_curves", "reserved"], fields))
+    if header["magic"] != MAGIC or header["version"] != VERSION:
+        raise ValueError("{} isn't a diagnostics dump".format(path))
+
+    offset = HEADER.size
+    peaks = []
+    for _ in range(header["n_peaks"]):
+        peaks.append(PEAK.unpack_from(data, offset))
+        offset += PEAK.size
+
+    curves = {}
+    for _ in range(header["n_curves"]):
+        name, length = CURVE.unpack_from(data, offset)
+        offset += CURVE.size
+        name = name.split(b"\0", 1)[0].decode()
+        values = array.array("f")
+        values.frombytes(data[offset:offset + length * values.itemsize])
+        curves[name] = values
+        offset += length * values.itemsize
+
+    return header, peaks, curves
+
+
+def list_paths(args):
+    paths = []
+    for arg in args:
+        if os.path.isdir(arg):
+            paths += [os.path.join(arg, name) for name in os.listdir(arg)
+                      if name.startswith("diag-") and name.endswith(".bin")]
+        else:
+            paths.append(arg)
+    return paths
+
+
+def print_dumps(paths):
+    dumps = []
+    for path in paths:
+        try:
+            header, peaks, _ = read_dump(path)
+        except (OSError, ValueError, struct.error) as e:
+            print("skipping {}: {}".format(path, e), file=sys.stderr)
+            continue
+        dumps.append((header["time_ns"], header["seq"], path, header, peaks))
+
+    for _, _, path, h, peaks in sorted(dumps):
+        rate = h["sample_rate"] or 1
+        time = datetime.datetime.fromtimestamp(h["time_ns"] / 1e9)
+        print("{}  {}  #{}  {:.2f} s  lag {} ({:.1f} ms)  coefficient {:.4f}"
+              .format(os.path.basename(path), time.strftime("%F %T"),
+                      h["seq"], h["sample_len"] / rate, h["lag"],
+                      h["lag"] * 1000 / rate, h["coefficient"]))
+        if peaks:
+            top = abs(peaks[0][1]) or 1
+            print("    candidates: " + ", ".join(
+                "{} ({:.2f})".format(lag, abs(value) / top)
+                for lag, value in peaks))
+
+
+def plot_dump(path):
+    import matplotlib.pyplot as plt
+    import numpy as np
+
+    header, peaks, curves = read_dump(path)
+    rate = header["sample_rate"] or 1
+    dec = header["decimation"]
+    n = header["sample_len"]
+
+    fig, (ax1, ax2) = plt.subplots(2, 1)
+    fig.suptitle("{}: lag {} frames, coefficient {:.4f}".format(
+        os.path.basename(path), header["lag"], header["coefficient"]))
+
+    source = np.asarray(curves["source"])
+    ax1.plot(np.arange(len(source)) * dec / rate, source, label="source")
+    sample = np.asarray(curves["sample"])
+    ax1.plot((np.arange(len(sample)) * dec + header["lag"]) / rate, sample,
+             label="sample", alpha=0.7)
+    ax1.set_xlabel("seconds")
+    ax1.legend()
+
+    # The second half of the correlation is made of the negative lags.
+    corr = np.asarray(curves["correlation"])
+    lags = np.arange(len(corr)) * dec
+    lags = np.where(lags >= n, lags - 2 * n, lags)
+    order = np.argsort(lags)
+    ax2.plot(lags[order] * 1000 / rate, corr[order], label="correlation")
+    ax2.plot([lag * 1000 / rate for lag, _ in peaks],
+             [value for _, value in peaks], "x", label="candidates")
+    ax2.set_xlabel("lag (ms)")
+    ax2.legend()
+
+    plt.show()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="View the diagnostics"
+                                     " dumps of audiosync.")
+    parser.add_argument("paths", nargs="+",
+                        help="directories or files of the dumps")
+    parser.add_argument("--plot", action="store_true",
+                        help="plot the curves of each file")
+    args = parser.parse_args()
+
+    paths = list_paths(args.paths)
+    if args.plot:
+        for path in paths:
+            plot_dump(path)
+    else:
+        print_dumps(paths)
+
+
+if __name__ == "__main__":
+    main()
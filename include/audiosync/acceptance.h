@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdlib.h>
+#include <audiosync/config.h>
+
+// The policy that decides when the lag of a run is good enough. An interval
+// is accepted on its own if its coefficient reaches the minimum confidence.
+// With noisy recordings, the coefficients may stay well below it even if the
+// lag is right, and the run would escalate to the longest intervals or fail.
+//
+// A wrong lag is the position of a random peak, so it's very unlikely that
+// several intervals obtain the same one. If the last consecutive intervals
+// agree on the lag within a tolerance, and the average of their coefficients
+// is above a lower threshold, the lag is accepted too. See the agreement
+// options in config.h.
+
+struct acceptance {
+    long lag;           // Lag of the last interval
+    size_t agreeing;    // Consecutive intervals that agree with it
+    double coefs[MAX_INTERVALS];  // And their coefficients
+};
+
+// Starts a new run without any intervals.
+void acceptance_init(struct acceptance *acc);
+
+// Adds the result of the next interval, in frames.
+//
+// Returns 1 if the lag is accepted, or 0 otherwise.
+int acceptance_update(struct acceptance *acc, long lag, double coefficient);
+
+// Breaks the agreement after an interval that failed.
+void acceptance_fail(struct acceptance *acc);
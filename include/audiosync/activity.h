@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Cheap activity detector used while the audio is being read, so that no
+// time is wasted correlating silence: the player may be paused, the song
+// may have a quiet intro, or nothing may be playing yet.
+//
+// The frames are split in blocks of a few milliseconds, and a block is
+// active if its mean energy is above the threshold. The producer updates the
+// detector before committing the frames to the ring, so the consumer can
+// read its results without locks once it sees the new frames.
+
+// The start of the activity when there hasn't been any yet.
+#define ACTIVITY_NONE ((size_t) -1)
+
+struct activity {
+    size_t block;       // Frames per block
+    double threshold;   // Minimum mean energy of an active block
+    double energy;      // Sum of the current block's energy so far
+    size_t filled;      // Frames in the current block so far
+    size_t pos;         // Frames analyzed
+    size_t start;       // First frame of the first active block
+    size_t active;      // Frames in active blocks
+};
+
+// Initializes the detector with blocks of `block` frames, considering them
+// active if their RMS is above `threshold`.
+void activity_init(struct activity *act, size_t block, double threshold);
+
+// Analyzes the next `n` frames of the stream. Only called by the producer.
+void activity_update(struct activity *act, const double *data, size_t n);
+
+// Returns the position of the first active frame, or ACTIVITY_NONE.
+size_t activity_start(const struct activity *act);
+
+// Returns the number of active frames so far.
+size_t activity_active(const struct activity *act);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdlib.h>
+#include <audiosync/audiosync.h>
+
+// The arena keeps the big buffers used by audiosync_run and
+// cross_correlation mapped between calls, so that a steady-state run doesn't
+// have to page-fault tens of megabytes again. The memory is aligned to the
+// page size (which is enough for FFTW's SIMD requirements) and pre-faulted
+// when it's first mapped, optionally backed by huge pages.
+//
+// All of these functions are thread-safe.
+
+// Returns a buffer of at least `size` bytes, or NULL in case of error. The
+// contents of the buffer are undefined, since it may have been used before.
+void *arena_alloc(size_t size);
+
+// Same as arena_alloc, but the buffer is backed by a memfd, which can be
+// obtained with arena_shared_fd. Other processes can write into it through
+// the file descriptor, which is how the memfd transport of ffmpeg_pipe
+// avoids copying the decoded audio. Shared buffers always use regular pages.
+void *arena_alloc_shared(size_t size);
+
+// Obtains the memfd backing the shared buffer that contains `ptr`, and the
+// offset of `ptr` in it.
+//
+// Returns the file descriptor, or -1 if `ptr` isn't in a shared buffer.
+int arena_shared_fd(const void *ptr, size_t *offset);
+
+// Gives a buffer obtained with arena_alloc or arena_alloc_shared back to the
+// arena. It will be kept mapped for the next allocation unless the retained
+// memory goes over the limit. NULL is accepted and ignored.
+void arena_free(void *ptr);
+
+// Unmaps all the buffers that aren't currently in use. Returns the number of
+// bytes released.
+size_t arena_trim();
+
+// Configures how the new buffers will be mapped. Already mapped buffers
+// aren't affected until they're trimmed.
+void arena_set_huge_pages(huge_pages_t mode);
@@ -3,25 +3,14 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <audiosync/activity.h>
+#include <audiosync/config.h>
+#include <audiosync/ring.h>
 
-// Information about the audio tracks. Both must have the same formats for
-// the analysis to work.
-//
-// The _STR macros are also required to save time when using them in a string,
-// so it must be the same as the original value.
-#define NUM_CHANNELS 1
-#define NUM_CHANNELS_STR "1"
-#define SAMPLE_RATE 48000
-#define SAMPLE_RATE_STR "48000"
-// The value of the last interval in audiosync.c in seconds.
-#define MAX_SECONDS_STR "30"
-
-// Conversion factor from WAV samples with the defined sample rate to
-// milliseconds.
-#define FRAMES_TO_MS (1000.0 / (double) SAMPLE_RATE)
-
-// The minimum cross-correlation coefficient accepted.
-#define MIN_CONFIDENCE 0.95
+// Information about the audio tracks, like the sample rate or the intervals
+// in which the algorithm is run, is part of the runtime configuration,
+// declared in config.h. Both tracks must have the same formats for the
+// analysis to work.
 
 // Easily and consistently printing logs to stderr.
 // The ## notation will ignore __VA_ARGS__ if no extra arguments were passed
@@ -42,15 +31,25 @@
 // of them have to be used obligatorily. This is useful for these cases.
 #define UNUSED(x) (void)(x)
 
+// Returned by audiosync_run when the recording is too silent for any of the
+// intervals to succeed, which is detected before running them.
+#define AUDIOSYNC_NO_SIGNAL -2
+
+
+// Statistics of a run, obtained with audiosync_last_run.
+struct audiosync_run_stats {
+    unsigned int intervals;  // Correlated, including the ones that failed
+    double recorded;         // Seconds of recording used by the last one
+};
 
 // Structure used to pass the parameters to the threads.
 struct ffmpeg_data {
     const char *title;         // Only used to download the audio
-    double *buf;               // Buffer with the obtained data
-    size_t len;                // Current buffer's length
-    const size_t total_len;    // Maximum length of the buffer
-    const size_t *intervals;   // Intervals in which the data will be obtained
-    const size_t n_intervals;  // Maximum number of intervals
+    struct ring *ring;         // Ring where the obtained data is written
+    const size_t total_len;    // Frames to obtain, or zero for a stream
+    const int detached;        // Ignores the global status (outside of runs)
+    struct activity *activity; // Updated with the frames read, or NULL
+    const int *stop;           // If detached, it stops once this is set
 };
 
 // The global status variable to communicate between threads and control
@@ -67,9 +66,9 @@ extern char *status_to_string(global_status_t status);
 
 // The global mutex and condition variables to synchronize between threads.
 extern pthread_mutex_t mutex;
-// Condition used to know when either thread has finished one of their
-// intervals.
-extern pthread_cond_t interval_done;
+// Event signaled when either thread has reached the watermark of its ring,
+// usually the end of an interval, and when audiosync is aborted.
+extern struct ring_event interval_event;
 // Condition used to continue the ffmpeg execution after it has been paused
 // with audiosync_pause().
 extern pthread_cond_t read_continue;
@@ -82,6 +81,35 @@ extern void audiosync_pause();
 extern void audiosync_resume();
 extern global_status_t audiosync_status();
 
+// Aborts the run in progress, if there's one. The status is checked with
+// the same lock, so a run that starts right after isn't aborted, and
+// nothing happens while idle.
+//
+// Returns 1 if a run was aborted, or 0 otherwise.
+extern int audiosync_abort_running();
+
+// Cancellation callback for cross_correlation_ex, which is true once
+// audiosync is aborted. `ctx` isn't used.
+extern int audiosync_cancelled(void *ctx);
+
+// The big buffers used by the algorithm are kept mapped between runs so that
+// the next one doesn't have to page-fault them again. audiosync_trim
+// releases them, which is useful after a run if audiosync won't be used for a
+// while. It returns the number of bytes released. The references kept
+// mapped by the reference cache are released too.
+//
+// How new buffers are mapped can be configured with the `huge_pages` field
+// in the configuration.
+extern size_t audiosync_trim();
+
+// Prepares everything needed by the runs in advance: the FFTW plans for the
+// current configuration, and the buffers of the arena, which are left
+// allocated and page-faulted for the first run. Long-running processes can
+// call it once at startup so that the first run isn't slower than the rest.
+//
+// Returns 0 on success, or -1 on error.
+extern int audiosync_warmup();
+
 // The setup function is optional. It will initialize the PulseAudio sink to
 // later record the media player output directly, rather than the entire
 // desktop audio.
@@ -93,7 +121,8 @@ extern global_status_t audiosync_status();
 extern int audiosync_setup(const char *stream_name);
 
 // Main function to start the audio synchronization algorithm. It will return
-// 0 in case of success, or -1 otherwise. `yt_title` is the name of the song
+// 0 in case of success, AUDIOSYNC_NO_SIGNAL if nothing is being played, or
+// -1 otherwise. `yt_title` is the name of the song
 // currently playing on the computer. The obtained lag will be returned to
 // the variable `lag` points to.
 //
@@ -106,3 +135,39 @@ extern int audiosync_setup(const char *stream_name);
 // This function starts the algorithm. Only one audiosync thread can be
 // running at once.
 extern int audiosync_run(const char *yt_title, long int *lag);
+
+// Same as audiosync_run, but after the initial sync, the lag keeps being
+// tracked until audiosync is aborted or the song ends, which is when it
+// returns the last lag. Meanwhile, it can be obtained with
+// audiosync_tracked_lag. See tracking.h for more details.
+extern int audiosync_track(const char *yt_title, long int *lag);
+
+// Starts and stops a playlist session, which keeps recording across the
+// runs, so that audiosync_run can use the audio from the beginning of each
+// track without starting a new recording. See session.h for more details.
+// The configuration can't be changed while a session is active.
+//
+// Both return 0 on success, or -1 on error. A session can't be started if
+// there's one already, and it can't be stopped while audiosync is running.
+extern int audiosync_session_start();
+extern int audiosync_session_stop();
+
+// Obtains the latest lag published by audiosync_track, in milliseconds, and
+// the coefficient of its last measurement.
+//
+// Returns 0 on success, or -1 if audiosync isn't tracking.
+extern int audiosync_tracked_lag(long int *lag, double *confidence);
+
+// Obtains the clock skew estimated by the last successful run, in parts per
+// million. It's only estimated if enabled in the configuration. See skew.h
+// for more details.
+//
+// Returns 0 on success, or -1 if it's not available.
+extern int audiosync_skew(double *ppm);
+
+// Obtains the statistics of the last run that finished, successfully or
+// not, like the number of intervals it correlated, which is useful for
+// benchmarks.
+//
+// Returns 0 on success, or -1 if there hasn't been any.
+extern int audiosync_last_run(struct audiosync_run_stats *stats);
@@ -1,12 +1,18 @@
 #pragma once
 
 // Function used for the capture thread. It will start a new ffmpeg process
-// to record either the custom sink created with pulseaudio_setup, or the
-// entire desktop.
+// to record either the custom sink created with pulseaudio_setup, the
+// entire desktop, or the file from capture_replay.
 //
 // In case of errors, it will signal the main thread to abort.
 void *capture(void *);
 
+// Records the file at `path` instead of the monitor, which is read at its
+// native rate, like if it was being played. It's useful to benchmark and
+// test the runs without PulseAudio. NULL goes back to the monitor. It can't
+// be called while audiosync is running.
+void capture_replay(const char *path);
+
 // Creates a new dedicated sink for recording within this module. It's
 // useful for complex PulseAudio setups, and avoids recording the entire
 // desktop audio. Only the indicated stream will be recorded, where
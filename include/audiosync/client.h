@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Client library for audiosyncd, the daemon that keeps audiosync warm
+// between runs: the FFTW plans, the buffers in the arena, the reference
+// cache and the PulseAudio sink are set up once, so that the latency of each
+// request only depends on how long the audio takes to arrive.
+//
+// The daemon listens on a Unix domain socket. Each request is a fixed-size
+// header, optionally followed by the title as a payload, and it's always
+// answered with a fixed-size reply. A connection may be used for multiple
+// requests in order, but a sync request blocks its connection until it's
+// finished, so aborting it requires a second connection.
+//
+// The integers are in the native byte order, since the socket is local.
+
+#define AUDIOSYNCD_MAGIC 0x44534141  // "AASD" in little endian
+#define AUDIOSYNCD_VERSION 1
+// Maximum length of the payload, which is the title.
+#define AUDIOSYNCD_MAX_PAYLOAD 1024
+// Name of the socket inside $XDG_RUNTIME_DIR, or /tmp if it's not set.
+#define AUDIOSYNCD_SOCKET_NAME "audiosyncd.sock"
+// The result of a sync request when nothing is being played, like
+// AUDIOSYNC_NO_SIGNAL, which isn't available without linking audiosync.
+#define AUDIOSYNCD_NO_SIGNAL -2
+
+// The types of request.
+typedef enum {
+    AUDIOSYNCD_SYNC = 1,  // Runs audiosync with the title in the payload
+    AUDIOSYNCD_PREFETCH,  // Saves the title's reference in the cache
+    AUDIOSYNCD_STATUS,    // Obtains audiosync's current status
+    AUDIOSYNCD_ABORT      // Aborts the current sync, if any
+} audiosyncd_request_t;
+
+struct audiosyncd_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;         // audiosyncd_request_t
+    uint16_t len;         // Length of the payload in bytes
+};
+
+struct audiosyncd_reply {
+    uint32_t magic;
+    int32_t ret;          // 0 on success, -1 on error, or
+                          // AUDIOSYNCD_NO_SIGNAL for sync requests
+    int64_t lag;          // Obtained lag in milliseconds, for sync requests
+    uint32_t status;      // global_status_t, for status requests
+    uint32_t reserved;
+};
+
+// Writes the default path of the socket into `path`.
+//
+// Returns 0 on success, or -1 if it doesn't fit.
+int audiosyncd_default_path(char *path, size_t size);
+
+// Connects to the daemon at `path`, or at the default path if it's NULL.
+//
+// Returns the connection's file descriptor, or -1 on error.
+int audiosyncd_connect(const char *path);
+
+// Sends a request with an optional title, waiting for its reply.
+//
+// Returns 0 if the reply was received, or -1 on error. Whether the request
+// itself succeeded is indicated by `reply->ret`.
+int audiosyncd_request(int fd, audiosyncd_request_t type, const char *title,
+                       struct audiosyncd_reply *reply);
+
+// Wrappers for each type of request, returning -1 in case of error or if the
+// request failed, and 0 otherwise. audiosyncd_sync may also return
+// AUDIOSYNCD_NO_SIGNAL if nothing is being played, so the failures should be
+// checked with `< 0`.
+int audiosyncd_sync(int fd, const char *title, long *lag);
+int audiosyncd_prefetch(int fd, const char *title);
+int audiosyncd_status(int fd, unsigned int *status);
+int audiosyncd_abort(int fd);
+
+// Converting the status in a reply to a string, with the same names as
+// status_to_string, which isn't available without linking audiosync.
+const char *audiosyncd_status_to_string(unsigned int status);
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdlib.h>
+
+// The runtime configuration of the module. It used to be a set of macros and
+// constant arrays, so tuning speed against accuracy required recompiling.
+//
+// The configuration is validated once with audiosync_configure, which also
+// precomputes everything derived from it (buffer sizes, ffmpeg arguments,
+// FFTW plans...), so that audiosync_run doesn't have to.
+
+// Maximum number of intervals in the schedule.
+#define MAX_INTERVALS 16
+// Maximum length of the paths in the configuration.
+#define MAX_LONG_PATH 512
+
+// Both audio tracks are analyzed in mono. This isn't configurable because
+// the cross-correlation only works with a single channel.
+#define NUM_CHANNELS 1
+
+// The default values for the configuration.
+#define DEFAULT_SAMPLE_RATE 48000
+#define DEFAULT_MIN_CONFIDENCE 0.95
+#define DEFAULT_THREADS 2
+#define DEFAULT_TRACK_PERIOD 2.0
+#define DEFAULT_TRACK_WINDOW 0.5
+#define DEFAULT_SILENCE_THRESHOLD 0.001
+#define DEFAULT_AGREEMENT_TOLERANCE 0.002
+#define DEFAULT_AGREEMENT_CONFIDENCE 0.5
+#define DEFAULT_DIAG_FILES 32
+#define DEFAULT_DIAG_DECIMATION 16
+
+// How the buffers kept between runs are mapped.
+typedef enum {
+    HUGE_PAGES_OFF,     // Regular pages
+    HUGE_PAGES_THP,     // Transparent huge pages, advised with madvise
+    HUGE_PAGES_HUGETLB  // Reserved huge pages, with MAP_HUGETLB
+} huge_pages_t;
+
+// How the decoded audio is obtained from the ffmpeg processes.
+typedef enum {
+    TRANSPORT_PIPE,  // Read from a pipe
+    TRANSPORT_MEMFD  // Written by ffmpeg into the buffers, see ffmpeg_pipe.h
+} transport_t;
+
+// The algorithm used to obtain the lag.
+typedef enum {
+    ENGINE_FFT,  // Circular cross-correlation with FFTW
+    ENGINE_SIGN  // Polarity-coincidence of the signs, see sign_correlation.h
+} engine_t;
+
+struct audiosync_config {
+    // Sample rate at which both tracks are analyzed, in Hz.
+    unsigned int sample_rate;
+    // The algorithm will be run in these intervals of the recorded audio,
+    // in seconds. They must be in ascending order.
+    double intervals[MAX_INTERVALS];
+    size_t n_intervals;
+    // Maximum absolute lag searched, in seconds. Zero means that the entire
+    // interval is searched.
+    double max_lag;
+    // The minimum cross-correlation coefficient accepted.
+    double min_confidence;
+    engine_t engine;
+    // Maximum number of threads used for the calculations.
+    unsigned int threads;
+    // How the buffers kept between runs are mapped. If there aren't enough
+    // reserved huge pages for HUGE_PAGES_HUGETLB, transparent huge pages are
+    // used instead.
+    huge_pages_t huge_pages;
+    // How the decoded audio is obtained from ffmpeg. With TRANSPORT_MEMFD,
+    // the buffers are shared with the ffmpeg processes, which write into
+    // them directly, so they can't use huge pages.
+    transport_t transport;
+    // Whether the decoded references are saved to disk, so that the next
+    // runs with the same track don't have to download it again.
+    int reference_cache;
+    // Whether the results are saved to disk, so that the next runs with the
+    // same track and a similar recording only have to verify them.
+    int result_cache;
+    // Directory where the cache is saved. If empty, $XDG_CACHE_HOME/audiosync
+    // or ~/.cache/audiosync is used.
+    char cache_dir[MAX_LONG_PATH];
+    // When tracking the lag after the initial sync, how often it's measured
+    // again, and the length of the recorded window used for it, in seconds.
+    // The window can't be longer than the first interval.
+    double track_period;
+    double track_window;
+    // Whether the clock skew between the recording and the reference is
+    // estimated, and compensated when the confidence isn't enough. See
+    // skew.h for more details.
+    int skew_compensation;
+    // The RMS below which the audio is considered silent. The intervals
+    // without enough audio above it are skipped, and the leading silence
+    // is trimmed before correlating. Zero disables it.
+    double silence_threshold;
+    // A lag is also accepted when this many consecutive intervals obtain it,
+    // within `agreement_tolerance` seconds, and the average of their
+    // coefficients is at least `agreement_confidence`. Zero disables it, so
+    // that only `min_confidence` is used. See acceptance.h for more details.
+    unsigned int agreement_intervals;
+    double agreement_tolerance;
+    double agreement_confidence;
+    // Directory where the curves of each cross-correlation are saved for
+    // debugging, in a ring of `diag_files` files, decimated by a factor of
+    // `diag_decimation`. If empty, they aren't saved. See diag.h for more
+    // details.
+    char diag_dir[MAX_LONG_PATH];
+    unsigned int diag_files;
+    unsigned int diag_decimation;
+};
+
+// The configuration used if audiosync_configure is never called.
+#define DEFAULT_CONFIG (struct audiosync_config) { \
+    .sample_rate = DEFAULT_SAMPLE_RATE, \
+    .intervals = { 3, 6, 10, 15, 20, 30 }, \
+    .n_intervals = 6, \
+    .max_lag = 0.0, \
+    .min_confidence = DEFAULT_MIN_CONFIDENCE, \
+    .engine = ENGINE_FFT, \
+    .threads = DEFAULT_THREADS, \
+    .huge_pages = HUGE_PAGES_THP, \
+    .transport = TRANSPORT_PIPE, \
+    .reference_cache = 1, \
+    .result_cache = 1, \
+    .cache_dir = "", \
+    .track_period = DEFAULT_TRACK_PERIOD, \
+    .track_window = DEFAULT_TRACK_WINDOW, \
+    .skew_compensation = 0, \
+    .silence_threshold = DEFAULT_SILENCE_THRESHOLD, \
+    .agreement_intervals = 0, \
+    .agreement_tolerance = DEFAULT_AGREEMENT_TOLERANCE, \
+    .agreement_confidence = DEFAULT_AGREEMENT_CONFIDENCE, \
+    .diag_dir = "", \
+    .diag_files = DEFAULT_DIAG_FILES, \
+    .diag_decimation = DEFAULT_DIAG_DECIMATION, \
+}
+
+// The values derived from the configuration, calculated once when it's
+// applied. The sizes are in frames.
+struct derived_config {
+    struct audiosync_config user;
+    // The intervals for downloading and capturing audio differ, since the
+    // source (download) doesn't require zero-padding inside
+    // cross_correlation. The download intervals will always be twice as big
+    // as the capture ones.
+    size_t interv_sample[MAX_INTERVALS];
+    size_t interv_source[MAX_INTERVALS];
+    size_t len_sample;
+    size_t len_source;
+    size_t max_lag;
+    size_t track_period;
+    size_t track_window;
+    size_t agreement_tolerance;
+    // Conversion factor from frames to milliseconds.
+    double frames_to_ms;
+    // The values as strings, used for the ffmpeg arguments.
+    char sample_rate_str[16];
+    char num_channels_str[16];
+    char max_seconds_str[32];
+    // The cache directory after resolving the default one. It's empty if it
+    // couldn't be resolved.
+    char cache_dir[MAX_LONG_PATH];
+};
+
+// Checks that a configuration is valid, logging the reason otherwise.
+//
+// Returns 0 if it's valid, or -1 otherwise.
+int audiosync_config_validate(const struct audiosync_config *config);
+
+// Validates and applies a new configuration. It can't be changed while
+// audiosync is running, during a session, or while it's acquired.
+//
+// Returns 0 on success, or -1 on error, in which case the previous
+// configuration is kept.
+int audiosync_configure(const struct audiosync_config *config);
+
+// Copies the current configuration into `config`.
+void audiosync_get_config(struct audiosync_config *config);
+
+// Returns the current configuration with its derived values. It's only
+// modified by audiosync_configure, which can't be called while running, so
+// it's safe to use without locks inside a run.
+const struct derived_config *get_config();
+
+// Marks the configuration as in use by an operation that doesn't change the
+// global status, so that audiosync_configure refuses to modify it until
+// config_release is called.
+const struct derived_config *config_acquire();
+void config_release();
+
+// Converting the enum values to strings, and vice versa. The latter return
+// -1 if the name is unknown.
+char *engine_to_string(engine_t engine);
+int engine_from_string(const char *name, engine_t *engine);
+char *huge_pages_to_string(huge_pages_t mode);
+int huge_pages_from_string(const char *name, huge_pages_t *mode);
+char *transport_to_string(transport_t transport);
+int transport_from_string(const char *name, transport_t *transport);
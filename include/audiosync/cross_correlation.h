@@ -1,6 +1,88 @@
 #pragma once
 
 #include <stdlib.h>
+#include <complex.h>
+
+// Buffers used by cross_correlation, which can be provided by the caller
+// so that they don't have to be obtained from the arena on every call. This
+// is useful when many correlations are calculated in parallel, with a
+// workspace per thread.
+struct xcorr_workspace {
+    size_t len;             // Maximum sample length supported
+    double *sample;         // Zero-padded sample, of length 2 * len
+    double complex *arr1;   // Transforms, of length len + 1
+    double complex *arr2;
+    double *results;        // Inverse transform, of length 2 * len
+};
+
+// Optional parameters for cross_correlation_ex.
+struct xcorr_params {
+    // Maximum absolute lag searched, in frames. Zero means that every lag
+    // is considered.
+    size_t max_lag;
+    // Maximum number of threads used. With less than two, both Fourier
+    // Transforms are calculated sequentially in the calling thread.
+    unsigned int threads;
+    // Buffers to use instead of the arena's, or NULL. They're only used if
+    // the sample fits in them.
+    struct xcorr_workspace *workspace;
+    // Called with `cancel_ctx` between the stages of the calculation, and
+    // every XCORR_CANCEL_CHUNK frames inside its loops. If it returns
+    // non-zero, the cross-correlation stops and fails. It can be NULL.
+    //
+    // Each Fourier Transform is a single FFTW call that can't be
+    // interrupted, so the longest of them bounds the time it takes to stop.
+    int (*cancel)(void *ctx);
+    void *cancel_ctx;
+    // Factor by which sign_correlation decimates both signals for its
+    // coarse search. Zero or one keeps the full rate. It isn't used by the
+    // rest of the functions.
+    unsigned int decimation;
+    // Combination of the XCORR_* flags below.
+    unsigned int flags;
+    // The source's transform, as calculated by xcorr_spectrum, or NULL.
+    // cross_correlation_ex then only transforms the sample. It isn't used
+    // by the rest of the functions.
+    const double complex *source_spectrum;
+};
+
+// The sample is preceded by `length` zeros in the same buffer, which must be
+// aligned like the arena's, so cross_correlation_ex transforms it in place
+// instead of copying it into a zero-padded buffer on every call. The
+// padding is before the sample rather than after it, so that the frames
+// after the sample can still be written, like while recording. The shift
+// this introduces is undone in the frequency domain.
+#define XCORR_PREPADDED (1 << 0)
+
+// The result for each of the sources in cross_correlation_many.
+struct xcorr_match {
+    size_t index;        // Position of the source in the provided array
+    int ret;             // 0 if the lag was obtained, or -1 otherwise
+    long lag;
+    double coefficient;
+};
+
+// The number of frames processed by the loops of cross_correlation_ex
+// between each call to the cancellation callback. It's small enough to take
+// well below a millisecond.
+#define XCORR_CANCEL_CHUNK 65536
+
+// The length of the blocks in long_correlation relative to the sample's.
+// Each block covers the positions of its length minus the sample's, so a
+// longer block wastes less of each transform, but it takes more memory.
+#define XCORR_LONG_BLOCK_FACTOR 4
+
+// The parameters used by cross_correlation.
+#define XCORR_DEFAULT_PARAMS { \
+    .max_lag = 0, \
+    .threads = 2, \
+    .workspace = NULL, \
+    .cancel = NULL, \
+    .cancel_ctx = NULL, \
+    .decimation = 1, \
+    .flags = 0, \
+    .source_spectrum = NULL, \
+}
 
 // Calculating the Pearson Correlation Coefficient between `source` and
 // `sample` between two pointers, applying the formula:
@@ -10,6 +92,17 @@
 double pearson_coefficient(double *source_start, const double *source_end,
                            double *sample_start, const double *sample_end);
 
+// Obtains the index of the absolute maximum value in an array of doubles
+// of length `len`. The array is scanned in chunks, checking between them if
+// the calculation was cancelled with the callback in `params`, which can be
+// NULL.
+//
+// Its length must be greater than zero to work correctly.
+//
+// Returns 0 on success, or -1 if it was cancelled.
+int max_abs_index(double *arr, size_t len, const struct xcorr_params *params,
+                  size_t *index);
+
 // Calculating the cross-correlation between two signals `a` and `b`:
 //     xcross = ifft(fft(a) * conj(fft(b)))
 //
@@ -23,3 +116,97 @@ double pearson_coefficient(double *source_start, const double *source_end,
 // In case of error, the function returns -1. Otherwise, zero.
 int cross_correlation(double *data1, double *data2, const size_t length,
                       long *displacement, double *coefficient);
+
+// Same as cross_correlation, with the parameters in `params`. If it's NULL,
+// the default ones are used.
+int cross_correlation_ex(double *source, double *sample, const size_t length,
+                         const struct xcorr_params *params, long *displacement,
+                         double *coefficient);
+
+// Calculates the transform of the `2 * sample_len` frames of `source` used
+// by cross_correlation_ex into `out`, which must have room for
+// `sample_len + 1` values. It can be saved and given back later with
+// `source_spectrum`, as long as the source doesn't change. Both arrays must
+// be aligned like the arena's, so that the same plans are used and the
+// values are exactly the same.
+void xcorr_spectrum(const double *source, size_t sample_len,
+                    double complex *out);
+
+// Correlates the same sample with `n_sources` sources, each of them twice
+// its length, like calling cross_correlation_ex with each of them. The
+// sample is transformed only once, so each source only costs its own
+// transform and the inverse one, instead of the three transforms of a call
+// to cross_correlation_ex. The sources are split between `params->threads`
+// workers of the pool, each with its own buffers, and its workspace isn't
+// used.
+//
+// `matches` must have room for `n_sources` results, which are sorted by
+// descending coefficient, and the sources that failed are left at the end.
+//
+// Returns the number of sources whose lag was obtained, or -1 on error or
+// if it was cancelled.
+int cross_correlation_many(double *const *sources, size_t n_sources,
+                           double *sample, size_t length,
+                           const struct xcorr_params *params,
+                           struct xcorr_match *matches);
+
+// Searches `sample` anywhere inside a much longer `source`, like an entire
+// track, instead of only within twice its length. The source is split in
+// overlap-save blocks of XCORR_LONG_BLOCK_FACTOR times the sample's length,
+// which are correlated in parallel between `params->threads` workers of the
+// pool with the sample's transform, calculated only once. The memory used
+// depends on the length of the blocks, and not on the source's.
+//
+// Only the positions where the whole sample is inside the source are
+// considered. Their correlation is normalized by the energy of the source
+// under the sample, and the best one is confirmed with the Pearson
+// coefficient. The maximum lag and the workspace in `params` aren't used.
+//
+// `position` is the frame of the source where the sample starts, which is
+// also its lag in the sense of cross_correlation.
+//
+// Returns 0 on success, or -1 on error or if it was cancelled.
+int long_correlation(const double *source, size_t source_len,
+                     double *sample, size_t sample_len,
+                     const struct xcorr_params *params, size_t *position,
+                     double *coefficient);
+
+// Searches the lag between `source` and `sample` directly in the time
+// domain, only considering the lags at most `radius` frames away from
+// `center`. It's much cheaper than cross_correlation when the lag is
+// approximately known already, like when verifying a previous result.
+//
+// The lags have the same meaning as in cross_correlation, and the overlap of
+// the sample with the source must be at least half the sample for a lag to
+// be considered.
+//
+// Returns the lag with the highest coefficient, or -1 if none of them could
+// be calculated.
+int bounded_correlation(double *source, size_t source_len, double *sample,
+                        size_t sample_len, long center, size_t radius,
+                        long *lag, double *coefficient);
+
+// Calculates the autocorrelation of `len` frames of `data` for the lags
+// between 0 and len - 1, saving it in `out`. It isn't normalized, so the
+// value at lag zero is the highest one.
+//
+// Returns 0 on success, or -1 on error.
+int autocorrelation(const double *data, size_t len, double *out);
+
+// Allocates the buffers of a workspace for samples of up to `sample_len`
+// frames from the arena, and gives them back.
+//
+// xcorr_workspace_init returns 0 on success, or -1 on error.
+int xcorr_workspace_init(struct xcorr_workspace *ws, size_t sample_len);
+void xcorr_workspace_free(struct xcorr_workspace *ws);
+
+// Creates the FFTW plans used by cross_correlation for a sample length of
+// `sample_len`, so that they don't have to be created on every call.
+// Otherwise, the plans are created and destroyed inside cross_correlation.
+//
+// Clearing the plans waits for the correlations using them in other threads
+// to finish.
+//
+// Returns 0 on success, or -1 on error.
+int xcorr_prepare(size_t sample_len);
+void xcorr_clear_plans();
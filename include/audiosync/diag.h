@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Diagnostics of the cross-correlation: every time a lag is obtained, its
+// curves are saved in a binary file, so that it can be inspected later
+// with dev/view_diag.py. They replace the plots that used to be made with
+// gnuplot, which took minutes per run and couldn't be used in production.
+//
+// The files are written in the configured directory as a ring of
+// `diag_files` files named diag-NNNN.bin, so the oldest ones are replaced
+// and the disk usage is bounded. The curves are saved as 32-bit floats,
+// optionally decimated by keeping the value with the largest magnitude of
+// each block of `diag_decimation` frames, so that the peaks stay visible.
+//
+// The format is native-endian, and it consists of:
+//   struct diag_header
+//   struct diag_peak            (n_peaks times)
+//   struct diag_curve + float   (n_curves times, with `len` values each)
+//
+// The curves are the source and the sample, without the padding, and the
+// output of the cross-correlation, whose index `i` is the lag `i` for the
+// first half and `i - 2 * sample_len` for the second one.
+
+#define DIAG_MAGIC "ASYNCDIA"
+#define DIAG_VERSION 1
+// Maximum number of files in the ring.
+#define DIAG_MAX_FILES 10000
+// Number of peak candidates saved, and the length of the blocks of the
+// correlation in which they're searched. Only the maximum of a block can be
+// a candidate, if it's higher than the ones of its neighbouring blocks.
+#define DIAG_PEAKS 8
+#define DIAG_PEAK_BLOCK 1024
+
+// The fields are sized so that there's no padding between them.
+struct diag_header {
+    char magic[8];          // DIAG_MAGIC, without the terminator
+    uint32_t version;
+    uint32_t sample_rate;
+    uint64_t seq;           // Number of the dump in this process
+    int64_t time_ns;        // Wall-clock time of the dump
+    uint64_t sample_len;    // In frames, before the decimation
+    uint32_t decimation;
+    uint32_t n_peaks;
+    int64_t lag;            // The lag obtained, in frames
+    double coefficient;     // Its Pearson coefficient
+    uint32_t n_curves;
+    uint32_t reserved;
+};
+
+// A peak candidate of the correlation, sorted by descending magnitude.
+struct diag_peak {
+    int64_t lag;
+    double value;
+};
+
+struct diag_curve {
+    char name[16];          // Null-terminated
+    uint64_t len;           // Values after the decimation
+};
+
+// Sets the directory of the dumps, the size of the ring and the decimation.
+// An empty directory disables them. It's created if it doesn't exist.
+//
+// It's called when the configuration is applied, and it can't be called
+// while a cross-correlation is running.
+void diag_configure(const char *dir, unsigned int files,
+                    unsigned int decimation, unsigned int sample_rate);
+
+// Returns whether the dumps are enabled.
+int diag_enabled();
+
+// Saves the curves of a cross-correlation of `sample_len` frames, with the
+// `2 * sample_len` frames of `results` obtained from them, and the lag and
+// coefficient obtained. Failing to save them is logged, but it isn't an
+// error for the caller.
+void diag_save(const double *source, const double *sample, size_t sample_len,
+               const double *results, long lag, double coefficient);
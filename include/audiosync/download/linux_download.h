@@ -1,12 +1,32 @@
 #pragma once
 
+#include <stdlib.h>
+
 // Function used for the download thread. In this case, it both obtains the
 // direct youtube link to download the audio from, and creates a new
 // PulseAudio process to save it inside the thread's data.
 //
+// If the entire track is downloaded, it's also saved in the reference cache
+// for the next runs, along with its spectra. The reference is usually
+// downloaded much faster than the recording, so these are calculated while
+// the run waits for it, and they stop if it's aborted.
+//
 // In case of error, it will signal the main thread to abort.
 void *download(void *);
 
+// Decodes the file at `path` as the reference of every title instead of
+// downloading it, which is useful to benchmark and test the runs without
+// the network. NULL goes back to YouTube. It can't be called while
+// audiosync is running.
+void download_local(const char *path);
+
+// Downloads the first `len` frames of a song into `buf` outside of a run,
+// so the global status is ignored. The rest of the buffer is filled with
+// zeroes if the song is shorter.
+//
+// Returns 0 on success, or -1 on error.
+int download_reference(const char *title, double *buf, size_t len);
+
 // Obtains the YouTube audio link with Youtube-dl.
 //
 // Returns 0 on exit, or -1 on error.
@@ -4,11 +4,20 @@
 
 
 // Executes the ffmpeg command in the arguments and pipes its data into the
-// provided array.
+// provided ring.
 //
-// It will send signals to the main thread as the intervals are being
-// finished, while also checking the current global status, or updating it in
-// case of errors.
+// The ring will wake up the main thread as the intervals are being
+// finished, while this also checks the current global status, or updates it
+// in case of errors. If `data->detached` is set, the global status is
+// ignored, and it stops once `data->stop` is set, if provided.
 //
-// Returns -1 in case of error, or zero otherwise.
+// Returns -1 in case of error (including ffmpeg failing), or zero otherwise.
 int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]);
+
+// Decodes the first `len` frames of any file supported by ffmpeg into `buf`,
+// with the sample rate and channels from the configuration. The rest of the
+// buffer is filled with zeroes if the file is shorter. It doesn't use the
+// global status, so it can be called outside of runs.
+//
+// Returns 0 on success, or -1 on error.
+int ffmpeg_decode(const char *path, double *buf, size_t len);
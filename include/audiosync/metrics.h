@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Runtime metrics of the process, to watch how audiosync performs in
+// production: the runs and their results, the data read from the streams,
+// the transforms executed and the latencies of each stage.
+//
+// They're always collected, since they're only relaxed atomic additions to
+// a global structure, and they can be read with audiosync_get_metrics or
+// written in the Prometheus text format with audiosync_write_metrics, which
+// is meant for the textfile collector of node_exporter.
+
+// Number of buckets of the latency histograms. The upper bound of the bucket
+// `i` is METRICS_FIRST_BOUND * 2^i seconds, and the last one has no bound.
+#define METRICS_BUCKETS 24
+#define METRICS_FIRST_BOUND 1e-5
+// Number of different transform lengths counted. The rest are counted in
+// the last entry, whose length is zero.
+#define METRICS_FFT_SIZES 32
+
+// The streams read with ffmpeg.
+typedef enum {
+    STREAM_RECORDING,
+    STREAM_REFERENCE,
+    N_STREAMS
+} metrics_stream_t;
+
+// The stages whose latencies are measured.
+typedef enum {
+    STAGE_RUN,            // A whole run
+    STAGE_URL,            // Obtaining the URL with youtube-dl
+    STAGE_FIRST_FRAMES,   // From starting ffmpeg until its first frames
+    STAGE_WAIT,           // Waiting for the streams to reach an interval
+    STAGE_CORRELATION,    // Correlating an interval
+    STAGE_FFT,            // A single transform
+    N_STAGES
+} metrics_stage_t;
+
+// The latencies of a stage. Each bucket only counts the latencies between
+// the previous bound and its own.
+struct metrics_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+// Every field is a 64-bit counter, so that they can be read and written
+// atomically one by one.
+struct audiosync_metrics {
+    uint64_t runs;                  // Started
+    uint64_t successes;             // Returned a lag
+    uint64_t aborts;                // Aborted before finishing
+    uint64_t pauses;                // Calls to audiosync_pause
+    uint64_t intervals;             // Correlated
+    uint64_t bytes[N_STREAMS];      // Read from ffmpeg
+    uint64_t reads[N_STREAMS];      // Read syscalls (none with memfd)
+    uint64_t alloc_bytes;           // Newly mapped by the arena
+    struct {
+        uint64_t len;               // Real length of the transform
+        uint64_t count;
+    } ffts[METRICS_FFT_SIZES];
+    struct metrics_histogram latency[N_STAGES];
+};
+
+// The metrics updated by the rest of the modules.
+extern struct audiosync_metrics global_metrics;
+
+// Adds `n` to a field of the global metrics, like `runs` or
+// `bytes[STREAM_RECORDING]`.
+#define metrics_add(field, n) \
+    __atomic_add_fetch(&global_metrics.field, (n), __ATOMIC_RELAXED)
+
+// Returns the current time in nanoseconds, to measure a stage.
+uint64_t metrics_now();
+
+// Saves the latency of a stage that started at `start`, from metrics_now.
+void metrics_observe(metrics_stage_t stage, uint64_t start);
+
+// Counts a transform of `len` real frames.
+void metrics_fft(size_t len);
+
+// Returns the upper bound of a bucket in seconds, which is infinite for the
+// last one.
+double metrics_bucket_bound(size_t bucket);
+
+// Returns the names used for the streams and stages in the exported
+// metrics.
+char *stream_to_string(metrics_stream_t stream);
+char *stage_to_string(metrics_stage_t stage);
+
+// Copies the current metrics into `metrics`. Thread-safe.
+void audiosync_get_metrics(struct audiosync_metrics *metrics);
+
+// Sets all the metrics to zero. Thread-safe.
+void audiosync_reset_metrics();
+
+// Writes the current metrics into `path` in the Prometheus text format. The
+// file is replaced atomically, so it's never read half-written.
+//
+// Returns 0 on success, or -1 on error.
+int audiosync_write_metrics(const char *path);
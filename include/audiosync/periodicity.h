@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Detection of repetitive references. When a track loops the same part
+// over and over, a short sample matches every repetition of it almost
+// equally, so the peaks of the cross-correlation are ambiguous and the
+// intervals shorter than the repeated part can't succeed. Correlating them
+// is wasted work, and a previous result can't be trusted either.
+//
+// The reference is decimated and its autocorrelation is calculated with a
+// single transform. Its strongest peaks after the main lobe are the
+// candidate periods, and the reference is compared with itself shifted by
+// each of them in blocks, so that the longest stretch that repeats is known.
+// Intervals that aren't longer than it are skipped.
+
+// Maximum number of periods kept.
+#define PERIODICITY_MAX_PEAKS 4
+
+struct periodicity {
+    size_t analyzed;    // Frames of the reference analyzed
+    size_t n_periods;
+    // The periods with repetitions, in frames, the strongest first. The
+    // lags that differ by one of them from a result compete with it.
+    size_t periods[PERIODICITY_MAX_PEAKS];
+    // The longest stretch of the reference that repeats, in frames. An
+    // interval has to be longer than this to be unambiguous.
+    size_t repeated;
+};
+
+// Analyzes the first `len` frames of the reference.
+//
+// Returns 0 on success, or -1 on error.
+int periodicity_analyze(const double *ref, size_t len,
+                        struct periodicity *per);
+
+// Same as periodicity_analyze, but the results are kept in memory for each
+// reference id and sample rate, and reused if they analyzed at least the
+// same frames.
+int periodicity_get(uint64_t id, const double *ref, size_t len,
+                    struct periodicity *per);
+
+// Returns whether an interval of `len` frames would be ambiguous.
+int periodicity_ambiguous(const struct periodicity *per, size_t len);
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Work-stealing pool used to run many independent tasks, like aligning a
+// batch of files. The tasks are identified by their index, and they're
+// initially split in equal ranges between the workers. Each worker takes
+// the tasks from the beginning of its own range, and once it's empty, it
+// steals the second half of the biggest remaining range. Thus, the workers
+// only contend when stealing, and a slow task doesn't leave the rest of
+// its range waiting.
+//
+// The ranges are packed in a single 64-bit word each, so that they can be
+// modified with compare-and-swap without any locks.
+
+// Function run for each task. `worker` is the index of the worker running
+// it, which can be used to access per-worker data without locks.
+typedef void (*pool_task_fn)(void *ctx, unsigned int worker, size_t task);
+
+// Runs `n_tasks` tasks on `n_workers` threads, returning once all of them
+// are finished. The number of tasks must fit in 32 bits.
+//
+// Returns 0 on success, or -1 if the threads couldn't be created.
+int pool_run(size_t n_tasks, unsigned int n_workers, pool_task_fn fn,
+             void *ctx);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <complex.h>
+
+// Cache of the downloaded references. Obtaining a reference requires
+// calling youtube-dl and decoding the track with ffmpeg, which takes a few
+// seconds even before the first interval can be analyzed. Instead, the
+// decoded frames are saved to disk once the download is complete, so that
+// the next runs with the same title can use them directly.
+//
+// The references are stored in the cache directory from the configuration,
+// in a file per title and sample rate. The files have a header with the
+// information needed to validate them, and the frames are mapped directly
+// into memory when they're used. The last used ones are kept mapped, so that
+// a long-running process doesn't have to map them again.
+//
+// The transforms of the reference that cross_correlation_ex needs for each
+// interval length are saved next to it too, so that the runs with a cached
+// reference only transform the recording. They're mapped lazily, since only
+// the ones of the intervals used are needed, and they're only valid with the
+// exact file of the reference and the same interval lengths.
+//
+// Nothing is cached if `reference_cache` is disabled in the configuration.
+
+// Looks for the reference of `title` with at least `len` frames at the
+// current sample rate. The returned data is read-only, and must be given
+// back with refcache_release once it's not needed anymore.
+//
+// Returns NULL if the reference isn't cached or it's invalid.
+const double *refcache_get(const char *title, size_t len);
+void refcache_release(const double *data);
+
+// Saves `len` frames of the reference of `title` in the cache, replacing the
+// previous one if it existed.
+//
+// Returns 0 on success, or -1 on error.
+int refcache_store(const char *title, const double *data, size_t len);
+
+// Calculates the transforms of the reference of `title` for each interval
+// of the configuration that fits in its `len` frames, and saves them next to
+// it in the cache, replacing the previous ones. The reference must have
+// been stored already, since the spectra are only valid with its file.
+// `data` must be aligned like the arena's.
+//
+// Returns 0 on success, or -1 on error or if `cancel` returned non-zero
+// between two of the transforms.
+int refcache_store_spectra(const char *title, const double *data, size_t len,
+                           int (*cancel)(void *), void *cancel_ctx);
+
+// Obtains the transform of the first `2 * sample_len` frames of a reference
+// obtained with refcache_get, as calculated by xcorr_spectrum, for
+// cross_correlation_ex. It's valid until the reference is released.
+//
+// Returns NULL if it wasn't saved for that length, or if it's invalid.
+const double complex *refcache_spectrum(const double *data,
+                                        size_t sample_len);
+
+// Downloads the reference of `title` and saves it in the cache along with
+// its spectra, unless they're already cached. It doesn't use the global
+// status, so it can be called while audiosync is running, but the
+// configuration can't change until it finishes.
+//
+// Returns 0 on success, or -1 on error.
+int refcache_prefetch(const char *title);
+
+// Unmaps all the references that aren't in use.
+void refcache_trim();
+
+// Returns the id of the reference of `title`, which is a hash of it. It's
+// also used as the key by the result cache.
+uint64_t refcache_id(const char *title);
+
+// Creates the cache directory from the configuration if it doesn't exist.
+//
+// Returns 0 on success, or -1 on error or if there isn't a cache directory.
+int cache_make_dir();
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+// Cache of the previous results. When the same track is synced again with
+// the same player and output, the lag is usually the same as the last time,
+// so running the full algorithm again is unnecessary.
+//
+// The results are identified by the reference id and a fingerprint of the
+// first second of the recorded audio. The fingerprint only has to be
+// similar to match, since the recording is never exactly the same, and the
+// matching results are verified with bounded_correlation around their lag
+// before being used, so a wrong match only costs that verification.
+//
+// The results are saved in a single file in the cache directory, and
+// nothing is cached if `result_cache` is disabled in the configuration.
+
+// Seconds of recorded audio used for the fingerprint and the verification.
+#define FINGERPRINT_SECONDS 1.0
+
+// Calculates the fingerprint of `len` frames of recorded audio: each bit
+// indicates whether the energy increases between two consecutive blocks.
+uint64_t fingerprint(const double *data, size_t len);
+
+// Looks for a previous result of `title` with a fingerprint similar to the
+// provided one, at the current sample rate.
+//
+// Returns 0 and its lag in frames if found, or -1 otherwise.
+int resultcache_find(const char *title, uint64_t print, long *lag);
+
+// Saves the lag in frames obtained for `title` with the fingerprint, which
+// replaces the previous results with a similar fingerprint.
+//
+// Returns 0 on success, or -1 on error.
+int resultcache_store(const char *title, uint64_t print, long lag);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Single-producer/single-consumer ring buffer of frames, used to pass the
+// audio data from the ffmpeg threads to the main thread.
+//
+// The producer writes directly into the ring and publishes the new frames
+// with an atomic store, so it never has to take a lock. The consumer always
+// sees a consistent number of frames, and is only woken up when the
+// producer reaches the watermark it's waiting for, rather than after every
+// read.
+//
+// The positions are absolute frame counts since the stream started. The
+// ring can also be used as a linear buffer: if the consumer never releases
+// frames and the producer writes at most `cap` frames, they are at the
+// beginning of `buf` in order.
+
+// Word used to wake up the threads waiting for a ring. Multiple rings can
+// share the same event, so that a consumer can wait for all of them at once.
+struct ring_event {
+    unsigned int seq;
+};
+
+struct ring {
+    double *buf;               // Data, allocated by the user
+    size_t cap;                // Capacity in frames
+    size_t head;               // Frames written, modified by the producer
+    size_t tail;               // Frames released, modified by the consumer
+    size_t watermark;          // The consumer is woken up when head reaches it
+    int closed;                // Set when the producer won't write more data
+    struct ring_event *event;  // Event signaled for the consumer
+    struct ring_event space;   // Event signaled for the producer
+};
+
+// Initializes a ring with the provided buffer of `cap` frames. The consumer
+// will be woken up by signaling `event`.
+void ring_init(struct ring *ring, double *buf, size_t cap,
+               struct ring_event *event);
+
+// Producer functions. ring_write_ptr returns where the next frames have to be
+// written, with the number of contiguous frames available in `avail`, which
+// may be zero if the ring is full. ring_commit publishes `n` frames written
+// there, waking up the consumer if its watermark was reached.
+// ring_close indicates that no more frames will be written.
+double *ring_write_ptr(struct ring *ring, size_t *avail);
+void ring_commit(struct ring *ring, size_t n);
+void ring_close(struct ring *ring);
+// Waits until the consumer releases frames, or for at most `timeout_ms`
+// milliseconds.
+void ring_wait_space(struct ring *ring, long timeout_ms);
+
+// Consumer functions. ring_count returns the number of frames written so
+// far. ring_set_watermark configures when the consumer will be woken up.
+// ring_read copies `n` frames starting at the absolute position `pos`, which
+// must still be in the ring. ring_release discards the frames before the
+// absolute position `pos`, so that the producer can reuse their space.
+size_t ring_count(struct ring *ring);
+int ring_is_closed(struct ring *ring);
+void ring_set_watermark(struct ring *ring, size_t watermark);
+void ring_read(struct ring *ring, size_t pos, double *dst, size_t n);
+void ring_release(struct ring *ring, size_t pos);
+
+// Event functions. To wait without missing any signals, the consumer must
+// take a snapshot before checking its condition, and then wait with that
+// snapshot if it isn't met. event_wait returns immediately if the event was
+// signaled after the snapshot. A negative timeout waits indefinitely.
+unsigned int event_snapshot(struct ring_event *event);
+void event_wait(struct ring_event *event, unsigned int snapshot,
+                long timeout_ms);
+void event_signal(struct ring_event *event);
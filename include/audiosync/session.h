@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Continuous capture across the tracks of a playlist. Otherwise, every run
+// starts a new recording from scratch: the audio played before it is lost,
+// and starting ffmpeg delays the first interval at every track change.
+//
+// While a session is active, a single recording is kept open, and the last
+// seconds of it are kept in a ring. The gaps of silence between the tracks
+// are detected as the audio is read, and each run starts its recording at
+// the last boundary before it was called, copying the frames from the
+// session's ring instead of starting its own capture. The first intervals
+// are usually available right away, and the lag is still relative to when
+// the run was called.
+//
+// Gapless playlists don't have any boundaries, in which case the runs start
+// at the frame where they were called, which still avoids starting ffmpeg.
+
+// Maximum number of boundaries remembered.
+#define SESSION_MAX_BOUNDARIES 8
+
+// Detector of the boundaries between tracks: the first active block after
+// a gap of silence, or after the beginning of the stream.
+struct boundary_detector {
+    size_t block;           // Frames per block
+    double threshold;       // Maximum mean energy of a silent block
+    size_t gap;             // Silent blocks that separate two tracks
+    double energy;          // Sum of the current block's energy so far
+    size_t filled;          // Frames in the current block so far
+    size_t pos;             // Frames analyzed
+    size_t silent;          // Silent blocks in a row
+    int active;             // Whether there has been any active block
+    // The last boundaries found, as absolute positions.
+    size_t boundaries[SESSION_MAX_BOUNDARIES];
+    size_t n_boundaries;
+};
+
+// Initializes the detector with blocks of `block` frames, which are silent
+// if their RMS is at most `threshold`, and tracks separated by at least
+// `gap` frames of silence.
+void boundary_init(struct boundary_detector *det, size_t block,
+                   double threshold, size_t gap);
+
+// Analyzes the next `n` frames of the stream.
+void boundary_update(struct boundary_detector *det, const double *data,
+                     size_t n);
+
+// Obtains the last boundary between `start` and `end`.
+//
+// Returns 0 on success, or -1 if there isn't any.
+int boundary_last(const struct boundary_detector *det, size_t start,
+                  size_t end, size_t *pos);
+
+// Internal functions used by audiosync_run while a session is active.
+//
+// session_begin chooses where the run's recording starts, and keeps the
+// session from discarding the frames after it. It returns the number of
+// frames between that position and the current one, which must be added to
+// the lag. session_feed is used for the capture thread instead of capture,
+// copying the frames from there into the provided ring. session_end lets
+// the session discard the frames again.
+int session_active();
+size_t session_begin();
+void *session_feed(void *arg);
+void session_end();
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <audiosync/cross_correlation.h>
+
+// Polarity-coincidence correlation, an alternative engine to
+// cross_correlation for the coarse search. Only the sign of each frame is
+// kept, so 64 frames are packed in a single word, and the score of a lag is
+// the number of frames whose signs agree minus the ones that don't, which
+// is obtained with XOR and popcount. The packed signals are small enough to
+// stay in the cache, unlike the transforms.
+//
+// Every lag is evaluated, so the cost grows with the square of the length.
+// To keep it cheap, the coarse search uses both signals decimated by
+// `params->decimation`, and it's split in ranges of lags between the
+// threads. Its strongest peaks are the candidates, which are refined with
+// the full-rate signs around them, and confirmed with the Pearson
+// coefficient of the actual audio.
+//
+// The XOR/popcount loop uses AVX-512 VPOPCNTDQ or AVX2 if the CPU supports
+// them, which is checked at runtime.
+
+// Rate at which the coarse search is run, in Hz. It's used to choose the
+// decimation from the sample rate.
+#define SIGN_COARSE_RATE 4000
+
+// Maximum number of candidates confirmed.
+#define SIGN_CANDIDATES 4
+
+// The implementations of the XOR/popcount loop.
+typedef enum {
+    SIGN_KERNEL_SCALAR,
+    SIGN_KERNEL_AVX2,
+    SIGN_KERNEL_AVX512
+} sign_kernel_t;
+
+// Same as cross_correlation_ex, with the same lags and coefficient, but the
+// candidates are obtained with the signs. If `params` is NULL, the default
+// ones are used.
+//
+// Returns 0 on success, or -1 if none of the candidates could be confirmed,
+// or if it was cancelled.
+int sign_correlation(double *source, double *sample, const size_t length,
+                     const struct xcorr_params *params, long *lag,
+                     double *coefficient);
+
+// Packs the signs of `len` frames decimated by `factor` into `bits`, which
+// must have room for sign_words(len / factor) words. The frames are
+// averaged in blocks of `factor`, and a bit is set if the block is above the
+// mean of the signal. The bits after the end are zero.
+//
+// Returns the number of bits packed.
+size_t sign_words(size_t nbits);
+size_t sign_pack(const double *data, size_t len, size_t factor,
+                 uint64_t *bits);
+
+// Counts the bits that differ between the first `nbits` bits of `a` and the
+// `nbits` bits of `b` starting at bit `off`. `b` must have at least one
+// readable word after the last one used.
+size_t sign_xor_count(const uint64_t *a, const uint64_t *b, size_t off,
+                      size_t nbits);
+
+// Obtains the kernel used by sign_xor_count, and changes it, which is
+// mostly useful to compare them.
+//
+// sign_set_kernel returns 0 on success, or -1 if the CPU doesn't support it.
+sign_kernel_t sign_kernel();
+int sign_set_kernel(sign_kernel_t kernel);
+char *sign_kernel_to_string(sign_kernel_t kernel);
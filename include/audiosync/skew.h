@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdlib.h>
+#include <audiosync/cross_correlation.h>
+
+// Estimation of the clock skew between the recording and the reference. A
+// single lag assumes that both run at exactly the same rate, which isn't true
+// for Bluetooth sinks, resampling players or long videos. The skew also
+// smears the peak of the cross-correlation over long intervals, so the
+// confidence stays low even if the track is right.
+//
+// The sample is split in sub-windows whose lags are obtained separately
+// around the lag of the whole sample, and the skew is the slope of a linear
+// fit of these lags. The Theil-Sen estimator is used (the median of the
+// slopes between every pair of points), so a few wrong sub-windows, like
+// silent parts, don't affect it.
+//
+// The skew is in parts per million, and it's positive if the reference
+// advances faster than the recording.
+
+// Estimates the skew between the sample and the source, which must be twice
+// as long, with `lag` being the approximate lag of the whole sample. The lag
+// of the fit at the beginning of the sample is saved in `fit_lag`.
+//
+// Returns 0 on success, or -1 if there weren't enough sub-windows with a
+// valid lag.
+int skew_estimate(double *source, double *sample, size_t sample_len,
+                  long lag, double *ppm, double *fit_lag);
+
+// Resamples `len` frames of the sample into `out` with linear interpolation,
+// so that it runs at the same rate as the source.
+void skew_compensate(const double *sample, double *out, size_t len,
+                     double ppm);
+
+// Same as cross_correlation_ex, but the skew is estimated too. If the
+// confidence isn't enough for the configuration, the sample is compensated
+// in `buf`, which must have `sample_len` frames, and it's correlated again.
+// The best result of both is kept. If `buf` is NULL, the skew is only
+// estimated.
+//
+// The skew is zero if it couldn't be estimated.
+//
+// Returns -1 on error, or 0 otherwise.
+int skew_correlation(double *source, double *sample, size_t sample_len,
+                     const struct xcorr_params *params, double *buf,
+                     long *lag, double *coefficient, double *ppm);
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+// Stage-level tracing, to find out where the time of a run goes: resolving
+// the URL, starting ffmpeg, waiting for the first frames and for each
+// interval, the transforms or the coefficient.
+//
+// The spans are only recorded if the library is compiled with TRACE
+// defined. Otherwise, the macros below expand to nothing. Each thread
+// appends its events to its own buffer, without locks, and at the end of
+// every run they're written as a Chrome trace to the file in the
+// AUDIOSYNC_TRACE environment variable, which can be opened in Perfetto or
+// chrome://tracing. If it's not set, they're discarded.
+//
+// The names must be string literals, since only their pointers are saved.
+
+// An open span, created with trace_begin.
+struct trace_span {
+    const char *name;
+    uint64_t start;   // In nanoseconds
+    long arg;         // Saved with the event if it's not negative
+};
+
+#ifdef TRACE
+# define trace_begin(span, name) \
+    struct trace_span span = trace_span_start(name, -1)
+# define trace_begin_arg(span, name, arg) \
+    struct trace_span span = trace_span_start(name, arg)
+# define trace_end(span) trace_span_end(&(span))
+# define trace_mark(name) trace_instant(name)
+# define trace_thread(name) trace_thread_name(name)
+# define trace_flush() trace_run_end()
+#else
+# define trace_begin(span, name) do {} while(0)
+# define trace_begin_arg(span, name, arg) do {} while(0)
+# define trace_end(span) do {} while(0)
+# define trace_mark(name) do {} while(0)
+# define trace_thread(name) do {} while(0)
+# define trace_flush() do {} while(0)
+#endif
+
+// Starts a span in the current thread, with an optional argument, like the
+// length of the data.
+struct trace_span trace_span_start(const char *name, long arg);
+
+// Ends a span, saving it in the current thread's buffer.
+void trace_span_end(const struct trace_span *span);
+
+// Saves an instant event, like the arrival of the first frames.
+void trace_instant(const char *name);
+
+// Names the current thread in the trace.
+void trace_thread_name(const char *name);
+
+// Writes the events saved so far by every thread into `path` as a Chrome
+// trace, and removes them from the buffers.
+//
+// Returns 0 on success, or -1 on error.
+int trace_dump(const char *path);
+
+// Called at the end of a run: the events are dumped into the file in
+// AUDIOSYNC_TRACE, or discarded.
+void trace_run_end();
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdlib.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/ring.h>
+
+// Tracking of the lag after the initial sync. Player buffering, seeks or the
+// clocks drifting apart make the lag wander, and running the full algorithm
+// again is expensive. Instead, the streams are kept open and every few
+// seconds a short window of the latest recorded audio is compared with the
+// reference around the current lag with bounded_correlation, which only
+// takes a few milliseconds. The measurements are smoothed with an
+// exponential moving average.
+//
+// If the confidence stays too low for a few measurements in a row (after a
+// seek, for example), the lag is searched again with cross_correlation in a
+// window as long as the first interval of the configuration.
+//
+// The tracker only reads the rings, so the frames it still needs have to be
+// kept in them: their capacity must be at least the length of the first
+// interval (twice for the reference) plus tracker_headroom().
+
+struct tracker {
+    double lag;              // Smoothed lag, in frames
+    double confidence;       // Coefficient of the last measurement
+    size_t pos;              // Recorded frames needed for the next update
+    unsigned int failures;   // Measurements without enough confidence in a row
+    double *sample;          // Windows copied out of the rings
+    double *source;
+    struct xcorr_workspace ws;
+};
+
+// Initializes a tracker that starts at `lag` frames, with its first update
+// once `pos` frames have been recorded.
+//
+// Returns 0 on success, or -1 if its buffers couldn't be allocated.
+int tracker_init(struct tracker *tr, long lag, size_t pos);
+void tracker_free(struct tracker *tr);
+
+// The extra frames the rings need so that the producers can keep writing
+// while the tracker still needs the previous frames.
+size_t tracker_headroom();
+
+// Obtains the number of frames each ring must have before the next update.
+void tracker_needed(const struct tracker *tr, size_t *cap_len,
+                    size_t *down_len);
+
+// Measures the lag with the latest frames, and releases the ones that won't
+// be needed anymore.
+//
+// Returns 0 if the lag was measured with enough confidence, or -1 otherwise.
+int tracker_update(struct tracker *tr, struct ring *cap_ring,
+                   struct ring *down_ring);
@@ -14,8 +14,16 @@ audiosync = Extension(
     include_dirs = ['include'],
     libraries = ['m', 'pthread', 'fftw3', 'pulse'],
     library_dirs = ['/usr/local/lib'],
-    sources = ['src/bind.c', 'src/audiosync.c', 'src/cross_correlation.c',
-               'src/ffmpeg_pipe.c', 'src/download/linux_download.c',
+    sources = ['src/bind.c', 'src/audiosync.c', 'src/acceptance.c',
+               'src/activity.c', 'src/arena.c',
+               'src/config.c', 'src/cross_correlation.c', 'src/diag.c',
+               'src/ffmpeg_pipe.c', 'src/metrics.c', 'src/periodicity.c',
+               'src/pool.c',
+               'src/reference_cache.c',
+               'src/result_cache.c', 'src/ring.c', 'src/session.c',
+               'src/sign_correlation.c', 'src/skew.c',
+               'src/trace.c', 'src/tracking.c',
+               'src/download/linux_download.c',
                'src/capture/linux_capture.c']
 )
 
@@ -0,0 +1,64 @@
+// The policy that decides when the lag of a run is good enough. See
+// acceptance.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/acceptance.h>
+#include <audiosync/config.h>
+
+
+// Starts a new run without any intervals.
+void acceptance_init(struct acceptance *acc) {
+    debug_assert(acc);
+
+    acc->lag = 0;
+    acc->agreeing = 0;
+}
+
+// Adds the result of the next interval, in frames. The agreement is
+// compared with the previous interval, so that a small drift between them
+// doesn't break it.
+//
+// Returns 1 if the lag is accepted, or 0 otherwise.
+int acceptance_update(struct acceptance *acc, long lag, double coefficient) {
+    debug_assert(acc);
+
+    const struct derived_config *config = get_config();
+    if (coefficient >= config->user.min_confidence) {
+        return 1;
+    }
+
+    if (acc->agreeing == 0
+            || (size_t) labs(lag - acc->lag) > config->agreement_tolerance) {
+        acc->agreeing = 0;
+    }
+    // There's one update per interval at most.
+    debug_assert(acc->agreeing < MAX_INTERVALS);
+    acc->coefs[acc->agreeing++] = coefficient;
+    acc->lag = lag;
+
+    // Only the coefficients of the last intervals are considered.
+    const size_t needed = config->user.agreement_intervals;
+    if (needed == 0 || acc->agreeing < needed) {
+        return 0;
+    }
+    double sum = 0.0;
+    for (size_t i = acc->agreeing - needed; i < acc->agreeing; i++) {
+        sum += acc->coefs[i];
+    }
+    if (sum / needed >= config->user.agreement_confidence) {
+        log("%zu intervals agree on %ld frames with an average confidence"
+            " of %f", needed, lag, sum / needed);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Breaks the agreement after an interval that failed.
+void acceptance_fail(struct acceptance *acc) {
+    debug_assert(acc);
+
+    acc->agreeing = 0;
+}
@@ -0,0 +1,54 @@
+// Activity detector used while reading the audio. See activity.h for more
+// details.
+
+#include <audiosync/audiosync.h>
+#include <audiosync/activity.h>
+
+
+// Initializes the detector with blocks of `block` frames, considering them
+// active if their RMS is above `threshold`.
+void activity_init(struct activity *act, size_t block, double threshold) {
+    debug_assert(act); debug_assert(block > 0);
+
+    act->block = block;
+    act->threshold = threshold * threshold;
+    act->energy = 0.0;
+    act->filled = 0;
+    act->pos = 0;
+    act->start = ACTIVITY_NONE;
+    act->active = 0;
+}
+
+// Analyzes the next `n` frames of the stream. The results are published
+// atomically after every block, since the consumer may be reading them.
+void activity_update(struct activity *act, const double *data, size_t n) {
+    debug_assert(act); debug_assert(data);
+
+    for (size_t i = 0; i < n; i++) {
+        act->energy += data[i] * data[i];
+        if (++act->filled < act->block) continue;
+
+        // The block is complete.
+        const size_t block_start = act->pos + i + 1 - act->block;
+        if (act->energy / act->block > act->threshold) {
+            if (act->start == ACTIVITY_NONE) {
+                __atomic_store_n(&act->start, block_start, __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&act->active, act->active + act->block,
+                             __ATOMIC_RELEASE);
+        }
+        act->energy = 0.0;
+        act->filled = 0;
+    }
+    act->pos += n;
+}
+
+// Returns the position of the first active frame, or ACTIVITY_NONE.
+size_t activity_start(const struct activity *act) {
+    return __atomic_load_n(&act->start, __ATOMIC_ACQUIRE);
+}
+
+// Returns the number of active frames so far.
+size_t activity_active(const struct activity *act) {
+    return __atomic_load_n(&act->active, __ATOMIC_ACQUIRE);
+}
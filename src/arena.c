@@ -0,0 +1,313 @@
+// The arena is a small library-level allocator for the big buffers in the
+// module. Every run used to allocate and free ~35 MB in audiosync_run and
+// ~70 MB more for each interval in cross_correlation, which meant
+// page-faulting all of that memory again on every run. Instead, the buffers
+// given back to the arena are kept mapped in a list and reused by the next
+// allocation that fits in them.
+//
+// The sizes are rounded up to the huge page size, so that the different
+// intervals can share the same blocks, and so that Transparent Huge Pages
+// can back them entirely.
+//
+// The shared blocks are backed by a memfd instead, so that the ffmpeg
+// processes can write into them directly. They're kept apart from the
+// anonymous ones, and always use regular pages.
+
+#define _GNU_SOURCE  // MAP_ANONYMOUS, MAP_HUGETLB, MAP_POPULATE, madvise()
+                     // and memfd_create()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/metrics.h>
+
+// The usual huge page size in x86_64 and aarch64.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Maximum number of bytes kept mapped while not in use. A regular run
+// requires ~105 MB in total at its last interval.
+#define MAX_RETAINED (256 * 1024 * 1024)
+
+
+// Information about each of the mapped blocks.
+struct block {
+    void *ptr;           // Start of the usable memory
+    void *map;           // Start of the mapping, which may be unaligned
+    size_t size;         // Usable size in bytes
+    size_t map_size;     // Size of the mapping in bytes
+    int fd;              // The memfd of a shared block, or -1
+    int in_use;          // Whether the block is currently being used
+    struct block *next;
+};
+
+// The list of blocks and the configuration are protected by a mutex. It's
+// only taken when allocating or freeing, which happens a few times per
+// interval.
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct block *blocks = NULL;
+static size_t retained = 0;
+static huge_pages_t huge_mode = HUGE_PAGES_THP;
+
+
+// Maps a new block of memory of `size` bytes, which must be a multiple of
+// HUGE_PAGE_SIZE. The memory is pre-faulted so that the first usage doesn't
+// have to do it.
+//
+// Returns 0 on success, or -1 on error.
+static int map_block(struct block *b, size_t size, huge_pages_t mode) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+
+    b->fd = -1;
+    if (mode == HUGE_PAGES_HUGETLB) {
+        // Reserved huge pages are already aligned and faulted with
+        // MAP_POPULATE. If there aren't enough of them, the regular pages
+        // are used instead.
+        b->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+                      | MAP_POPULATE, -1, 0);
+        if (b->map != MAP_FAILED) {
+            b->ptr = b->map;
+            b->size = b->map_size = size;
+            return 0;
+        }
+        log("MAP_HUGETLB failed, falling back to transparent huge pages");
+        mode = HUGE_PAGES_THP;
+    }
+
+    if (mode == HUGE_PAGES_OFF) {
+        b->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (b->map == MAP_FAILED) {
+            perror("audiosync: mmap for arena block failed");
+            return -1;
+        }
+        b->ptr = b->map;
+        b->size = b->map_size = size;
+        return 0;
+    }
+
+    // Transparent huge pages are only used for regions aligned to the huge
+    // page size, so an extra huge page is mapped to align the start.
+    b->map_size = size + HUGE_PAGE_SIZE;
+    b->map = mmap(NULL, b->map_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->map == MAP_FAILED) {
+        perror("audiosync: mmap for arena block failed");
+        return -1;
+    }
+    uintptr_t start = ((uintptr_t) b->map + HUGE_PAGE_SIZE - 1)
+                      & ~((uintptr_t) HUGE_PAGE_SIZE - 1);
+    b->ptr = (void *) start;
+    b->size = size;
+    // Not being able to advise the kernel isn't fatal: it might just not
+    // support THP.
+    madvise(b->ptr, b->size, MADV_HUGEPAGE);
+
+    // Pre-faulting the block after the advice, so that the kernel can
+    // directly use huge pages.
+    for (size_t i = 0; i < b->size; i += page_size) {
+        ((volatile char *) b->ptr)[i] = 0;
+    }
+
+    return 0;
+}
+
+// Maps a new shared block of `size` bytes, backed by a memfd. Its size is
+// sealed, so that a process writing past its end fails instead of growing
+// it.
+//
+// Returns 0 on success, or -1 on error.
+static int map_shared_block(struct block *b, size_t size) {
+    b->fd = memfd_create("audiosync", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (b->fd < 0) {
+        perror("audiosync: memfd_create for arena block failed");
+        return -1;
+    }
+    if (ftruncate(b->fd, size) < 0) {
+        perror("audiosync: ftruncate for arena block failed");
+        close(b->fd);
+        return -1;
+    }
+    // Not being able to seal it isn't fatal, the writes are bounded anyway.
+    fcntl(b->fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK);
+
+    b->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, b->fd, 0);
+    if (b->map == MAP_FAILED) {
+        perror("audiosync: mmap for arena block failed");
+        close(b->fd);
+        return -1;
+    }
+    b->ptr = b->map;
+    b->size = b->map_size = size;
+
+    return 0;
+}
+
+// Unmaps a block and frees its information. The block must already be
+// removed from the list.
+static void unmap_block(struct block *b) {
+    munmap(b->map, b->map_size);
+    if (b->fd >= 0) close(b->fd);
+    free(b);
+}
+
+// Returns a free block of either kind with at least `size` bytes, or maps a
+// new one.
+static void *alloc_block(size_t size, int shared) {
+    debug_assert(size > 0);
+
+    size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+
+    // Looking for the smallest free block that fits the requested size.
+    pthread_mutex_lock(&arena_mutex);
+    struct block *best = NULL;
+    for (struct block *b = blocks; b != NULL; b = b->next) {
+        if (!b->in_use && (b->fd >= 0) == shared && b->size >= size
+                && (best == NULL || b->size < best->size)) {
+            best = b;
+        }
+    }
+    if (best) {
+        best->in_use = 1;
+        retained -= best->size;
+        pthread_mutex_unlock(&arena_mutex);
+        return best->ptr;
+    }
+    huge_pages_t mode = huge_mode;
+    pthread_mutex_unlock(&arena_mutex);
+
+    // Otherwise, a new block is mapped outside the lock, since it may take a
+    // while to pre-fault it.
+    struct block *b = malloc(sizeof(*b));
+    if (b == NULL) {
+        perror("audiosync: arena block malloc failed");
+        return NULL;
+    }
+    if ((shared ? map_shared_block(b, size) : map_block(b, size, mode)) < 0) {
+        free(b);
+        return NULL;
+    }
+    b->in_use = 1;
+    metrics_add(alloc_bytes, size);
+
+    pthread_mutex_lock(&arena_mutex);
+    b->next = blocks;
+    blocks = b;
+    pthread_mutex_unlock(&arena_mutex);
+
+    return b->ptr;
+}
+
+// Returns a buffer of at least `size` bytes, or NULL in case of error. The
+// contents of the buffer are undefined, since it may have been used before.
+void *arena_alloc(size_t size) {
+    return alloc_block(size, 0);
+}
+
+// Same as arena_alloc, but the buffer is backed by a memfd, which can be
+// obtained with arena_shared_fd.
+void *arena_alloc_shared(size_t size) {
+    return alloc_block(size, 1);
+}
+
+// Obtains the memfd backing the shared buffer that contains `ptr`, and the
+// offset of `ptr` in it.
+//
+// Returns the file descriptor, or -1 if `ptr` isn't in a shared buffer.
+int arena_shared_fd(const void *ptr, size_t *offset) {
+    int fd = -1;
+
+    pthread_mutex_lock(&arena_mutex);
+    for (struct block *b = blocks; b != NULL; b = b->next) {
+        const char *start = b->ptr;
+        if (b->fd >= 0 && b->in_use && (const char *) ptr >= start
+                && (const char *) ptr < start + b->size) {
+            fd = b->fd;
+            *offset = (const char *) ptr - start;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&arena_mutex);
+
+    return fd;
+}
+
+// Gives a buffer obtained with arena_alloc or arena_alloc_shared back to the
+// arena. It will be kept mapped for the next allocation unless the retained
+// memory goes over the limit. NULL is accepted and ignored.
+void arena_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    pthread_mutex_lock(&arena_mutex);
+    struct block **prev = &blocks;
+    struct block *b = blocks;
+    while (b != NULL && b->ptr != ptr) {
+        prev = &b->next;
+        b = b->next;
+    }
+    debug_assert(b != NULL); debug_assert(b->in_use);
+    if (b == NULL) {
+        pthread_mutex_unlock(&arena_mutex);
+        return;
+    }
+
+    // The block is unmapped directly if keeping it would exceed the limit.
+    if (retained + b->size > MAX_RETAINED) {
+        *prev = b->next;
+        pthread_mutex_unlock(&arena_mutex);
+        unmap_block(b);
+        return;
+    }
+
+    b->in_use = 0;
+    retained += b->size;
+    pthread_mutex_unlock(&arena_mutex);
+}
+
+// Unmaps all the buffers that aren't currently in use. Returns the number of
+// bytes released.
+size_t arena_trim() {
+    size_t released = 0;
+    struct block *unused = NULL;
+
+    // The blocks are first moved to a separate list so that the munmap
+    // calls are performed without the lock.
+    pthread_mutex_lock(&arena_mutex);
+    struct block **prev = &blocks;
+    struct block *b = blocks;
+    while (b != NULL) {
+        struct block *next = b->next;
+        if (!b->in_use) {
+            *prev = next;
+            b->next = unused;
+            unused = b;
+            released += b->size;
+        } else {
+            prev = &b->next;
+        }
+        b = next;
+    }
+    retained = 0;
+    pthread_mutex_unlock(&arena_mutex);
+
+    while (unused != NULL) {
+        struct block *next = unused->next;
+        unmap_block(unused);
+        unused = next;
+    }
+
+    return released;
+}
+
+// Configures how the new buffers will be mapped. Already mapped buffers
+// aren't affected until they're trimmed.
+void arena_set_huge_pages(huge_pages_t mode) {
+    pthread_mutex_lock(&arena_mutex);
+    huge_mode = mode;
+    pthread_mutex_unlock(&arena_mutex);
+}
@@ -24,13 +24,42 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <math.h>
+#include <complex.h>
 #include <fftw3.h>
 #include <string.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/acceptance.h>
+#include <audiosync/activity.h>
+#include <audiosync/arena.h>
 #include <audiosync/cross_correlation.h>
+#include <audiosync/metrics.h>
+#include <audiosync/periodicity.h>
+#include <audiosync/reference_cache.h>
+#include <audiosync/result_cache.h>
+#include <audiosync/session.h>
+#include <audiosync/sign_correlation.h>
+#include <audiosync/skew.h>
+#include <audiosync/trace.h>
+#include <audiosync/tracking.h>
 #include <audiosync/capture/linux_capture.h>
 #include <audiosync/download/linux_download.h>
 
+// Maximum distance from a previous result's lag searched when verifying it,
+// in milliseconds.
+#define RESULT_RADIUS_MS 10
+// A previous result isn't trusted if the lags a period away from it match
+// almost as well, within this coefficient.
+#define COMPETING_MARGIN 0.05
+// Length of the blocks analyzed by the activity detector, in milliseconds.
+#define ACTIVITY_BLOCK_MS 10
+// Minimum part of an interval that must be active for it to be correlated.
+#define MIN_ACTIVE_RATIO 0.5
+// The offsets of the source are multiples of this number of frames, so that
+// it keeps the alignment required by the precomputed FFTW plans.
+#define SOURCE_ALIGN 8
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 
 // Defining the global variables from audiosync.h
 volatile global_status_t global_status = IDLE_ST;
@@ -38,50 +67,66 @@ volatile global_status_t global_status = IDLE_ST;
 // nothing will happen, because the mutex and conditiona are initialized
 // already.
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t interval_done = PTHREAD_COND_INITIALIZER;
+struct ring_event interval_event = { 0 };
 pthread_cond_t read_continue = PTHREAD_COND_INITIALIZER;
 
-// The algorithm will be run in these intervals. When both threads signal
-// that their interval is finished, the cross correlation will be calculated.
-// If it's accepted, the threads will finish and the main function will return
-// the lag. The intervals for downloading and capturing audio differ, since
-// the source (download) doesn't require zero-padding inside cross_correlation.
-const size_t INTERV_SAMPLE[] = {
-    3 * SAMPLE_RATE,  // 144,000 frames
-    6 * SAMPLE_RATE,  // 288,000 frames
-    10 * SAMPLE_RATE,  // 432,000 frames
-    15 * SAMPLE_RATE,  // 576,000 frames
-    20 * SAMPLE_RATE,  // 720,000 frames
-    30 * SAMPLE_RATE,  // 1,440,000 frames
-};
-const size_t N_INTERVALS = sizeof(INTERV_SAMPLE) / sizeof(INTERV_SAMPLE[0]);
-const size_t LEN_SAMPLE = 30 * SAMPLE_RATE;
-// The download intervals will always be twice as big as the capture ones,
-// and the size of n_intervals.
-const size_t INTERV_SOURCE[] = {
-    2 * 3 * SAMPLE_RATE, 
-    2 * 6 * SAMPLE_RATE, 
-    2 * 10 * SAMPLE_RATE,
-    2 * 15 * SAMPLE_RATE,
-    2 * 20 * SAMPLE_RATE,
-    2 * 30 * SAMPLE_RATE,
-};
-const size_t LEN_SOURCE = 2 * 30 * SAMPLE_RATE;
+// The lag published while tracking, protected by the global mutex.
+static struct {
+    int active;
+    long lag;           // In milliseconds
+    double confidence;
+} tracked = { 0 };
+
+// The skew estimated by the last successful run, protected by the global
+// mutex.
+static struct {
+    int valid;
+    double ppm;
+} last_skew = { 0 };
+
+// The statistics of the last run, protected by the global mutex.
+static struct {
+    int valid;
+    struct audiosync_run_stats stats;
+} last_run = { 0 };
+
 
+// Sets the aborted status with the global mutex held. The abort "wakes up"
+// all threads waiting for something.
+static void abort_locked() {
+    global_status = ABORT_ST;
+    event_signal(&interval_event);
+    pthread_cond_broadcast(&read_continue);
+}
 
 // The module can be controlled externally with these basic functions. They
 // expose the global status variable, which will be received from the threads
 // accordingly. These functions atomically read or write the global status.
 void audiosync_abort() {
     pthread_mutex_lock(&mutex);
-    global_status = ABORT_ST;
-    // The abort "wakes up" all threads waiting for something.
-    pthread_cond_broadcast(&interval_done);
-    pthread_cond_broadcast(&read_continue);
+    abort_locked();
     pthread_mutex_unlock(&mutex);
 }
 
+// Aborts the run in progress, if there's one. The status is checked with
+// the same lock, so a run that starts right after isn't aborted, and
+// nothing happens while idle.
+//
+// Returns 1 if a run was aborted, or 0 otherwise.
+int audiosync_abort_running() {
+    int ret = 0;
+    pthread_mutex_lock(&mutex);
+    if (global_status == RUNNING_ST || global_status == PAUSED_ST) {
+        abort_locked();
+        ret = 1;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
 void audiosync_pause() {
+    metrics_add(pauses, 1);
     pthread_mutex_lock(&mutex);
     global_status = PAUSED_ST;
     pthread_mutex_unlock(&mutex);
@@ -96,6 +141,13 @@ void audiosync_resume() {
     pthread_mutex_unlock(&mutex);
 }
 
+// Cancellation callback for cross_correlation_ex, so that the correlations
+// stop shortly after an abort instead of running until they're done.
+int audiosync_cancelled(void *ctx) {
+    UNUSED(ctx);
+    return global_status == ABORT_ST;
+}
+
 global_status_t audiosync_status() {
     global_status_t ret;
     pthread_mutex_lock(&mutex);
@@ -105,6 +157,68 @@ global_status_t audiosync_status() {
     return ret;
 }
 
+// The big buffers used by the algorithm are kept mapped between runs so that
+// the next one doesn't have to page-fault them again. audiosync_trim
+// releases them, which is useful after a run if audiosync won't be used for a
+// while. It returns the number of bytes released.
+size_t audiosync_trim() {
+    refcache_trim();
+    size_t released = arena_trim();
+    log("released %ld bytes from the arena", released);
+    return released;
+}
+
+// Prepares everything needed by the runs in advance: the FFTW plans for the
+// current configuration, and the buffers of the arena, which are left
+// allocated and page-faulted for the first run. Long-running processes can
+// call it once at startup so that the first run isn't slower than the rest.
+//
+// Returns 0 on success, or -1 on error.
+int audiosync_warmup() {
+    const struct derived_config *config = get_config();
+    const size_t source_len = config->len_source;
+    const size_t cpx_len = (source_len / 2) + 1;
+    int ret = -1;
+
+    for (size_t i = 0; i < config->user.n_intervals; i++) {
+        if (xcorr_prepare(config->interv_sample[i]) < 0) {
+            return -1;
+        }
+    }
+
+    // The same buffers that a run at its last interval requires: the
+    // recording with its padding and the source in audiosync_run, and the
+    // padded sample, both spectrums and the results in cross_correlation.
+    // The recording is longer if the leading silence is trimmed.
+    const size_t trim = config->user.silence_threshold > 0.0
+        ? config->interv_sample[0] : 0;
+    const size_t sizes[] = {
+        (2 * config->len_sample + trim) * sizeof(double),
+        config->len_source * sizeof(double),
+        source_len * sizeof(double),
+        cpx_len * sizeof(double complex),
+        cpx_len * sizeof(double complex),
+        source_len * sizeof(double),
+    };
+    const size_t n_bufs = sizeof(sizes) / sizeof(*sizes);
+    void *bufs[sizeof(sizes) / sizeof(*sizes)] = { NULL };
+    for (size_t i = 0; i < n_bufs; i++) {
+        bufs[i] = arena_alloc(sizes[i]);
+        if (bufs[i] == NULL) {
+            log("warmup arena_alloc failed");
+            goto finish;
+        }
+    }
+    ret = 0;
+
+finish:
+    for (size_t i = 0; i < n_bufs; i++) {
+        arena_free(bufs[i]);
+    }
+
+    return ret;
+}
+
 // Converting a status enum value to a string.
 char *status_to_string(global_status_t status) {
     switch (status) {
@@ -134,135 +248,596 @@ int audiosync_setup(const char *stream_name) {
     return pulseaudio_setup(stream_name);
 }
 
-// Main function to start the audio synchronization algorithm. It will return
-// 0 in case of success, or -1 otherwise. `yt_title` is the name of the song
-// currently playing on the computer. The obtained lag will be returned to
-// the variable `lag` points to.
+// Obtains the latest lag published by audiosync_track, in milliseconds, and
+// the coefficient of its last measurement.
 //
-// It will start two threads: one to download the audio, and another one to
-// record it. These threads will signal this main function once they have
-// finished an interval, so that the audio synchronization algorithm can
-// be ran with the current data. This will be done until an acceptable
-// result is obtained, or until all intervals are finished.
+// Returns 0 on success, or -1 if audiosync isn't tracking.
+int audiosync_tracked_lag(long *lag, double *confidence) {
+    debug_assert(lag); debug_assert(confidence);
+
+    int ret = -1;
+    pthread_mutex_lock(&mutex);
+    if (tracked.active) {
+        *lag = tracked.lag;
+        *confidence = tracked.confidence;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+// Obtains the clock skew estimated by the last successful run, in parts per
+// million. It's only estimated if enabled in the configuration.
 //
-// This function starts the algorithm. Only one audiosync thread can be
-// running at once.
-int audiosync_run(const char *yt_title, long *lag) {
+// Returns 0 on success, or -1 if it's not available.
+int audiosync_skew(double *ppm) {
+    debug_assert(ppm);
+
+    int ret = -1;
+    pthread_mutex_lock(&mutex);
+    if (last_skew.valid) {
+        *ppm = last_skew.ppm;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+// Obtains the statistics of the last run that finished, successfully or
+// not.
+//
+// Returns 0 on success, or -1 if there hasn't been any.
+int audiosync_last_run(struct audiosync_run_stats *stats) {
+    debug_assert(stats);
+
+    int ret = -1;
+    pthread_mutex_lock(&mutex);
+    if (last_run.valid) {
+        *stats = last_run.stats;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+static void publish(int active, long lag, double confidence) {
+    pthread_mutex_lock(&mutex);
+    tracked.active = active;
+    tracked.lag = lag;
+    tracked.confidence = confidence;
+    pthread_mutex_unlock(&mutex);
+}
+
+// Waits until the rings have at least `cap_len` and `down_len` frames, or
+// until audiosync is aborted. The threads only signal the event when they
+// reach the watermark, rather than after every read.
+//
+// Returns 0 on success, or -1 if it was aborted or a ring was closed without
+// enough frames.
+static int wait_rings(struct ring *cap_ring, size_t cap_len,
+                      struct ring *down_ring, size_t down_len) {
+    trace_begin(span, "wait for the streams");
+    const uint64_t start = metrics_now();
+    int ret;
+    ring_set_watermark(cap_ring, cap_len);
+    ring_set_watermark(down_ring, down_len);
+    while (1) {
+        // The snapshot is taken before checking the condition so that no
+        // signals are missed.
+        unsigned int snapshot = event_snapshot(&interval_event);
+        if (global_status == ABORT_ST) {
+            ret = -1;
+            break;
+        }
+        if (ring_count(cap_ring) >= cap_len
+                && ring_count(down_ring) >= down_len) {
+            ret = 0;
+            break;
+        }
+        if ((ring_is_closed(cap_ring) && ring_count(cap_ring) < cap_len)
+                || (ring_is_closed(down_ring)
+                    && ring_count(down_ring) < down_len)) {
+            ret = -1;
+            break;
+        }
+        event_wait(&interval_event, snapshot, -1);
+    }
+    trace_end(span);
+    metrics_observe(STAGE_WAIT, start);
+
+    return ret;
+}
+
+// Looks for a previous result of the track with a similar recording, and
+// verifies its lag with bounded_correlation, which only requires the first
+// `len` frames of the recording and the same part of the reference. If the
+// reference is repetitive, the lags a period away from it must match
+// clearly worse too.
+//
+// Returns 0 and the verified lag in frames, or -1 if there isn't any.
+static int verify_previous(const char *title, uint64_t print,
+                           struct ring *cap_ring, struct ring *down_ring,
+                           size_t len, long *lag) {
+    const struct derived_config *config = get_config();
+    const long radius = config->user.sample_rate * RESULT_RADIUS_MS / 1000;
+    struct periodicity per;
+    long prev;
+    double coef;
+
+    if (resultcache_find(title, print, &prev) < 0) {
+        return -1;
+    }
+
+    // The previous lag might not fit in the current configuration.
+    const long needed = prev + radius + (long) len;
+    if (needed > (long) config->len_source || needed < (long) len / 2) {
+        return -1;
+    }
+    if (wait_rings(cap_ring, len, down_ring, needed) < 0) {
+        return -1;
+    }
+    const size_t available = ring_count(down_ring);
+    if (bounded_correlation(down_ring->buf, available, cap_ring->buf, len,
+                            prev, radius, lag, &coef) < 0) {
+        return -1;
+    }
+
+    log("previous result of %ld frames verified with %ld frames of delay"
+        " and a confidence of %f", prev, *lag, coef);
+    if (coef < config->user.min_confidence) {
+        return -1;
+    }
+
+    if (periodicity_get(refcache_id(title), down_ring->buf, available,
+                        &per) < 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < 2 * per.n_periods; i++) {
+        const long period = per.periods[i / 2];
+        const long other = i % 2 ? *lag + period : *lag - period;
+        long other_lag;
+        double other_coef;
+        if (bounded_correlation(down_ring->buf, available, cap_ring->buf,
+                                len, other, radius, &other_lag,
+                                &other_coef) == 0
+                && other_coef >= coef - COMPETING_MARGIN) {
+            log("competing lag of %ld frames with a confidence of %f",
+                other_lag, other_coef);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Decides where interval `i` starts in both streams, skipping their leading
+// silence. The offsets are limited so that the interval still fits in the
+// buffers, with the recording being `cap_len` frames long.
+//
+// Returns 0 on success, -1 if the recording doesn't have enough activity for
+// the interval yet, or AUDIOSYNC_NO_SIGNAL if it won't have enough for any
+// of the intervals, even if the rest of the recording is active.
+static int gate_interval(size_t i, size_t cap_len,
+                         const struct activity *cap_act,
+                         struct ring *cap_ring,
+                         const struct activity *down_act, size_t *cap_off,
+                         size_t *down_off) {
+    const struct derived_config *config = get_config();
+    const size_t len = config->interv_sample[i];
+    const size_t count = ring_count(cap_ring);
+    const size_t active = activity_active(cap_act);
+    const size_t left = count < cap_len ? cap_len - count : 0;
+
+    if (active + left < MIN_ACTIVE_RATIO * config->len_sample) {
+        return AUDIOSYNC_NO_SIGNAL;
+    }
+    if (active < MIN_ACTIVE_RATIO * len) {
+        return -1;
+    }
+
+    const size_t cap_start = activity_start(cap_act);
+    const size_t down_start = activity_start(down_act);
+    *cap_off = MIN(cap_start, cap_len - len);
+    *down_off = 0;
+    if (down_start != ACTIVITY_NONE) {
+        *down_off = MIN(down_start, config->len_source - 2 * len);
+        *down_off -= *down_off % SOURCE_ALIGN;
+    }
+
+    return 0;
+}
+
+// Keeps the lag in frames updated after the initial sync, until audiosync is
+// aborted or either stream ends. The smoothed lag is published after every
+// measurement for audiosync_tracked_lag.
+static void track_lag(struct ring *cap_ring, struct ring *down_ring,
+                      long *lag) {
+    const struct derived_config *config = get_config();
+    struct tracker tr;
+    size_t cap_len, down_len;
+
+    if (tracker_init(&tr, *lag, ring_count(cap_ring)) < 0) {
+        return;
+    }
+    // The first update is done right away, with the latest frames.
+    log("tracking the lag from %ld frames", *lag);
+    while (1) {
+        tracker_needed(&tr, &cap_len, &down_len);
+        if (wait_rings(cap_ring, cap_len, down_ring, down_len) < 0) {
+            break;
+        }
+        tracker_update(&tr, cap_ring, down_ring);
+        *lag = round(tr.lag);
+        publish(1, round(tr.lag * config->frames_to_ms), tr.confidence);
+    }
+    tracker_free(&tr);
+}
+
+// The implementation of audiosync_run and audiosync_track. When tracking,
+// the streams don't have a fixed length, and they're only used linearly
+// until the initial sync is done.
+static int run(const char *yt_title, long *lag, int track) {
     debug_assert(yt_title); debug_assert(lag);
     debug_assert(global_status == IDLE_ST);
 
+    pthread_mutex_lock(&mutex);
     global_status = RUNNING_ST;
+    pthread_mutex_unlock(&mutex);
+    trace_thread("audiosync_run");
+    trace_begin(run_span, "audiosync_run");
+    const uint64_t run_start = metrics_now();
+    metrics_add(runs, 1);
+    // The algorithm will be run in the intervals from the configuration.
+    // When both threads signal that their interval is finished, the cross
+    // correlation will be calculated. If it's accepted, the threads will
+    // finish and the main function will return the lag.
+    const struct derived_config *config = get_config();
+    const struct xcorr_params params = {
+        .max_lag = config->max_lag,
+        .threads = config->user.threads,
+        .cancel = audiosync_cancelled,
+        .decimation = config->user.sample_rate / SIGN_COARSE_RATE,
+    };
+    // The intervals that start at the beginning of the recording are
+    // already preceded by their padding. Otherwise, the frames before them
+    // aren't zero.
+    struct xcorr_params padded = params;
+    padded.flags |= XCORR_PREPADDED;
     int ret = -1;
-    // The audio data.
+    // The audio data. The recording is preceded by the zero padding of the
+    // longest interval, so that the intervals can be transformed in place.
+    double *recording = NULL;
     double *sample = NULL;
     double *source = NULL;
+    const double *cached = NULL;
+    // The compensated sample, if the skew is estimated.
+    double *compensated = NULL;
     double confidence;
+    double ppm = 0.0;
+    // The statistics of this run.
+    struct audiosync_run_stats stats = { 0 };
+    // The activity detectors of both streams, if the silence is gated. In
+    // that case, the recording is longer so that up to the first interval
+    // of leading silence can be trimmed.
+    const int gating = config->user.silence_threshold > 0.0;
+    const size_t cap_len = config->len_sample
+        + (gating ? config->interv_sample[0] : 0);
+    const size_t block = config->user.sample_rate * ACTIVITY_BLOCK_MS / 1000;
+    struct activity cap_act, down_act;
+    activity_init(&cap_act, block, config->user.silence_threshold);
+    activity_init(&down_act, block, config->user.silence_threshold);
+    // The fingerprint of the recording for the result cache.
+    uint64_t print = 0;
+    // The periodicity of the reference, to skip the ambiguous intervals.
+    struct periodicity per;
+    size_t print_len = round(FINGERPRINT_SECONDS * config->user.sample_rate);
+    if (print_len > config->interv_sample[0]) {
+        print_len = config->interv_sample[0];
+    }
+    // If a playlist session is active, the recording is copied from it,
+    // starting `since` frames before this call.
+    const int in_session = !track && session_active();
+    size_t since = 0;
     // Threading variables
     pthread_t cap_th = 0;
     pthread_t down_th = 0;
 
     // Allocated dynamically because the stack doesn't have enough memory.
-    sample = malloc(LEN_SAMPLE * sizeof(*sample));
-    if (sample == NULL) {
-        perror("audiosync: sample malloc failed");
+    // The arena keeps the buffers between runs, and they're aligned, which
+    // is required for the source because the cross_correlation function
+    // doesn't copy it (unlike the sample).
+    // With the memfd transport, the buffers are shared with ffmpeg, which
+    // writes into them directly.
+    void *(*alloc)(size_t) = config->user.transport == TRANSPORT_MEMFD
+        ? arena_alloc_shared : arena_alloc;
+    const size_t headroom = track ? tracker_headroom() : 0;
+    const size_t padding = config->len_sample;
+    recording = alloc((padding + cap_len + headroom) * sizeof(*recording));
+    if (recording == NULL) {
+        log("sample arena_alloc failed");
         goto finish;
     }
-    // The source is allocated using fftw_malloc because the cross_correlation
-    // function doesn't copy it (unlike the sample), and it needs to be
-    // aligned for faster calculations.
-    source = fftw_alloc_real(LEN_SOURCE);
-    if (source == NULL) {
-        perror("audiosync: source fftw_alloc_real failed");
-        goto finish;
+    memset(recording, 0, padding * sizeof(*recording));
+    sample = recording + padding;
+    if (config->user.skew_compensation) {
+        compensated = arena_alloc(config->len_sample * sizeof(*compensated));
+        if (compensated == NULL) {
+            log("compensated arena_alloc failed");
+            goto finish;
+        }
+    }
+    pthread_mutex_lock(&mutex);
+    last_skew.valid = 0;
+    pthread_mutex_unlock(&mutex);
+
+    // If the reference was downloaded previously, it's used directly from
+    // the cache. It's never modified, since FFTW_ESTIMATE is used. Only the
+    // beginning of the reference is cached, so it's not enough to track it.
+    cached = track ? NULL : refcache_get(yt_title, config->len_source);
+    if (cached) {
+        source = (double *) cached;
+    } else {
+        source = alloc((config->len_source + headroom) * sizeof(*source));
+        if (source == NULL) {
+            log("source arena_alloc failed");
+            goto finish;
+        }
     }
 
-    // Initializing thread-related variables, and starting them.
+    // Initializing thread-related variables, and starting them. The
+    // buffers are used linearly by the rings, since their capacity is at
+    // least the total length and the frames aren't released until the
+    // initial sync is done.
+    struct ring cap_ring, down_ring;
+    ring_init(&cap_ring, sample, cap_len + headroom, &interval_event);
+    ring_init(&down_ring, source, config->len_source + headroom,
+              &interval_event);
     struct ffmpeg_data cap_args = {
         .title = "",
-        .buf = sample,
-        .total_len = LEN_SAMPLE,
-        .len = 0,
-        .intervals = INTERV_SAMPLE,
-        .n_intervals = N_INTERVALS,
+        .ring = &cap_ring,
+        .total_len = track ? 0 : cap_len,
+        .activity = gating ? &cap_act : NULL,
     };
     struct ffmpeg_data down_args = {
         .title = yt_title,
-        .buf = source,
-        .total_len = LEN_SOURCE,
-        .len = 0,
-        .intervals = INTERV_SOURCE,
-        .n_intervals = N_INTERVALS,
+        .ring = &down_ring,
+        .total_len = track ? 0 : config->len_source,
+        .activity = gating ? &down_act : NULL,
     };
-    if (pthread_create(&cap_th, NULL, &capture, (void *) &cap_args) < 0) {
+    if (in_session) {
+        since = session_begin();
+    }
+    if (pthread_create(&cap_th, NULL, in_session ? &session_feed : &capture,
+                       (void *) &cap_args) < 0) {
         audiosync_abort();
         perror("audiosync: pthread_create for cap_th failed");
         goto finish;
     }
-    if (pthread_create(&down_th, NULL, &download, (void *) &down_args) < 0) {
+    if (cached) {
+        // The download thread isn't needed, since the entire reference is
+        // already available.
+        if (gating) {
+            activity_update(&down_act, cached, config->len_source);
+        }
+        ring_commit(&down_ring, config->len_source);
+        ring_close(&down_ring);
+    } else if (pthread_create(&down_th, NULL, &download,
+                              (void *) &down_args) < 0) {
         audiosync_abort();
         perror("audiosync: pthread_create for down_th failed");
         goto finish;
     }
 
+    // If the same track was synced before with a similar recording, its
+    // result is verified after the first second, before running the full
+    // algorithm.
+    if (config->user.result_cache
+            && wait_rings(&cap_ring, print_len, &down_ring, 0) == 0) {
+        trace_begin(verify_span, "verify the previous result");
+        print = fingerprint(sample, print_len);
+        if (verify_previous(yt_title, print, &cap_ring, &down_ring,
+                            print_len, lag) == 0) {
+            stats.recorded = (double) print_len / config->user.sample_rate;
+            ret = 0;
+        }
+        trace_end(verify_span);
+    }
+
     // The main loop iterates through all intervals until a valid result is
     // found.
     log("starting interval loop");
-    for (size_t i = 0; i < N_INTERVALS; i++) {
+    struct acceptance acc;
+    acceptance_init(&acc);
+    for (size_t i = 0; ret < 0 && i < config->user.n_intervals; i++) {
         // Waits for both threads to finish their interval, or until another
         // thread sends an abort signal.
-        pthread_mutex_lock(&mutex);
-        while ((cap_args.len < INTERV_SAMPLE[i]
-               || down_args.len < INTERV_SOURCE[i])
-               && global_status != ABORT_ST) {
-            pthread_cond_wait(&interval_done, &mutex);
+        if (wait_rings(&cap_ring, config->interv_sample[i], &down_ring,
+                       config->interv_source[i]) < 0) {
+            break;
         }
-        pthread_mutex_unlock(&mutex);
 
-        // Checking if audiosync_abort() was called after waiting.
-        if (global_status == ABORT_ST) {
-            break;
+        log("next interval (%ld): cap=%ld down=%ld", i, ring_count(&cap_ring),
+            ring_count(&down_ring));
+
+        // The intervals that can't succeed because the recording is mostly
+        // silent are skipped, and the leading silence of both streams is
+        // trimmed, so the interval may have to wait for a bit more data.
+        const size_t len = config->interv_sample[i];
+        size_t cap_off = 0;
+        size_t down_off = 0;
+        if (gating) {
+            const int gate = gate_interval(i, cap_len, &cap_act, &cap_ring,
+                                           &down_act, &cap_off, &down_off);
+            if (gate == AUDIOSYNC_NO_SIGNAL) {
+                log("no signal in the recording");
+                ret = gate;
+                break;
+            }
+            if (gate < 0) {
+                log("skipping interval %ld without enough activity", i);
+                continue;
+            }
+            if (wait_rings(&cap_ring, cap_off + len, &down_ring,
+                           down_off + 2 * len) < 0) {
+                break;
+            }
         }
 
-        log("next interval (%ld): cap=%ld down=%ld", i, cap_args.len,
-            down_args.len);
+        // If the reference is repetitive, the intervals that aren't longer
+        // than its repeated part can't tell the repetitions apart, so
+        // they're skipped, except for the last one.
+        if (i + 1 < config->user.n_intervals
+                && periodicity_get(refcache_id(yt_title), source,
+                                   ring_count(&down_ring), &per) == 0
+                && periodicity_ambiguous(&per, len)) {
+            log("skipping interval %ld, shorter than the repetitions of the"
+                " reference", i);
+            continue;
+        }
 
         // Running the cross correlation algorithm and checking for errors.
-        if (cross_correlation(source, sample, INTERV_SAMPLE[i], lag,
-                              &confidence) < 0) {
+        // If enabled, the skew is estimated too, and the sample is
+        // compensated when the confidence isn't enough.
+        stats.intervals++;
+        stats.recorded = (double) (cap_off + len) / config->user.sample_rate;
+        metrics_add(intervals, 1);
+        trace_begin_arg(interval_span, "interval", i);
+        const uint64_t interval_start = metrics_now();
+        int failed;
+        if (compensated) {
+            failed = skew_correlation(source + down_off, sample + cap_off,
+                                      len, &params, compensated, lag,
+                                      &confidence, &ppm) < 0;
+        } else if (config->user.engine == ENGINE_SIGN) {
+            failed = sign_correlation(source + down_off, sample + cap_off,
+                                      len, &params, lag, &confidence) < 0;
+        } else {
+            // The transforms of a cached reference may have been saved
+            // too, in which case only the recording is transformed.
+            struct xcorr_params fft_params = cap_off == 0 ? padded : params;
+            if (cached && down_off == 0) {
+                fft_params.source_spectrum = refcache_spectrum(cached, len);
+            }
+            failed = cross_correlation_ex(source + down_off,
+                                          sample + cap_off, len, &fft_params,
+                                          lag, &confidence) < 0;
+        }
+        trace_end(interval_span);
+        metrics_observe(STAGE_CORRELATION, interval_start);
+        if (failed) {
+            acceptance_fail(&acc);
             continue;
         }
+        // The lag is relative to the beginning of both streams.
+        *lag += (long) down_off - (long) cap_off;
 
         // If the returned confidence is higher or equal than the minimum
-        // required, the program ends with the obtained result, and returns
-        // zero to indicate that it succeeded.
-        if (confidence >= MIN_CONFIDENCE) {
-            *lag = round((double) (*lag) * FRAMES_TO_MS);
+        // required, or enough intervals agree on the lag, the program ends
+        // with the obtained result, and returns zero to indicate that it
+        // succeeded.
+        if (acceptance_update(&acc, *lag, confidence)) {
+            if (config->user.result_cache) {
+                resultcache_store(yt_title, print, *lag);
+            }
+            if (compensated) {
+                pthread_mutex_lock(&mutex);
+                last_skew.valid = 1;
+                last_skew.ppm = ppm;
+                pthread_mutex_unlock(&mutex);
+            }
             ret = 0;
-            break;
         }
     }
 
+    if (ret == 0 && track) {
+        track_lag(&cap_ring, &down_ring, lag);
+    }
+    if (ret == 0) {
+        // With a session, the recording started before this call, so the
+        // lag is made relative to it like without one.
+        *lag += (long) since;
+        *lag = round((double) (*lag) * config->frames_to_ms);
+    }
+
 finish:
-    // Signaling the rest of the threads to finish.
+    // Signaling the rest of the threads to finish. If they were signaled
+    // already, the run was aborted by the user or by an error.
+    if (global_status == ABORT_ST) {
+        metrics_add(aborts, 1);
+    }
     audiosync_abort();
 
     // Waiting for the other threads to finish.
-    if (pthread_join(cap_th, NULL) < 0) {
+    if (cap_th && pthread_join(cap_th, NULL) < 0) {
         perror("audiosync: pthread_join for cap_th failed");
         goto finish;
     }
-    if (pthread_join(down_th, NULL) < 0) {
+    if (down_th && pthread_join(down_th, NULL) < 0) {
         perror("audiosync: pthread_join for down_th failed");
         goto finish;
     }
 
-    // Freeing the main resources used previously.
-    if (sample) free(sample);
-    if (source) fftw_free(source);
+    if (in_session) {
+        session_end();
+    }
+
+    // Giving the main resources used previously back to the arena.
+    arena_free(recording);
+    arena_free(compensated);
+    if (cached) {
+        refcache_release(cached);
+    } else {
+        arena_free(source);
+    }
+
+    pthread_mutex_lock(&mutex);
+    last_run.valid = 1;
+    last_run.stats = stats;
+    pthread_mutex_unlock(&mutex);
+
+    // The trace of the run is saved once all of its threads are done.
+    trace_end(run_span);
+    trace_flush();
+    if (ret == 0) {
+        metrics_add(successes, 1);
+    }
+    metrics_observe(STAGE_RUN, run_start);
 
     // Resetting the global status at the end.
+    publish(0, 0, 0.0);
+    pthread_mutex_lock(&mutex);
     global_status = IDLE_ST;
+    pthread_mutex_unlock(&mutex);
     log("finished run");
 
     return ret;
 }
+
+// Main function to start the audio synchronization algorithm. It will return
+// 0 in case of success, AUDIOSYNC_NO_SIGNAL if nothing is being played, or
+// -1 otherwise. `yt_title` is the name of the song
+// currently playing on the computer. The obtained lag will be returned to
+// the variable `lag` points to.
+//
+// It will start two threads: one to download the audio, and another one to
+// record it. These threads will signal this main function once they have
+// finished an interval, so that the audio synchronization algorithm can
+// be ran with the current data. This will be done until an acceptable
+// result is obtained, or until all intervals are finished.
+//
+// This function starts the algorithm. Only one audiosync thread can be
+// running at once.
+int audiosync_run(const char *yt_title, long *lag) {
+    return run(yt_title, lag, 0);
+}
+
+// Same as audiosync_run, but after the initial sync, the lag keeps being
+// tracked until audiosync is aborted or the song ends, which is when it
+// returns the last lag. Meanwhile, it can be obtained with
+// audiosync_tracked_lag. See tracking.h for more details.
+int audiosync_track(const char *yt_title, long *lag) {
+    return run(yt_title, lag, 1);
+}
@@ -7,6 +7,8 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/metrics.h>
+#include <audiosync/reference_cache.h>
 
 
 PyObject *audiosyncmodule_pause(PyObject *self, PyObject *args);
@@ -14,7 +16,19 @@ PyObject *audiosyncmodule_resume(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_abort(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_status(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_setup(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_trim(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_configure(PyObject *self, PyObject *args,
+                                    PyObject *kwargs);
+PyObject *audiosyncmodule_config(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_metrics(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_write_metrics(PyObject *self, PyObject *args);
 PyObject *audiosyncmodule_run(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_track(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_tracked_lag(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_skew(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_session_start(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_session_stop(PyObject *self, PyObject *args);
+PyObject *audiosyncmodule_prefetch(PyObject *self, PyObject *args);
 
 
 static PyMethodDef VidifyAudiosyncMethods[] = {
@@ -25,6 +39,50 @@ static PyMethodDef VidifyAudiosyncMethods[] = {
         "Obtain the provided YouTube song's lag in respect to the currently"
         " playing track. It can only be run once at a time."
     },
+    {
+        "track",
+        audiosyncmodule_track,
+        METH_VARARGS,
+        "Same as run, but the lag keeps being tracked after the initial sync"
+        " until the job is aborted or the song ends. Returns the last lag."
+    },
+    {
+        "tracked_lag",
+        audiosyncmodule_tracked_lag,
+        METH_NOARGS,
+        "Returns the latest lag obtained by track and the confidence of its"
+        " last measurement, or None if it isn't tracking. Thread-safe."
+    },
+    {
+        "skew",
+        audiosyncmodule_skew,
+        METH_NOARGS,
+        "Returns the clock skew in ppm estimated by the last successful run,"
+        " or None if it wasn't estimated. Thread-safe."
+    },
+    {
+        "session_start",
+        audiosyncmodule_session_start,
+        METH_NOARGS,
+        "Start a playlist session, which keeps recording across the runs so"
+        " that they can start at the beginning of the current track. Returns"
+        " whether it was started."
+    },
+    {
+        "session_stop",
+        audiosyncmodule_session_stop,
+        METH_NOARGS,
+        "Stop the playlist session. It can't be used while running. Returns"
+        " whether it was stopped."
+    },
+    {
+        "prefetch",
+        audiosyncmodule_prefetch,
+        METH_VARARGS,
+        "Download the provided YouTube song into the reference cache, so that"
+        " its run doesn't have to wait for it. Returns whether it succeeded."
+        " It can be used while running."
+    },
     {
         "pause",
         audiosyncmodule_pause,
@@ -57,6 +115,52 @@ static PyMethodDef VidifyAudiosyncMethods[] = {
         "Attempts to initialize a PulseAudio sink to record more easily the"
         " audio directly from the music player stream. Not thread-safe."
     },
+    {
+        "trim",
+        audiosyncmodule_trim,
+        METH_NOARGS,
+        "Release the buffers kept between runs. Returns the number of bytes"
+        " released. Thread-safe."
+    },
+    {
+        "configure",
+        (PyCFunction) (void (*)(void)) audiosyncmodule_configure,
+        METH_VARARGS | METH_KEYWORDS,
+        "Change the configuration with keyword arguments: sample_rate,"
+        " intervals, max_lag, min_confidence, engine (fft or sign), threads,"
+        " huge_pages,"
+        " reference_cache, result_cache, cache_dir, track_period,"
+        " track_window, skew_compensation, silence_threshold,"
+        " agreement_intervals, agreement_tolerance, agreement_confidence,"
+        " transport (pipe or memfd), diag_dir, diag_files and"
+        " diag_decimation."
+        " The rest of the values are kept. Returns whether the new"
+        " configuration was valid and applied. It can't be used while"
+        " running."
+    },
+    {
+        "config",
+        audiosyncmodule_config,
+        METH_NOARGS,
+        "Returns the current configuration as a dictionary. Thread-safe."
+    },
+    {
+        "metrics",
+        audiosyncmodule_metrics,
+        METH_NOARGS,
+        "Returns the metrics of the process as a dictionary: runs,"
+        " successes, aborts, pauses, intervals, bytes and reads per stream,"
+        " alloc_bytes, ffts per length and the latency histogram of each"
+        " stage, with its count, sum in seconds and cumulative buckets."
+        " Thread-safe."
+    },
+    {
+        "write_metrics",
+        audiosyncmodule_write_metrics,
+        METH_VARARGS,
+        "Write the metrics into the provided file in the Prometheus text"
+        " format. Returns whether it succeeded. Thread-safe."
+    },
     {NULL, NULL, 0, NULL}
 };
 
@@ -94,6 +198,98 @@ PyObject *audiosyncmodule_run(PyObject *self, PyObject *args) {
 }
 
 
+PyObject *audiosyncmodule_track(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *yt_title;
+    if (!PyArg_ParseTuple(args, "s", &yt_title)) {
+        return NULL;
+    }
+
+    int ret;
+    long int lag;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_track(yt_title, &lag);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("lO", lag, ret == 0 ? Py_True : Py_False);
+}
+
+
+PyObject *audiosyncmodule_tracked_lag(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    int ret;
+    long int lag;
+    double confidence;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_tracked_lag(&lag, &confidence);
+    Py_END_ALLOW_THREADS
+
+    if (ret < 0) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("ld", lag, confidence);
+}
+
+
+PyObject *audiosyncmodule_skew(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    int ret;
+    double ppm;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_skew(&ppm);
+    Py_END_ALLOW_THREADS
+
+    if (ret < 0) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("d", ppm);
+}
+
+
+PyObject *audiosyncmodule_session_start(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_session_start();
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+
+PyObject *audiosyncmodule_session_stop(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_session_stop();
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+
+PyObject *audiosyncmodule_prefetch(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *title;
+    if (!PyArg_ParseTuple(args, "s", &title)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = refcache_prefetch(title);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+
 PyObject *audiosyncmodule_pause(PyObject *self, PyObject *args) {
     UNUSED(self); UNUSED(args);
 
@@ -155,3 +351,277 @@ PyObject *audiosyncmodule_setup(PyObject *self, PyObject *args) {
 
     return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
 }
+
+PyObject *audiosyncmodule_trim(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    size_t released;
+    Py_BEGIN_ALLOW_THREADS
+    released = audiosync_trim();
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("n", (Py_ssize_t) released);
+}
+
+PyObject *audiosyncmodule_configure(PyObject *self, PyObject *args,
+                                    PyObject *kwargs) {
+    UNUSED(self);
+
+    static char *keywords[] = {
+        "sample_rate", "intervals", "max_lag", "min_confidence", "engine",
+        "threads", "huge_pages", "reference_cache", "result_cache",
+        "cache_dir", "track_period", "track_window",
+        "skew_compensation", "silence_threshold", "agreement_intervals",
+        "agreement_tolerance", "agreement_confidence", "transport",
+        "diag_dir", "diag_files", "diag_decimation", NULL
+    };
+    struct audiosync_config config;
+    PyObject *intervals = NULL;
+    const char *engine = NULL;
+    const char *huge_pages = NULL;
+    const char *cache_dir = NULL;
+    const char *transport = NULL;
+    const char *diag_dir = NULL;
+
+    // The values that aren't provided are kept.
+    audiosync_get_config(&config);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$IOddsIsppsddpdIddssII",
+                                     keywords,
+                                     &config.sample_rate, &intervals,
+                                     &config.max_lag, &config.min_confidence,
+                                     &engine, &config.threads, &huge_pages,
+                                     &config.reference_cache,
+                                     &config.result_cache, &cache_dir,
+                                     &config.track_period,
+                                     &config.track_window,
+                                     &config.skew_compensation,
+                                     &config.silence_threshold,
+                                     &config.agreement_intervals,
+                                     &config.agreement_tolerance,
+                                     &config.agreement_confidence,
+                                     &transport, &diag_dir,
+                                     &config.diag_files,
+                                     &config.diag_decimation)) {
+        return NULL;
+    }
+
+    if (intervals) {
+        PyObject *seq = PySequence_Fast(intervals,
+                                        "intervals must be a sequence");
+        if (seq == NULL) {
+            return NULL;
+        }
+        Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+        if (len > MAX_INTERVALS) {
+            Py_DECREF(seq);
+            return PyErr_Format(PyExc_ValueError,
+                                "there can't be more than %d intervals",
+                                MAX_INTERVALS);
+        }
+        for (Py_ssize_t i = 0; i < len; i++) {
+            config.intervals[i] = PyFloat_AsDouble(
+                PySequence_Fast_GET_ITEM(seq, i));
+        }
+        config.n_intervals = len;
+        Py_DECREF(seq);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (engine && engine_from_string(engine, &config.engine) < 0) {
+        return PyErr_Format(PyExc_ValueError, "unknown engine '%s'", engine);
+    }
+    if (cache_dir) {
+        if (strlen(cache_dir) >= MAX_LONG_PATH) {
+            return PyErr_Format(PyExc_ValueError, "cache_dir is too long");
+        }
+        strcpy(config.cache_dir, cache_dir);
+    }
+    if (diag_dir) {
+        if (strlen(diag_dir) >= MAX_LONG_PATH) {
+            return PyErr_Format(PyExc_ValueError, "diag_dir is too long");
+        }
+        strcpy(config.diag_dir, diag_dir);
+    }
+    if (huge_pages && huge_pages_from_string(huge_pages,
+                                             &config.huge_pages) < 0) {
+        return PyErr_Format(PyExc_ValueError, "unknown huge pages mode '%s'",
+                            huge_pages);
+    }
+    if (transport && transport_from_string(transport,
+                                           &config.transport) < 0) {
+        return PyErr_Format(PyExc_ValueError, "unknown transport '%s'",
+                            transport);
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_configure(&config);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
+
+PyObject *audiosyncmodule_config(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    struct audiosync_config config;
+    Py_BEGIN_ALLOW_THREADS
+    audiosync_get_config(&config);
+    Py_END_ALLOW_THREADS
+
+    PyObject *intervals = PyList_New(config.n_intervals);
+    if (intervals == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < config.n_intervals; i++) {
+        PyList_SET_ITEM(intervals, i, PyFloat_FromDouble(config.intervals[i]));
+    }
+
+    // The list's reference is stolen with the N format.
+    return Py_BuildValue("{s:I,s:N,s:d,s:d,s:s,s:I,s:s,s:O,s:O,s:s,s:d,"
+                         "s:d,s:O,s:d,s:I,s:d,s:d,s:s,s:s,s:I,s:I}",
+                         "sample_rate", config.sample_rate,
+                         "intervals", intervals,
+                         "max_lag", config.max_lag,
+                         "min_confidence", config.min_confidence,
+                         "engine", engine_to_string(config.engine),
+                         "threads", config.threads,
+                         "huge_pages", huge_pages_to_string(config.huge_pages),
+                         "reference_cache",
+                         config.reference_cache ? Py_True : Py_False,
+                         "result_cache",
+                         config.result_cache ? Py_True : Py_False,
+                         "cache_dir", config.cache_dir,
+                         "track_period", config.track_period,
+                         "track_window", config.track_window,
+                         "skew_compensation",
+                         config.skew_compensation ? Py_True : Py_False,
+                         "silence_threshold", config.silence_threshold,
+                         "agreement_intervals", config.agreement_intervals,
+                         "agreement_tolerance", config.agreement_tolerance,
+                         "agreement_confidence",
+                         config.agreement_confidence,
+                         "transport", transport_to_string(config.transport),
+                         "diag_dir", config.diag_dir,
+                         "diag_files", config.diag_files,
+                         "diag_decimation", config.diag_decimation);
+}
+
+// Builds a dictionary with a value per stream.
+static PyObject *streams_dict(const uint64_t *values) {
+    PyObject *dict = PyDict_New();
+    if (dict == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < N_STREAMS; i++) {
+        PyObject *value = PyLong_FromUnsignedLongLong(values[i]);
+        if (value == NULL
+                || PyDict_SetItemString(dict, stream_to_string(i),
+                                        value) < 0) {
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+
+    return dict;
+}
+
+// Builds the dictionary of a histogram. The buckets are a list of pairs
+// with their upper bound and cumulative count, like in Prometheus.
+static PyObject *histogram_dict(const struct metrics_histogram *h) {
+    PyObject *buckets = PyList_New(METRICS_BUCKETS);
+    if (buckets == NULL) {
+        return NULL;
+    }
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += h->buckets[i];
+        PyObject *bucket = Py_BuildValue("(dK)", metrics_bucket_bound(i),
+                                         (unsigned long long) cumulative);
+        if (bucket == NULL) {
+            Py_DECREF(buckets);
+            return NULL;
+        }
+        PyList_SET_ITEM(buckets, i, bucket);
+    }
+
+    return Py_BuildValue("{s:K,s:d,s:N}",
+                         "count", (unsigned long long) h->count,
+                         "sum", h->sum_ns / 1e9,
+                         "buckets", buckets);
+}
+
+PyObject *audiosyncmodule_metrics(PyObject *self, PyObject *args) {
+    UNUSED(self); UNUSED(args);
+
+    struct audiosync_metrics m;
+    Py_BEGIN_ALLOW_THREADS
+    audiosync_get_metrics(&m);
+    Py_END_ALLOW_THREADS
+
+    PyObject *ffts = PyDict_New();
+    PyObject *latency = PyDict_New();
+    if (ffts == NULL || latency == NULL) {
+        goto error;
+    }
+    for (size_t i = 0; i < METRICS_FFT_SIZES; i++) {
+        if (m.ffts[i].count == 0) {
+            continue;
+        }
+        PyObject *len = PyLong_FromUnsignedLongLong(m.ffts[i].len);
+        PyObject *count = PyLong_FromUnsignedLongLong(m.ffts[i].count);
+        const int ret = len && count ? PyDict_SetItem(ffts, len, count) : -1;
+        Py_XDECREF(len);
+        Py_XDECREF(count);
+        if (ret < 0) {
+            goto error;
+        }
+    }
+    for (int i = 0; i < N_STAGES; i++) {
+        PyObject *hist = histogram_dict(&m.latency[i]);
+        if (hist == NULL
+                || PyDict_SetItemString(latency, stage_to_string(i),
+                                        hist) < 0) {
+            Py_XDECREF(hist);
+            goto error;
+        }
+        Py_DECREF(hist);
+    }
+
+    // The references of the dictionaries are stolen with the N format.
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:N,s:N,s:K,s:N,s:N}",
+                         "runs", (unsigned long long) m.runs,
+                         "successes", (unsigned long long) m.successes,
+                         "aborts", (unsigned long long) m.aborts,
+                         "pauses", (unsigned long long) m.pauses,
+                         "intervals", (unsigned long long) m.intervals,
+                         "bytes", streams_dict(m.bytes),
+                         "reads", streams_dict(m.reads),
+                         "alloc_bytes", (unsigned long long) m.alloc_bytes,
+                         "ffts", ffts,
+                         "latency", latency);
+
+error:
+    Py_XDECREF(ffts);
+    Py_XDECREF(latency);
+    return NULL;
+}
+
+PyObject *audiosyncmodule_write_metrics(PyObject *self, PyObject *args) {
+    UNUSED(self);
+
+    char *path;
+    if (!PyArg_ParseTuple(args, "s", &path)) {
+        return NULL;
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = audiosync_write_metrics(path);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("O", ret == 0 ? Py_True : Py_False);
+}
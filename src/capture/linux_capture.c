@@ -8,6 +8,7 @@
 #include <pulse/error.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/trace.h>
 #include <audiosync/capture/linux_capture.h>
 
 #define SINK_NAME "audiosync"
@@ -48,6 +49,9 @@ static char stream_name[MAX_LONG_NAME];
 // called previously and worked successfully.
 static int use_default = 1;
 
+// The file recorded instead of the monitor, if not empty.
+static char replay_path[MAX_LONG_PATH];
+
 
 // This PulseAudio function acts as a callback when the context changes state.
 // We really only care about when it's ready or if it has failed.
@@ -144,6 +148,7 @@ int pulseaudio_setup(const char *name) {
     // Saving the stream name as a global variable so that it can be accessed
     // within the callback functions.
     strcpy(stream_name, name);
+    trace_begin(span, "pulseaudio_setup");
 
     // Define the pulseaudio loop and connection variables
     pa_mainloop *mainloop = NULL;
@@ -347,28 +352,66 @@ error:
         pa_context_unref(context);
     }
     if (mainloop) pa_mainloop_free(mainloop);
+    trace_end(span);
 
     return ret;
 }
 
+// Records the file at `path` instead of the monitor, which is read at its
+// native rate, like if it was being played. It's useful to benchmark and
+// test the runs without PulseAudio. NULL goes back to the monitor. It can't
+// be called while audiosync is running.
+void capture_replay(const char *path) {
+    if (path == NULL) {
+        replay_path[0] = '\0';
+        return;
+    }
+    debug_assert(strlen(path) < sizeof(replay_path));
+    snprintf(replay_path, sizeof(replay_path), "%s", path);
+}
+
 // Function used for the capture thread. It will start a new ffmpeg process
-// to record either the custom sink created with pulseaudio_setup, or the
-// entire desktop.
+// to record either the custom sink created with pulseaudio_setup, the
+// entire desktop, or the file from capture_replay.
 //
 // In case of errors, it will signal the main thread to abort.
 void *capture(void *arg) {
     struct ffmpeg_data *data = arg;
     log("starting capture thread");
+    trace_thread("capture");
 
     // Finally starting to record the audio with ffmpeg. If the setup function
     // was called and it was successful, the audiosync monitor is used.
     // Otherwise, the default monitor will record the entire device audio.
-    log("using %s monitor for capture", use_default ? "default" : "custom");
+    const int replay = replay_path[0] != '\0';
+    if (replay) {
+        log("replaying '%s' for capture", replay_path);
+    } else {
+        log("using %s monitor for capture",
+            use_default ? "default" : "custom");
+    }
+    const struct derived_config *config = get_config();
+    // The recording may be longer than the intervals, to make up for its
+    // leading silence.
+    char seconds[32];
+    snprintf(seconds, sizeof(seconds), "%g",
+             (double) data->total_len / config->user.sample_rate);
     char *args[] = {
-        "ffmpeg", "-y", "-to", MAX_SECONDS_STR, "-f", "pulse", "-i",
-        use_default ? "default" : (SINK_NAME ".monitor"), "-ac",
-        NUM_CHANNELS_STR, "-r", SAMPLE_RATE_STR, "-f", "f64le", "pipe:1", NULL
+        "ffmpeg", "-y", "-to", seconds, "-f",
+        "pulse", "-i", use_default ? "default" : (SINK_NAME ".monitor"),
+        "-ac", (char *) config->num_channels_str, "-ar",
+        (char *) config->sample_rate_str, "-f", "f64le", "pipe:1", NULL
     };
+    // The replayed file is read in real time instead of the input format.
+    if (replay) {
+        args[4] = "-re";
+        args[5] = "-nostdin";
+        args[7] = replay_path;
+    }
+    // Streams are recorded until audiosync is aborted.
+    if (data->total_len == 0) {
+        memmove(&args[2], &args[4], sizeof(args) - 4 * sizeof(*args));
+    }
     ffmpeg_pipe(data, args);
 
     pthread_exit(NULL);
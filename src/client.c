@@ -0,0 +1,171 @@
+// Client library for audiosyncd. It only depends on libc, so that it can be
+// used without linking FFTW or PulseAudio. See client.h for the protocol.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <audiosync/client.h>
+
+
+// Writes the default path of the socket into `path`.
+//
+// Returns 0 on success, or -1 if it doesn't fit.
+int audiosyncd_default_path(char *path, size_t size) {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/tmp";
+    }
+
+    int n = snprintf(path, size, "%s/%s", dir, AUDIOSYNCD_SOCKET_NAME);
+    return (n < 0 || (size_t) n >= size) ? -1 : 0;
+}
+
+// Connects to the daemon at `path`, or at the default path if it's NULL.
+//
+// Returns the connection's file descriptor, or -1 on error.
+int audiosyncd_connect(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (path == NULL) {
+        if (audiosyncd_default_path(addr.sun_path,
+                                    sizeof(addr.sun_path)) < 0) {
+            fprintf(stderr, "audiosyncd: socket path is too long\n");
+            return -1;
+        }
+    } else if (strlen(path) < sizeof(addr.sun_path)) {
+        strcpy(addr.sun_path, path);
+    } else {
+        fprintf(stderr, "audiosyncd: socket path is too long\n");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("audiosyncd: socket failed");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("audiosyncd: connect failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Writes or reads exactly `len` bytes, retrying after partial transfers.
+//
+// Returns 0 on success, or -1 on error or if the connection was closed.
+static int send_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, (const char *) buf + done, len - done,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, (char *) buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Sends a request with an optional title, waiting for its reply.
+//
+// Returns 0 if the reply was received, or -1 on error. Whether the request
+// itself succeeded is indicated by `reply->ret`.
+int audiosyncd_request(int fd, audiosyncd_request_t type, const char *title,
+                       struct audiosyncd_reply *reply) {
+    const size_t len = title ? strlen(title) : 0;
+    if (len > AUDIOSYNCD_MAX_PAYLOAD) {
+        fprintf(stderr, "audiosyncd: title is too long\n");
+        return -1;
+    }
+
+    struct audiosyncd_header header = {
+        .magic = AUDIOSYNCD_MAGIC,
+        .version = AUDIOSYNCD_VERSION,
+        .type = type,
+        .len = len,
+    };
+    if (send_all(fd, &header, sizeof(header)) < 0
+            || send_all(fd, title, len) < 0) {
+        perror("audiosyncd: couldn't send the request");
+        return -1;
+    }
+    if (recv_all(fd, reply, sizeof(*reply)) < 0) {
+        perror("audiosyncd: couldn't receive the reply");
+        return -1;
+    }
+    if (reply->magic != AUDIOSYNCD_MAGIC) {
+        fprintf(stderr, "audiosyncd: invalid reply\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Wrappers for each type of request, returning -1 in case of error or if the
+// request failed, and 0 otherwise. audiosyncd_sync may also return
+// AUDIOSYNCD_NO_SIGNAL if nothing is being played.
+int audiosyncd_sync(int fd, const char *title, long *lag) {
+    struct audiosyncd_reply reply;
+    if (audiosyncd_request(fd, AUDIOSYNCD_SYNC, title, &reply) < 0) {
+        return -1;
+    }
+
+    *lag = reply.lag;
+    return reply.ret;
+}
+
+int audiosyncd_prefetch(int fd, const char *title) {
+    struct audiosyncd_reply reply;
+    if (audiosyncd_request(fd, AUDIOSYNCD_PREFETCH, title, &reply) < 0) {
+        return -1;
+    }
+
+    return reply.ret;
+}
+
+int audiosyncd_status(int fd, unsigned int *status) {
+    struct audiosyncd_reply reply;
+    if (audiosyncd_request(fd, AUDIOSYNCD_STATUS, NULL, &reply) < 0) {
+        return -1;
+    }
+
+    *status = reply.status;
+    return reply.ret;
+}
+
+int audiosyncd_abort(int fd) {
+    struct audiosyncd_reply reply;
+    if (audiosyncd_request(fd, AUDIOSYNCD_ABORT, NULL, &reply) < 0) {
+        return -1;
+    }
+
+    return reply.ret;
+}
+
+// Converting the status in a reply to a string, with the same names as
+// status_to_string, which isn't available without linking audiosync.
+const char *audiosyncd_status_to_string(unsigned int status) {
+    // In the same order as global_status_t.
+    static const char *names[] = { "idle", "running", "paused", "aborting" };
+
+    if (status >= sizeof(names) / sizeof(*names)) {
+        return "unknown";
+    }
+    return names[status];
+}
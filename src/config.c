@@ -0,0 +1,382 @@
+// The runtime configuration of the module. The user-provided values are
+// validated once, and then everything that depends on them is calculated and
+// saved in the derived configuration, so that the rest of the module can
+// access it directly.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/diag.h>
+#include <audiosync/session.h>
+
+// Limits used when validating the configuration.
+#define MIN_SAMPLE_RATE 8000
+#define MAX_SAMPLE_RATE 192000
+#define MAX_INTERVAL_SECONDS 300.0
+// The shortest interval accepted, in frames at the configured rate.
+#define MIN_INTERVAL_FRAMES 256
+#define MAX_THREADS 64
+#define MAX_DIAG_DECIMATION 65536
+
+
+// The current configuration. It's initialized with the default values the
+// first time it's accessed.
+static struct derived_config current;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+// The operations using the configuration outside a run, like prefetches,
+// protected by the global mutex.
+static unsigned int current_users = 0;
+
+
+// Checks that a configuration is valid, logging the reason otherwise.
+//
+// Returns 0 if it's valid, or -1 otherwise.
+int audiosync_config_validate(const struct audiosync_config *config) {
+    debug_assert(config);
+
+    if (config->sample_rate < MIN_SAMPLE_RATE
+            || config->sample_rate > MAX_SAMPLE_RATE) {
+        log("invalid config: sample rate must be between %d and %d",
+            MIN_SAMPLE_RATE, MAX_SAMPLE_RATE);
+        return -1;
+    }
+    if (config->n_intervals == 0 || config->n_intervals > MAX_INTERVALS) {
+        log("invalid config: there must be between 1 and %d intervals",
+            MAX_INTERVALS);
+        return -1;
+    }
+    for (size_t i = 0; i < config->n_intervals; i++) {
+        // The comparisons are negated so that NaN is rejected too.
+        if (!(config->intervals[i] > 0.0
+                && config->intervals[i] <= MAX_INTERVAL_SECONDS)) {
+            log("invalid config: interval %ld must be between 0 and %.0f"
+                " seconds", i, MAX_INTERVAL_SECONDS);
+            return -1;
+        }
+        if (i > 0 && !(config->intervals[i] > config->intervals[i-1])) {
+            log("invalid config: intervals must be in ascending order");
+            return -1;
+        }
+        // The lengths in frames are checked too, since that's what's
+        // actually used, rounded like in derive().
+        const double frames = round(config->intervals[i]
+                                    * config->sample_rate);
+        if (frames < MIN_INTERVAL_FRAMES) {
+            log("invalid config: interval %ld must be at least %d frames",
+                i, MIN_INTERVAL_FRAMES);
+            return -1;
+        }
+        if (i > 0 && frames <= round(config->intervals[i-1]
+                                     * config->sample_rate)) {
+            log("invalid config: intervals %ld and %ld have the same"
+                " length in frames", i - 1, i);
+            return -1;
+        }
+    }
+    if (!(config->max_lag >= 0.0)) {
+        log("invalid config: maximum lag can't be negative");
+        return -1;
+    }
+    if (!(config->min_confidence > 0.0 && config->min_confidence <= 1.0)) {
+        log("invalid config: minimum confidence must be in (0, 1]");
+        return -1;
+    }
+    if (config->engine != ENGINE_FFT && config->engine != ENGINE_SIGN) {
+        log("invalid config: unknown engine %d", config->engine);
+        return -1;
+    }
+    if (config->threads == 0 || config->threads > MAX_THREADS) {
+        log("invalid config: threads must be between 1 and %d",
+            MAX_THREADS);
+        return -1;
+    }
+    if (config->huge_pages != HUGE_PAGES_OFF
+            && config->huge_pages != HUGE_PAGES_THP
+            && config->huge_pages != HUGE_PAGES_HUGETLB) {
+        log("invalid config: unknown huge pages mode %d",
+            config->huge_pages);
+        return -1;
+    }
+    if (config->transport != TRANSPORT_PIPE
+            && config->transport != TRANSPORT_MEMFD) {
+        log("invalid config: unknown transport %d", config->transport);
+        return -1;
+    }
+    if (!(config->track_period > 0.0
+            && config->track_period <= MAX_INTERVAL_SECONDS)) {
+        log("invalid config: tracking period must be between 0 and %.0f"
+            " seconds", MAX_INTERVAL_SECONDS);
+        return -1;
+    }
+    if (!(config->track_window > 0.0
+            && config->track_window <= config->intervals[0])) {
+        log("invalid config: tracking window must be between 0 and the"
+            " first interval");
+        return -1;
+    }
+    if (!(config->silence_threshold >= 0.0
+            && config->silence_threshold < 1.0)) {
+        log("invalid config: silence threshold must be in [0, 1)");
+        return -1;
+    }
+    if (config->agreement_intervals == 1
+            || config->agreement_intervals > config->n_intervals) {
+        log("invalid config: agreeing intervals must be zero or between 2"
+            " and the number of intervals");
+        return -1;
+    }
+    if (!(config->agreement_tolerance >= 0.0
+            && config->agreement_tolerance <= MAX_INTERVAL_SECONDS)) {
+        log("invalid config: agreement tolerance must be between 0 and %.0f"
+            " seconds", MAX_INTERVAL_SECONDS);
+        return -1;
+    }
+    if (!(config->agreement_confidence > 0.0
+            && config->agreement_confidence <= 1.0)) {
+        log("invalid config: agreement confidence must be in (0, 1]");
+        return -1;
+    }
+    if (memchr(config->cache_dir, '\0', MAX_LONG_PATH) == NULL) {
+        log("invalid config: cache directory is too long");
+        return -1;
+    }
+    if (memchr(config->diag_dir, '\0', MAX_LONG_PATH) == NULL) {
+        log("invalid config: diagnostics directory is too long");
+        return -1;
+    }
+    if (config->diag_files == 0 || config->diag_files > DIAG_MAX_FILES) {
+        log("invalid config: diagnostics files must be between 1 and %d",
+            DIAG_MAX_FILES);
+        return -1;
+    }
+    if (config->diag_decimation == 0
+            || config->diag_decimation > MAX_DIAG_DECIMATION) {
+        log("invalid config: diagnostics decimation must be between 1 and"
+            " %d", MAX_DIAG_DECIMATION);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Calculates the values derived from a valid configuration.
+static void derive(const struct audiosync_config *config,
+                   struct derived_config *derived) {
+    const double rate = config->sample_rate;
+    const size_t last = config->n_intervals - 1;
+
+    derived->user = *config;
+    for (size_t i = 0; i < config->n_intervals; i++) {
+        derived->interv_sample[i] = round(config->intervals[i] * rate);
+        derived->interv_source[i] = 2 * derived->interv_sample[i];
+    }
+    derived->len_sample = derived->interv_sample[last];
+    derived->len_source = derived->interv_source[last];
+    derived->max_lag = round(config->max_lag * rate);
+    derived->track_period = round(config->track_period * rate);
+    derived->track_window = round(config->track_window * rate);
+    derived->agreement_tolerance = round(config->agreement_tolerance * rate);
+    derived->frames_to_ms = 1000.0 / rate;
+
+    snprintf(derived->sample_rate_str, sizeof(derived->sample_rate_str),
+             "%u", config->sample_rate);
+    snprintf(derived->num_channels_str, sizeof(derived->num_channels_str),
+             "%d", NUM_CHANNELS);
+    snprintf(derived->max_seconds_str, sizeof(derived->max_seconds_str),
+             "%g", config->intervals[last]);
+
+    // Resolving the default cache directory.
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (config->cache_dir[0] != '\0') {
+        snprintf(derived->cache_dir, sizeof(derived->cache_dir), "%s",
+                 config->cache_dir);
+    } else if (xdg != NULL && xdg[0] != '\0') {
+        snprintf(derived->cache_dir, sizeof(derived->cache_dir),
+                 "%s/audiosync", xdg);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(derived->cache_dir, sizeof(derived->cache_dir),
+                 "%s/.cache/audiosync", home);
+    } else {
+        derived->cache_dir[0] = '\0';
+    }
+}
+
+// Precomputes the resources needed by the current configuration.
+static void prepare(const struct derived_config *derived) {
+    arena_set_huge_pages(derived->user.huge_pages);
+    diag_configure(derived->user.diag_dir, derived->user.diag_files,
+                   derived->user.diag_decimation, derived->user.sample_rate);
+
+    // The plans aren't required, so failing to create them isn't fatal:
+    // cross_correlation would create them itself.
+    xcorr_clear_plans();
+    for (size_t i = 0; i < derived->user.n_intervals; i++) {
+        if (xcorr_prepare(derived->interv_sample[i]) < 0) {
+            log("couldn't prepare the plans for interval %ld", i);
+        }
+    }
+}
+
+// Initializes the current configuration with the default values.
+static void init_current() {
+    const struct audiosync_config config = DEFAULT_CONFIG;
+    derive(&config, &current);
+    prepare(&current);
+}
+
+// Validates and applies a new configuration. It can't be changed while
+// audiosync is running, during a session, or while it's acquired.
+//
+// Returns 0 on success, or -1 on error, in which case the previous
+// configuration is kept.
+int audiosync_configure(const struct audiosync_config *config) {
+    debug_assert(config);
+
+    pthread_once(&current_once, init_current);
+    if (audiosync_config_validate(config) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (global_status != IDLE_ST) {
+        pthread_mutex_unlock(&mutex);
+        log("can't configure audiosync while it's %s",
+            status_to_string(global_status));
+        return -1;
+    }
+    if (session_active()) {
+        pthread_mutex_unlock(&mutex);
+        log("can't configure audiosync during a session");
+        return -1;
+    }
+    if (current_users > 0) {
+        pthread_mutex_unlock(&mutex);
+        log("can't configure audiosync while it's in use");
+        return -1;
+    }
+    derive(config, &current);
+    prepare(&current);
+    pthread_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+// Copies the current configuration into `config`.
+void audiosync_get_config(struct audiosync_config *config) {
+    debug_assert(config);
+
+    pthread_once(&current_once, init_current);
+    pthread_mutex_lock(&mutex);
+    *config = current.user;
+    pthread_mutex_unlock(&mutex);
+}
+
+// Returns the current configuration with its derived values.
+const struct derived_config *get_config() {
+    pthread_once(&current_once, init_current);
+    return &current;
+}
+
+// Marks the configuration as in use by an operation that doesn't change the
+// global status, so that audiosync_configure refuses to modify it until
+// config_release is called.
+const struct derived_config *config_acquire() {
+    pthread_once(&current_once, init_current);
+    pthread_mutex_lock(&mutex);
+    current_users++;
+    pthread_mutex_unlock(&mutex);
+
+    return &current;
+}
+
+// Releases the configuration acquired by config_acquire.
+void config_release() {
+    pthread_mutex_lock(&mutex);
+    debug_assert(current_users > 0);
+    current_users--;
+    pthread_mutex_unlock(&mutex);
+}
+
+// Converting an engine enum value to a string, and vice versa.
+char *engine_to_string(engine_t engine) {
+    switch (engine) {
+    case ENGINE_FFT:
+        return "fft";
+    case ENGINE_SIGN:
+        return "sign";
+    default:
+        return "unknown";
+    }
+}
+
+int engine_from_string(const char *name, engine_t *engine) {
+    if (strcmp(name, "fft") == 0) {
+        *engine = ENGINE_FFT;
+        return 0;
+    }
+    if (strcmp(name, "sign") == 0) {
+        *engine = ENGINE_SIGN;
+        return 0;
+    }
+
+    return -1;
+}
+
+// Converting a huge pages enum value to a string, and vice versa.
+char *huge_pages_to_string(huge_pages_t mode) {
+    switch (mode) {
+    case HUGE_PAGES_OFF:
+        return "off";
+    case HUGE_PAGES_THP:
+        return "thp";
+    case HUGE_PAGES_HUGETLB:
+        return "hugetlb";
+    default:
+        return "unknown";
+    }
+}
+
+int huge_pages_from_string(const char *name, huge_pages_t *mode) {
+    if (strcmp(name, "off") == 0) {
+        *mode = HUGE_PAGES_OFF;
+    } else if (strcmp(name, "thp") == 0) {
+        *mode = HUGE_PAGES_THP;
+    } else if (strcmp(name, "hugetlb") == 0) {
+        *mode = HUGE_PAGES_HUGETLB;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Converting a transport enum value to a string, and vice versa.
+char *transport_to_string(transport_t transport) {
+    switch (transport) {
+    case TRANSPORT_PIPE:
+        return "pipe";
+    case TRANSPORT_MEMFD:
+        return "memfd";
+    default:
+        return "unknown";
+    }
+}
+
+int transport_from_string(const char *name, transport_t *transport) {
+    if (strcmp(name, "pipe") == 0) {
+        *transport = TRANSPORT_PIPE;
+    } else if (strcmp(name, "memfd") == 0) {
+        *transport = TRANSPORT_MEMFD;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
@@ -1,6 +1,3 @@
-#ifdef PLOT
-# define _GNU_SOURCE  // popen() is used for plotting with gnuplot
-#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -9,9 +6,16 @@
 #include <complex.h>
 #include <fftw3.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/diag.h>
+#include <audiosync/metrics.h>
+#include <audiosync/pool.h>
+#include <audiosync/trace.h>
 
 
-// The global cross-correlation mutex.
+// The global cross-correlation mutex. FFTW's planner isn't thread-safe, so
+// it also protects the plan cache.
 static pthread_mutex_t cc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Data structure used to pass parameters to concurrent FFTW-related functions.
@@ -19,14 +23,42 @@ struct fftw_data {
     double *real;
     double complex *cpx;
     const size_t len;
+    fftw_plan plan;  // Precomputed plan, or NULL to create one
 };
 
+// The plans for the sizes in the configuration are created once by
+// xcorr_prepare and reused with FFTW's new-array execute functions. These
+// require the arrays to have the same alignment as the ones the plan was
+// created with, which is the page size in this case (arena_alloc).
+struct plan_entry {
+    size_t len;      // Length of the real data
+    fftw_plan r2c;   // Forward transform
+    fftw_plan c2r;   // Inverse transform
+};
+static struct plan_entry plans[MAX_INTERVALS];
+static size_t n_plans = 0;
+// The correlations using the cached plans, which can't be destroyed until
+// all of them release them. Both are protected by cc_mutex.
+static unsigned int plan_users = 0;
+static pthread_cond_t plans_released = PTHREAD_COND_INITIALIZER;
+
 
-// Concurrent implementation of the Fast Fourier Transform using FFTW.
+// Concurrent implementation of the Fast Fourier Transform using FFTW. It can
+// also be called directly rather than as a thread.
 static void *fft(void *arg) {
     // Getting the parameters passed to this thread
     struct fftw_data *data = arg;
     debug_assert(data); debug_assert(data->real); debug_assert(data->cpx);
+    trace_begin_arg(span, "fft", data->len);
+    const uint64_t start = metrics_now();
+    metrics_fft(data->len);
+
+    if (data->plan) {
+        fftw_execute_dft_r2c(data->plan, data->real, data->cpx);
+        trace_end(span);
+        metrics_observe(STAGE_FFT, start);
+        return NULL;
+    }
 
     // Initializing the plan: the only thread-safe call in FFTW is
     // fftw_execute, so the plan has to be created and destroyed with a lock.
@@ -42,28 +74,258 @@ static void *fft(void *arg) {
     pthread_mutex_lock(&cc_mutex);
     fftw_destroy_plan(p);
     pthread_mutex_unlock(&cc_mutex);
-    pthread_exit(NULL);
+    trace_end(span);
+    metrics_observe(STAGE_FFT, start);
+    return NULL;
+}
+
+// Takes a reference to the plan cache, so that the plans returned by
+// find_plans stay valid until release_plans is called.
+static void acquire_plans() {
+    pthread_mutex_lock(&cc_mutex);
+    plan_users++;
+    pthread_mutex_unlock(&cc_mutex);
+}
+
+// Releases the reference taken by acquire_plans.
+static void release_plans() {
+    pthread_mutex_lock(&cc_mutex);
+    debug_assert(plan_users > 0);
+    if (--plan_users == 0) pthread_cond_broadcast(&plans_released);
+    pthread_mutex_unlock(&cc_mutex);
+}
+
+// Looks for the precomputed plans of a length. The caller must hold a
+// reference from acquire_plans while it uses them. Only the plans whose arrays
+// have the same alignment as the provided ones are returned. Otherwise, the
+// plans are set to NULL.
+static void find_plans(size_t len, double *real, double complex *cpx,
+                       fftw_plan *r2c, fftw_plan *c2r) {
+    *r2c = NULL;
+    *c2r = NULL;
+
+    pthread_mutex_lock(&cc_mutex);
+    for (size_t i = 0; i < n_plans; i++) {
+        if (plans[i].len == len) {
+            if (fftw_alignment_of(real) == 0) *r2c = plans[i].r2c;
+            *c2r = plans[i].c2r;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cc_mutex);
+
+    // The complex arrays are always obtained from the arena.
+    debug_assert(fftw_alignment_of((double *) cpx) == 0);
+    UNUSED(cpx);
+}
+
+// Creates the FFTW plans used by cross_correlation for a sample length of
+// `sample_len`, so that they don't have to be created on every call.
+//
+// Returns 0 on success, or -1 on error.
+int xcorr_prepare(size_t sample_len) {
+    debug_assert(sample_len > 0);
+
+    const size_t len = sample_len * 2;
+    const size_t cpx_len = (len / 2) + 1;
+    int ret = -1;
+
+    pthread_mutex_lock(&cc_mutex);
+    for (size_t i = 0; i < n_plans; i++) {
+        if (plans[i].len == len) {
+            pthread_mutex_unlock(&cc_mutex);
+            return 0;
+        }
+    }
+    if (n_plans == MAX_INTERVALS) {
+        pthread_mutex_unlock(&cc_mutex);
+        log("plan cache is full");
+        return -1;
+    }
+
+    // The planner needs arrays with the same alignment as the ones that
+    // will be used. They aren't modified because FFTW_ESTIMATE is used, and
+    // they're kept in the arena for the next calls.
+    double *real = arena_alloc(len * sizeof(*real));
+    double complex *cpx = arena_alloc(cpx_len * sizeof(*cpx));
+    if (real == NULL || cpx == NULL) {
+        log("plan arrays arena_alloc failed");
+        goto finish;
+    }
+    struct plan_entry *entry = &plans[n_plans];
+    entry->len = len;
+    entry->r2c = fftw_plan_dft_r2c_1d(len, real, cpx, FFTW_ESTIMATE);
+    entry->c2r = fftw_plan_dft_c2r_1d(len, cpx, real, FFTW_ESTIMATE);
+    if (entry->r2c == NULL || entry->c2r == NULL) {
+        log("couldn't create the plans for length %ld", len);
+        if (entry->r2c) fftw_destroy_plan(entry->r2c);
+        if (entry->c2r) fftw_destroy_plan(entry->c2r);
+        goto finish;
+    }
+    n_plans++;
+    ret = 0;
+
+finish:
+    pthread_mutex_unlock(&cc_mutex);
+    arena_free(real);
+    arena_free(cpx);
+
+    return ret;
+}
+
+// Destroys all the plans created by xcorr_prepare, once the correlations
+// using them finish.
+void xcorr_clear_plans() {
+    pthread_mutex_lock(&cc_mutex);
+    while (plan_users > 0) {
+        pthread_cond_wait(&plans_released, &cc_mutex);
+    }
+    for (size_t i = 0; i < n_plans; i++) {
+        fftw_destroy_plan(plans[i].r2c);
+        fftw_destroy_plan(plans[i].c2r);
+    }
+    n_plans = 0;
+    pthread_mutex_unlock(&cc_mutex);
+}
+
+// Allocates the buffers of a workspace for samples of up to `sample_len`
+// frames from the arena.
+//
+// Returns 0 on success, or -1 on error.
+int xcorr_workspace_init(struct xcorr_workspace *ws, size_t sample_len) {
+    debug_assert(ws); debug_assert(sample_len > 0);
+
+    const size_t source_len = sample_len * 2;
+    const size_t cpx_len = (source_len / 2) + 1;
+
+    ws->len = sample_len;
+    ws->sample = arena_alloc(source_len * sizeof(*ws->sample));
+    ws->arr1 = arena_alloc(cpx_len * sizeof(*ws->arr1));
+    ws->arr2 = arena_alloc(cpx_len * sizeof(*ws->arr2));
+    ws->results = arena_alloc(source_len * sizeof(*ws->results));
+    if (ws->sample == NULL || ws->arr1 == NULL || ws->arr2 == NULL
+            || ws->results == NULL) {
+        log("workspace arena_alloc failed");
+        xcorr_workspace_free(ws);
+        return -1;
+    }
+
+    return 0;
 }
 
-// Returns the index of the absolute maximum value in an array of doubles
-// of length `len`.
+// Gives the buffers of a workspace back to the arena.
+void xcorr_workspace_free(struct xcorr_workspace *ws) {
+    arena_free(ws->sample);
+    arena_free(ws->arr1);
+    arena_free(ws->arr2);
+    arena_free(ws->results);
+    memset(ws, 0, sizeof(*ws));
+}
+
+// Whether the caller of cross_correlation_ex asked it to stop.
+static int cancelled(const struct xcorr_params *params) {
+    return params && params->cancel && params->cancel(params->cancel_ctx);
+}
+
+// Obtains the index of the absolute maximum value in an array of doubles
+// of length `len`. The array is scanned in chunks, checking between them if
+// the calculation was cancelled with the callback in `params`, which can be
+// NULL.
 //
 // Its length must be greater than zero to work correctly.
-static size_t max_abs_index(double *arr, size_t len) {
+//
+// Returns 0 on success, or -1 if it was cancelled.
+int max_abs_index(double *arr, size_t len, const struct xcorr_params *params,
+                  size_t *index) {
     debug_assert(arr); debug_assert(len > 0);
 
     double abs_val;
     double max_val = arr[0];
     size_t max_ind = 0;
-    for (size_t i = 1; i < len; i++) {
-        abs_val = fabs(arr[i]);
-        if (abs_val > max_val) {
-            max_val = abs_val;
-            max_ind = i;
+    for (size_t chunk = 0; chunk < len; chunk += XCORR_CANCEL_CHUNK) {
+        if (cancelled(params)) return -1;
+
+        const size_t end = len - chunk > XCORR_CANCEL_CHUNK
+            ? chunk + XCORR_CANCEL_CHUNK : len;
+        for (size_t i = chunk > 0 ? chunk : 1; i < end; i++) {
+            abs_val = fabs(arr[i]);
+            if (abs_val > max_val) {
+                max_val = abs_val;
+                max_ind = i;
+            }
+        }
+    }
+
+    *index = max_ind;
+    return 0;
+}
+
+// Same as max_abs_index, but only considering the lags whose absolute value
+// is at most `max_lag`. These are at both ends of the circular results.
+// If `max_lag` is zero, the entire array is considered.
+static int max_abs_lag_index(double *arr, size_t len, size_t max_lag,
+                             const struct xcorr_params *params,
+                             size_t *index) {
+    if (max_lag == 0 || 2 * max_lag + 1 >= len) {
+        return max_abs_index(arr, len, params, index);
+    }
+
+    size_t right, left;
+    if (max_abs_index(arr, max_lag + 1, params, &right) < 0
+            || max_abs_index(arr + len - max_lag, max_lag, params,
+                             &left) < 0) {
+        return -1;
+    }
+    left += len - max_lag;
+    *index = fabs(arr[left]) > fabs(arr[right]) ? left : right;
+    return 0;
+}
+
+// Same as pearson_coefficient, but both passes are split in chunks, checking
+// between them if the calculation was cancelled. The chunks are summed in
+// order, so the result is exactly the same.
+//
+// Returns 0 on success, or -1 if it was cancelled.
+static int chunked_pearson(const double *source, const double *sample,
+                           size_t len, const struct xcorr_params *params,
+                           double *coefficient) {
+    // 1. The average for both datasets.
+    double sum1 = 0.0;
+    double sum2 = 0.0;
+    for (size_t chunk = 0; chunk < len; chunk += XCORR_CANCEL_CHUNK) {
+        if (cancelled(params)) return -1;
+
+        const size_t end = len - chunk > XCORR_CANCEL_CHUNK
+            ? chunk + XCORR_CANCEL_CHUNK : len;
+        for (size_t i = chunk; i < end; i++) {
+            sum1 += source[i];
+            sum2 += sample[i];
+        }
+    }
+    const double avg1 = sum1 / len;
+    const double avg2 = sum2 / len;
+
+    // 2. Applying the definition formula.
+    double diff1, diff2;
+    double diffprod = 0.0;
+    double diff1_squared = 0.0;
+    double diff2_squared = 0.0;
+    for (size_t chunk = 0; chunk < len; chunk += XCORR_CANCEL_CHUNK) {
+        if (cancelled(params)) return -1;
+
+        const size_t end = len - chunk > XCORR_CANCEL_CHUNK
+            ? chunk + XCORR_CANCEL_CHUNK : len;
+        for (size_t i = chunk; i < end; i++) {
+            diff1 = source[i] - avg1;
+            diff2 = sample[i] - avg2;
+            diffprod += diff1 * diff2;
+            diff1_squared += diff1 * diff1;
+            diff2_squared += diff2 * diff2;
         }
     }
 
-    return max_ind;
+    *coefficient = diffprod / sqrt(diff1_squared * diff2_squared);
+    return 0;
 }
 
 // Calculating the Pearson Correlation Coefficient between `source` and
@@ -77,42 +339,245 @@ double pearson_coefficient(double *source_start, const double *source_end,
     debug_assert(source_end - source_start > 0);
     debug_assert(sample_start); debug_assert(sample_end);
     debug_assert(sample_end - sample_start > 0);
+    UNUSED(sample_end);
 
-    // 1. The average for both datasets.
-    double sum1 = 0.0;
-    double sum2 = 0.0;
-    // Both segments have the same size but start at different indexes.
-    double *source_i = source_start;
-    double *sample_i = sample_start;
-    while (source_i != source_end) {
-         sum1 += *source_i;
-         sum2 += *sample_i;
+    double coef;
+    chunked_pearson(source_start, sample_start, source_end - source_start,
+                    NULL, &coef);
+    return coef;
+}
+
+// Searches the lag between `source` and `sample` directly in the time
+// domain, only considering the lags at most `radius` frames away from
+// `center`. It's much cheaper than cross_correlation when the lag is
+// approximately known already, like when verifying a previous result.
+//
+// The lags have the same meaning as in cross_correlation, and the overlap of
+// the sample with the source must be at least half the sample for a lag to
+// be considered.
+//
+// Returns the lag with the highest coefficient, or -1 if none of them could
+// be calculated.
+int bounded_correlation(double *source, size_t source_len, double *sample,
+                        size_t sample_len, long center, size_t radius,
+                        long *lag, double *coefficient) {
+    debug_assert(source); debug_assert(sample);
+    debug_assert(lag); debug_assert(coefficient);
+    debug_assert(sample_len > 0);
+
+    int ret = -1;
+    *coefficient = -1.0;
+    for (long l = center - (long) radius; l <= center + (long) radius; l++) {
+        double *source_start, *sample_start;
+        long overlap;
+        if (l >= 0) {
+            source_start = source + l;
+            sample_start = sample;
+            overlap = (long) source_len - l;
+            if (overlap > (long) sample_len) overlap = sample_len;
+        } else {
+            source_start = source;
+            sample_start = sample - l;
+            overlap = (long) sample_len + l;
+        }
+        if (overlap < (long) (sample_len / 2) || overlap <= 0) continue;
 
-         source_i++;
-         sample_i++;
+        double coef = pearson_coefficient(source_start, source_start + overlap,
+                                          sample_start,
+                                          sample_start + overlap);
+        // NaN is skipped too, since the comparison is false.
+        if (coef > *coefficient) {
+            *coefficient = coef;
+            *lag = l;
+            ret = 0;
+        }
     }
-    double avg1 = sum1 / (source_end - source_start);
-    double avg2 = sum2 / (sample_end - sample_start);
 
-    // 2. Applying the definition formula.
-    double diff1, diff2;
-    double diffprod = 0.0;
-    double diff1_squared = 0.0;
-    double diff2_squared = 0.0;
-    source_i = source_start;
-    sample_i = sample_start;
-    while (source_i != source_end) {
-        diff1 = *source_i - avg1;
-        diff2 = *sample_i - avg2;
-        diffprod += diff1 * diff2;
-        diff1_squared += diff1 * diff1;
-        diff2_squared += diff2 * diff2;
+    return ret;
+}
+
+// Calculates the autocorrelation of `len` frames of `data` for the lags
+// between 0 and len - 1, saving it in `out`. The data is zero-padded to
+// twice its length, so the autocorrelation isn't circular.
+//
+// Returns 0 on success, or -1 on error.
+int autocorrelation(const double *data, size_t len, double *out) {
+    debug_assert(data); debug_assert(out); debug_assert(len > 0);
+
+    const size_t real_len = 2 * len;
+    const size_t cpx_len = len + 1;
+    int ret = -1;
+    fftw_plan r2c = NULL;
+    fftw_plan c2r = NULL;
+    double *real = arena_alloc(real_len * sizeof(*real));
+    double complex *cpx = arena_alloc(cpx_len * sizeof(*cpx));
+    if (real == NULL || cpx == NULL) {
+        log("autocorrelation arena_alloc failed");
+        goto finish;
+    }
+
+    // The plans are only used once, so they aren't cached.
+    pthread_mutex_lock(&cc_mutex);
+    r2c = fftw_plan_dft_r2c_1d(real_len, real, cpx, FFTW_ESTIMATE);
+    c2r = fftw_plan_dft_c2r_1d(real_len, cpx, real, FFTW_ESTIMATE);
+    pthread_mutex_unlock(&cc_mutex);
+    if (r2c == NULL || c2r == NULL) {
+        log("couldn't create the autocorrelation plans");
+        goto finish;
+    }
+
+    // The inverse transform of the power spectrum. FFTW doesn't normalize
+    // it, which doesn't matter for the ratios between lags.
+    memcpy(real, data, len * sizeof(*real));
+    memset(real + len, 0, len * sizeof(*real));
+    fftw_execute(r2c);
+    for (size_t i = 0; i < cpx_len; i++) {
+        cpx[i] = creal(cpx[i]) * creal(cpx[i])
+            + cimag(cpx[i]) * cimag(cpx[i]);
+    }
+    fftw_execute(c2r);
+    memcpy(out, real, len * sizeof(*out));
+    ret = 0;
+
+finish:
+    pthread_mutex_lock(&cc_mutex);
+    if (r2c) fftw_destroy_plan(r2c);
+    if (c2r) fftw_destroy_plan(c2r);
+    pthread_mutex_unlock(&cc_mutex);
+    arena_free(real);
+    arena_free(cpx);
+
+    return ret;
+}
+
+// Whether every frame of the sample is the same, like silence. Such a sample
+// has no correlation with anything.
+static int constant_sample(const double *sample, size_t len) {
+    size_t first_change = 1;
+    while (first_change < len && sample[first_change] == sample[0]) {
+        first_change++;
+    }
+
+    return first_change == len;
+}
 
-        source_i++;
-        sample_i++;
+// Product of the source's transform in `src` and the conjugate of the
+// sample's in `smp`, saved in `out`, which may be either of them. If the
+// padding was before the sample, it was shifted by half the transform,
+// which multiplies its odd bins by -1, so they're negated back.
+//
+// Returns 0 on success, or -1 if it was cancelled.
+static int multiply_spectra(double complex *out, const double complex *src,
+                            const double complex *smp, size_t cpx_len,
+                            int prepadded,
+                            const struct xcorr_params *params) {
+    for (size_t chunk = 0; chunk < cpx_len; chunk += XCORR_CANCEL_CHUNK) {
+        if (cancelled(params)) return -1;
+
+        const size_t end = cpx_len - chunk > XCORR_CANCEL_CHUNK
+            ? chunk + XCORR_CANCEL_CHUNK : cpx_len;
+        if (prepadded) {
+            for (size_t i = chunk; i < end; ++i)
+                out[i] = src[i] * (i % 2 ? -conj(smp[i]) : conj(smp[i]));
+        } else {
+            for (size_t i = chunk; i < end; ++i)
+                out[i] = src[i] * conj(smp[i]);
+        }
     }
 
-    return diffprod / sqrt(diff1_squared * diff2_squared);
+    return 0;
+}
+
+// Calculates the inverse transform of `arr1` into `results`, of length
+// `len`, with the precomputed plan if there is one.
+static void inverse_fft(fftw_plan c2r, double complex *arr1, double *results,
+                        size_t len) {
+    metrics_fft(len);
+    if (c2r) {
+        fftw_execute_dft_c2r(c2r, arr1, results);
+        return;
+    }
+
+    pthread_mutex_lock(&cc_mutex);
+    c2r = fftw_plan_dft_c2r_1d(len, arr1, results, FFTW_ESTIMATE);
+    pthread_mutex_unlock(&cc_mutex);
+    fftw_execute(c2r);
+    pthread_mutex_lock(&cc_mutex);
+    fftw_destroy_plan(c2r);
+    pthread_mutex_unlock(&cc_mutex);
+}
+
+// Obtains the lag from the inverse transform of the product in `results`,
+// and its coefficient with the actual data. The coefficient may be NaN.
+//
+// Returns 0 on success, or -1 if it was cancelled.
+static int results_lag(double *source, double *input_sample,
+                       size_t sample_len, double *results,
+                       const struct xcorr_params *params, long *lag,
+                       double *coefficient) {
+    const size_t source_len = sample_len * 2;
+    double *source_start, *source_end, *sample_start, *sample_end;
+
+    // The index of the maximum value is the desired lag, optionally limited
+    // to a maximum absolute lag.
+    if (cancelled(params)) return -1;
+    size_t peak;
+    trace_begin(peak_span, "peak");
+    const int found = max_abs_lag_index(results, source_len, params->max_lag,
+                                        params, &peak);
+    trace_end(peak_span);
+    if (found < 0) {
+        return -1;
+    }
+    *lag = peak;
+
+    // If the lag is greater than the input array itself, it means that the
+    // sample displacement has to be performed is to the left, and otherwise
+    // to the right.
+    //
+    // The source size is twice the sample size, so if the sample is displaced
+    // to the right, no sample data will be lost, and the resulting size will
+    // be sample_len. But if the sample is moved to the left, some elements
+    // will be lost from it and thus, the resulting size will be
+    // sample_len - lag.
+    //
+    // Finally, the Pearson Correlation Coefficient is calculated with the
+    // resulting segment of data.
+    if (*lag >= (long) sample_len) {
+        // Displacing the sample to the left (lag is negative), final size
+        // is sample_len - lag.
+        *lag = (*lag % (long) sample_len) - (long) sample_len;
+        source_start = source;
+        source_end = source + *lag + sample_len;
+        sample_start = input_sample - *lag;
+        sample_end = input_sample + sample_len;
+    } else {
+        // Displacing the sample to the right (lag is positive), final size
+        // is sample_len.
+        source_start = source + *lag;
+        source_end = source + *lag + sample_len;
+        sample_start = input_sample;
+        sample_end = input_sample + sample_len;
+    }
+    debug_assert(source_end - source_start == sample_end - sample_start);
+    trace_begin_arg(pearson_span, "pearson", source_end - source_start);
+    const int computed = chunked_pearson(source_start, sample_start,
+                                         source_end - source_start, params,
+                                         coefficient);
+    trace_end(pearson_span);
+    if (computed < 0) {
+        return -1;
+    }
+
+    UNUSED(sample_end);
+
+    // Saving the curves for the diagnostics, if they're enabled.
+    if (diag_enabled()) {
+        diag_save(source, input_sample, sample_len, results, *lag,
+                  *coefficient);
+    }
+
+    return 0;
 }
 
 // Calculating the cross-correlation between two signals `a` and `b`:
@@ -128,180 +593,616 @@ double pearson_coefficient(double *source_start, const double *source_end,
 // In case of error, the function returns -1. Otherwise, zero.
 //
 // Note: FFTW won't overwrite the source if FFTW_ESTIMATE is used, meaning
-// that the source can be initialized with fftw_alloc_real so that it's also
-// aligned and thus, the Fourier Transforms will be faster.
+// that the source can be initialized with arena_alloc or fftw_alloc_real so
+// that it's also aligned and thus, the Fourier Transforms will be faster.
 int cross_correlation(double *source, double *input_sample,
                       const size_t sample_len, long *lag,
                       double *coefficient) {
+    return cross_correlation_ex(source, input_sample, sample_len, NULL, lag,
+                                coefficient);
+}
+
+// Same as cross_correlation, with the parameters in `params`. If it's NULL,
+// the default ones are used.
+int cross_correlation_ex(double *source, double *input_sample,
+                         const size_t sample_len,
+                         const struct xcorr_params *params, long *lag,
+                         double *coefficient) {
     debug_assert(source); debug_assert(input_sample);
     debug_assert(lag); debug_assert(coefficient);
     debug_assert(sample_len > 0);
 
+    const struct xcorr_params default_params = XCORR_DEFAULT_PARAMS;
+    if (params == NULL) params = &default_params;
+
+    // A constant sample, like silence, has no correlation with anything, so
+    // it fails before calculating any of the transforms.
+    if (constant_sample(input_sample, sample_len)) {
+        log("constant sample, skipping the cross-correlation");
+        return -1;
+    }
+
+    trace_begin_arg(span, "cross_correlation", sample_len);
+    acquire_plans();
     int ret = -1;
+    const int prepadded = params->flags & XCORR_PREPADDED;
+    const double complex *spectrum = params->source_spectrum;
     const size_t source_len = sample_len * 2;
     const size_t cpx_len = (source_len / 2) + 1;
+    // The zero-padded sample, which is only allocated if it wasn't provided.
     double *sample = NULL;
+    double *padded = NULL;
     double *results = NULL;
     double complex *arr1 = NULL;
     double complex *arr2 = NULL;
+    struct xcorr_workspace *ws = params->workspace;
     pthread_t fft1_th = 0;
     pthread_t fft2_th = 0;
-    double *source_start, *source_end, *sample_start, *sample_end;
+    fftw_plan r2c, c2r;
 
     // Only the sample needs to be zero-padded, since the cross correlation
     // will be circular, and only one of the inputs is shifted.
     // FFTW doesn't overwrite the source when FFTW_ESTIMATE is used, so the
     // sample doesn't have to be copied.
     //
-    // Note: fftw_alloc_* uses fftw_malloc, which is an equivalent of running
-    // malloc + memalign. This means that it may also return NULL in case of
-    // error.
-    sample = fftw_alloc_real(source_len);
-    if (sample == NULL) {
-        perror("audiosync: sample fftw_alloc_real failed");
-        goto finish;
+    // Note: the buffers are obtained from the arena, which keeps them mapped
+    // and pre-faulted between intervals and runs. They are aligned to the
+    // page size, so FFTW can use SIMD instructions with them. If the caller
+    // provided a workspace that's big enough, its buffers are used instead.
+    // If the sample is already preceded by its padding, it isn't copied at
+    // all.
+    if (ws && ws->len < sample_len) {
+        ws = NULL;
     }
-    memcpy(sample, input_sample, sample_len * sizeof(*sample));
-    memset(sample + sample_len, 0,
-           (source_len - sample_len) * sizeof(*sample));
-
-#ifdef PLOT
-    // Plotting the output with gnuplot
-    log("Saving initial plot to '%ld_original.png'", source_len);
-    FILE *gnuplot = popen("gnuplot", "w");
-    fprintf(gnuplot, "set term 'png'\n");
-    fprintf(gnuplot, "set output 'images/%ld_original.png'\n", source_len);
-    fprintf(gnuplot, "plot '-' with lines title 'sample', '-' with lines"
-            " title 'source'\n");
-    for (size_t i = 0; i < source_len; ++i)
-        fprintf(gnuplot, "%f\n", source[i]);
-    fprintf(gnuplot, "e\n");
-    for (size_t i = 0; i < source_len; ++i)
-        fprintf(gnuplot, "%f\n", sample[i]);
-    fprintf(gnuplot, "e\n");
-    fflush(gnuplot);
-    pclose(gnuplot);
-#endif
-
-    // First allocating the arrays where the results will be saved at.
-    arr1 = fftw_alloc_complex(cpx_len);
-    if (arr1 == NULL) {
-        perror("audiosync: arr1 fftw_alloc_real failed");
-        goto finish;
+    if (ws) {
+        sample = ws->sample;
+        arr1 = ws->arr1;
+        arr2 = ws->arr2;
+        results = ws->results;
+    } else {
+        if (!prepadded) {
+            sample = padded = arena_alloc(source_len * sizeof(*sample));
+        }
+        if (!spectrum) {
+            arr1 = arena_alloc(cpx_len * sizeof(*arr1));
+        }
+        arr2 = arena_alloc(cpx_len * sizeof(*arr2));
+        results = arena_alloc(source_len * sizeof(*results));
     }
-    arr2 = fftw_alloc_complex(cpx_len);
-    if (arr2 == NULL) {
-        perror("audiosync: arr2 fftw_alloc_real failed");
-        goto finish;
+    if (prepadded) {
+        sample = input_sample - sample_len;
     }
-    results = fftw_alloc_real(source_len);
-    if (results == NULL) {
-        perror("audiosync: results fftw_alloc_real failed");
+    if (sample == NULL || (arr1 == NULL && !spectrum) || arr2 == NULL
+            || results == NULL) {
+        log("cross_correlation arena_alloc failed");
         goto finish;
     }
+    if (!prepadded) {
+        memcpy(sample, input_sample, sample_len * sizeof(*sample));
+        memset(sample + sample_len, 0,
+               (source_len - sample_len) * sizeof(*sample));
+    }
 
-    // Initializing the threads and starting them.
+    // Initializing the threads and starting them. The source and the sample
+    // may have different alignments, so the plans are looked for separately.
+    find_plans(source_len, source, arr1, &r2c, &c2r);
     struct fftw_data fft1_data = {
         .real = source,
         .cpx = arr1,
         .len = source_len,
+        .plan = r2c,
     };
+    find_plans(source_len, sample, arr2, &r2c, &c2r);
     struct fftw_data fft2_data = {
         .real = sample,
         .cpx = arr2,
         .len = source_len,
+        .plan = r2c,
     };
-    if (pthread_create(&fft1_th, NULL, &fft, (void *) &fft1_data) < 0) {
-        perror("audiosync: pthread_create for fft1_th failed");
-        goto finish;
+    if (cancelled(params)) goto cancel;
+    if (spectrum) {
+        // The source's transform was calculated previously, so only the
+        // sample's is needed.
+        fft(&fft2_data);
+    } else if (params->threads < 2) {
+        // Both transforms are run sequentially in the current thread.
+        fft(&fft1_data);
+        if (cancelled(params)) goto cancel;
+        fft(&fft2_data);
+    } else {
+        if (pthread_create(&fft1_th, NULL, &fft, (void *) &fft1_data) < 0) {
+            perror("audiosync: pthread_create for fft1_th failed");
+            goto finish;
+        }
+        if (pthread_create(&fft2_th, NULL, &fft, (void *) &fft2_data) < 0) {
+            perror("audiosync: pthread_create for fft2_th failed");
+            pthread_join(fft1_th, NULL);
+            goto finish;
+        }
+        if (pthread_join(fft1_th, NULL) < 0) {
+            perror("audiosync: pthread_join for fft1_th failed");
+            goto finish;
+        }
+        if (pthread_join(fft2_th, NULL) < 0) {
+            perror("audiosync: pthread_join for fft2_th failed");
+            goto finish;
+        }
     }
-    if (pthread_create(&fft2_th, NULL, &fft, (void *) &fft2_data) < 0) {
-        perror("audiosync: pthread_create for fft2_th failed");
-        goto finish;
+
+    // Product of fft1 and conj(fft2), and its inverse transform. The size of
+    // the results is going to be the original length again. The provided
+    // spectrum is read-only, so the product is saved in the sample's
+    // transform in that case.
+    double complex *product = spectrum ? arr2 : arr1;
+    trace_begin(multiply_span, "multiply spectra");
+    const int multiplied = multiply_spectra(product,
+                                            spectrum ? spectrum : arr1, arr2,
+                                            cpx_len, prepadded, params);
+    trace_end(multiply_span);
+    if (multiplied < 0) goto cancel;
+    if (cancelled(params)) goto cancel;
+    trace_begin_arg(ifft_span, "inverse fft", source_len);
+    inverse_fft(c2r, product, results, source_len);
+    trace_end(ifft_span);
+
+    if (results_lag(source, input_sample, sample_len, results, params, lag,
+                    coefficient) < 0) {
+        goto cancel;
+    }
+
+    // Checking that the resulting coefficient isn't NaN.
+    if (*coefficient != *coefficient) goto finish;
+
+    log("%ld frames of delay with a confidence of %f", *lag, *coefficient);
+
+    ret = 0;
+    goto finish;
+
+cancel:
+    log("cross-correlation cancelled");
+
+finish:
+    if (ws == NULL) {
+        arena_free(padded);
+        arena_free(arr1);
+        arena_free(arr2);
+        arena_free(results);
+    }
+    release_plans();
+    trace_end(span);
+
+    return ret;
+}
+
+// Calculates the transform of the `2 * sample_len` frames of `source` used
+// by cross_correlation_ex into `out`, so that it can be provided later with
+// `source_spectrum`.
+void xcorr_spectrum(const double *source, size_t sample_len,
+                    double complex *out) {
+    debug_assert(source); debug_assert(out); debug_assert(sample_len > 0);
+
+    // FFTW doesn't overwrite the input with FFTW_ESTIMATE, like in
+    // cross_correlation_ex.
+    fftw_plan r2c, c2r;
+    acquire_plans();
+    find_plans(sample_len * 2, (double *) source, out, &r2c, &c2r);
+    struct fftw_data data = {
+        .real = (double *) source,
+        .cpx = out,
+        .len = sample_len * 2,
+        .plan = r2c,
+    };
+    fft(&data);
+    release_plans();
+}
+
+// The buffers of each worker of cross_correlation_many.
+struct many_buffers {
+    double complex *arr;  // Transform of the source, and then the product
+    double *results;      // Inverse transform
+};
+
+// The state shared by the tasks of cross_correlation_many.
+struct many_job {
+    double *const *sources;
+    double *sample;                  // Without the padding
+    size_t sample_len;
+    const double complex *spectrum;  // Transform of the padded sample
+    int prepadded;
+    const struct xcorr_params *params;
+    struct many_buffers *buffers;
+    struct xcorr_match *matches;
+};
+
+// Correlates a single source with the sample's transform, which only
+// requires the transform of the source and the inverse one.
+static void many_task(void *ctx, unsigned int worker, size_t task) {
+    struct many_job *job = ctx;
+    struct many_buffers *buf = &job->buffers[worker];
+    struct xcorr_match *match = &job->matches[task];
+    const size_t source_len = job->sample_len * 2;
+    fftw_plan r2c, c2r;
+
+    match->index = task;
+    match->ret = -1;
+    if (cancelled(job->params)) return;
+
+    find_plans(source_len, job->sources[task], buf->arr, &r2c, &c2r);
+    struct fftw_data data = {
+        .real = job->sources[task],
+        .cpx = buf->arr,
+        .len = source_len,
+        .plan = r2c,
+    };
+    fft(&data);
+    if (multiply_spectra(buf->arr, buf->arr, job->spectrum,
+                         job->sample_len + 1, job->prepadded,
+                         job->params) < 0) {
+        return;
+    }
+    if (cancelled(job->params)) return;
+    inverse_fft(c2r, buf->arr, buf->results, source_len);
+    if (results_lag(job->sources[task], job->sample, job->sample_len,
+                    buf->results, job->params, &match->lag,
+                    &match->coefficient) < 0) {
+        return;
+    }
+
+    // NaN is a failure too.
+    if (match->coefficient == match->coefficient) {
+        match->ret = 0;
+    }
+}
+
+// The successful matches go first, sorted by descending coefficient, and
+// the ties by their index.
+static int compare_matches(const void *a, const void *b) {
+    const struct xcorr_match *x = a;
+    const struct xcorr_match *y = b;
+
+    if (x->ret != y->ret) return x->ret == 0 ? -1 : 1;
+    if (x->ret == 0 && x->coefficient != y->coefficient) {
+        return x->coefficient > y->coefficient ? -1 : 1;
     }
-    if (pthread_join(fft1_th, NULL) < 0) {
-        perror("audiosync: pthread_join for fft1_th failed");
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Correlates the same sample with `n_sources` sources, like calling
+// cross_correlation_ex with each of them.
+//
+// Returns the number of sources whose lag was obtained, or -1 on error or
+// if it was cancelled.
+int cross_correlation_many(double *const *sources, size_t n_sources,
+                           double *input_sample, size_t sample_len,
+                           const struct xcorr_params *params,
+                           struct xcorr_match *matches) {
+    debug_assert(sources); debug_assert(input_sample);
+    debug_assert(matches); debug_assert(sample_len > 0);
+
+    const struct xcorr_params default_params = XCORR_DEFAULT_PARAMS;
+    if (params == NULL) params = &default_params;
+
+    if (constant_sample(input_sample, sample_len)) {
+        log("constant sample, skipping the cross-correlations");
+        return -1;
+    }
+    if (n_sources == 0) {
+        return 0;
+    }
+
+    int ret = -1;
+    const int prepadded = params->flags & XCORR_PREPADDED;
+    const size_t source_len = sample_len * 2;
+    const size_t cpx_len = (source_len / 2) + 1;
+    const unsigned int n_workers = params->threads < 2 ? 1
+        : (n_sources < params->threads ? n_sources : params->threads);
+    double *sample = NULL;
+    double *padded = NULL;
+    double complex *spectrum = NULL;
+    struct many_buffers *buffers = NULL;
+    fftw_plan r2c, c2r;
+
+    // The sample is transformed only once, and each worker has its own
+    // buffers for the sources.
+    buffers = calloc(n_workers, sizeof(*buffers));
+    if (buffers == NULL) {
+        perror("audiosync: calloc for the buffers failed");
+        return -1;
+    }
+    // The tasks find the plans too, and they finish before returning.
+    acquire_plans();
+    if (prepadded) {
+        sample = input_sample - sample_len;
+    } else {
+        sample = padded = arena_alloc(source_len * sizeof(*sample));
+    }
+    spectrum = arena_alloc(cpx_len * sizeof(*spectrum));
+    if (sample == NULL || spectrum == NULL) {
+        log("cross_correlation_many arena_alloc failed");
         goto finish;
     }
-    if (pthread_join(fft2_th, NULL) < 0) {
-        perror("audiosync: pthread_join for fft2_th failed");
+    for (unsigned int i = 0; i < n_workers; i++) {
+        buffers[i].arr = arena_alloc(cpx_len * sizeof(*buffers[i].arr));
+        buffers[i].results = arena_alloc(source_len
+                                         * sizeof(*buffers[i].results));
+        if (buffers[i].arr == NULL || buffers[i].results == NULL) {
+            log("cross_correlation_many arena_alloc failed");
+            goto finish;
+        }
+    }
+    if (!prepadded) {
+        memcpy(sample, input_sample, sample_len * sizeof(*sample));
+        memset(sample + sample_len, 0,
+               (source_len - sample_len) * sizeof(*sample));
+    }
+
+    if (cancelled(params)) goto cancel;
+    find_plans(source_len, sample, spectrum, &r2c, &c2r);
+    struct fftw_data data = {
+        .real = sample,
+        .cpx = spectrum,
+        .len = source_len,
+        .plan = r2c,
+    };
+    fft(&data);
+
+    // Each source is a task, so the workers steal them from each other if
+    // some take longer, like without a precomputed plan.
+    struct many_job job = {
+        .sources = sources,
+        .sample = input_sample,
+        .sample_len = sample_len,
+        .spectrum = spectrum,
+        .prepadded = prepadded,
+        .params = params,
+        .buffers = buffers,
+        .matches = matches,
+    };
+    if (n_workers == 1) {
+        for (size_t i = 0; i < n_sources; i++) {
+            many_task(&job, 0, i);
+        }
+    } else if (pool_run(n_sources, n_workers, many_task, &job) < 0) {
         goto finish;
     }
+    if (cancelled(params)) goto cancel;
 
-    // Product of fft1 and conj(fft2), saved in the first array.
-    for (size_t i = 0; i < cpx_len; ++i)
-        arr1[i] *= conj(arr2[i]);
+    qsort(matches, n_sources, sizeof(*matches), compare_matches);
+    ret = 0;
+    while ((size_t) ret < n_sources && matches[ret].ret == 0) {
+        ret++;
+    }
+    log("correlated %d of %zu sources", ret, n_sources);
+    goto finish;
 
-    // And calculating the ifft. The size of the results is going to be the
-    // original length again.
-    fftw_plan p = fftw_plan_dft_c2r_1d(source_len, arr1, results, FFTW_ESTIMATE);
-    fftw_execute(p);
-    fftw_destroy_plan(p);
+cancel:
+    log("cross-correlations cancelled");
 
-    // The index of the maximum value is the desired lag.
-    *lag = max_abs_index(results, source_len);
+finish:
+    arena_free(padded);
+    arena_free(spectrum);
+    for (unsigned int i = 0; i < n_workers; i++) {
+        arena_free(buffers[i].arr);
+        arena_free(buffers[i].results);
+    }
+    free(buffers);
+    release_plans();
 
-    // If the lag is greater than the input array itself, it means that the
-    // sample displacement has to be performed is to the left, and otherwise
-    // to the right.
-    //
-    // The source size is twice the sample size, so if the sample is displaced
-    // to the right, no sample data will be lost, and the resulting size will
-    // be sample_len. But if the sample is moved to the left, some elements
-    // will be lost from it and thus, the resulting size will be
-    // sample_len - lag.
-    //
-    // Finally, the Pearson Correlation Coefficient is calculated with the
-    // resulting segment of data.
-    if (*lag >= (long) sample_len) {
-        // Displacing the sample to the left (lag is negative), final size
-        // is sample_len - lag.
-        *lag = (*lag % (long) sample_len) - (long) sample_len;
-        source_start = source;
-        source_end = source + *lag + sample_len;
-        sample_start = sample - *lag;
-        sample_end = sample + sample_len;
-    } else {
-        // Displacing the sample to the right (lag is positive), final size
-        // is sample_len.
-        source_start = source + *lag;
-        source_end = source + *lag + sample_len;
-        sample_start = sample;
-        sample_end = sample + sample_len;
+    return ret;
+}
+
+// The state shared by the tasks of long_correlation, with a task per block.
+struct long_job {
+    const double *source;
+    size_t source_len;
+    size_t sample_len;
+    size_t block_len;                // Length of the transforms
+    size_t step;                     // Positions covered by each block
+    const double complex *spectrum;  // Transform of the padded sample
+    fftw_plan r2c;
+    fftw_plan c2r;
+    const struct xcorr_params *params;
+    struct many_buffers *buffers;    // With the block in `results`
+    // The best position of each block and its score, which is negative if
+    // there wasn't any.
+    size_t *positions;
+    double *scores;
+};
+
+// Correlates the sample with the block of the source starting at `task`
+// steps, keeping its best position. The raw correlation is normalized by
+// the energy of the source under the sample, so that the loud parts of the
+// track don't win just because of their volume.
+static void long_task(void *ctx, unsigned int worker, size_t task) {
+    struct long_job *job = ctx;
+    struct many_buffers *buf = &job->buffers[worker];
+    const size_t start = task * job->step;
+    const double *src = job->source + start;
+    const size_t avail = job->source_len - start;
+
+    job->scores[task] = -1.0;
+    if (cancelled(job->params)) return;
+
+    // The block is zero-padded after the end of the source.
+    const size_t copied = avail < job->block_len ? avail : job->block_len;
+    memcpy(buf->results, src, copied * sizeof(*buf->results));
+    memset(buf->results + copied, 0,
+           (job->block_len - copied) * sizeof(*buf->results));
+    fftw_execute_dft_r2c(job->r2c, buf->results, buf->arr);
+    if (multiply_spectra(buf->arr, buf->arr, job->spectrum,
+                         job->block_len / 2 + 1, 0, job->params) < 0) {
+        return;
     }
-    *coefficient = pearson_coefficient(source_start, source_end, sample_start,
-                                       sample_end);
+    if (cancelled(job->params)) return;
+    fftw_execute_dft_c2r(job->c2r, buf->arr, buf->results);
 
-    // Checking that the resulting coefficient isn't NaN.
-    if (*coefficient != *coefficient) goto finish;
+    // Only the positions where the whole sample is inside the source are
+    // valid. The ones after the step wrap around in the circular result.
+    size_t n = job->step;
+    if (avail < job->sample_len) return;
+    if (avail - job->sample_len + 1 < n) n = avail - job->sample_len + 1;
+    double energy = 0.0;
+    for (size_t i = 0; i < job->sample_len; i++) {
+        energy += src[i] * src[i];
+    }
+    for (size_t t = 0; t < n; t++) {
+        if (t > 0) {
+            const double out = src[t - 1];
+            const double in = src[t + job->sample_len - 1];
+            energy += in * in - out * out;
+            if (energy < 0.0) energy = 0.0;
+        }
+        if (energy <= 0.0) continue;
 
-    log("%ld frames of delay with a confidence of %f", *lag, *coefficient);
+        const double score = fabs(buf->results[t]) / sqrt(energy);
+        if (score > job->scores[task]) {
+            job->scores[task] = score;
+            job->positions[task] = start + t;
+        }
+    }
+}
+
+// Searches `sample` anywhere inside a much longer `source` with overlap-save
+// blocks.
+//
+// Returns 0 on success, or -1 on error or if it was cancelled.
+int long_correlation(const double *source, size_t source_len,
+                     double *sample, size_t sample_len,
+                     const struct xcorr_params *params, size_t *position,
+                     double *coefficient) {
+    debug_assert(source); debug_assert(sample);
+    debug_assert(position); debug_assert(coefficient);
+    debug_assert(sample_len > 0);
+
+    const struct xcorr_params default_params = XCORR_DEFAULT_PARAMS;
+    if (params == NULL) params = &default_params;
+
+    if (source_len < sample_len) {
+        log("the source is shorter than the sample");
+        return -1;
+    }
+    if (constant_sample(sample, sample_len)) {
+        log("constant sample, skipping the long correlation");
+        return -1;
+    }
+
+    int ret = -1;
+    const size_t block_len = sample_len * XCORR_LONG_BLOCK_FACTOR;
+    const size_t cpx_len = (block_len / 2) + 1;
+    const size_t step = block_len - sample_len + 1;
+    const size_t n_blocks = (source_len - sample_len) / step + 1;
+    const unsigned int n_workers = params->threads < 2 ? 1
+        : (n_blocks < params->threads ? n_blocks : params->threads);
+    double *padded = NULL;
+    double complex *spectrum = NULL;
+    struct many_buffers *buffers = NULL;
+    size_t *positions = NULL;
+    double *scores = NULL;
+    fftw_plan r2c = NULL;
+    fftw_plan c2r = NULL;
+
+    buffers = calloc(n_workers, sizeof(*buffers));
+    positions = malloc(n_blocks * sizeof(*positions));
+    scores = malloc(n_blocks * sizeof(*scores));
+    if (buffers == NULL || positions == NULL || scores == NULL) {
+        perror("audiosync: malloc for the long correlation failed");
+        goto finish;
+    }
+    padded = arena_alloc(block_len * sizeof(*padded));
+    spectrum = arena_alloc(cpx_len * sizeof(*spectrum));
+    if (padded == NULL || spectrum == NULL) {
+        log("long_correlation arena_alloc failed");
+        goto finish;
+    }
+    for (unsigned int i = 0; i < n_workers; i++) {
+        buffers[i].arr = arena_alloc(cpx_len * sizeof(*buffers[i].arr));
+        buffers[i].results = arena_alloc(block_len
+                                         * sizeof(*buffers[i].results));
+        if (buffers[i].arr == NULL || buffers[i].results == NULL) {
+            log("long_correlation arena_alloc failed");
+            goto finish;
+        }
+    }
+
+    // The block length usually isn't in the plan cache, so its plans are
+    // created once here and shared by every block, with the arena's
+    // alignment.
+    pthread_mutex_lock(&cc_mutex);
+    r2c = fftw_plan_dft_r2c_1d(block_len, padded, spectrum, FFTW_ESTIMATE);
+    c2r = fftw_plan_dft_c2r_1d(block_len, spectrum, padded, FFTW_ESTIMATE);
+    pthread_mutex_unlock(&cc_mutex);
+    if (r2c == NULL || c2r == NULL) {
+        log("couldn't create the plans for length %zu", block_len);
+        goto finish;
+    }
 
-#ifdef PLOT
-    // Plotting the output with gnuplot
-    log("Saving plot to '%ld.png'", source_len);
-    gnuplot = popen("gnuplot", "w");
-    fprintf(gnuplot, "set term 'png'\n");
-    fprintf(gnuplot, "set output 'images/%ld.png'\n", source_len);
-    fprintf(gnuplot, "plot '-' with lines title 'sample', '-' with lines"
-            " title 'source'\n");
-    for (double *i = source_start; i < source_end; i++)
-        fprintf(gnuplot, "%f\n", *i);
-    fprintf(gnuplot, "e\n");
-    for (double *i = sample_start; i < sample_end; i++)
-        fprintf(gnuplot, "%f\n", *i);
-    fprintf(gnuplot, "e\n");
-    fflush(gnuplot);
-    pclose(gnuplot);
-#endif
+    // The sample is only transformed once.
+    memcpy(padded, sample, sample_len * sizeof(*padded));
+    memset(padded + sample_len, 0,
+           (block_len - sample_len) * sizeof(*padded));
+    fftw_execute(r2c);
+
+    struct long_job job = {
+        .source = source,
+        .source_len = source_len,
+        .sample_len = sample_len,
+        .block_len = block_len,
+        .step = step,
+        .spectrum = spectrum,
+        .r2c = r2c,
+        .c2r = c2r,
+        .params = params,
+        .buffers = buffers,
+        .positions = positions,
+        .scores = scores,
+    };
+    if (n_workers == 1) {
+        for (size_t i = 0; i < n_blocks; i++) {
+            long_task(&job, 0, i);
+        }
+    } else if (pool_run(n_blocks, n_workers, long_task, &job) < 0) {
+        goto finish;
+    }
+    if (cancelled(params)) goto cancel;
 
+    // The best block is confirmed with the Pearson coefficient.
+    size_t best = 0;
+    for (size_t i = 1; i < n_blocks; i++) {
+        if (scores[i] > scores[best]) best = i;
+    }
+    if (scores[best] < 0.0) {
+        log("the source is silent");
+        goto finish;
+    }
+    *position = positions[best];
+    if (chunked_pearson(source + *position, sample, sample_len, params,
+                        coefficient) < 0) {
+        goto cancel;
+    }
+    if (*coefficient != *coefficient) goto finish;
+
+    log("found at frame %zu of %zu with a confidence of %f", *position,
+        source_len, *coefficient);
     ret = 0;
+    goto finish;
+
+cancel:
+    log("long correlation cancelled");
 
 finish:
-    if (sample) fftw_free(sample);
-    if (arr1) fftw_free(arr1);
-    if (arr2) fftw_free(arr2);
-    if (results) fftw_free(results);
+    pthread_mutex_lock(&cc_mutex);
+    if (r2c) fftw_destroy_plan(r2c);
+    if (c2r) fftw_destroy_plan(c2r);
+    pthread_mutex_unlock(&cc_mutex);
+    arena_free(padded);
+    arena_free(spectrum);
+    for (unsigned int i = 0; buffers && i < n_workers; i++) {
+        arena_free(buffers[i].arr);
+        arena_free(buffers[i].results);
+    }
+    free(buffers);
+    free(positions);
+    free(scores);
 
     return ret;
 }
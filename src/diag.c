@@ -0,0 +1,210 @@
+// Diagnostics of the cross-correlation. See diag.h for more details.
+//
+// Saving the curves only takes a pass over each of them, converting them to
+// floats in a small buffer on the stack, and a sequential write of the
+// decimated result, so it costs much less than the transforms that obtained
+// them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/diag.h>
+#include <audiosync/trace.h>
+
+// Values converted at a time before writing them.
+#define DIAG_CHUNK 4096
+
+
+static char diag_dir[MAX_LONG_PATH] = "";
+static unsigned int diag_files = 1;
+static unsigned int diag_decimation = 1;
+static unsigned int diag_sample_rate = 0;
+// The number of the next dump, shared by the threads correlating.
+static uint64_t diag_seq = 0;
+
+
+// Sets the directory of the dumps, the size of the ring and the decimation.
+// An empty directory disables them. It's created if it doesn't exist.
+void diag_configure(const char *dir, unsigned int files,
+                    unsigned int decimation, unsigned int sample_rate) {
+    debug_assert(dir); debug_assert(files > 0); debug_assert(decimation > 0);
+
+    snprintf(diag_dir, sizeof(diag_dir), "%s", dir);
+    diag_files = files;
+    diag_decimation = decimation;
+    diag_sample_rate = sample_rate;
+    if (diag_dir[0] != '\0' && mkdir(diag_dir, 0700) < 0
+            && errno != EEXIST) {
+        perror("audiosync: mkdir for the diagnostics directory failed");
+        diag_dir[0] = '\0';
+    }
+}
+
+// Returns whether the dumps are enabled.
+int diag_enabled() {
+    return diag_dir[0] != '\0';
+}
+
+// Converts a circular index of the correlation into its lag, like
+// results_lag in cross_correlation.c.
+static int64_t index_lag(size_t i, size_t sample_len) {
+    return i >= sample_len ? (int64_t) i - 2 * (int64_t) sample_len
+                           : (int64_t) i;
+}
+
+// Inserts a candidate into `peaks`, sorted by descending magnitude, if it's
+// higher than the last one.
+static void insert_peak(struct diag_peak *peaks, uint32_t *n_peaks,
+                        int64_t lag, double value) {
+    size_t pos = *n_peaks;
+    if (pos == DIAG_PEAKS) {
+        if (fabs(value) <= fabs(peaks[pos - 1].value)) return;
+        pos--;
+    } else {
+        (*n_peaks)++;
+    }
+    while (pos > 0 && fabs(value) > fabs(peaks[pos - 1].value)) {
+        peaks[pos] = peaks[pos - 1];
+        pos--;
+    }
+    peaks[pos] = (struct diag_peak) { .lag = lag, .value = value };
+}
+
+// Finds the index of the maximum absolute value in a block of the
+// correlation.
+static size_t block_max(const double *results, size_t start, size_t end) {
+    size_t best = start;
+    for (size_t i = start + 1; i < end; i++) {
+        if (fabs(results[i]) > fabs(results[best])) best = i;
+    }
+    return best;
+}
+
+// Saves the local maxima of the correlation with the largest magnitude,
+// comparing the maximum of each block with its neighbours'.
+static uint32_t find_peaks(const double *results, size_t sample_len,
+                           struct diag_peak *peaks) {
+    const size_t len = sample_len * 2;
+    uint32_t n_peaks = 0;
+    double prev = 0.0;
+    size_t cur = block_max(results, 0, len < DIAG_PEAK_BLOCK
+                                        ? len : DIAG_PEAK_BLOCK);
+
+    for (size_t start = 0; start < len; start += DIAG_PEAK_BLOCK) {
+        const size_t next_start = start + DIAG_PEAK_BLOCK;
+        double next = 0.0;
+        size_t next_idx = 0;
+        if (next_start < len) {
+            const size_t next_end = next_start + DIAG_PEAK_BLOCK;
+            next_idx = block_max(results, next_start,
+                                 next_end < len ? next_end : len);
+            next = fabs(results[next_idx]);
+        }
+        const double value = fabs(results[cur]);
+        if (value >= prev && value >= next) {
+            insert_peak(peaks, &n_peaks, index_lag(cur, sample_len),
+                        results[cur]);
+        }
+        prev = value;
+        cur = next_idx;
+    }
+
+    return n_peaks;
+}
+
+// Writes a curve of `len` frames, keeping the value with the largest
+// magnitude of each block of `decimation` frames.
+//
+// Returns 0 on success, or -1 on error.
+static int write_curve(FILE *fp, const char *name, const double *data,
+                       size_t len, unsigned int decimation) {
+    struct diag_curve curve = { .len = (len + decimation - 1) / decimation };
+    strncpy(curve.name, name, sizeof(curve.name) - 1);
+    if (fwrite(&curve, sizeof(curve), 1, fp) != 1) return -1;
+
+    float buf[DIAG_CHUNK];
+    size_t n = 0;
+    for (size_t start = 0; start < len; start += decimation) {
+        const size_t end = start + decimation < len ? start + decimation
+                                                     : len;
+        double best = data[start];
+        for (size_t i = start + 1; i < end; i++) {
+            if (fabs(data[i]) > fabs(best)) best = data[i];
+        }
+        buf[n++] = best;
+        if (n == DIAG_CHUNK) {
+            if (fwrite(buf, sizeof(*buf), n, fp) != n) return -1;
+            n = 0;
+        }
+    }
+    if (n > 0 && fwrite(buf, sizeof(*buf), n, fp) != n) return -1;
+
+    return 0;
+}
+
+// Saves the curves of a cross-correlation into the next file of the ring.
+// It's written with another name first and renamed, so that a file is never
+// read half-written.
+void diag_save(const double *source, const double *sample, size_t sample_len,
+               const double *results, long lag, double coefficient) {
+    debug_assert(source); debug_assert(sample); debug_assert(results);
+    if (!diag_enabled()) return;
+
+    trace_begin_arg(span, "diagnostics", sample_len);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const uint64_t seq = __atomic_fetch_add(&diag_seq, 1, __ATOMIC_RELAXED);
+    struct diag_peak peaks[DIAG_PEAKS];
+    struct diag_header header = {
+        .version = DIAG_VERSION,
+        .sample_rate = diag_sample_rate,
+        .seq = seq,
+        .time_ns = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec,
+        .sample_len = sample_len,
+        .decimation = diag_decimation,
+        .lag = lag,
+        .coefficient = coefficient,
+        .n_curves = 3,
+    };
+    memcpy(header.magic, DIAG_MAGIC, sizeof(header.magic));
+    header.n_peaks = find_peaks(results, sample_len, peaks);
+
+    char path[MAX_LONG_PATH + 32];
+    char tmp[MAX_LONG_PATH + 32];
+    snprintf(path, sizeof(path), "%s/diag-%04u.bin", diag_dir,
+             (unsigned int) (seq % diag_files));
+    snprintf(tmp, sizeof(tmp), "%s/.diag-%lu.tmp", diag_dir,
+             (unsigned long) seq);
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        perror("audiosync: fopen for the diagnostics failed");
+        trace_end(span);
+        return;
+    }
+
+    int failed = fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(peaks, sizeof(*peaks), header.n_peaks, fp)
+            != header.n_peaks
+        || write_curve(fp, "source", source, 2 * sample_len,
+                       diag_decimation) < 0
+        || write_curve(fp, "sample", sample, sample_len,
+                       diag_decimation) < 0
+        || write_curve(fp, "correlation", results, 2 * sample_len,
+                       diag_decimation) < 0;
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) {
+        perror("audiosync: writing the diagnostics failed");
+        remove(tmp);
+    } else if (rename(tmp, path) < 0) {
+        perror("audiosync: rename for the diagnostics failed");
+        remove(tmp);
+    }
+    trace_end(span);
+}
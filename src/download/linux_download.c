@@ -5,48 +5,127 @@
 #include <string.h>
 #include <audiosync/audiosync.h>
 #include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/metrics.h>
+#include <audiosync/reference_cache.h>
+#include <audiosync/trace.h>
 #include <audiosync/download/linux_download.h>
 
 #define MAX_LONG_URL 8172
 #define MAX_LONG_COMMAND 4086
 
+// The file decoded instead of downloading the references, if not empty.
+static char local_path[MAX_LONG_PATH];
 
-// Function used for the download thread. In this case, it both obtains the
-// direct youtube link to download the audio from, and creates a new
-// pulseaudio process to save it inside the thread's data.
+
+// Obtains the direct YouTube link of the song and downloads its audio with
+// ffmpeg into the data's ring.
 //
-// In case of error, it will signal the main thread to abort.
-void *download(void *arg) {
-    struct ffmpeg_data *data = arg;
-    log("starting download thread");
+// Returns 0 on success, or -1 on error.
+static int download_audio(struct ffmpeg_data *data) {
+    int ret = -1;
 
-    // Obtaining the youtube-dl direct URL to download.
+    // Obtaining the youtube-dl direct URL to download, unless a local file
+    // is used instead.
     char *url = NULL;
     url = malloc(sizeof(*url) * MAX_LONG_URL);
     if (url == NULL) {
-        audiosync_abort();
         perror("url malloc failed");
         goto finish;
     }
-    if (get_audio_url(data->title, &url) < 0) {
-        audiosync_abort();
+    if (local_path[0] != '\0') {
+        log("using '%s' as the reference", local_path);
+        snprintf(url, MAX_LONG_URL, "%s", local_path);
+    } else if (get_audio_url(data->title, &url) < 0) {
         log("could not obtain youtube url");
         goto finish;
     }
     log("obtained youtube-dl URL for download");
 
     // Finally downloading the track data with ffmpeg.
+    const struct derived_config *config = get_config();
     char *args[] = {
-        "ffmpeg", "-y", "-to", MAX_SECONDS_STR, "-i", url, "-ac",
-        NUM_CHANNELS_STR, "-r", SAMPLE_RATE_STR, "-f", "f64le", "pipe:1", NULL
+        "ffmpeg", "-y", "-to", (char *) config->max_seconds_str, "-i", url,
+        "-ac", (char *) config->num_channels_str, "-ar",
+        (char *) config->sample_rate_str, "-f", "f64le", "pipe:1", NULL
     };
-    ffmpeg_pipe(data, args);
+    // Streams are downloaded until the end of the song.
+    if (data->total_len == 0) {
+        memmove(&args[2], &args[4], sizeof(args) - 4 * sizeof(*args));
+    }
+    ret = ffmpeg_pipe(data, args);
 
 finish:
     if (url) free(url);
+    return ret;
+}
+
+// Decodes the file at `path` as the reference of every title instead of
+// downloading it, which is useful to benchmark and test the runs without
+// the network. NULL goes back to YouTube. It can't be called while
+// audiosync is running.
+void download_local(const char *path) {
+    if (path == NULL) {
+        local_path[0] = '\0';
+        return;
+    }
+    debug_assert(strlen(path) < sizeof(local_path));
+    snprintf(local_path, sizeof(local_path), "%s", path);
+}
+
+// Function used for the download thread. In this case, it both obtains the
+// direct youtube link to download the audio from, and creates a new
+// pulseaudio process to save it inside the thread's data.
+//
+// If the entire track is downloaded, it's also saved in the reference cache
+// for the next runs, along with its spectra. The reference is usually
+// downloaded much faster than the recording, so these are calculated while
+// the run waits for it, and they stop if it's aborted.
+//
+// In case of error, it will signal the main thread to abort.
+void *download(void *arg) {
+    struct ffmpeg_data *data = arg;
+    log("starting download thread");
+    trace_thread("download");
+
+    if (download_audio(data) < 0) {
+        audiosync_abort();
+        ring_close(data->ring);
+    } else if (data->total_len > 0
+               && ring_count(data->ring) == data->total_len) {
+        trace_begin(span, "cache the reference");
+        if (refcache_store(data->title, data->ring->buf,
+                           data->total_len) == 0) {
+            refcache_store_spectra(data->title, data->ring->buf,
+                                   data->total_len, audiosync_cancelled,
+                                   NULL);
+        }
+        trace_end(span);
+    }
+
     pthread_exit(NULL);
 }
 
+// Downloads the first `len` frames of a song into `buf` outside of a run,
+// so the global status is ignored. The rest of the buffer is filled with
+// zeroes if the song is shorter.
+//
+// Returns 0 on success, or -1 on error.
+int download_reference(const char *title, double *buf, size_t len) {
+    debug_assert(title); debug_assert(buf); debug_assert(len > 0);
+
+    struct ring_event event = { 0 };
+    struct ring ring;
+    ring_init(&ring, buf, len, &event);
+    struct ffmpeg_data data = {
+        .title = title,
+        .ring = &ring,
+        .total_len = len,
+        .detached = 1,
+    };
+
+    return download_audio(&data);
+}
+
 // Obtains the YouTube audio link with Youtube-dl.
 //
 // Returns 0 on exit, or -1 on error.
@@ -61,16 +140,22 @@ int get_audio_url(const char *title, char **url) {
     strcat(command, "'");
 
     // Run the command and read the output
+    trace_begin(span, "youtube-dl");
+    const uint64_t start = metrics_now();
+    int ret = 0;
     FILE *fp = popen(command, "r");
     // Failed to run
     if (fp == NULL) {
-        return -1;
-    }
-    fscanf(fp, "%s", *url);
-    // Returned an error code
-    if (pclose(fp) != 0) {
-        return -1;
+        ret = -1;
+    } else {
+        fscanf(fp, "%s", *url);
+        // Returned an error code
+        if (pclose(fp) != 0) {
+            ret = -1;
+        }
     }
+    trace_end(span);
+    metrics_observe(STAGE_URL, start);
 
-    return 0;
+    return ret;
 }
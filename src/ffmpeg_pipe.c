@@ -1,160 +1,433 @@
-#define _POSIX_SOURCE  // for kill()
+#define _GNU_SOURCE  // for kill() and syscall()
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/ffmpeg_pipe.h>
+#include <audiosync/metrics.h>
+#include <audiosync/trace.h>
 
 #define PIPE_RD 0
 #define PIPE_WR 1
 #define BUFSIZE 4096
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+// Milliseconds waited at most for the consumer to release frames when the
+// ring is full, so that the status is still checked regularly.
+#define SPACE_TIMEOUT_MS 100
+// Milliseconds between the checks of ffmpeg's progress with the memfd
+// transport.
+#define SHM_POLL_MS 2
 
 
-// Executes the ffmpeg command in the arguments and pipes its data into the
-// provided array.
-//
-// It will send signals to the main thread as the intervals are being
-// finished, while also checking the current global status, or updating it in
-// case of errors.
+// Decodes the first `len` frames of any file supported by ffmpeg into `buf`,
+// with the sample rate and channels from the configuration. The rest of the
+// buffer is filled with zeroes if the file is shorter. It doesn't use the
+// global status, so it can be called outside of runs.
 //
-// Returns -1 in case of error, or zero otherwise.
-int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
-    debug_assert(args); debug_assert(data); debug_assert(data->title);
-    debug_assert(data->buf); debug_assert(data->intervals);
-    debug_assert(data->intervals[data->n_intervals-1] == data->total_len);
+// Returns 0 on success, or -1 on error.
+int ffmpeg_decode(const char *path, double *buf, size_t len) {
+    debug_assert(path); debug_assert(buf); debug_assert(len > 0);
 
-    int wav_pipe[2];
-    int interval_count = 0;
-    ssize_t read_bytes;
-    pid_t pid;
+    const struct derived_config *config = get_config();
+    struct ring_event event = { 0 };
+    struct ring ring;
+    ring_init(&ring, buf, len, &event);
+    struct ffmpeg_data data = {
+        .title = path,
+        .ring = &ring,
+        .total_len = len,
+        .detached = 1,
+    };
+    // The output is limited to the frames needed, like the downloads and
+    // the recordings with `-to`. Otherwise, with the memfd transport,
+    // ffmpeg would keep writing past the end of the buffer until it fails.
+    // It's rounded up, since the missing frames would be zeroes.
+    char seconds[32];
+    snprintf(seconds, sizeof(seconds), "%.6f",
+             ceil(len * 1e6 / config->user.sample_rate) / 1e6);
+    char *args[] = {
+        "ffmpeg", "-y", "-i", (char *) path, "-t", seconds, "-ac",
+        (char *) config->num_channels_str, "-ar",
+        (char *) config->sample_rate_str, "-f", "f64le", "pipe:1", NULL
+    };
 
-    if (pipe(wav_pipe) < 0) {
-        audiosync_abort();
-        perror("audiosync: pipe for wav_pipe failed");
-        return -1;
-    }
+    return ffmpeg_pipe(&data, args);
+}
 
-    pid = fork();
-    if (pid < 0) {
-        audiosync_abort();
-        perror("audiosync: fork in read_pipe failed");
-        close(wav_pipe[PIPE_RD]); close(wav_pipe[PIPE_WR]);
-        return -1;
+// Starts ffmpeg with its standard output redirected to `out_fd`. The
+// descriptor `unused_fd` is closed in the child, unless it's negative.
+//
+// Returns the pid of the child, or -1 on error.
+static pid_t spawn(char *args[], int out_fd, int unused_fd) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
     }
-    if (pid == 0) {
-        // Child process (ffmpeg), doesn't read the pipe.
-        close(wav_pipe[PIPE_RD]);
 
-        // Redirecting stdout to the pipe
-        dup2(wav_pipe[PIPE_WR], 1);
-        close(wav_pipe[PIPE_WR]);
+    // Child process (ffmpeg), doesn't read the pipe.
+    if (unused_fd >= 0) close(unused_fd);
+
+    // Redirecting stdout to the pipe or the memfd
+    dup2(out_fd, 1);
+    close(out_fd);
 
 #ifndef DEBUG
-        // Ignoring stderr when debug mode is disabled
-        freopen("/dev/null", "w", stderr);
+    // Ignoring stderr when debug mode is disabled
+    freopen("/dev/null", "w", stderr);
 #endif
 
-        // ffmpeg must be available on the path for exevp to work.
-        log("running ffmpeg command");
-        execvp("ffmpeg", args);
+    // ffmpeg must be available on the path for exevp to work.
+    log("running ffmpeg command");
+    execvp("ffmpeg", args);
 
-        // If this part of the code is executed, it means that execvp failed.
-        audiosync_abort();
-        log("ffmpeg command failed");
-        return -1;
+    // If this part of the code is executed, it means that execvp failed.
+    // The child process can't return to the caller's code.
+    log("ffmpeg command failed");
+    _exit(1);
+}
+
+// Checks if the main process has indicated that the read should end. The
+// status is read atomically without locking, since it's only needed to take
+// the mutex when pausing, which suspends the ffmpeg process with a SIGSTOP
+// until the global status is changed from PAUSED_ST. If `data->detached` is
+// set, only `data->stop` is checked.
+//
+// Returns 1 if the read has to end, in which case ffmpeg was already killed,
+// or 0 otherwise.
+static int check_status(struct ffmpeg_data *data, pid_t pid) {
+    if (data->detached) {
+        if (data->stop && __atomic_load_n(data->stop, __ATOMIC_ACQUIRE)) {
+            log("detached read stopped, quitting...");
+            goto stop;
+        }
+        return 0;
     }
 
-    // Parent process (reading the output pipe), doesn't write.
-    close(wav_pipe[PIPE_WR]);
-    data->len = 0;
+    switch (__atomic_load_n(&global_status, __ATOMIC_ACQUIRE)) {
+    case ABORT_ST:
+        log("read ABORT_ST, quitting...");
+        goto stop;
+    case PAUSED_ST:
+        log("stopping ffmpeg");
+        kill(pid, SIGSTOP);
+
+        pthread_mutex_lock(&mutex);
+        while (global_status == PAUSED_ST) {
+            pthread_cond_wait(&read_continue, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        // After being woken up, checking if the ffmpeg process should
+        // continue or stop.
+        if (global_status == ABORT_ST) {
+            log("read ABORT_ST after pause, quitting...");
+            goto stop;
+        }
+
+        log("resuming ffmpeg");
+        kill(pid, SIGCONT);
+        break;
+    default:
+        // RUNNING_ST and IDLE_ST are ignored.
+        break;
+    }
+
+    return 0;
+
+stop:
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return 1;
+}
+
+// The stream read, for the metrics. Only the references have a title.
+static metrics_stream_t stream_of(const struct ffmpeg_data *data) {
+    return data->title[0] == '\0' ? STREAM_RECORDING : STREAM_REFERENCE;
+}
+
+// Counts the frames published by ffmpeg, which was started at `spawned`.
+static void count_frames(const struct ffmpeg_data *data, size_t n,
+                         size_t written, uint64_t spawned) {
+    if (written == 0) {
+        trace_mark("ffmpeg first frames");
+        metrics_observe(STAGE_FIRST_FRAMES, spawned);
+    }
+    metrics_add(bytes[stream_of(data)], n * sizeof(double));
+}
+
+// Reads ffmpeg's output from the pipe directly into the ring, in chunks of
+// at most `BUFSIZE` frames. If it's full, this waits for the consumer to
+// release some of its frames.
+//
+// Returns -1 in case of error, 1 if the read was ended by check_status, or
+// 0 once ffmpeg finishes or enough frames were read. In the latter case,
+// `stopped` is set if ffmpeg had to be killed, since its exit status
+// doesn't matter anymore.
+static int read_pipe(struct ffmpeg_data *data, int fd, pid_t pid,
+                     uint64_t spawned, size_t *written, int *stopped) {
+    struct ring *ring = data->ring;
+    ssize_t read_bytes;
+    // Bytes of an incomplete frame read after the ring's head, since the
+    // pipe doesn't guarantee that the reads are aligned to the frame size.
+    size_t partial = 0;
+    size_t avail;
+    double *dst;
+
     while (1) {
-        // Reading the data from ffmpeg in chunks of size `BUFSIZE`.
-        read_bytes = read(wav_pipe[PIPE_RD], data->buf + data->len,
-                          BUFSIZE * sizeof(*(data->buf)));
-
-        // Error when trying to read
-        if (read_bytes < 0) {
-            audiosync_abort();
-            perror("audiosync: read for wav_pipe failed");
-            close(wav_pipe[PIPE_RD]);
-            return -1;
+        dst = ring_write_ptr(ring, &avail);
+        if (data->total_len > 0) {
+            avail = MIN(avail, data->total_len - *written);
         }
+        if (avail == 0) {
+            ring_wait_space(ring, SPACE_TIMEOUT_MS);
+        } else {
+            read_bytes = read(fd, (char *) dst + partial,
+                              MIN(avail, BUFSIZE) * sizeof(*dst) - partial);
+            metrics_add(reads[stream_of(data)], 1);
 
-        data->len += read_bytes / sizeof(*(data->buf));
+            // Error when trying to read
+            if (read_bytes < 0) {
+                perror("audiosync: read for wav_pipe failed");
+                return -1;
+            }
 
-        // End of file or the buffer won't be big enough for the next read.
-        if (read_bytes == 0 || data->len + BUFSIZE >= data->total_len) {
-            log("finished ffmpeg loop");
-            break;
+            // Only the complete frames are published. The rest of the bytes
+            // stay after the head until the next read completes them.
+            partial += read_bytes;
+            if (partial >= sizeof(*dst)) {
+                count_frames(data, partial / sizeof(*dst), *written, spawned);
+                if (data->activity) {
+                    activity_update(data->activity, dst,
+                                    partial / sizeof(*dst));
+                }
+                ring_commit(ring, partial / sizeof(*dst));
+                *written += partial / sizeof(*dst);
+                partial %= sizeof(*dst);
+            }
+
+            // End of file or the requested length has been read. In the
+            // latter case ffmpeg isn't needed anymore, and it would fail
+            // when writing into the closed pipe.
+            if (read_bytes == 0
+                    || (data->total_len > 0 && *written >= data->total_len)) {
+                log("finished ffmpeg loop");
+                if (read_bytes != 0) {
+                    kill(pid, SIGKILL);
+                    *stopped = 1;
+                }
+                return 0;
+            }
         }
 
-        // Signaling the main thread when a full interval is read.
-        if (data->len >= data->intervals[interval_count]) {
-            pthread_mutex_lock(&mutex);
-            pthread_cond_signal(&interval_done);
-            pthread_mutex_unlock(&mutex);
-            interval_count++;
+        if (check_status(data, pid)) {
+            return 1;
         }
+    }
+}
 
-        // Checking if the main process has indicated that this thread
-        // should end (accessing it atomically).
-        switch (audiosync_status()) {
-        case ABORT_ST:
-            log("read ABORT_ST, quitting...");
-            kill(pid, SIGKILL);
-            wait(NULL);
-            close(wav_pipe[PIPE_RD]);
-            return 0;
-        case PAUSED_ST:
-            // Suspending the ffmpeg process with a SIGSTOP until the
-            // global status is changed from PAUSED_ST.
-            log("stopping ffmpeg");
-            kill(pid, SIGSTOP);
-
-            pthread_mutex_lock(&mutex);
-            while (global_status == PAUSED_ST) {
-                pthread_cond_wait(&read_continue, &mutex);
+// Publishes the frames that ffmpeg writes into the ring through the memfd
+// backing it, which is its standard output. The file offset is shared with
+// the child, so it's ffmpeg's progress, and the frames before it are
+// already in the ring's buffer: nothing is read nor copied. Between checks,
+// this waits for ffmpeg to exit with its pidfd, which simply sleeps if the
+// kernel doesn't support them.
+//
+// `base` is the offset in the memfd of the ring's head, which must have
+// room for `data->total_len` contiguous frames.
+//
+// Returns the same values as read_pipe.
+static int read_shared(struct ffmpeg_data *data, int fd, size_t base,
+                       pid_t pid, uint64_t spawned, size_t *written,
+                       int *stopped) {
+    struct ring *ring = data->ring;
+    struct pollfd pidfd = { .fd = -1, .events = POLLIN };
+#ifdef SYS_pidfd_open
+    pidfd.fd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    int exited = 0;
+    int ret = 0;
+    size_t avail;
+
+    while (1) {
+        const off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset < 0) {
+            perror("audiosync: lseek for the memfd failed");
+            ret = -1;
+            break;
+        }
+
+        // Only the complete frames are published.
+        size_t frames = ((size_t) offset - base) / sizeof(double);
+        frames = MIN(frames, data->total_len);
+        if (frames > *written) {
+            double *dst = ring_write_ptr(ring, &avail);
+            const size_t n = frames - *written;
+            count_frames(data, n, *written, spawned);
+            debug_assert(avail >= n);
+            if (data->activity) {
+                activity_update(data->activity, dst, n);
             }
-            pthread_mutex_unlock(&mutex);
+            ring_commit(ring, n);
+            *written = frames;
+        }
 
-            // After being woken up, checking if the ffmpeg process
-            // should continue or stop.
-            if (global_status == ABORT_ST) {
-                log("read ABORT_ST after pause, quitting...");
+        // The last frames are published after ffmpeg exits. If it's still
+        // running, the rest of its output isn't needed. If it wrote more
+        // than that, it may have failed when reaching the end of the memfd,
+        // which doesn't matter either, so it's considered stopped as well.
+        if (exited || *written >= data->total_len) {
+            log("finished ffmpeg loop");
+            if (!exited) {
                 kill(pid, SIGKILL);
-                wait(NULL);
-                close(wav_pipe[PIPE_RD]);
-                return 0;
             }
-
-            log("resuming ffmpeg");
-            kill(pid, SIGCONT);
+            *stopped = *written >= data->total_len;
             break;
-        default:
-            // RUNNING_ST and IDLE_ST are ignored.
+        }
+
+        if (check_status(data, pid)) {
+            ret = 1;
             break;
         }
+        if (poll(&pidfd, 1, SHM_POLL_MS) > 0) {
+            exited = 1;
+        }
+    }
+    if (pidfd.fd >= 0) close(pidfd.fd);
+
+    return ret;
+}
+
+// Executes the ffmpeg command in the arguments and pipes its data into the
+// provided ring.
+//
+// The ring will wake up the main thread when its watermark is reached. The
+// current global status is also checked without locks after every read, and
+// it's updated in case of errors. If `data->detached` is set, the global
+// status is ignored, since the read isn't part of a run, and `data->stop` is
+// checked instead.
+//
+// If the ring's buffer was obtained with arena_alloc_shared and the frames
+// fit in it without wrapping around, ffmpeg writes them into its memfd
+// instead of a pipe, which saves a copy and the read syscalls. Only one
+// ffmpeg process can use a shared buffer at a time.
+//
+// Returns -1 in case of error, or zero otherwise.
+int ffmpeg_pipe(struct ffmpeg_data *data, char *args[]) {
+    debug_assert(args); debug_assert(data); debug_assert(data->title);
+    debug_assert(data->ring);
+    debug_assert(data->total_len == 0 || data->total_len <= data->ring->cap);
+
+    struct ring *ring = data->ring;
+    int wav_pipe[2] = { -1, -1 };
+    // The memfd of the ring's buffer, and the offset of its head in it.
+    int shm_fd = -1;
+    size_t base = 0;
+    size_t written = 0;
+    // Whether ffmpeg was stopped before it finished on its own, or it
+    // finished after every frame needed was obtained. Its exit status is
+    // ignored in that case.
+    int stopped = 0;
+    int ret;
+    size_t avail;
+    double *dst;
+    pid_t pid;
+
+    trace_begin(spawn_span, "ffmpeg spawn");
+    const uint64_t spawned = metrics_now();
+    if (data->total_len > 0) {
+        dst = ring_write_ptr(ring, &avail);
+        if (avail >= data->total_len) {
+            shm_fd = arena_shared_fd(dst, &base);
+        }
+    }
+
+    if (shm_fd >= 0) {
+        log("using the memfd transport");
+        if (lseek(shm_fd, base, SEEK_SET) < 0) {
+            if (!data->detached) audiosync_abort();
+            ring_close(ring);
+            perror("audiosync: lseek for the memfd failed");
+            return -1;
+        }
+        pid = spawn(args, shm_fd, -1);
+    } else {
+        if (pipe(wav_pipe) < 0) {
+            if (!data->detached) audiosync_abort();
+            ring_close(ring);
+            perror("audiosync: pipe for wav_pipe failed");
+            return -1;
+        }
+        pid = spawn(args, wav_pipe[PIPE_WR], wav_pipe[PIPE_RD]);
+        // Parent process (reading the output pipe), doesn't write.
+        close(wav_pipe[PIPE_WR]);
+    }
+    trace_end(spawn_span);
+    if (pid < 0) {
+        if (!data->detached) audiosync_abort();
+        ring_close(ring);
+        perror("audiosync: fork in read_pipe failed");
+        if (wav_pipe[PIPE_RD] >= 0) close(wav_pipe[PIPE_RD]);
+        return -1;
+    }
+
+    trace_begin(read_span, "ffmpeg read");
+    if (shm_fd >= 0) {
+        ret = read_shared(data, shm_fd, base, pid, spawned, &written,
+                          &stopped);
+    } else {
+        ret = read_pipe(data, wav_pipe[PIPE_RD], pid, spawned, &written,
+                        &stopped);
+    }
+    trace_end(read_span);
+    if (ret != 0) {
+        // Either an error, in which case the run is aborted, or the status
+        // indicated that it should end.
+        if (ret < 0) {
+            if (!data->detached) audiosync_abort();
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        if (wav_pipe[PIPE_RD] >= 0) close(wav_pipe[PIPE_RD]);
+        ring_close(ring);
+        return ret < 0 ? -1 : 0;
     }
 
     // If the track isn't long enough for every interval, the rest of the
-    // data is filled with zeroes.
-    if (data->len < data->total_len) {
-        for (size_t i = data->len; i < data->total_len; i++) {
-            data->buf[i] = 0.0;
-        }
-        data->len = data->total_len;
-        // Also sending a signal to the main thread indicating it that all the
-        // intervals have been read successfully.
-        pthread_mutex_lock(&mutex);
-        pthread_cond_signal(&interval_done);
-        pthread_mutex_unlock(&mutex);
+    // data is filled with zeroes. Committing them also wakes up the main
+    // thread if it was waiting for any of the intervals.
+    while (data->total_len > 0 && written < data->total_len) {
+        dst = ring_write_ptr(ring, &avail);
+        avail = MIN(avail, data->total_len - written);
+        if (avail == 0) {
+            ring_wait_space(ring, SPACE_TIMEOUT_MS);
+            if (!data->detached && __atomic_load_n(
+                    &global_status, __ATOMIC_ACQUIRE) == ABORT_ST) {
+                break;
+            }
+            continue;
+        }
+        memset(dst, 0, avail * sizeof(*dst));
+        ring_commit(ring, avail);
+        written += avail;
     }
+    ring_close(ring);
 
-    close(wav_pipe[PIPE_RD]);
-    wait(NULL);
+    if (wav_pipe[PIPE_RD] >= 0) close(wav_pipe[PIPE_RD]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!stopped && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        log("ffmpeg exited with an error");
+        return -1;
+    }
 
     return 0;
 }
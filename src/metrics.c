@@ -0,0 +1,219 @@
+// Runtime metrics. See metrics.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/metrics.h>
+
+// Every field of the metrics is a counter, so they're accessed as an array.
+#define N_COUNTERS (sizeof(struct audiosync_metrics) / sizeof(uint64_t))
+
+
+struct audiosync_metrics global_metrics = { 0 };
+
+
+// Returns the current time in nanoseconds, to measure a stage.
+uint64_t metrics_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Saves the latency of a stage that started at `start`, from metrics_now.
+void metrics_observe(metrics_stage_t stage, uint64_t start) {
+    debug_assert(stage < N_STAGES);
+
+    const uint64_t ns = metrics_now() - start;
+    uint64_t bound = METRICS_FIRST_BOUND * 1e9;
+    size_t bucket = 0;
+    while (ns > bound && bucket < METRICS_BUCKETS - 1) {
+        bound *= 2;
+        bucket++;
+    }
+    metrics_add(latency[stage].buckets[bucket], 1);
+    metrics_add(latency[stage].sum_ns, ns);
+    metrics_add(latency[stage].count, 1);
+}
+
+// Counts a transform of `len` real frames. Its entry is claimed with a
+// compare-and-swap the first time.
+void metrics_fft(size_t len) {
+    for (size_t i = 0; i < METRICS_FFT_SIZES - 1; i++) {
+        uint64_t cur = __atomic_load_n(&global_metrics.ffts[i].len,
+                                       __ATOMIC_RELAXED);
+        if (cur == 0) {
+            __atomic_compare_exchange_n(&global_metrics.ffts[i].len, &cur,
+                                        len, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED);
+            if (cur == 0) cur = len;
+        }
+        if (cur == len) {
+            metrics_add(ffts[i].count, 1);
+            return;
+        }
+    }
+    metrics_add(ffts[METRICS_FFT_SIZES - 1].count, 1);
+}
+
+// Returns the upper bound of a bucket in seconds, which is infinite for the
+// last one.
+double metrics_bucket_bound(size_t bucket) {
+    if (bucket >= METRICS_BUCKETS - 1) {
+        return INFINITY;
+    }
+    return ldexp(METRICS_FIRST_BOUND, bucket);
+}
+
+char *stream_to_string(metrics_stream_t stream) {
+    switch (stream) {
+    case STREAM_RECORDING:
+        return "recording";
+    case STREAM_REFERENCE:
+        return "reference";
+    default:
+        return "unknown";
+    }
+}
+
+char *stage_to_string(metrics_stage_t stage) {
+    switch (stage) {
+    case STAGE_RUN:
+        return "run";
+    case STAGE_URL:
+        return "url";
+    case STAGE_FIRST_FRAMES:
+        return "first_frames";
+    case STAGE_WAIT:
+        return "wait";
+    case STAGE_CORRELATION:
+        return "correlation";
+    case STAGE_FFT:
+        return "fft";
+    default:
+        return "unknown";
+    }
+}
+
+// Copies the current metrics into `metrics`. Each counter is read
+// atomically, but not all of them at once, so a histogram's count may be
+// slightly ahead of its buckets, for example.
+void audiosync_get_metrics(struct audiosync_metrics *metrics) {
+    const uint64_t *src = (const uint64_t *) &global_metrics;
+    uint64_t *dst = (uint64_t *) metrics;
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Sets all the metrics to zero.
+void audiosync_reset_metrics() {
+    uint64_t *dst = (uint64_t *) &global_metrics;
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void write_counter(FILE *fp, const char *name, const char *help,
+                          uint64_t value) {
+    fprintf(fp, "# HELP audiosync_%s %s\n# TYPE audiosync_%s counter\n"
+            "audiosync_%s %lu\n", name, help, name, name,
+            (unsigned long) value);
+}
+
+// Writes the metrics of both streams with a label.
+static void write_streams(FILE *fp, const char *name, const char *help,
+                          const uint64_t *values) {
+    fprintf(fp, "# HELP audiosync_%s %s\n# TYPE audiosync_%s counter\n",
+            name, help, name);
+    for (int i = 0; i < N_STREAMS; i++) {
+        fprintf(fp, "audiosync_%s{stream=\"%s\"} %lu\n", name,
+                stream_to_string(i), (unsigned long) values[i]);
+    }
+}
+
+// Writes the current metrics into `path` in the Prometheus text format. The
+// file is replaced atomically, so it's never read half-written.
+//
+// Returns 0 on success, or -1 on error.
+int audiosync_write_metrics(const char *path) {
+    struct audiosync_metrics m;
+    audiosync_get_metrics(&m);
+
+    char tmp[MAX_LONG_PATH + 8];
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        log("metrics path too long");
+        return -1;
+    }
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("audiosync: fopen for the metrics failed");
+        return -1;
+    }
+
+    write_counter(fp, "runs_total", "Runs started.", m.runs);
+    write_counter(fp, "successes_total", "Runs that obtained a lag.",
+                  m.successes);
+    write_counter(fp, "aborts_total", "Runs aborted before finishing.",
+                  m.aborts);
+    write_counter(fp, "pauses_total", "Times the runs were paused.",
+                  m.pauses);
+    write_counter(fp, "intervals_total", "Intervals correlated.",
+                  m.intervals);
+    write_streams(fp, "stream_bytes_total", "Bytes read from ffmpeg.",
+                  m.bytes);
+    write_streams(fp, "stream_reads_total", "Reads from the ffmpeg pipes.",
+                  m.reads);
+    write_counter(fp, "alloc_bytes_total", "Bytes mapped by the arena.",
+                  m.alloc_bytes);
+
+    fprintf(fp, "# HELP audiosync_ffts_total Transforms executed, by their"
+            " length (0 for the rest).\n# TYPE audiosync_ffts_total"
+            " counter\n");
+    for (size_t i = 0; i < METRICS_FFT_SIZES; i++) {
+        if (m.ffts[i].count > 0) {
+            fprintf(fp, "audiosync_ffts_total{len=\"%lu\"} %lu\n",
+                    (unsigned long) m.ffts[i].len,
+                    (unsigned long) m.ffts[i].count);
+        }
+    }
+
+    fprintf(fp, "# HELP audiosync_stage_seconds Latency of each stage.\n"
+            "# TYPE audiosync_stage_seconds histogram\n");
+    for (int s = 0; s < N_STAGES; s++) {
+        const struct metrics_histogram *h = &m.latency[s];
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += h->buckets[b];
+            if (b == METRICS_BUCKETS - 1) {
+                fprintf(fp, "audiosync_stage_seconds_bucket{stage=\"%s\","
+                        "le=\"+Inf\"} %lu\n", stage_to_string(s),
+                        (unsigned long) cumulative);
+            } else {
+                fprintf(fp, "audiosync_stage_seconds_bucket{stage=\"%s\","
+                        "le=\"%g\"} %lu\n", stage_to_string(s),
+                        metrics_bucket_bound(b), (unsigned long) cumulative);
+            }
+        }
+        fprintf(fp, "audiosync_stage_seconds_sum{stage=\"%s\"} %.9f\n"
+                "audiosync_stage_seconds_count{stage=\"%s\"} %lu\n",
+                stage_to_string(s), h->sum_ns / 1e9, stage_to_string(s),
+                (unsigned long) h->count);
+    }
+
+    if (fclose(fp) != 0) {
+        perror("audiosync: fclose for the metrics failed");
+        remove(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) < 0) {
+        perror("audiosync: rename for the metrics failed");
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+}
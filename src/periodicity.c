@@ -0,0 +1,218 @@
+// Detection of repetitive references. See periodicity.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/periodicity.h>
+
+// Approximate rate of the decimated reference, in Hz. The repetitions of a
+// loop are also there after removing the high frequencies.
+#define PERIODICITY_RATE 2000
+// Longest period considered, in seconds.
+#define PERIODICITY_MAX_SECONDS 10.0
+// Minimum normalized autocorrelation of a candidate period. It's low because
+// the repeated part may be a small portion of the reference.
+#define PERIODICITY_MIN_PEAK 0.1
+// Length of the blocks compared with their repetition, in seconds, and the
+// minimum coefficient for a block to be repeated.
+#define PERIODICITY_BLOCK_SECONDS 0.5
+#define PERIODICITY_BLOCK_MATCH 0.9
+// Number of references whose results are kept in memory.
+#define PERIODICITY_CACHE_SIZE 16
+
+
+static struct {
+    uint64_t id;
+    unsigned int sample_rate;
+    struct periodicity per;
+} cache[PERIODICITY_CACHE_SIZE];
+static size_t cache_next = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Inserts a candidate period in the list, which is sorted by the strength
+// of the peaks. The weakest one is dropped if it's full.
+static void add_candidate(size_t *periods, double *strengths, size_t *n,
+                          size_t period, double strength) {
+    size_t pos = *n;
+    while (pos > 0 && strengths[pos-1] < strength) pos--;
+    if (pos == PERIODICITY_MAX_PEAKS) return;
+
+    const size_t last = *n < PERIODICITY_MAX_PEAKS ? *n : *n - 1;
+    memmove(periods + pos + 1, periods + pos,
+            (last - pos) * sizeof(*periods));
+    memmove(strengths + pos + 1, strengths + pos,
+            (last - pos) * sizeof(*strengths));
+    periods[pos] = period;
+    strengths[pos] = strength;
+    if (*n < PERIODICITY_MAX_PEAKS) (*n)++;
+}
+
+// The longest run of consecutive blocks of `block` frames that are repeated
+// `period` frames later.
+static size_t repeated_blocks(double *data, size_t len, size_t block,
+                              size_t period) {
+    size_t run = 0;
+    size_t longest = 0;
+    for (size_t start = 0; start + block + period <= len; start += block) {
+        const double coef = pearson_coefficient(
+            data + start, data + start + block,
+            data + start + period, data + start + period + block);
+        // Silent blocks are NaN, which isn't repeated either.
+        run = coef >= PERIODICITY_BLOCK_MATCH ? run + 1 : 0;
+        if (run > longest) longest = run;
+    }
+
+    return longest;
+}
+
+// Analyzes the first `len` frames of the reference.
+//
+// Returns 0 on success, or -1 on error.
+int periodicity_analyze(const double *ref, size_t len,
+                        struct periodicity *per) {
+    debug_assert(ref); debug_assert(per);
+
+    const struct derived_config *config = get_config();
+    const size_t factor = config->user.sample_rate / PERIODICITY_RATE;
+    const size_t n = len / factor;
+    const size_t block = PERIODICITY_BLOCK_SECONDS * PERIODICITY_RATE;
+    int ret = -1;
+    double *data = NULL;
+    double *ac = NULL;
+
+    memset(per, 0, sizeof(*per));
+    per->analyzed = len;
+    if (n < 2 * block) {
+        return 0;
+    }
+
+    data = arena_alloc(n * sizeof(*data));
+    ac = arena_alloc(n * sizeof(*ac));
+    if (data == NULL || ac == NULL) {
+        log("periodicity arena_alloc failed");
+        goto finish;
+    }
+
+    // Decimating the reference with the average of each block of frames,
+    // without its DC offset.
+    double mean = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double sum = 0.0;
+        for (size_t j = 0; j < factor; j++) {
+            sum += ref[i * factor + j];
+        }
+        data[i] = sum / factor;
+        mean += data[i];
+    }
+    mean /= n;
+    for (size_t i = 0; i < n; i++) {
+        data[i] -= mean;
+    }
+    if (autocorrelation(data, n, ac) < 0) {
+        goto finish;
+    }
+    if (!(ac[0] > 0.0)) {
+        ret = 0;
+        goto finish;
+    }
+
+    // The candidates are the strongest local maxima after the main lobe,
+    // normalized by the overlap at each lag.
+    size_t max_period = PERIODICITY_MAX_SECONDS * PERIODICITY_RATE;
+    if (max_period > n / 2) max_period = n / 2;
+    size_t lag = 1;
+    while (lag < max_period && ac[lag] > 0.0) lag++;
+
+    size_t candidates[PERIODICITY_MAX_PEAKS];
+    double strengths[PERIODICITY_MAX_PEAKS];
+    size_t n_candidates = 0;
+    for (lag++; lag + 1 < max_period; lag++) {
+        if (!(ac[lag] > ac[lag-1] && ac[lag] >= ac[lag+1])) continue;
+
+        const double strength = ac[lag] / ac[0] * n / (n - lag);
+        if (strength >= PERIODICITY_MIN_PEAK) {
+            add_candidate(candidates, strengths, &n_candidates, lag,
+                          strength);
+        }
+    }
+
+    // Only the candidates that actually repeat are kept.
+    for (size_t i = 0; i < n_candidates; i++) {
+        const size_t run = repeated_blocks(data, n, block, candidates[i]);
+        if (run == 0) continue;
+
+        // The repeated stretch is up to a block longer, since they're
+        // compared as a whole.
+        const size_t repeated = (run + 1) * block * factor;
+        per->periods[per->n_periods++] = candidates[i] * factor;
+        if (repeated > per->repeated) per->repeated = repeated;
+        log("reference repeats every %zu frames for %zu frames (peak of"
+            " %f)", candidates[i] * factor, repeated, strengths[i]);
+    }
+    ret = 0;
+
+finish:
+    arena_free(data);
+    arena_free(ac);
+
+    return ret;
+}
+
+// Same as periodicity_analyze, but the results are kept in memory for each
+// reference id and sample rate, and reused if they analyzed at least the
+// same frames.
+int periodicity_get(uint64_t id, const double *ref, size_t len,
+                    struct periodicity *per) {
+    debug_assert(per);
+
+    const unsigned int rate = get_config()->user.sample_rate;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (size_t i = 0; i < PERIODICITY_CACHE_SIZE; i++) {
+        if (cache[i].id == id && cache[i].sample_rate == rate
+                && cache[i].per.analyzed >= len) {
+            *per = cache[i].per;
+            pthread_mutex_unlock(&cache_mutex);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (periodicity_analyze(ref, len, per) < 0) {
+        return -1;
+    }
+
+    // The previous results of the reference are replaced, or otherwise the
+    // oldest ones.
+    pthread_mutex_lock(&cache_mutex);
+    size_t slot = PERIODICITY_CACHE_SIZE;
+    for (size_t i = 0; i < PERIODICITY_CACHE_SIZE; i++) {
+        if (cache[i].id == id && cache[i].sample_rate == rate) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == PERIODICITY_CACHE_SIZE) {
+        slot = cache_next;
+        cache_next = (cache_next + 1) % PERIODICITY_CACHE_SIZE;
+    }
+    cache[slot].id = id;
+    cache[slot].sample_rate = rate;
+    cache[slot].per = *per;
+    pthread_mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+// Returns whether an interval of `len` frames would be ambiguous.
+int periodicity_ambiguous(const struct periodicity *per, size_t len) {
+    debug_assert(per);
+
+    return per->n_periods > 0 && len <= per->repeated;
+}
@@ -0,0 +1,163 @@
+// Work-stealing pool. See pool.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/pool.h>
+
+// A range of tasks [begin, end) packed in a 64-bit word.
+#define RANGE(begin, end) (((uint64_t) (begin) << 32) | (uint32_t) (end))
+#define RANGE_BEGIN(range) ((uint32_t) ((range) >> 32))
+#define RANGE_END(range) ((uint32_t) (range))
+
+
+// Each range is in its own cache line, since it's modified very often by
+// its owner.
+struct worker {
+    uint64_t range;
+    char padding[64 - sizeof(uint64_t)];
+};
+
+struct pool {
+    struct worker *workers;
+    unsigned int n_workers;
+    pool_task_fn fn;
+    void *ctx;
+};
+
+struct worker_arg {
+    struct pool *pool;
+    unsigned int index;
+};
+
+
+// Takes the first task of the worker's own range.
+//
+// Returns 0 and the task on success, or -1 if the range is empty.
+static int take(struct worker *w, size_t *task) {
+    uint64_t range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+    while (RANGE_BEGIN(range) < RANGE_END(range)) {
+        const uint64_t next = RANGE(RANGE_BEGIN(range) + 1, RANGE_END(range));
+        if (__atomic_compare_exchange_n(&w->range, &range, next, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *task = RANGE_BEGIN(range);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// Steals the second half of the biggest range of the other workers, which
+// becomes the new range of `self`. It must be empty.
+//
+// Returns 0 on success, or -1 if there's nothing left to steal.
+static int steal(struct pool *pool, struct worker *self) {
+    while (1) {
+        struct worker *victim = NULL;
+        uint64_t range = 0;
+        uint32_t most = 0;
+        for (unsigned int i = 0; i < pool->n_workers; i++) {
+            const uint64_t r = __atomic_load_n(&pool->workers[i].range,
+                                               __ATOMIC_ACQUIRE);
+            if (RANGE_END(r) - RANGE_BEGIN(r) > most
+                    && RANGE_BEGIN(r) < RANGE_END(r)) {
+                victim = &pool->workers[i];
+                range = r;
+                most = RANGE_END(r) - RANGE_BEGIN(r);
+            }
+        }
+        if (victim == NULL) {
+            return -1;
+        }
+
+        // With a single task left, the thief takes it, since the owner may
+        // not be able to run it soon.
+        const uint32_t mid = RANGE_END(range) - (most + 1) / 2;
+        const uint64_t kept = RANGE(RANGE_BEGIN(range), mid);
+        if (__atomic_compare_exchange_n(&victim->range, &range, kept, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&self->range, RANGE(mid, RANGE_END(range)),
+                             __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+}
+
+static void *worker_loop(void *arg) {
+    struct worker_arg *wa = arg;
+    struct pool *pool = wa->pool;
+    struct worker *self = &pool->workers[wa->index];
+    size_t task;
+
+    while (1) {
+        while (take(self, &task) == 0) {
+            pool->fn(pool->ctx, wa->index, task);
+        }
+        if (steal(pool, self) < 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Runs `n_tasks` tasks on `n_workers` threads, returning once all of them
+// are finished. The number of tasks must fit in 32 bits.
+//
+// Returns 0 on success, or -1 if the threads couldn't be created.
+int pool_run(size_t n_tasks, unsigned int n_workers, pool_task_fn fn,
+             void *ctx) {
+    debug_assert(n_workers > 0); debug_assert(fn);
+    debug_assert(n_tasks <= UINT32_MAX);
+
+    int ret = -1;
+    struct pool pool = {
+        .n_workers = n_workers,
+        .fn = fn,
+        .ctx = ctx,
+    };
+    pthread_t *threads = calloc(n_workers, sizeof(*threads));
+    struct worker_arg *args = calloc(n_workers, sizeof(*args));
+    if (posix_memalign((void **) &pool.workers, sizeof(struct worker),
+                       n_workers * sizeof(struct worker)) != 0) {
+        pool.workers = NULL;
+    }
+    if (threads == NULL || args == NULL || pool.workers == NULL) {
+        perror("audiosync: pool malloc failed");
+        goto finish;
+    }
+
+    // The tasks are split in equal ranges.
+    for (unsigned int i = 0; i < n_workers; i++) {
+        pool.workers[i].range = RANGE(n_tasks * i / n_workers,
+                                      n_tasks * (i + 1) / n_workers);
+    }
+
+    // If a thread can't be created, its range will be stolen by the rest,
+    // as long as there's at least one of them.
+    unsigned int started = 0;
+    for (unsigned int i = 0; i < n_workers; i++) {
+        args[i].pool = &pool;
+        args[i].index = i;
+        if (pthread_create(&threads[i], NULL, &worker_loop, &args[i]) != 0) {
+            perror("audiosync: pthread_create for pool worker failed");
+            threads[i] = 0;
+            continue;
+        }
+        started++;
+    }
+    for (unsigned int i = 0; i < n_workers; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+    }
+    ret = started > 0 ? 0 : -1;
+
+finish:
+    free(threads);
+    free(args);
+    free(pool.workers);
+
+    return ret;
+}
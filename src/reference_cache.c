@@ -0,0 +1,699 @@
+// Cache of the downloaded references, saved in disk and mapped into memory
+// when used. See reference_cache.h for more details.
+
+#define _GNU_SOURCE  // MAP_POPULATE, mkostemp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/reference_cache.h>
+#include <audiosync/download/linux_download.h>
+
+// The header takes an entire page so that the frames after it are aligned,
+// which FFTW needs to use the precomputed plans with them.
+#define HEADER_SIZE 4096
+#define HEADER_MAGIC 0x3146455243534155ULL  // "AUSCREF1" in little endian
+#define MAX_TITLE 2048
+#define SPECTRA_MAGIC 0x3143505343535541ULL  // "AUSCSPC1" in little endian
+// Maximum number of references kept mapped.
+#define MAX_ENTRIES 8
+
+
+// The header at the beginning of each file. The title is saved to detect
+// collisions in the hash used for the file name.
+struct ref_header {
+    uint64_t magic;
+    uint32_t sample_rate;
+    uint32_t title_len;
+    uint64_t len;
+    char title[MAX_TITLE];
+};
+
+// The header of the spectra saved next to a reference, which takes an
+// entire page too. Each transform starts at a page boundary. The spectra are
+// only valid with the exact file of the reference they were calculated
+// from, which also makes sure that the title is the same.
+struct spec_header {
+    uint64_t magic;
+    uint32_t sample_rate;
+    uint32_t n_sizes;
+    uint64_t ref_size;   // Identity of the reference's file
+    uint64_t ref_ino;
+    int64_t ref_mtime;   // In nanoseconds
+    struct {
+        uint64_t sample_len;
+        uint64_t offset;
+    } sizes[MAX_INTERVALS];
+};
+
+// A mapped reference.
+struct entry {
+    void *map;           // Start of the mapping, which includes the header
+    size_t map_size;
+    const double *data;  // The frames after the header
+    size_t len;
+    uint64_t key;
+    unsigned int sample_rate;
+    unsigned int refs;   // Number of users, it can't be unmapped if non-zero
+    unsigned long used;  // When it was last used, for the eviction
+    // The identity of the reference's file, to validate its spectra.
+    uint64_t ref_size;
+    uint64_t ref_ino;
+    int64_t ref_mtime;
+    // The spectra, which are only mapped the first time they're needed.
+    void *spec_map;
+    size_t spec_size;
+    int spec_tried;      // Whether mapping them was attempted already
+};
+
+// The mapped references are protected by a mutex, which is only taken once
+// per run.
+static pthread_mutex_t refcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct entry entries[MAX_ENTRIES];
+static unsigned long use_counter = 0;
+
+
+// Returns the id of the reference of `title`, which is a 64-bit FNV-1a hash
+// of it. It's also used as the key by the result cache.
+uint64_t refcache_id(const char *title) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = title; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Writes the path of the file for a key into `path`, with the extension
+// `ext`, which is "ref" for the frames and "spec" for their spectra.
+//
+// Returns 0 on success, or -1 if the cache is disabled.
+static int ref_path(uint64_t key, unsigned int rate, const char *ext,
+                    char *path, size_t size) {
+    const struct derived_config *config = get_config();
+    if (!config->user.reference_cache || config->cache_dir[0] == '\0') {
+        return -1;
+    }
+
+    int n = snprintf(path, size, "%s/%016llx-%u.%s", config->cache_dir,
+                     (unsigned long long) key, rate, ext);
+    if (n < 0 || (size_t) n >= size) {
+        log("cache path is too long");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Creates a directory and its parents if they don't exist.
+//
+// Returns 0 on success, or -1 on error.
+static int make_dirs(const char *dir) {
+    char path[MAX_LONG_PATH];
+    snprintf(path, sizeof(path), "%s", dir);
+
+    for (char *c = path + 1; ; c++) {
+        if (*c != '/' && *c != '\0') continue;
+
+        const char end = *c;
+        *c = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+            perror("audiosync: mkdir for cache directory failed");
+            return -1;
+        }
+        if (end == '\0') break;
+        *c = end;
+    }
+
+    return 0;
+}
+
+// Creates the cache directory from the configuration if it doesn't exist.
+//
+// Returns 0 on success, or -1 on error or if there isn't a cache directory.
+int cache_make_dir() {
+    const struct derived_config *config = get_config();
+    if (config->cache_dir[0] == '\0') {
+        return -1;
+    }
+
+    return make_dirs(config->cache_dir);
+}
+
+// Checks that the mapped reference belongs to `title`, since different
+// titles may have the same key.
+static int same_title(const struct entry *e, const char *title) {
+    const struct ref_header *header = e->map;
+    const size_t title_len = strlen(title);
+
+    return header->title_len == title_len
+           && memcmp(header->title, title, title_len) == 0;
+}
+
+// Maps and validates the file of a reference.
+//
+// Returns 0 on success, or -1 if it doesn't exist or it's invalid.
+static int map_entry(const char *path, const char *title, unsigned int rate,
+                     struct entry *e) {
+    int ret = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        // Not existing is the regular cache miss.
+        if (errno != ENOENT) {
+            perror("audiosync: open for cached reference failed");
+        }
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < HEADER_SIZE) {
+        log("invalid cached reference '%s'", path);
+        goto finish;
+    }
+
+    // The mapping is private so that, even if the frames were written by
+    // mistake, the file wouldn't be modified. The pages will usually be in
+    // the page cache already.
+    e->map_size = st.st_size;
+    e->map = mmap(NULL, e->map_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                  fd, 0);
+    if (e->map == MAP_FAILED) {
+        perror("audiosync: mmap for cached reference failed");
+        goto finish;
+    }
+
+    const struct ref_header *header = e->map;
+    if (header->magic != HEADER_MAGIC || header->sample_rate != rate
+            || !same_title(e, title)
+            || HEADER_SIZE + header->len * sizeof(double) != e->map_size) {
+        log("ignoring invalid cached reference '%s'", path);
+        munmap(e->map, e->map_size);
+        goto finish;
+    }
+    e->data = (const double *) ((char *) e->map + HEADER_SIZE);
+    e->len = header->len;
+    e->sample_rate = rate;
+    e->ref_size = st.st_size;
+    e->ref_ino = st.st_ino;
+    e->ref_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    ret = 0;
+
+finish:
+    close(fd);
+    return ret;
+}
+
+// Unmaps a reference and its spectra, leaving the entry empty.
+static void unmap_entry(struct entry *e) {
+    if (e->map != NULL) {
+        munmap(e->map, e->map_size);
+    }
+    if (e->spec_map != NULL) {
+        munmap(e->spec_map, e->spec_size);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+// Looks for the reference of `title` with at least `len` frames at the
+// current sample rate. The returned data is read-only, and must be given
+// back with refcache_release once it's not needed anymore.
+//
+// Returns NULL if the reference isn't cached or it's invalid.
+const double *refcache_get(const char *title, size_t len) {
+    debug_assert(title);
+
+    const unsigned int rate = get_config()->user.sample_rate;
+    const uint64_t key = refcache_id(title);
+    char path[MAX_LONG_PATH];
+    if (strlen(title) >= MAX_TITLE
+            || ref_path(key, rate, "ref", path, sizeof(path)) < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&refcache_mutex);
+
+    // The references that are already mapped are used directly.
+    struct entry *e = NULL;
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].map != NULL && entries[i].key == key
+                && entries[i].sample_rate == rate
+                && same_title(&entries[i], title)) {
+            e = &entries[i];
+            break;
+        }
+    }
+
+    // A shorter reference may have been cached with a previous
+    // configuration, and replaced in disk since then.
+    if (e != NULL && e->len < len && e->refs == 0) {
+        unmap_entry(e);
+        e = NULL;
+    }
+
+    // Otherwise, the least recently used entry is replaced.
+    if (e == NULL) {
+        struct entry *victim = NULL;
+        for (size_t i = 0; i < MAX_ENTRIES; i++) {
+            if (entries[i].refs == 0 && (victim == NULL
+                    || entries[i].used < victim->used)) {
+                victim = &entries[i];
+            }
+        }
+        if (victim == NULL) {
+            pthread_mutex_unlock(&refcache_mutex);
+            return NULL;
+        }
+
+        struct entry new_entry = { .key = key };
+        if (map_entry(path, title, rate, &new_entry) < 0) {
+            pthread_mutex_unlock(&refcache_mutex);
+            return NULL;
+        }
+        unmap_entry(victim);
+        *victim = new_entry;
+        e = victim;
+    }
+
+    if (e->len < len) {
+        pthread_mutex_unlock(&refcache_mutex);
+        return NULL;
+    }
+    e->refs++;
+    e->used = ++use_counter;
+    const double *data = e->data;
+    pthread_mutex_unlock(&refcache_mutex);
+
+    log("using cached reference for '%s'", title);
+    return data;
+}
+
+// Gives back the data obtained with refcache_get. NULL is accepted and
+// ignored.
+void refcache_release(const double *data) {
+    if (data == NULL) return;
+
+    pthread_mutex_lock(&refcache_mutex);
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].map != NULL && entries[i].data == data) {
+            debug_assert(entries[i].refs > 0);
+            entries[i].refs--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&refcache_mutex);
+}
+
+// Writes `size` bytes of `buf` at `offset` of a file.
+//
+// Returns 0 on success, or -1 on error.
+static int write_all(int fd, const void *buf, size_t size, off_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = pwrite(fd, (const char *) buf + written, size - written,
+                           offset + written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("audiosync: write for the cache failed");
+            return -1;
+        }
+        written += n;
+    }
+
+    return 0;
+}
+
+// Saves `len` frames of the reference of `title` in the cache, replacing the
+// previous one if it existed.
+//
+// Returns 0 on success, or -1 on error.
+int refcache_store(const char *title, const double *data, size_t len) {
+    debug_assert(title); debug_assert(data); debug_assert(len > 0);
+
+    const struct derived_config *config = get_config();
+    const unsigned int rate = config->user.sample_rate;
+    const size_t title_len = strlen(title);
+    char path[MAX_LONG_PATH];
+    char tmp_path[MAX_LONG_PATH + 32];
+    if (title_len >= MAX_TITLE
+            || ref_path(refcache_id(title), rate, "ref", path,
+                        sizeof(path)) < 0) {
+        return -1;
+    }
+    if (cache_make_dir() < 0) {
+        return -1;
+    }
+
+    // The reference is written into a temporary file first, and then
+    // renamed, so that other processes never see an incomplete one. Its
+    // name is unique, since other threads may be storing the same title.
+    int ret = -1;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        perror("audiosync: mkostemp for new cached reference failed");
+        return -1;
+    }
+
+    union {
+        struct ref_header fields;
+        char bytes[HEADER_SIZE];
+    } header;
+    memset(&header, 0, sizeof(header));
+    header.fields.magic = HEADER_MAGIC;
+    header.fields.sample_rate = rate;
+    header.fields.title_len = title_len;
+    header.fields.len = len;
+    memcpy(header.fields.title, title, title_len);
+
+    if (write_all(fd, header.bytes, HEADER_SIZE, 0) < 0
+            || write_all(fd, data, len * sizeof(*data), HEADER_SIZE) < 0) {
+        goto finish;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("audiosync: rename for cached reference failed");
+        goto finish;
+    }
+    log("saved reference for '%s' in the cache", title);
+    ret = 0;
+
+    // The previous file may still be mapped, and its spectra wouldn't be
+    // valid with the new one, so it's unmapped unless it's in use.
+    pthread_mutex_lock(&refcache_mutex);
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].map != NULL && entries[i].key == refcache_id(title)
+                && entries[i].refs == 0) {
+            unmap_entry(&entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&refcache_mutex);
+
+finish:
+    close(fd);
+    if (ret < 0) unlink(tmp_path);
+    return ret;
+}
+
+// Rounds a size up to the pages of the spectra's files.
+static size_t page_align(size_t size) {
+    return (size + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE;
+}
+
+// Calculates the transforms of the reference of `title` for each interval
+// of the configuration that fits in its `len` frames, and saves them next to
+// it in the cache, replacing the previous ones. The reference must have
+// been stored already, since the spectra are only valid with its file.
+// `data` must be aligned like the arena's.
+//
+// Returns 0 on success, or -1 on error or if `cancel` returned non-zero
+// between two of the transforms.
+int refcache_store_spectra(const char *title, const double *data, size_t len,
+                           int (*cancel)(void *), void *cancel_ctx) {
+    debug_assert(title); debug_assert(data);
+
+    const struct derived_config *config = get_config();
+    const unsigned int rate = config->user.sample_rate;
+    const uint64_t key = refcache_id(title);
+    char ref_file[MAX_LONG_PATH];
+    char path[MAX_LONG_PATH];
+    char tmp_path[MAX_LONG_PATH + 32];
+    if (strlen(title) >= MAX_TITLE
+            || ref_path(key, rate, "ref", ref_file, sizeof(ref_file)) < 0
+            || ref_path(key, rate, "spec", path, sizeof(path)) < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (stat(ref_file, &st) < 0) {
+        perror("audiosync: stat for cached reference failed");
+        return -1;
+    }
+
+    union {
+        struct spec_header fields;
+        char bytes[HEADER_SIZE];
+    } header;
+    memset(&header, 0, sizeof(header));
+    header.fields.magic = SPECTRA_MAGIC;
+    header.fields.sample_rate = rate;
+    header.fields.ref_size = st.st_size;
+    header.fields.ref_ino = st.st_ino;
+    header.fields.ref_mtime = st.st_mtim.tv_sec * 1000000000LL
+        + st.st_mtim.tv_nsec;
+
+    // The layout of the file, with a transform per interval length.
+    size_t offset = HEADER_SIZE;
+    size_t max_len = 0;
+    for (size_t i = 0; i < config->user.n_intervals; i++) {
+        const size_t sample_len = config->interv_sample[i];
+        if (2 * sample_len > len) continue;
+
+        header.fields.sizes[header.fields.n_sizes].sample_len = sample_len;
+        header.fields.sizes[header.fields.n_sizes].offset = offset;
+        header.fields.n_sizes++;
+        offset += page_align((sample_len + 1) * sizeof(double complex));
+        if (sample_len > max_len) max_len = sample_len;
+    }
+    if (header.fields.n_sizes == 0) {
+        return -1;
+    }
+
+    int ret = -1;
+    double complex *spectrum = arena_alloc((max_len + 1) * sizeof(*spectrum));
+    if (spectrum == NULL) {
+        log("spectra arena_alloc failed");
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        perror("audiosync: mkostemp for new cached spectra failed");
+        arena_free(spectrum);
+        return -1;
+    }
+
+    for (size_t i = 0; i < header.fields.n_sizes; i++) {
+        if (cancel && cancel(cancel_ctx)) {
+            log("cancelled saving the spectra of '%s'", title);
+            goto finish;
+        }
+        const size_t sample_len = header.fields.sizes[i].sample_len;
+        xcorr_spectrum(data, sample_len, spectrum);
+        if (write_all(fd, spectrum, (sample_len + 1) * sizeof(*spectrum),
+                      header.fields.sizes[i].offset) < 0) {
+            goto finish;
+        }
+    }
+    // The header is written last, and the end of the last transform is
+    // padded to a full page.
+    if (write_all(fd, header.bytes, HEADER_SIZE, 0) < 0) {
+        goto finish;
+    }
+    if (ftruncate(fd, offset) < 0) {
+        perror("audiosync: ftruncate for cached spectra failed");
+        goto finish;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror("audiosync: rename for cached spectra failed");
+        goto finish;
+    }
+
+    // A mapped reference may have tried to map its spectra already.
+    pthread_mutex_lock(&refcache_mutex);
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].key == key && entries[i].spec_map == NULL) {
+            entries[i].spec_tried = 0;
+        }
+    }
+    pthread_mutex_unlock(&refcache_mutex);
+    log("saved %u spectra for '%s' in the cache", header.fields.n_sizes,
+        title);
+    ret = 0;
+
+finish:
+    close(fd);
+    if (ret < 0) unlink(tmp_path);
+    arena_free(spectrum);
+    return ret;
+}
+
+// Maps and validates the spectra of a mapped reference. The pages aren't
+// populated, since only the ones of the intervals used are needed.
+//
+// Returns 0 on success, or -1 if they don't exist or they're invalid.
+static int map_spectra(struct entry *e) {
+    char path[MAX_LONG_PATH];
+    if (ref_path(e->key, e->sample_rate, "spec", path, sizeof(path)) < 0) {
+        return -1;
+    }
+
+    int ret = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            perror("audiosync: open for cached spectra failed");
+        }
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < HEADER_SIZE) {
+        log("invalid cached spectra '%s'", path);
+        goto finish;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("audiosync: mmap for cached spectra failed");
+        goto finish;
+    }
+
+    const struct spec_header *header = map;
+    int valid = header->magic == SPECTRA_MAGIC
+        && header->sample_rate == e->sample_rate
+        && header->ref_size == e->ref_size
+        && header->ref_ino == e->ref_ino
+        && header->ref_mtime == e->ref_mtime
+        && header->n_sizes <= MAX_INTERVALS;
+    for (size_t i = 0; valid && i < header->n_sizes; i++) {
+        const uint64_t sample_len = header->sizes[i].sample_len;
+        const uint64_t offset = header->sizes[i].offset;
+        valid = 2 * sample_len <= e->len && offset % HEADER_SIZE == 0
+            && offset >= HEADER_SIZE
+            && offset + (sample_len + 1) * sizeof(double complex)
+               <= (uint64_t) st.st_size;
+    }
+    if (!valid) {
+        log("ignoring invalid cached spectra '%s'", path);
+        munmap(map, st.st_size);
+        goto finish;
+    }
+    e->spec_map = map;
+    e->spec_size = st.st_size;
+    ret = 0;
+
+finish:
+    close(fd);
+    return ret;
+}
+
+// Obtains the transform of the first `2 * sample_len` frames of a reference
+// obtained with refcache_get, as calculated by xcorr_spectrum, for
+// cross_correlation_ex. It's valid until the reference is released.
+//
+// Returns NULL if it wasn't saved for that length, or if it's invalid.
+const double complex *refcache_spectrum(const double *data,
+                                        size_t sample_len) {
+    debug_assert(data);
+
+    const double complex *spectrum = NULL;
+    pthread_mutex_lock(&refcache_mutex);
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        struct entry *e = &entries[i];
+        if (e->map == NULL || e->data != data) continue;
+
+        debug_assert(e->refs > 0);
+        if (e->spec_map == NULL && !e->spec_tried) {
+            e->spec_tried = 1;
+            map_spectra(e);
+        }
+        if (e->spec_map == NULL) break;
+
+        const struct spec_header *header = e->spec_map;
+        for (size_t j = 0; j < header->n_sizes; j++) {
+            if (header->sizes[j].sample_len == sample_len) {
+                spectrum = (const double complex *)
+                    ((char *) e->spec_map + header->sizes[j].offset);
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&refcache_mutex);
+
+    return spectrum;
+}
+
+// Whether the spectra of a cached reference are available for all the
+// intervals of the configuration.
+static int has_spectra(const double *data) {
+    const struct derived_config *config = get_config();
+    for (size_t i = 0; i < config->user.n_intervals; i++) {
+        if (refcache_spectrum(data, config->interv_sample[i]) == NULL) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Implementation of refcache_prefetch, with the configuration acquired.
+static int prefetch(const char *title,
+                    const struct derived_config *config) {
+    if (!config->user.reference_cache) {
+        log("can't prefetch with the reference cache disabled");
+        return -1;
+    }
+
+    // A reference cached by a run may not have its spectra.
+    const double *cached = refcache_get(title, config->len_source);
+    if (cached) {
+        int ret = 0;
+        if (!has_spectra(cached)) {
+            ret = refcache_store_spectra(title, cached, config->len_source,
+                                         NULL, NULL);
+        }
+        refcache_release(cached);
+        return ret;
+    }
+
+    int ret = -1;
+    double *buf = config->user.transport == TRANSPORT_MEMFD
+        ? arena_alloc_shared(config->len_source * sizeof(*buf))
+        : arena_alloc(config->len_source * sizeof(*buf));
+    if (buf == NULL) {
+        log("prefetch arena_alloc failed");
+        return -1;
+    }
+    if (download_reference(title, buf, config->len_source) == 0
+            && refcache_store(title, buf, config->len_source) == 0) {
+        ret = refcache_store_spectra(title, buf, config->len_source, NULL,
+                                     NULL);
+    }
+    arena_free(buf);
+
+    return ret;
+}
+
+// Downloads the reference of `title` and saves it in the cache along with
+// its spectra, unless they're already cached. It doesn't use the global
+// status, so it can be called while audiosync is running, but the
+// configuration can't change until it finishes.
+//
+// Returns 0 on success, or -1 on error.
+int refcache_prefetch(const char *title) {
+    debug_assert(title);
+
+    const struct derived_config *config = config_acquire();
+    const int ret = prefetch(title, config);
+    config_release();
+
+    return ret;
+}
+
+// Unmaps all the references that aren't in use.
+void refcache_trim() {
+    pthread_mutex_lock(&refcache_mutex);
+    for (size_t i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].map != NULL && entries[i].refs == 0) {
+            unmap_entry(&entries[i]);
+        }
+    }
+    pthread_mutex_unlock(&refcache_mutex);
+}
@@ -0,0 +1,251 @@
+// Cache of the previous results, saved in a single file in the cache
+// directory. See result_cache.h for more details.
+
+#define _GNU_SOURCE  // mkostemp()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/reference_cache.h>
+#include <audiosync/result_cache.h>
+
+#define RESULTS_MAGIC 0x3153455243534155ULL  // "AUSCRES1" in little endian
+#define RESULTS_FILE "results.bin"
+// Maximum number of results kept. The oldest ones are replaced first.
+#define MAX_RESULTS 256
+// Maximum number of different bits for two fingerprints to be considered
+// similar.
+#define MAX_FINGERPRINT_DISTANCE 12
+// Number of bits in the fingerprint, and thus, blocks minus one.
+#define FINGERPRINT_BITS 64
+
+
+struct result {
+    uint64_t id;           // Id of the reference
+    uint64_t print;        // Fingerprint of the recorded audio
+    int64_t lag;           // Lag in frames
+    uint32_t sample_rate;
+    uint32_t age;          // When it was saved, for the replacement
+};
+
+struct results_file {
+    uint64_t magic;
+    uint32_t n_results;
+    uint32_t counter;
+    struct result results[MAX_RESULTS];
+};
+
+// The results are loaded from the file the first time they're used, and
+// they're protected by a mutex.
+static pthread_mutex_t results_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct results_file results;
+static char loaded_path[MAX_LONG_PATH] = "";
+
+
+// Calculates the fingerprint of `len` frames of recorded audio: each bit
+// indicates whether the energy increases between two consecutive blocks.
+uint64_t fingerprint(const double *data, size_t len) {
+    debug_assert(data);
+
+    const size_t n_blocks = FINGERPRINT_BITS + 1;
+    const size_t block_len = len / n_blocks;
+    if (block_len == 0) {
+        return 0;
+    }
+
+    uint64_t print = 0;
+    double prev = 0.0;
+    for (size_t b = 0; b < n_blocks; b++) {
+        double energy = 0.0;
+        for (size_t i = b * block_len; i < (b + 1) * block_len; i++) {
+            energy += data[i] * data[i];
+        }
+        if (b > 0 && energy > prev) {
+            print |= (uint64_t) 1 << (b - 1);
+        }
+        prev = energy;
+    }
+
+    return print;
+}
+
+// Number of different bits between two fingerprints.
+static int distance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
+
+// Writes the path of the results file into `path`.
+//
+// Returns 0 on success, or -1 if the cache is disabled.
+static int results_path(char *path, size_t size) {
+    const struct derived_config *config = get_config();
+    if (!config->user.result_cache || config->cache_dir[0] == '\0') {
+        return -1;
+    }
+
+    int n = snprintf(path, size, "%s/%s", config->cache_dir, RESULTS_FILE);
+    if (n < 0 || (size_t) n >= size) {
+        log("cache path is too long");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Loads the results from the file, unless they were already loaded from the
+// same path. A missing or invalid file is the same as having no results. It
+// must be called with the lock.
+//
+// Returns 0 on success, or -1 if the cache is disabled.
+static int load_results() {
+    char path[MAX_LONG_PATH];
+    if (results_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    if (strcmp(path, loaded_path) == 0) {
+        return 0;
+    }
+
+    memset(&results, 0, sizeof(results));
+    strcpy(loaded_path, path);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        if (errno != ENOENT) perror("audiosync: fopen for results failed");
+        return 0;
+    }
+    if (fread(&results, sizeof(results), 1, fp) != 1
+            || results.magic != RESULTS_MAGIC
+            || results.n_results > MAX_RESULTS) {
+        log("ignoring invalid results file '%s'", path);
+        memset(&results, 0, sizeof(results));
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+// Saves the results into the file, replacing it atomically. It must be
+// called with the lock.
+//
+// Returns 0 on success, or -1 on error.
+static int save_results() {
+    char tmp_path[MAX_LONG_PATH + 32];
+    if (cache_make_dir() < 0) {
+        return -1;
+    }
+
+    // The temporary file has a unique name, since other processes may be
+    // saving their results too.
+    snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", loaded_path);
+    const int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        perror("audiosync: mkostemp for new results failed");
+        return -1;
+    }
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        perror("audiosync: fdopen for new results failed");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    results.magic = RESULTS_MAGIC;
+    int ok = fwrite(&results, sizeof(results), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path, loaded_path) < 0) {
+        perror("audiosync: saving the results failed");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns the result of `id` most similar to the fingerprint, or NULL if
+// there isn't any similar enough. It must be called with the lock.
+static struct result *closest(uint64_t id, uint64_t print,
+                              unsigned int rate) {
+    struct result *best = NULL;
+    int best_dist = MAX_FINGERPRINT_DISTANCE + 1;
+    for (size_t i = 0; i < results.n_results; i++) {
+        struct result *r = &results.results[i];
+        if (r->id != id || r->sample_rate != rate) continue;
+
+        int dist = distance(r->print, print);
+        if (dist < best_dist) {
+            best = r;
+            best_dist = dist;
+        }
+    }
+
+    return best;
+}
+
+// Looks for a previous result of `title` with a fingerprint similar to the
+// provided one, at the current sample rate.
+//
+// Returns 0 and its lag in frames if found, or -1 otherwise.
+int resultcache_find(const char *title, uint64_t print, long *lag) {
+    debug_assert(title); debug_assert(lag);
+
+    const unsigned int rate = get_config()->user.sample_rate;
+    int ret = -1;
+
+    pthread_mutex_lock(&results_mutex);
+    if (load_results() == 0) {
+        struct result *r = closest(refcache_id(title), print, rate);
+        if (r) {
+            *lag = r->lag;
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&results_mutex);
+
+    return ret;
+}
+
+// Saves the lag in frames obtained for `title` with the fingerprint, which
+// replaces the previous results with a similar fingerprint.
+//
+// Returns 0 on success, or -1 on error.
+int resultcache_store(const char *title, uint64_t print, long lag) {
+    debug_assert(title);
+
+    const unsigned int rate = get_config()->user.sample_rate;
+    const uint64_t id = refcache_id(title);
+    int ret = -1;
+
+    pthread_mutex_lock(&results_mutex);
+    if (load_results() < 0) {
+        goto finish;
+    }
+
+    // A previous result with a similar fingerprint is replaced. Otherwise,
+    // a new one is added, replacing the oldest one if it's full.
+    struct result *r = closest(id, print, rate);
+    if (r == NULL && results.n_results < MAX_RESULTS) {
+        r = &results.results[results.n_results++];
+    } else if (r == NULL) {
+        r = &results.results[0];
+        for (size_t i = 1; i < results.n_results; i++) {
+            if (results.results[i].age < r->age) {
+                r = &results.results[i];
+            }
+        }
+    }
+    r->id = id;
+    r->print = print;
+    r->lag = lag;
+    r->sample_rate = rate;
+    r->age = ++results.counter;
+    ret = save_results();
+
+finish:
+    pthread_mutex_unlock(&results_mutex);
+    return ret;
+}
@@ -0,0 +1,145 @@
+// Lock-free single-producer/single-consumer ring buffer. The indices are
+// accessed with the GCC/Clang atomic builtins, since the module is written
+// in C99. The waiting is implemented with futexes, so that the producer can
+// wake up the consumer without taking a lock.
+
+#define _GNU_SOURCE  // syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/ring.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+// Initializes a ring with the provided buffer of `cap` frames. The consumer
+// will be woken up by signaling `event`.
+void ring_init(struct ring *ring, double *buf, size_t cap,
+               struct ring_event *event) {
+    debug_assert(ring); debug_assert(buf); debug_assert(cap > 0);
+    debug_assert(event);
+
+    ring->buf = buf;
+    ring->cap = cap;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->watermark = 0;
+    ring->closed = 0;
+    ring->event = event;
+    ring->space.seq = 0;
+}
+
+// Returns where the next frames have to be written, with the number of
+// contiguous frames available in `avail`.
+double *ring_write_ptr(struct ring *ring, size_t *avail) {
+    // The head is only modified by this thread.
+    const size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    const size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    const size_t offset = head % ring->cap;
+
+    *avail = MIN(ring->cap - (head - tail), ring->cap - offset);
+    return ring->buf + offset;
+}
+
+// Publishes `n` frames written at ring_write_ptr, waking up the consumer if
+// its watermark was reached.
+void ring_commit(struct ring *ring, size_t n) {
+    const size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    // The store and the load are sequentially consistent so that either this
+    // thread sees the new watermark, or the consumer sees the new head.
+    __atomic_store_n(&ring->head, head + n, __ATOMIC_SEQ_CST);
+    const size_t watermark = __atomic_load_n(&ring->watermark,
+                                             __ATOMIC_SEQ_CST);
+    if (head < watermark && head + n >= watermark) {
+        event_signal(ring->event);
+    }
+}
+
+// Indicates that no more frames will be written.
+void ring_close(struct ring *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    event_signal(ring->event);
+}
+
+// Waits until the consumer releases frames, or for at most `timeout_ms`
+// milliseconds.
+void ring_wait_space(struct ring *ring, long timeout_ms) {
+    const unsigned int snapshot = event_snapshot(&ring->space);
+    size_t avail;
+
+    ring_write_ptr(ring, &avail);
+    if (avail == 0) {
+        event_wait(&ring->space, snapshot, timeout_ms);
+    }
+}
+
+// Returns the number of frames written so far.
+size_t ring_count(struct ring *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+}
+
+// Returns whether the producer has finished writing.
+int ring_is_closed(struct ring *ring) {
+    return __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST);
+}
+
+// Configures when the consumer will be woken up.
+void ring_set_watermark(struct ring *ring, size_t watermark) {
+    __atomic_store_n(&ring->watermark, watermark, __ATOMIC_SEQ_CST);
+}
+
+// Copies `n` frames starting at the absolute position `pos`, which must still
+// be in the ring.
+void ring_read(struct ring *ring, size_t pos, double *dst, size_t n) {
+    debug_assert(pos >= __atomic_load_n(&ring->tail, __ATOMIC_RELAXED));
+    debug_assert(pos + n <= ring_count(ring));
+
+    // The data may wrap around the end of the buffer.
+    const size_t offset = pos % ring->cap;
+    const size_t first = MIN(n, ring->cap - offset);
+    memcpy(dst, ring->buf + offset, first * sizeof(*dst));
+    memcpy(dst + first, ring->buf, (n - first) * sizeof(*dst));
+}
+
+// Discards the frames before the absolute position `pos`, so that the
+// producer can reuse their space.
+void ring_release(struct ring *ring, size_t pos) {
+    debug_assert(pos <= ring_count(ring));
+
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+    event_signal(&ring->space);
+}
+
+// Takes a snapshot of the event, to be used later with event_wait.
+unsigned int event_snapshot(struct ring_event *event) {
+    return __atomic_load_n(&event->seq, __ATOMIC_SEQ_CST);
+}
+
+// Waits until the event is signaled after the snapshot was taken. A negative
+// timeout waits indefinitely.
+void event_wait(struct ring_event *event, unsigned int snapshot,
+                long timeout_ms) {
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000,
+    };
+
+    // The futex call returns immediately if the value was already modified,
+    // and it may also wake up spuriously, which the callers must handle.
+    syscall(SYS_futex, &event->seq, FUTEX_WAIT_PRIVATE, snapshot,
+            timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+// Wakes up all the threads waiting for the event.
+void event_signal(struct ring_event *event) {
+    __atomic_add_fetch(&event->seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &event->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+            NULL, 0);
+}
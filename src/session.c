@@ -0,0 +1,370 @@
+// Continuous capture across the tracks of a playlist. See session.h for more
+// details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/session.h>
+#include <audiosync/capture/linux_capture.h>
+
+// Seconds of the recording kept to start the runs from a boundary, and the
+// extra ones in the ring so that the recording doesn't have to wait for the
+// monitor to release frames.
+#define SESSION_LOOKBACK_SECONDS 10
+#define SESSION_SLACK_SECONDS 5
+// Length of the blocks analyzed, and of the silence between two tracks, in
+// milliseconds.
+#define SESSION_BLOCK_MS 10
+#define SESSION_GAP_MS 300
+// Milliseconds waited at most for new frames, so that the status is still
+// checked regularly.
+#define SESSION_WAIT_MS 20
+// Frames analyzed at once by the monitor.
+#define MONITOR_CHUNK 4096
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+// The state of the session. The boundaries and the frames held by a run are
+// protected by its lock, and the rest is only modified when starting and
+// stopping it.
+static struct {
+    int active;
+    int stop;                       // Stops the recording
+    double *buf;
+    struct ring ring;
+    struct ring_event event;
+    struct ffmpeg_data cap_args;
+    pthread_t cap_th;
+    pthread_t monitor_th;
+    struct boundary_detector det;
+    int holding;                    // Whether a run is using the frames
+    size_t hold;                    // First frame still needed by the run
+    pthread_mutex_t lock;
+} session = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+// Initializes the detector with blocks of `block` frames, which are silent
+// if their RMS is at most `threshold`, and tracks separated by at least
+// `gap` frames of silence.
+void boundary_init(struct boundary_detector *det, size_t block,
+                   double threshold, size_t gap) {
+    debug_assert(det); debug_assert(block > 0);
+
+    det->block = block;
+    det->threshold = threshold * threshold;
+    det->gap = (gap + block - 1) / block;
+    det->energy = 0.0;
+    det->filled = 0;
+    det->pos = 0;
+    det->silent = 0;
+    det->active = 0;
+    det->n_boundaries = 0;
+}
+
+// Analyzes the next `n` frames of the stream. When the list of boundaries is
+// full, the oldest one is dropped.
+void boundary_update(struct boundary_detector *det, const double *data,
+                     size_t n) {
+    debug_assert(det); debug_assert(data);
+
+    for (size_t i = 0; i < n; i++) {
+        det->energy += data[i] * data[i];
+        if (++det->filled < det->block) continue;
+
+        // The block is complete.
+        const size_t block_start = det->pos + i + 1 - det->block;
+        if (det->energy / det->block <= det->threshold) {
+            det->silent++;
+        } else {
+            if (!det->active || det->silent >= det->gap) {
+                if (det->n_boundaries == SESSION_MAX_BOUNDARIES) {
+                    for (size_t j = 1; j < SESSION_MAX_BOUNDARIES; j++) {
+                        det->boundaries[j-1] = det->boundaries[j];
+                    }
+                    det->n_boundaries--;
+                }
+                det->boundaries[det->n_boundaries++] = block_start;
+            }
+            det->active = 1;
+            det->silent = 0;
+        }
+        det->energy = 0.0;
+        det->filled = 0;
+    }
+    det->pos += n;
+}
+
+// Obtains the last boundary between `start` and `end`.
+//
+// Returns 0 on success, or -1 if there isn't any.
+int boundary_last(const struct boundary_detector *det, size_t start,
+                  size_t end, size_t *pos) {
+    debug_assert(det); debug_assert(pos);
+
+    for (size_t i = det->n_boundaries; i > 0; i--) {
+        const size_t b = det->boundaries[i-1];
+        if (b >= start && b <= end) {
+            *pos = b;
+            return 0;
+        }
+        if (b < start) break;
+    }
+
+    return -1;
+}
+
+// Analyzes the recording as it's read, and releases the frames that aren't
+// needed anymore: the ones older than the lookback, unless a run is still
+// copying them.
+static void *monitor(void *arg) {
+    UNUSED(arg);
+
+    const size_t keep = SESSION_LOOKBACK_SECONDS
+        * get_config()->user.sample_rate;
+    double tmp[MONITOR_CHUNK];
+    size_t pos = 0;
+
+    log("starting session monitor");
+    while (1) {
+        // The snapshot is taken before checking the ring so that no signals
+        // are missed.
+        const unsigned int snapshot = event_snapshot(&session.event);
+        const int closed = ring_is_closed(&session.ring);
+        const size_t count = ring_count(&session.ring);
+
+        while (pos < count) {
+            const size_t n = MIN(MONITOR_CHUNK, count - pos);
+            ring_read(&session.ring, pos, tmp, n);
+            pthread_mutex_lock(&session.lock);
+            boundary_update(&session.det, tmp, n);
+            pthread_mutex_unlock(&session.lock);
+            pos += n;
+        }
+
+        pthread_mutex_lock(&session.lock);
+        size_t release = count > keep ? count - keep : 0;
+        if (session.holding && session.hold < release) {
+            release = session.hold;
+        }
+        if (release > session.ring.tail) {
+            ring_release(&session.ring, release);
+        }
+        pthread_mutex_unlock(&session.lock);
+
+        if (closed) break;
+        ring_set_watermark(&session.ring, count + 1);
+        event_wait(&session.event, snapshot, SESSION_WAIT_MS);
+    }
+    log("finished session monitor");
+
+    return NULL;
+}
+
+// Starts a playlist session, recording until audiosync_session_stop.
+//
+// Returns 0 on success, or -1 on error or if there was a session already.
+int audiosync_session_start() {
+    const struct derived_config *config = get_config();
+    const size_t cap = (SESSION_LOOKBACK_SECONDS + SESSION_SLACK_SECONDS)
+        * config->user.sample_rate;
+    const size_t block = config->user.sample_rate * SESSION_BLOCK_MS / 1000;
+    const size_t gap = config->user.sample_rate * SESSION_GAP_MS / 1000;
+    const double threshold = config->user.silence_threshold > 0.0
+        ? config->user.silence_threshold : DEFAULT_SILENCE_THRESHOLD;
+    int ret = -1;
+
+    // The global mutex is taken so that the configuration doesn't change
+    // meanwhile.
+    pthread_mutex_lock(&mutex);
+    if (session.active || global_status != IDLE_ST) {
+        log("can't start a session while %s",
+            session.active ? "there's one already" : "running");
+        goto finish;
+    }
+
+    session.buf = arena_alloc(cap * sizeof(*session.buf));
+    if (session.buf == NULL) {
+        log("session arena_alloc failed");
+        goto finish;
+    }
+    session.stop = 0;
+    session.event.seq = 0;
+    ring_init(&session.ring, session.buf, cap, &session.event);
+    boundary_init(&session.det, block, threshold, gap);
+    session.holding = 0;
+    session.hold = 0;
+    // The fields of ffmpeg_data are constant, so it's initialized as a
+    // whole.
+    const struct ffmpeg_data args = {
+        .title = "",
+        .ring = &session.ring,
+        .total_len = 0,
+        .detached = 1,
+        .stop = &session.stop,
+    };
+    memcpy(&session.cap_args, &args, sizeof(args));
+
+    if (pthread_create(&session.cap_th, NULL, &capture,
+                       (void *) &session.cap_args) < 0) {
+        perror("audiosync: pthread_create for the session failed");
+        arena_free(session.buf);
+        goto finish;
+    }
+    if (pthread_create(&session.monitor_th, NULL, &monitor, NULL) < 0) {
+        perror("audiosync: pthread_create for the session monitor failed");
+        __atomic_store_n(&session.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(session.cap_th, NULL);
+        arena_free(session.buf);
+        goto finish;
+    }
+    __atomic_store_n(&session.active, 1, __ATOMIC_RELEASE);
+    log("started playlist session");
+    ret = 0;
+
+finish:
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+// Stops the playlist session.
+//
+// Returns 0 on success, or -1 if there isn't any or audiosync is running.
+int audiosync_session_stop() {
+    int ret = -1;
+
+    pthread_mutex_lock(&mutex);
+    if (!session.active || global_status != IDLE_ST) {
+        log("can't stop the session while %s",
+            session.active ? "running" : "there isn't any");
+        goto finish;
+    }
+
+    // The recording closes the ring once it stops, which ends the monitor
+    // too.
+    __atomic_store_n(&session.stop, 1, __ATOMIC_RELEASE);
+    if (pthread_join(session.cap_th, NULL) < 0) {
+        perror("audiosync: pthread_join for the session failed");
+    }
+    if (pthread_join(session.monitor_th, NULL) < 0) {
+        perror("audiosync: pthread_join for the session monitor failed");
+    }
+    arena_free(session.buf);
+    __atomic_store_n(&session.active, 0, __ATOMIC_RELEASE);
+    log("stopped playlist session");
+    ret = 0;
+
+finish:
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+// Returns whether the runs can use the session's recording. If it stopped
+// on its own, because ffmpeg failed, the runs start their own capture.
+int session_active() {
+    return __atomic_load_n(&session.active, __ATOMIC_ACQUIRE)
+        && !ring_is_closed(&session.ring);
+}
+
+// Chooses where the run's recording starts: the last boundary within the
+// lookback, or the current frame otherwise. The frames after it are held
+// until session_end.
+//
+// Returns the number of frames between that position and the current one.
+size_t session_begin() {
+    const size_t keep = SESSION_LOOKBACK_SECONDS
+        * get_config()->user.sample_rate;
+
+    pthread_mutex_lock(&session.lock);
+    const size_t count = ring_count(&session.ring);
+    size_t start = count > keep ? count - keep : 0;
+    if (start < session.ring.tail) start = session.ring.tail;
+    size_t pos;
+    if (boundary_last(&session.det, start, count, &pos) < 0) {
+        pos = count;
+    }
+    session.holding = 1;
+    session.hold = pos;
+    pthread_mutex_unlock(&session.lock);
+
+    log("starting the recording %zu frames back in the session",
+        count - pos);
+    return count - pos;
+}
+
+// Used for the capture thread instead of capture, copying the frames from
+// the session's ring into the run's, starting at the position chosen by
+// session_begin.
+void *session_feed(void *arg) {
+    struct ffmpeg_data *data = arg;
+    struct ring *dst_ring = data->ring;
+    size_t written = 0;
+
+    log("feeding the recording from the session");
+    while (data->total_len == 0 || written < data->total_len) {
+        const unsigned int snapshot = event_snapshot(&session.event);
+        const global_status_t status = __atomic_load_n(&global_status,
+                                                       __ATOMIC_ACQUIRE);
+        if (status == ABORT_ST) {
+            log("feed read ABORT_ST, quitting...");
+            break;
+        }
+        if (status == PAUSED_ST) {
+            pthread_mutex_lock(&mutex);
+            while (global_status == PAUSED_ST) {
+                pthread_cond_wait(&read_continue, &mutex);
+            }
+            pthread_mutex_unlock(&mutex);
+
+            // The frames recorded while paused are skipped, like when the
+            // ffmpeg process is stopped.
+            pthread_mutex_lock(&session.lock);
+            session.hold = ring_count(&session.ring);
+            pthread_mutex_unlock(&session.lock);
+            continue;
+        }
+
+        const int closed = ring_is_closed(&session.ring);
+        const size_t count = ring_count(&session.ring);
+        while (session.hold < count) {
+            size_t avail;
+            double *dst = ring_write_ptr(dst_ring, &avail);
+            size_t n = MIN(avail, count - session.hold);
+            if (data->total_len > 0) {
+                n = MIN(n, data->total_len - written);
+            }
+            if (n == 0) break;
+
+            ring_read(&session.ring, session.hold, dst, n);
+            if (data->activity) {
+                activity_update(data->activity, dst, n);
+            }
+            ring_commit(dst_ring, n);
+            written += n;
+            pthread_mutex_lock(&session.lock);
+            session.hold += n;
+            pthread_mutex_unlock(&session.lock);
+        }
+
+        if (closed && session.hold >= count) {
+            log("session recording finished");
+            break;
+        }
+        event_wait(&session.event, snapshot, SESSION_WAIT_MS);
+    }
+    ring_close(dst_ring);
+
+    return NULL;
+}
+
+// Lets the session discard the frames held by the run.
+void session_end() {
+    pthread_mutex_lock(&session.lock);
+    session.holding = 0;
+    pthread_mutex_unlock(&session.lock);
+}
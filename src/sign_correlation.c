@@ -0,0 +1,472 @@
+// Polarity-coincidence correlation with XOR and popcount. See
+// sign_correlation.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define SIGN_X86
+#endif
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/pool.h>
+#include <audiosync/sign_correlation.h>
+
+// Number of lags of the coarse search in each task given to the threads.
+// The cancellation is also checked between them.
+#define SIGN_TASK_LAGS 256
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+
+typedef size_t (*xor_count_fn)(const uint64_t *a, const uint64_t *b,
+                               size_t off, size_t nbits);
+
+// The ranges of lags of the coarse search, split in tasks.
+struct coarse_job {
+    const uint64_t *source;
+    size_t source_len;      // In bits
+    const uint64_t *sample;
+    size_t sample_len;
+    long first;             // First lag searched
+    size_t n_lags;
+    long *scores;           // Score of each lag
+    const struct xcorr_params *params;
+    int cancelled;
+};
+
+
+// The window of 64 bits of `b` starting at bit `r` of word `w`.
+static inline uint64_t window(const uint64_t *b, size_t w, unsigned int r) {
+    return r == 0 ? b[w] : (b[w] >> r) | (b[w+1] << (64 - r));
+}
+
+// The scalar loop, starting at the word `from`, which is also used for the
+// words left by the vectorized ones. The last word is masked if the bits
+// end in the middle of it.
+static size_t xor_count_from(const uint64_t *a, const uint64_t *b,
+                             size_t off, size_t nbits, size_t from) {
+    const size_t q = off / 64;
+    const unsigned int r = off % 64;
+    const size_t words = nbits / 64;
+    size_t count = 0;
+
+    for (size_t w = from; w < words; w++) {
+        count += __builtin_popcountll(a[w] ^ window(b, q + w, r));
+    }
+    if (nbits % 64) {
+        const uint64_t mask = (UINT64_C(1) << (nbits % 64)) - 1;
+        count += __builtin_popcountll((a[words] ^ window(b, q + words, r))
+                                      & mask);
+    }
+
+    return count;
+}
+
+static size_t xor_count_scalar(const uint64_t *a, const uint64_t *b,
+                               size_t off, size_t nbits) {
+    return xor_count_from(a, b, off, nbits, 0);
+}
+
+#ifdef SIGN_X86
+// AVX2 doesn't have a popcount instruction, so the bits of each nibble are
+// looked up with a shuffle, and the bytes are added with SAD. A shift by 64
+// gives zero, so the window doesn't need a special case for `r` == 0.
+__attribute__((target("avx2")))
+static size_t xor_count_avx2(const uint64_t *a, const uint64_t *b,
+                             size_t off, size_t nbits) {
+    const size_t q = off / 64;
+    const unsigned int r = off % 64;
+    const size_t words = nbits / 64;
+    const __m128i right = _mm_cvtsi32_si128(r);
+    const __m128i left = _mm_cvtsi32_si128(64 - r);
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                         2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t w = 0;
+
+    for (; w + 4 <= words; w += 4) {
+        const __m256i lo = _mm256_loadu_si256((const __m256i *) (b + q + w));
+        const __m256i hi = _mm256_loadu_si256(
+            (const __m256i *) (b + q + w + 1));
+        const __m256i x = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i *) (a + w)),
+            _mm256_or_si256(_mm256_srl_epi64(lo, right),
+                            _mm256_sll_epi64(hi, left)));
+        const __m256i counts = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(x, nibble)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(
+                _mm256_srli_epi16(x, 4), nibble)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+        + xor_count_from(a, b, off, nbits, w);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t xor_count_avx512(const uint64_t *a, const uint64_t *b,
+                               size_t off, size_t nbits) {
+    const size_t q = off / 64;
+    const unsigned int r = off % 64;
+    const size_t words = nbits / 64;
+    const __m128i right = _mm_cvtsi32_si128(r);
+    const __m128i left = _mm_cvtsi32_si128(64 - r);
+    __m512i acc = _mm512_setzero_si512();
+    size_t w = 0;
+
+    for (; w + 8 <= words; w += 8) {
+        const __m512i lo = _mm512_loadu_si512(b + q + w);
+        const __m512i hi = _mm512_loadu_si512(b + q + w + 1);
+        const __m512i x = _mm512_xor_si512(
+            _mm512_loadu_si512(a + w),
+            _mm512_or_si512(_mm512_srl_epi64(lo, right),
+                            _mm512_sll_epi64(hi, left)));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(x));
+    }
+
+    return _mm512_reduce_add_epi64(acc) + xor_count_from(a, b, off, nbits, w);
+}
+#endif
+
+static xor_count_fn kernels[] = {
+    [SIGN_KERNEL_SCALAR] = xor_count_scalar,
+#ifdef SIGN_X86
+    [SIGN_KERNEL_AVX2] = xor_count_avx2,
+    [SIGN_KERNEL_AVX512] = xor_count_avx512,
+#endif
+};
+static sign_kernel_t current = SIGN_KERNEL_SCALAR;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+
+// Whether the CPU supports a kernel.
+static int supported(sign_kernel_t kernel) {
+    switch (kernel) {
+    case SIGN_KERNEL_SCALAR:
+        return 1;
+#ifdef SIGN_X86
+    case SIGN_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case SIGN_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+    default:
+        return 0;
+    }
+}
+
+// The best kernel supported is chosen the first time.
+static void init_current() {
+    __builtin_cpu_init();
+    if (supported(SIGN_KERNEL_AVX512)) {
+        current = SIGN_KERNEL_AVX512;
+    } else if (supported(SIGN_KERNEL_AVX2)) {
+        current = SIGN_KERNEL_AVX2;
+    }
+    log("using the %s kernel for the sign correlation",
+        sign_kernel_to_string(current));
+}
+
+// Obtains the kernel used by sign_xor_count.
+sign_kernel_t sign_kernel() {
+    pthread_once(&current_once, init_current);
+    return __atomic_load_n(&current, __ATOMIC_RELAXED);
+}
+
+// Changes the kernel used by sign_xor_count.
+//
+// Returns 0 on success, or -1 if the CPU doesn't support it.
+int sign_set_kernel(sign_kernel_t kernel) {
+    pthread_once(&current_once, init_current);
+    if (!supported(kernel)) {
+        return -1;
+    }
+    __atomic_store_n(&current, kernel, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Converting a kernel enum value to a string.
+char *sign_kernel_to_string(sign_kernel_t kernel) {
+    switch (kernel) {
+    case SIGN_KERNEL_SCALAR:
+        return "scalar";
+    case SIGN_KERNEL_AVX2:
+        return "avx2";
+    case SIGN_KERNEL_AVX512:
+        return "avx512";
+    default:
+        return "unknown";
+    }
+}
+
+// Counts the bits that differ between the first `nbits` bits of `a` and the
+// `nbits` bits of `b` starting at bit `off`.
+size_t sign_xor_count(const uint64_t *a, const uint64_t *b, size_t off,
+                      size_t nbits) {
+    debug_assert(a); debug_assert(b);
+
+    return kernels[sign_kernel()](a, b, off, nbits);
+}
+
+// The words needed to pack `nbits` bits, including the one that can be read
+// after the last one.
+size_t sign_words(size_t nbits) {
+    return (nbits + 63) / 64 + 1;
+}
+
+// Packs the signs of `len` frames decimated by `factor` into `bits`.
+//
+// Returns the number of bits packed.
+size_t sign_pack(const double *data, size_t len, size_t factor,
+                 uint64_t *bits) {
+    debug_assert(data); debug_assert(bits); debug_assert(factor > 0);
+
+    const size_t nbits = len / factor;
+    double mean = 0.0;
+    for (size_t i = 0; i < nbits * factor; i++) {
+        mean += data[i];
+    }
+    // The blocks are compared by their sums, which is the same as comparing
+    // their averages.
+    mean = nbits > 0 ? mean / nbits : 0.0;
+
+    memset(bits, 0, sign_words(nbits) * sizeof(*bits));
+    for (size_t i = 0; i < nbits; i++) {
+        double sum = 0.0;
+        for (size_t j = 0; j < factor; j++) {
+            sum += data[i * factor + j];
+        }
+        if (sum > mean) {
+            bits[i / 64] |= UINT64_C(1) << (i % 64);
+        }
+    }
+
+    return nbits;
+}
+
+// The score of a lag: the frames whose signs agree minus the ones that
+// don't, in their overlap. Like the cross-correlation, it isn't normalized,
+// so the lags with a short overlap aren't favored.
+static long lag_score(const uint64_t *source, size_t source_len,
+                      const uint64_t *sample, size_t sample_len,
+                      xor_count_fn count, long lag) {
+    size_t nbits, diff;
+    if (lag >= 0) {
+        nbits = MIN(sample_len, source_len - lag);
+        diff = count(sample, source, lag, nbits);
+    } else {
+        nbits = sample_len + lag;
+        diff = count(source, sample, -lag, nbits);
+    }
+
+    return (long) nbits - 2 * (long) diff;
+}
+
+// Whether the caller of sign_correlation asked it to stop.
+static int cancelled(const struct xcorr_params *params) {
+    return params->cancel && params->cancel(params->cancel_ctx);
+}
+
+// Task run by the pool for each range of lags of the coarse search.
+static void coarse_task(void *ctx, unsigned int worker, size_t task) {
+    UNUSED(worker);
+
+    struct coarse_job *job = ctx;
+    const xor_count_fn count = kernels[sign_kernel()];
+    if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) return;
+    if (cancelled(job->params)) {
+        __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const size_t start = task * SIGN_TASK_LAGS;
+    const size_t end = MIN(start + SIGN_TASK_LAGS, job->n_lags);
+    for (size_t i = start; i < end; i++) {
+        job->scores[i] = lag_score(job->source, job->source_len, job->sample,
+                                   job->sample_len, count,
+                                   job->first + (long) i);
+    }
+}
+
+// Inserts a candidate lag in the list, which is sorted by the absolute
+// value of the scores. The weakest one is dropped if it's full.
+static void add_candidate(long *lags, long *scores, size_t *n, long lag,
+                          long score) {
+    size_t pos = *n;
+    while (pos > 0 && labs(scores[pos-1]) < labs(score)) pos--;
+    if (pos == SIGN_CANDIDATES) return;
+
+    const size_t last = *n < SIGN_CANDIDATES ? *n : *n - 1;
+    memmove(lags + pos + 1, lags + pos, (last - pos) * sizeof(*lags));
+    memmove(scores + pos + 1, scores + pos, (last - pos) * sizeof(*scores));
+    lags[pos] = lag;
+    scores[pos] = score;
+    if (*n < SIGN_CANDIDATES) (*n)++;
+}
+
+// Searches the lag with the best score between `first` and `last` with the
+// full-rate signs.
+static long refine(const uint64_t *source, size_t source_len,
+                   const uint64_t *sample, size_t sample_len, long first,
+                   long last) {
+    const xor_count_fn count = kernels[sign_kernel()];
+    long best = first;
+    long best_score = 0;
+    for (long l = first; l <= last; l++) {
+        const long score = lag_score(source, source_len, sample, sample_len,
+                                     count, l);
+        if (labs(score) > labs(best_score)) {
+            best = l;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+// Same as cross_correlation_ex, but the candidates are obtained with the
+// signs, and confirmed with the Pearson coefficient.
+//
+// Returns 0 on success, or -1 if none of the candidates could be confirmed,
+// or if it was cancelled.
+int sign_correlation(double *source, double *sample, const size_t length,
+                     const struct xcorr_params *params, long *lag,
+                     double *coefficient) {
+    debug_assert(source); debug_assert(sample);
+    debug_assert(lag); debug_assert(coefficient);
+    debug_assert(length > 0);
+
+    const struct xcorr_params default_params = XCORR_DEFAULT_PARAMS;
+    if (params == NULL) params = &default_params;
+
+    // A constant sample has no correlation with anything, like in
+    // cross_correlation.
+    size_t first_change = 1;
+    while (first_change < length && sample[first_change] == sample[0]) {
+        first_change++;
+    }
+    if (first_change == length) {
+        log("constant sample, skipping the sign correlation");
+        return -1;
+    }
+
+    // The coarse search needs a few frames at least.
+    size_t factor = params->decimation > 1 ? params->decimation : 1;
+    if (length / factor < 64) factor = 1;
+
+    int ret = -1;
+    const long max_lag = params->max_lag > 0 && params->max_lag < length
+        ? (long) params->max_lag : (long) length - 1;
+    const size_t coarse_len = length / factor;
+    const long coarse_max = MIN(max_lag / (long) factor + 1,
+                                (long) coarse_len - 1);
+    struct coarse_job job = {
+        .first = -coarse_max,
+        .n_lags = 2 * coarse_max + 1,
+        .params = params,
+        .cancelled = 0,
+    };
+    uint64_t *coarse_source = arena_alloc(
+        sign_words(2 * coarse_len) * sizeof(*coarse_source));
+    uint64_t *coarse_sample = arena_alloc(
+        sign_words(coarse_len) * sizeof(*coarse_sample));
+    uint64_t *full_source = arena_alloc(
+        sign_words(2 * length) * sizeof(*full_source));
+    uint64_t *full_sample = arena_alloc(
+        sign_words(length) * sizeof(*full_sample));
+    job.scores = arena_alloc(job.n_lags * sizeof(*job.scores));
+    if (coarse_source == NULL || coarse_sample == NULL || full_source == NULL
+            || full_sample == NULL || job.scores == NULL) {
+        log("sign_correlation arena_alloc failed");
+        goto finish;
+    }
+
+    // The source is twice as long as the sample.
+    if (cancelled(params)) goto cancel;
+    job.source = coarse_source;
+    job.source_len = sign_pack(source, 2 * length, factor, coarse_source);
+    job.sample = coarse_sample;
+    job.sample_len = sign_pack(sample, length, factor, coarse_sample);
+    const size_t source_len = sign_pack(source, 2 * length, 1, full_source);
+    const size_t sample_len = sign_pack(sample, length, 1, full_sample);
+
+    // The coarse search, split between the threads.
+    const size_t n_tasks = (job.n_lags + SIGN_TASK_LAGS - 1) / SIGN_TASK_LAGS;
+    if (params->threads < 2) {
+        for (size_t i = 0; i < n_tasks; i++) {
+            coarse_task(&job, 0, i);
+        }
+    } else if (pool_run(n_tasks, params->threads, coarse_task, &job) < 0) {
+        goto finish;
+    }
+    if (job.cancelled) goto cancel;
+
+    // The candidates are the strongest local maxima.
+    long candidates[SIGN_CANDIDATES];
+    long scores[SIGN_CANDIDATES];
+    size_t n_candidates = 0;
+    for (size_t i = 0; i < job.n_lags; i++) {
+        const long score = labs(job.scores[i]);
+        if ((i > 0 && labs(job.scores[i-1]) >= score)
+                || (i + 1 < job.n_lags && labs(job.scores[i+1]) > score)) {
+            continue;
+        }
+        add_candidate(candidates, scores, &n_candidates,
+                      job.first + (long) i, job.scores[i]);
+    }
+
+    // Each of them is refined around its position at the full rate, and the
+    // one with the best coefficient is kept.
+    *coefficient = -1.0;
+    for (size_t i = 0; i < n_candidates; i++) {
+        if (cancelled(params)) goto cancel;
+
+        const long center = candidates[i] * (long) factor;
+        const long found = refine(full_source, source_len, full_sample,
+                                  sample_len,
+                                  MAX(center - (long) factor, -max_lag),
+                                  MIN(center + (long) factor, max_lag));
+        double *source_start = found >= 0 ? source + found : source;
+        double *sample_start = found >= 0 ? sample : sample - found;
+        const size_t overlap = found >= 0 ? length : length + found;
+        const double coef = pearson_coefficient(
+            source_start, source_start + overlap, sample_start,
+            sample_start + overlap);
+        // NaN is skipped too, since the comparison is false.
+        if (coef > *coefficient) {
+            *coefficient = coef;
+            *lag = found;
+            ret = 0;
+        }
+    }
+
+    if (ret == 0) {
+        log("%ld frames of delay with a confidence of %f (sign)", *lag,
+            *coefficient);
+    }
+    goto finish;
+
+cancel:
+    log("sign correlation cancelled");
+
+finish:
+    arena_free(coarse_source);
+    arena_free(coarse_sample);
+    arena_free(full_source);
+    arena_free(full_sample);
+    arena_free(job.scores);
+
+    return ret;
+}
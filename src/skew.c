@@ -0,0 +1,167 @@
+// Estimation of the clock skew between the recording and the reference. See
+// skew.h for more details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/skew.h>
+
+// Number of sub-windows the sample is split in.
+#define SKEW_WINDOWS 8
+// Minimum number of sub-windows with a valid lag required for the fit.
+#define SKEW_MIN_WINDOWS 3
+// Maximum distance from the lag of the whole sample searched in each
+// sub-window, in milliseconds.
+#define SKEW_RADIUS_MS 50
+// Minimum coefficient for the lag of a sub-window to be used.
+#define SKEW_MIN_CONFIDENCE 0.5
+// Skews that are too small aren't worth compensating, in ppm.
+#define SKEW_MIN_PPM 1.0
+
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// The median of `n` values, which are sorted in place.
+static double median(double *values, size_t n) {
+    qsort(values, n, sizeof(*values), compare_doubles);
+    return n % 2 ? values[n / 2] : (values[n/2 - 1] + values[n / 2]) / 2.0;
+}
+
+// Estimates the skew between the sample and the source, which must be twice
+// as long, with `lag` being the approximate lag of the whole sample. The lag
+// of the fit at the beginning of the sample is saved in `fit_lag`.
+//
+// Returns 0 on success, or -1 if there weren't enough sub-windows with a
+// valid lag.
+int skew_estimate(double *source, double *sample, size_t sample_len,
+                  long lag, double *ppm, double *fit_lag) {
+    debug_assert(source); debug_assert(sample);
+    debug_assert(ppm); debug_assert(fit_lag);
+
+    const struct derived_config *config = get_config();
+    const size_t len = sample_len / SKEW_WINDOWS;
+    const struct xcorr_params params = {
+        .max_lag = config->user.sample_rate * SKEW_RADIUS_MS / 1000,
+        .threads = config->user.threads,
+        .cancel = audiosync_cancelled,
+    };
+    double pos[SKEW_WINDOWS], lags[SKEW_WINDOWS];
+    double values[SKEW_WINDOWS * (SKEW_WINDOWS - 1) / 2];
+    size_t n = 0;
+
+    // The source of each sub-window starts at its lag, so that the search
+    // can be limited around it.
+    for (size_t i = 0; len > 0 && i < SKEW_WINDOWS; i++) {
+        const long start = (long) (i * len) + lag;
+        if (start < 0 || start + 2 * (long) len > 2 * (long) sample_len) {
+            continue;
+        }
+
+        long found;
+        double coef;
+        if (cross_correlation_ex(source + start, sample + i * len, len,
+                                 &params, &found, &coef) < 0
+                || coef < SKEW_MIN_CONFIDENCE) {
+            continue;
+        }
+        pos[n] = i * len + len / 2.0;
+        lags[n] = lag + found;
+        n++;
+    }
+    if (n < SKEW_MIN_WINDOWS) {
+        return -1;
+    }
+
+    size_t n_values = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            values[n_values++] = (lags[j] - lags[i]) / (pos[j] - pos[i]);
+        }
+    }
+    const double slope = median(values, n_values);
+    for (size_t i = 0; i < n; i++) {
+        values[i] = lags[i] - slope * pos[i];
+    }
+    *fit_lag = median(values, n);
+    *ppm = slope * 1e6;
+
+    log("skew of %f ppm with %zu sub-windows, starting at %f frames", *ppm,
+        n, *fit_lag);
+    return 0;
+}
+
+// Resamples `len` frames of the sample into `out` with linear interpolation,
+// so that it runs at the same rate as the source. The frames after the end
+// of the sample are zeroes.
+void skew_compensate(const double *sample, double *out, size_t len,
+                     double ppm) {
+    debug_assert(sample); debug_assert(out);
+
+    const double step = 1.0 / (1.0 + ppm * 1e-6);
+    for (size_t i = 0; i < len; i++) {
+        const double x = i * step;
+        const size_t j = x;
+        const double frac = x - j;
+        if (j + 1 < len) {
+            out[i] = sample[j] + frac * (sample[j+1] - sample[j]);
+        } else if (j < len) {
+            out[i] = sample[j];
+        } else {
+            out[i] = 0.0;
+        }
+    }
+}
+
+// Same as cross_correlation_ex, but the skew is estimated too. If the
+// confidence isn't enough for the configuration, the sample is compensated
+// in `buf`, which must have `sample_len` frames, and it's correlated again.
+// The best result of both is kept. If `buf` is NULL, the skew is only
+// estimated.
+//
+// The skew is zero if it couldn't be estimated.
+//
+// Returns -1 on error, or 0 otherwise.
+int skew_correlation(double *source, double *sample, size_t sample_len,
+                     const struct xcorr_params *params, double *buf,
+                     long *lag, double *coefficient, double *ppm) {
+    debug_assert(ppm);
+
+    const struct derived_config *config = get_config();
+    double fit_lag;
+    long comp_lag;
+    double comp_coef;
+
+    *ppm = 0.0;
+    if (cross_correlation_ex(source, sample, sample_len, params, lag,
+                             coefficient) < 0) {
+        return -1;
+    }
+    if (skew_estimate(source, sample, sample_len, *lag, ppm, &fit_lag) < 0) {
+        *ppm = 0.0;
+        return 0;
+    }
+    if (*coefficient >= config->user.min_confidence || buf == NULL
+            || fabs(*ppm) < SKEW_MIN_PPM) {
+        return 0;
+    }
+
+    // The compensated sample starts at the same frame, so its lag is the
+    // same as the fit's.
+    skew_compensate(sample, buf, sample_len, *ppm);
+    if (cross_correlation_ex(source, buf, sample_len, params, &comp_lag,
+                             &comp_coef) == 0 && comp_coef > *coefficient) {
+        log("compensated skew improves the confidence from %f to %f",
+            *coefficient, comp_coef);
+        *lag = comp_lag;
+        *coefficient = comp_coef;
+    }
+
+    return 0;
+}
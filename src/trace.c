@@ -0,0 +1,240 @@
+// Stage-level tracing. See trace.h for more details.
+//
+// Every thread that records an event claims a buffer, which is a ring of
+// events with a single producer, the thread itself, and a single consumer,
+// the dump. The buffers are never freed: once their thread exits, they're
+// marked as unused and another thread may claim them, so the short-lived
+// threads of the transforms don't allocate a new one each time. They're
+// kept in a list that only grows, with a compare-and-swap, so neither the
+// threads nor the dump need any locks to walk it.
+
+#define _GNU_SOURCE  // syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/trace.h>
+
+// Events per thread between dumps. The rest are dropped and counted.
+#define TRACE_CAPACITY 4096
+
+
+// A complete span ('X') or an instant event ('i').
+struct trace_event {
+    const char *name;
+    uint64_t start;   // In nanoseconds
+    uint64_t dur;     // In nanoseconds
+    long arg;
+    pid_t tid;
+    char phase;
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    int in_use;
+    pid_t tid;
+    const char *thread_name;
+    // The events [tail, head) haven't been dumped yet. The head is only
+    // written by the owner, and the tail by the dump.
+    size_t head;
+    size_t tail;
+    size_t dropped;
+    struct trace_event events[TRACE_CAPACITY];
+};
+
+static struct trace_buffer *buffers = NULL;
+static __thread struct trace_buffer *current = NULL;
+static pthread_key_t release_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+// Only one dump at a time, which doesn't affect the threads recording.
+static pthread_mutex_t dump_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Marks the buffer of an exiting thread as unused.
+static void release_buffer(void *arg) {
+    struct trace_buffer *buf = arg;
+    __atomic_store_n(&buf->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_key() {
+    pthread_key_create(&release_key, release_buffer);
+}
+
+// Returns the buffer of the current thread, claiming an unused one or
+// allocating it if needed, or NULL if the allocation failed.
+static struct trace_buffer *thread_buffer() {
+    if (current) return current;
+
+    pthread_once(&key_once, create_key);
+    struct trace_buffer *buf;
+    for (buf = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); buf;
+            buf = buf->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&buf->in_use, &unused, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (buf == NULL) {
+        buf = calloc(1, sizeof(*buf));
+        if (buf == NULL) return NULL;
+        buf->in_use = 1;
+        buf->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &buf->next, buf, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED));
+    }
+    buf->tid = syscall(SYS_gettid);
+    buf->thread_name = NULL;
+    pthread_setspecific(release_key, buf);
+    current = buf;
+    return buf;
+}
+
+static void push(const struct trace_event *event) {
+    struct trace_buffer *buf = thread_buffer();
+    if (buf == NULL) return;
+
+    const size_t head = buf->head;
+    if (head - __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE)
+            >= TRACE_CAPACITY) {
+        __atomic_add_fetch(&buf->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    buf->events[head % TRACE_CAPACITY] = *event;
+    buf->events[head % TRACE_CAPACITY].tid = buf->tid;
+    __atomic_store_n(&buf->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Starts a span in the current thread, with an optional argument, like the
+// length of the data.
+struct trace_span trace_span_start(const char *name, long arg) {
+    return (struct trace_span) { .name = name, .start = now_ns(),
+                                 .arg = arg };
+}
+
+// Ends a span, saving it in the current thread's buffer.
+void trace_span_end(const struct trace_span *span) {
+    const struct trace_event event = {
+        .name = span->name,
+        .start = span->start,
+        .dur = now_ns() - span->start,
+        .arg = span->arg,
+        .phase = 'X',
+    };
+    push(&event);
+}
+
+// Saves an instant event, like the arrival of the first frames.
+void trace_instant(const char *name) {
+    const struct trace_event event = {
+        .name = name,
+        .start = now_ns(),
+        .arg = -1,
+        .phase = 'i',
+    };
+    push(&event);
+}
+
+// Names the current thread in the trace.
+void trace_thread_name(const char *name) {
+    struct trace_buffer *buf = thread_buffer();
+    if (buf) buf->thread_name = name;
+}
+
+// Consumes the pending events of every buffer, writing them into `fp` if
+// it's not NULL.
+static void consume(FILE *fp) {
+    const pid_t pid = getpid();
+    int first = 1;
+
+    for (struct trace_buffer *buf = __atomic_load_n(&buffers,
+                                                    __ATOMIC_ACQUIRE);
+            buf; buf = buf->next) {
+        const size_t head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+        const size_t dropped = __atomic_exchange_n(&buf->dropped, 0,
+                                                   __ATOMIC_RELAXED);
+        if (fp == NULL) {
+            __atomic_store_n(&buf->tail, head, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (dropped > 0) {
+            log("%zu trace events of thread %d were dropped", dropped,
+                buf->tid);
+        }
+
+        const char *thread_name = buf->thread_name;
+        if (thread_name) {
+            fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                    first ? "" : ",", pid, buf->tid, thread_name);
+            first = 0;
+        }
+        for (size_t i = buf->tail; i < head; i++) {
+            const struct trace_event *ev = &buf->events[i % TRACE_CAPACITY];
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+                    first ? "" : ",", ev->name, ev->phase, ev->start / 1e3);
+            if (ev->phase == 'X') {
+                fprintf(fp, "\"dur\":%.3f,", ev->dur / 1e3);
+            } else {
+                fprintf(fp, "\"s\":\"t\",");
+            }
+            if (ev->arg >= 0) {
+                fprintf(fp, "\"args\":{\"n\":%ld},", ev->arg);
+            }
+            fprintf(fp, "\"pid\":%d,\"tid\":%d}", pid, ev->tid);
+            first = 0;
+        }
+        __atomic_store_n(&buf->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Writes the events saved so far by every thread into `path` as a Chrome
+// trace, and removes them from the buffers.
+//
+// Returns 0 on success, or -1 on error.
+int trace_dump(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("audiosync: fopen for the trace failed");
+        return -1;
+    }
+
+    pthread_mutex_lock(&dump_mutex);
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    consume(fp);
+    fprintf(fp, "\n]}\n");
+    pthread_mutex_unlock(&dump_mutex);
+
+    if (fclose(fp) != 0) {
+        perror("audiosync: fclose for the trace failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Called at the end of a run: the events are dumped into the file in
+// AUDIOSYNC_TRACE, or discarded.
+void trace_run_end() {
+    const char *path = getenv("AUDIOSYNC_TRACE");
+    if (path && *path) {
+        if (trace_dump(path) == 0) {
+            log("trace saved to '%s'", path);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&dump_mutex);
+    consume(NULL);
+    pthread_mutex_unlock(&dump_mutex);
+}
@@ -0,0 +1,199 @@
+// Tracking of the lag after the initial sync. See tracking.h for more
+// details.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/tracking.h>
+
+// Maximum distance from the current lag searched by each measurement, in
+// milliseconds. It only has to cover the drift during a period.
+#define TRACK_RADIUS_MS 5
+// Weight of each new measurement in the smoothed lag.
+#define TRACK_SMOOTHING 0.25
+// The windows are much shorter than the intervals, so a lower coefficient
+// than the configured minimum is accepted when tracking, relative to it.
+#define TRACK_CONFIDENCE_RATIO 0.75
+// Measurements without enough confidence in a row before searching the lag
+// again from scratch.
+#define TRACK_MAX_FAILURES 3
+
+
+static size_t radius() {
+    return get_config()->user.sample_rate * TRACK_RADIUS_MS / 1000;
+}
+
+// The length of the recorded window used by the full search.
+static size_t full_len() {
+    return get_config()->interv_sample[0];
+}
+
+static size_t clamp_pos(long pos) {
+    return pos > 0 ? pos : 0;
+}
+
+// Copies `n` frames starting at `pos` out of the ring. The frames that
+// aren't in it (before the stream started, already released, or not written
+// yet) are zeroes.
+static void read_window(struct ring *ring, long pos, double *dst, size_t n) {
+    const long tail = ring->tail;
+    const long head = ring_count(ring);
+    const long start = pos > tail ? pos : tail;
+    const long end = pos + (long) n < head ? pos + (long) n : head;
+
+    memset(dst, 0, n * sizeof(*dst));
+    if (start < end) {
+        ring_read(ring, start, dst + (start - pos), end - start);
+    }
+}
+
+// Initializes a tracker that starts at `lag` frames, with its first update
+// once `pos` frames have been recorded.
+//
+// Returns 0 on success, or -1 if its buffers couldn't be allocated.
+int tracker_init(struct tracker *tr, long lag, size_t pos) {
+    debug_assert(tr);
+
+    const size_t len = full_len();
+    memset(tr, 0, sizeof(*tr));
+    tr->lag = lag;
+    tr->pos = pos;
+    tr->sample = arena_alloc(len * sizeof(*tr->sample));
+    tr->source = arena_alloc(2 * len * sizeof(*tr->source));
+    if (tr->sample == NULL || tr->source == NULL
+            || xcorr_workspace_init(&tr->ws, len) < 0) {
+        log("tracker arena_alloc failed");
+        tracker_free(tr);
+        return -1;
+    }
+
+    return 0;
+}
+
+void tracker_free(struct tracker *tr) {
+    arena_free(tr->sample);
+    arena_free(tr->source);
+    xcorr_workspace_free(&tr->ws);
+    tr->sample = NULL;
+    tr->source = NULL;
+}
+
+// The extra frames the rings need so that the producers can keep writing
+// while the tracker still needs the previous frames.
+size_t tracker_headroom() {
+    return get_config()->track_period + 2 * radius();
+}
+
+// Obtains the number of frames each ring must have before the next update.
+// The full search needs more of the reference than a regular measurement.
+void tracker_needed(const struct tracker *tr, size_t *cap_len,
+                    size_t *down_len) {
+    const long lag = round(tr->lag);
+    const long end = tr->failures >= TRACK_MAX_FAILURES
+        ? (long) tr->pos + lag + (long) full_len() / 2
+        : (long) tr->pos + lag + (long) radius();
+
+    *cap_len = tr->pos;
+    *down_len = clamp_pos(end);
+}
+
+// Measures the lag with a short window around the current one.
+static int measure(struct tracker *tr, struct ring *cap_ring,
+                   struct ring *down_ring, long *lag) {
+    const struct derived_config *config = get_config();
+    const size_t len = config->track_window;
+    const size_t r = radius();
+    const long sample_start = (long) tr->pos - (long) len;
+    const long source_start = sample_start + lround(tr->lag) - (long) r;
+    long found;
+
+    read_window(cap_ring, sample_start, tr->sample, len);
+    read_window(down_ring, source_start, tr->source, len + 2 * r);
+    if (bounded_correlation(tr->source, len + 2 * r, tr->sample, len, r, r,
+                            &found, &tr->confidence) < 0) {
+        return -1;
+    }
+
+    *lag = source_start - sample_start + found;
+    return tr->confidence >= config->user.min_confidence
+        * TRACK_CONFIDENCE_RATIO ? 0 : -1;
+}
+
+// Searches the lag again in a window as long as the first interval, with the
+// reference starting half of it before the current lag.
+static int search(struct tracker *tr, struct ring *cap_ring,
+                  struct ring *down_ring, long *lag) {
+    const struct derived_config *config = get_config();
+    const size_t len = full_len();
+    const struct xcorr_params params = {
+        .threads = config->user.threads,
+        .workspace = &tr->ws,
+        .cancel = audiosync_cancelled,
+    };
+    const long sample_start = (long) tr->pos - (long) len;
+    const long source_start = sample_start + lround(tr->lag)
+        - (long) len / 2;
+    long found;
+
+    read_window(cap_ring, sample_start, tr->sample, len);
+    read_window(down_ring, source_start, tr->source, 2 * len);
+    if (cross_correlation_ex(tr->source, tr->sample, len, &params, &found,
+                             &tr->confidence) < 0) {
+        return -1;
+    }
+
+    *lag = source_start - sample_start + found;
+    return tr->confidence >= config->user.min_confidence ? 0 : -1;
+}
+
+// Measures the lag with the latest frames, and releases the ones that won't
+// be needed anymore.
+//
+// Returns 0 if the lag was measured with enough confidence, or -1 otherwise.
+int tracker_update(struct tracker *tr, struct ring *cap_ring,
+                   struct ring *down_ring) {
+    debug_assert(tr); debug_assert(cap_ring); debug_assert(down_ring);
+
+    const struct derived_config *config = get_config();
+    int ret;
+    long lag;
+
+    if (tr->failures >= TRACK_MAX_FAILURES) {
+        ret = search(tr, cap_ring, down_ring, &lag);
+        if (ret == 0) {
+            log("lag found again at %ld frames with a confidence of %f", lag,
+                tr->confidence);
+            tr->lag = lag;
+        }
+    } else {
+        ret = measure(tr, cap_ring, down_ring, &lag);
+        if (ret == 0) {
+            tr->lag += TRACK_SMOOTHING * (lag - tr->lag);
+        }
+    }
+    tr->failures = ret == 0 ? 0 : tr->failures + 1;
+
+    // The frames before the windows of the next update can be reused. The
+    // full search needs the most of both.
+    tr->pos += config->track_period;
+    const long keep = (long) tr->pos - (long) full_len();
+    const size_t cap_release = clamp_pos(keep);
+    const size_t down_release = clamp_pos(keep + lround(tr->lag)
+                                          - (long) full_len() / 2
+                                          - (long) radius());
+    if (cap_release > cap_ring->tail
+            && cap_release <= ring_count(cap_ring)) {
+        ring_release(cap_ring, cap_release);
+    }
+    if (down_release > down_ring->tail
+            && down_release <= ring_count(down_ring)) {
+        ring_release(down_ring, down_release);
+    }
+
+    return ret;
+}
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+
+# Performance regression gate, run by CTest with the "perf" label.
+#
+# It runs one of the benchmarks and compares its results with the baseline
+# checked in at tests/perf_baseline.json. The times are divided by the
+# calibration loop the benchmarks measure, so that the baseline can be used
+# on machines of different speeds. Each metric has its own tolerance, and if
+# any of them is worse than its baseline by more than that, this prints a
+# table with all of them and fails.
+#
+#   perf_gate.py kernels BENCH_XCORR BASELINE
+#       The correlation kernels, with bench_xcorr.
+#   perf_gate.py run BENCH_RUN BASELINE
+#       A synthetic end-to-end run with bench_run, whose recording and
+#       reference are generated by this script. It's skipped if ffmpeg
+#       isn't installed.
+#
+# With --update, the baseline of the suite is replaced with the current
+# results, keeping the tolerances that were already there. That's what the
+# perf_baseline target does, after a change that's expected to alter them.
+
+import argparse
+import json
+import math
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+# Exit code for CTest's SKIP_RETURN_CODE.
+SKIP = 77
+
+# The sizes of the sweep in bench_xcorr, besides the intervals. They're
+# powers of two and not, but small enough that the suite takes seconds.
+KERNEL_SIZES = "4096,10007,65536,262144"
+KERNEL_ITERATIONS = 31
+
+# The tolerances of new metrics, relative to their baseline, by their name
+# or their suite. The results of the runs must stay the same.
+DEFAULT_TOLERANCES = {
+    "kernels": 0.30,
+    "run": 0.50,
+    "run/errors": 0.0,
+    "run/mean_intervals": 0.0,
+}
+
+# The synthetic tracks: the reference's length and the lags of the
+# recordings in it, in seconds.
+SAMPLE_RATE = 48000
+REFERENCE_SECONDS = 20
+RECORDING_SECONDS = 12
+LAGS = [0.75, 2.25]
+RUN_REPEATS = "2"
+
+
+def run_kernels(bench, iterations):
+    out = subprocess.run([bench, "-s", KERNEL_SIZES, "-n", str(iterations)],
+                         check=True, stdout=subprocess.PIPE).stdout
+    results = json.loads(out)
+    calibration = results["calibration_us"]
+    metrics = {}
+    for res in results["results"]:
+        name = "kernel/{}/{}".format(res["kernel"], res["size"])
+        metrics[name] = res["median_us"] / calibration
+
+    return metrics
+
+
+def write_wav(path, frames):
+    """Mono WAV file with 64-bit float frames."""
+    data = struct.pack("<{}d".format(len(frames)), *frames)
+    with open(path, "wb") as f:
+        f.write(b"RIFF" + struct.pack("<I", 36 + len(data)) + b"WAVE")
+        f.write(b"fmt " + struct.pack("<IHHIIHH", 16, 3, 1, SAMPLE_RATE,
+                                      SAMPLE_RATE * 8, 8, 64))
+        f.write(b"data" + struct.pack("<I", len(data)))
+        f.write(data)
+
+
+def make_corpus(directory):
+    """Noise with a slow envelope as the reference, and noisier excerpts of
+    it as the recordings. Returns the path of the manifest."""
+    rng = random.Random(1234)
+    n = REFERENCE_SECONDS * SAMPLE_RATE
+    reference = [0.3 * (1.2 + math.sin(i / SAMPLE_RATE * 2.1))
+                 * rng.uniform(-1, 1) for i in range(n)]
+    ref_path = os.path.join(directory, "reference.wav")
+    write_wav(ref_path, reference)
+
+    lines = []
+    for i, lag in enumerate(LAGS):
+        start = int(lag * SAMPLE_RATE)
+        end = start + RECORDING_SECONDS * SAMPLE_RATE
+        recording = [x + 0.05 * rng.uniform(-1, 1)
+                     for x in reference[start:end]]
+        rec_path = os.path.join(directory, "recording{}.wav".format(i))
+        write_wav(rec_path, recording)
+        lines.append("{}\t{}\t{}".format(rec_path, ref_path,
+                                         round(lag * 1000)))
+
+    manifest = os.path.join(directory, "manifest.tsv")
+    with open(manifest, "w") as f:
+        f.write("\n".join(lines) + "\n")
+    return manifest
+
+
+def run_e2e(bench):
+    if shutil.which("ffmpeg") is None:
+        print("ffmpeg isn't installed, skipping the end-to-end run")
+        sys.exit(SKIP)
+
+    with tempfile.TemporaryDirectory(prefix="audiosync_perf_") as directory:
+        manifest = make_corpus(directory)
+        out = subprocess.run([bench, "-f", "json", "-n", RUN_REPEATS,
+                              manifest], check=True,
+                             stdout=subprocess.PIPE).stdout
+
+    lines = [json.loads(line) for line in out.decode().splitlines()]
+    runs, summary = lines[:-1], lines[-1]
+    calibration = summary["calibration_ms"]
+    # The time after the recorded audio was available, which is mostly
+    # spent starting ffmpeg and correlating.
+    latency = sorted(r["time_ms"] - r["recorded_s"] * 1000 for r in runs)
+    return {
+        "run/cpu_ms": summary["cpu_ms"]["p50"] / calibration,
+        "run/latency_ms": latency[len(latency) // 2] / calibration,
+        "run/mean_intervals": summary["mean_intervals"],
+        # Lower is better for every metric, so the errors are compared.
+        "run/errors": summary["runs"] - summary["correct"],
+    }
+
+
+def compare(current, baseline):
+    """Prints the table of the metrics, and returns whether any of them
+    regressed."""
+    rows = []
+    failed = False
+    for name in sorted(set(current) | set(baseline)):
+        base = baseline.get(name)
+        cur = current.get(name)
+        if base is None:
+            rows.append((name, "-", "{:.4g}".format(cur), "", "", "new"))
+            continue
+        if cur is None:
+            rows.append((name, "{:.4g}".format(base["value"]), "-", "", "",
+                         "MISSING"))
+            failed = True
+            continue
+
+        limit = base["value"] * (1 + base["tolerance"])
+        if base["value"] > 0:
+            change = "{:+.1f}%".format((cur / base["value"] - 1) * 100)
+        else:
+            change = "{:+.4g}".format(cur - base["value"])
+        if cur > limit:
+            status = "REGRESSION"
+            failed = True
+        elif cur < base["value"] * (1 - base["tolerance"]):
+            status = "improved"
+        else:
+            status = "ok"
+        rows.append((name, "{:.4g}".format(base["value"]),
+                     "{:.4g}".format(cur), change,
+                     "+{:.0f}%".format(base["tolerance"] * 100), status))
+
+    header = ("metric", "baseline", "current", "change", "limit", "")
+    widths = [max(len(row[i]) for row in rows + [header])
+              for i in range(len(header))]
+    for row in [header] + rows:
+        print("  ".join(col.ljust(w) for col, w in zip(row, widths)).rstrip())
+    return failed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Performance regression"
+                                     " gate for audiosync.")
+    parser.add_argument("suite", choices=["kernels", "run"])
+    parser.add_argument("bench", help="path to bench_xcorr or bench_run")
+    parser.add_argument("baseline", help="path to the baseline file")
+    parser.add_argument("--update", action="store_true",
+                        help="replace the baseline with the results")
+    parser.add_argument("--iterations", type=int, default=KERNEL_ITERATIONS,
+                        help="iterations of each kernel"
+                        " (default: %(default)s)")
+    args = parser.parse_args()
+
+    try:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    except FileNotFoundError:
+        baseline = {}
+    suite = baseline.get(args.suite, {})
+
+    if args.suite == "kernels":
+        current = run_kernels(args.bench, args.iterations)
+    else:
+        current = run_e2e(args.bench)
+
+    if args.update:
+        baseline[args.suite] = {
+            name: {
+                "value": round(value, 6),
+                "tolerance": suite.get(name, {}).get(
+                    "tolerance", DEFAULT_TOLERANCES.get(
+                        name, DEFAULT_TOLERANCES[args.suite])),
+            } for name, value in current.items()
+        }
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print("Updated the {} baseline in {}".format(args.suite,
+                                                     args.baseline))
+        return 0
+
+    if compare(current, suite):
+        print("\nThe {} suite regressed. If it's expected, refresh the"
+              " baseline with the perf_baseline target.".format(args.suite))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/acceptance.h>
+#include <audiosync/config.h>
+
+
+// Testing the acceptance policy, with and without the agreement between
+// intervals.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    struct acceptance acc;
+    config.sample_rate = 8000;
+    config.agreement_tolerance = 0.001;
+    assert(audiosync_configure(&config) == 0);
+
+    // Without agreement, only the minimum confidence is used.
+    printf(">> Test 1\n");
+    acceptance_init(&acc);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 300, 0.96) == 1);
+
+    // Three intervals agreeing within the tolerance (8 frames) are accepted
+    // even with lower coefficients.
+    printf(">> Test 2\n");
+    config.agreement_intervals = 3;
+    assert(audiosync_configure(&config) == 0);
+    acceptance_init(&acc);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 104, 0.55) == 0);
+    assert(acceptance_update(&acc, 110, 0.6) == 1);
+
+    // A different lag or a failed interval breaks the agreement.
+    printf(">> Test 3\n");
+    acceptance_init(&acc);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 100, 0.6) == 0);
+    assert(acceptance_update(&acc, 5000, 0.6) == 0);
+    assert(acceptance_update(&acc, 5000, 0.6) == 0);
+    acceptance_fail(&acc);
+    assert(acceptance_update(&acc, 5000, 0.6) == 0);
+    assert(acceptance_update(&acc, 5000, 0.6) == 0);
+    assert(acceptance_update(&acc, 5000, 0.6) == 1);
+
+    // The average coefficient of the last intervals must be high enough.
+    printf(">> Test 4\n");
+    acceptance_init(&acc);
+    assert(acceptance_update(&acc, 100, 0.1) == 0);
+    assert(acceptance_update(&acc, 100, 0.4) == 0);
+    assert(acceptance_update(&acc, 100, 0.4) == 0);
+    assert(acceptance_update(&acc, 100, 0.7) == 1);
+
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/activity.h>
+
+#define BLOCK 80
+#define LEN 8000
+#define SILENCE 1000
+
+
+// Testing that the activity detector finds where the audio starts and
+// counts the active frames, no matter how the data is split.
+int main() {
+    struct activity act;
+    double *data = calloc(LEN, sizeof(*data));
+    srand(1234);
+    for (size_t i = SILENCE; i < LEN; i++) {
+        data[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+
+    // Leading silence, read in chunks that aren't multiples of the block.
+    printf(">> Test 1\n");
+    activity_init(&act, BLOCK, 0.01);
+    for (size_t i = 0; i < LEN; i += 333) {
+        activity_update(&act, data + i, i + 333 < LEN ? 333 : LEN - i);
+    }
+    printf(">> Start=%zu active=%zu\n", activity_start(&act),
+           activity_active(&act));
+    // The first active block is the one containing the first sound.
+    assert(activity_start(&act) == SILENCE / BLOCK * BLOCK);
+    assert(activity_active(&act) == LEN - SILENCE / BLOCK * BLOCK);
+
+    // Nothing but silence.
+    printf(">> Test 2\n");
+    activity_init(&act, BLOCK, 0.01);
+    activity_update(&act, data, SILENCE);
+    assert(activity_start(&act) == ACTIVITY_NONE);
+    assert(activity_active(&act) == 0);
+
+    // Quiet noise below the threshold isn't active.
+    printf(">> Test 3\n");
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] *= 0.001;
+    }
+    activity_init(&act, BLOCK, 0.01);
+    activity_update(&act, data, LEN);
+    assert(activity_start(&act) == ACTIVITY_NONE);
+    assert(activity_active(&act) == 0);
+
+    free(data);
+
+    return 0;
+}
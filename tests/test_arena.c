@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+
+
+// Testing that the arena reuses the buffers given back to it, and that
+// they're correctly released when trimmed.
+int main() {
+    void *buf1, *buf2, *buf3;
+
+    // The buffers must be aligned and writable.
+    printf(">> Test 1\n");
+    buf1 = arena_alloc(1000 * sizeof(double));
+    assert(buf1 != NULL);
+    assert((uintptr_t) buf1 % 64 == 0);
+    memset(buf1, 1, 1000 * sizeof(double));
+
+    // A buffer in use can't be returned again.
+    printf(">> Test 2\n");
+    buf2 = arena_alloc(1000 * sizeof(double));
+    assert(buf2 != NULL);
+    assert(buf2 != buf1);
+
+    // After freeing it, the same buffer is reused, even for a smaller size.
+    printf(">> Test 3\n");
+    arena_free(buf1);
+    buf3 = arena_alloc(100 * sizeof(double));
+    assert(buf3 == buf1);
+
+    // Trimming only releases the buffers that aren't in use.
+    printf(">> Test 4\n");
+    arena_free(buf3);
+    size_t released = arena_trim();
+    printf(">> Released %ld bytes\n", released);
+    assert(released >= 1000 * sizeof(double));
+    assert(arena_trim() == 0);
+    memset(buf2, 1, 1000 * sizeof(double));
+    arena_free(buf2);
+    assert(arena_trim() > 0);
+
+    // The regular pages mode works as well.
+    printf(">> Test 5\n");
+    arena_set_huge_pages(HUGE_PAGES_OFF);
+    buf1 = arena_alloc(5 * 1024 * 1024);
+    assert(buf1 != NULL);
+    memset(buf1, 1, 5 * 1024 * 1024);
+    arena_free(buf1);
+    arena_free(NULL);
+    arena_trim();
+
+    // The shared buffers are kept apart from the rest, and the data written
+    // into their memfd is seen in the buffer.
+    printf(">> Test 6\n");
+    size_t offset;
+    const double value = 1.5;
+    buf1 = arena_alloc(1000 * sizeof(double));
+    buf2 = arena_alloc_shared(1000 * sizeof(double));
+    assert(buf2 != NULL);
+    assert(arena_shared_fd(buf1, &offset) == -1);
+    const int fd = arena_shared_fd((double *) buf2 + 10, &offset);
+    assert(fd >= 0);
+    assert(offset == 10 * sizeof(double));
+    assert(pwrite(fd, &value, sizeof(value), offset) == sizeof(value));
+    assert(((double *) buf2)[10] == value);
+    arena_free(buf1);
+    arena_free(buf2);
+    assert(arena_alloc(100) == buf1);
+    assert(arena_alloc_shared(100) == buf2);
+    arena_free(buf1);
+    arena_free(buf2);
+    assert(arena_shared_fd(buf2, &offset) == -1);
+    arena_trim();
+
+    return 0;
+}
@@ -9,6 +9,14 @@ import threading
 import audiosync
 
 
+print(">> Changing the configuration")
+assert(audiosync.configure(intervals=[3, 6, 10, 15, 20, 30], threads=2))
+assert(not audiosync.configure(min_confidence=2.0))
+config = audiosync.config()
+print(">> Current config is", config)
+assert(config['intervals'][-1] == 30)
+assert(config['min_confidence'] == 0.95)
+
 print(">> Calling setup function")
 audiosync.setup("test")
 
@@ -45,3 +53,10 @@ th2.start()
 print(">> Aborting second thread")
 audiosync.abort()
 th2.join()
+
+print(">> Reading the metrics")
+metrics = audiosync.metrics()
+print(">> Current metrics are", metrics)
+assert(metrics['runs'] == 2)
+assert(metrics['pauses'] == 1)
+assert(metrics['latency']['run']['count'] == 2)
@@ -0,0 +1,134 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+
+// Long enough for each stage of the cross-correlation to take a while.
+#define LEN (1 << 16)
+#define LAG 1234
+// Number of points during the calculation at which it's cancelled.
+#define STEPS 8
+
+struct job {
+    double *source;
+    double *sample;
+    struct xcorr_params params;
+    volatile int cancel;
+    int ret;
+    double end;
+};
+
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int is_cancelled(void *ctx) {
+    return ((struct job *) ctx)->cancel;
+}
+
+static void *correlate(void *arg) {
+    struct job *job = arg;
+    long lag;
+    double coef;
+    job->ret = cross_correlation_ex(job->source, job->sample, LEN,
+                                    &job->params, &lag, &coef);
+    job->end = now_ms();
+    return NULL;
+}
+
+// Testing that a cross-correlation can be cancelled, and that it returns
+// soon after that at any point of the calculation.
+int main() {
+    struct job job = {
+        .source = malloc(2 * LEN * sizeof(*job.source)),
+        .sample = malloc(LEN * sizeof(*job.sample)),
+        .params = XCORR_DEFAULT_PARAMS,
+    };
+    job.params.threads = 1;
+    job.params.cancel = is_cancelled;
+    job.params.cancel_ctx = &job;
+    srand(1234);
+    for (size_t i = 0; i < 2 * LEN; i++) {
+        job.source[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    for (size_t i = 0; i < LEN; i++) {
+        job.sample[i] = job.source[i + LAG];
+    }
+
+    // Without cancelling it, the lag is found as usual.
+    printf(">> Test 1\n");
+    long lag;
+    double coef;
+    double start = now_ms();
+    assert(cross_correlation_ex(job.source, job.sample, LEN, &job.params,
+                                &lag, &coef) == 0);
+    const double full = now_ms() - start;
+    printf(">> Lag %ld with confidence %f in %f ms\n", lag, coef, full);
+    assert(lag == LAG);
+    assert(coef > 0.99);
+
+    // If it was cancelled already, nothing is calculated.
+    printf(">> Test 2\n");
+    job.cancel = 1;
+    start = now_ms();
+    assert(cross_correlation_ex(job.source, job.sample, LEN, &job.params,
+                                &lag, &coef) == -1);
+    const double early = now_ms() - start;
+    printf(">> Returned after %f ms\n", early);
+    assert(early < full / 4);
+
+    // Cancelling it at different points of the calculation from another
+    // thread. It can only stop between the transforms, which are three
+    // of similar cost, so it takes about a third of the whole calculation at
+    // most, instead of the rest of it. Some margin is left for the
+    // scheduling of the threads.
+    printf(">> Test 3\n");
+    double worst = 0.0;
+    for (int i = 1; i < STEPS; i++) {
+        pthread_t th;
+        job.cancel = 0;
+        assert(pthread_create(&th, NULL, correlate, &job) == 0);
+
+        const double delay = full * i / STEPS;
+        const struct timespec ts = {
+            .tv_sec = delay / 1e3,
+            .tv_nsec = fmod(delay, 1e3) * 1e6,
+        };
+        nanosleep(&ts, NULL);
+        const double cancelled = now_ms();
+        job.cancel = 1;
+        assert(pthread_join(th, NULL) == 0);
+
+        const double latency = job.end > cancelled ? job.end - cancelled : 0;
+        printf(">> Cancelled at %f ms: returned %d after %f ms\n", delay,
+               job.ret, latency);
+        if (latency > worst) worst = latency;
+    }
+    printf(">> Worst latency of %f ms out of %f ms\n", worst, full);
+    assert(worst < full * 2 / 3);
+
+    // Only a run in progress is aborted, which then cancels the
+    // correlations using audiosync_cancelled.
+    printf(">> Test 4\n");
+    assert(audiosync_abort_running() == 0);
+    assert(audiosync_status() == IDLE_ST);
+    assert(!audiosync_cancelled(NULL));
+    global_status = PAUSED_ST;
+    assert(audiosync_abort_running() == 1);
+    assert(audiosync_status() == ABORT_ST);
+    assert(audiosync_cancelled(NULL));
+    global_status = IDLE_ST;
+
+    free(job.source);
+    free(job.sample);
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+
+
+// Testing that the configuration is validated correctly, and that the
+// derived values are consistent with it.
+int main() {
+    struct audiosync_config config;
+    const struct derived_config *derived;
+
+    // The default configuration must be valid and match the previous
+    // compile-time values.
+    printf(">> Test 1\n");
+    config = DEFAULT_CONFIG;
+    assert(audiosync_config_validate(&config) == 0);
+    derived = get_config();
+    assert(derived->len_sample == 30 * 48000);
+    assert(derived->len_source == 2 * 30 * 48000);
+    assert(derived->interv_sample[0] == 3 * 48000);
+    assert(derived->interv_source[0] == 2 * 3 * 48000);
+    assert(strcmp(derived->sample_rate_str, "48000") == 0);
+    assert(strcmp(derived->max_seconds_str, "30") == 0);
+
+    // Invalid configurations.
+    printf(">> Test 2\n");
+    config = DEFAULT_CONFIG;
+    config.sample_rate = 0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.intervals[2] = config.intervals[1];
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.n_intervals = 0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.intervals[0] = 1e-6;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.intervals[1] = config.intervals[0] + 1e-6;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.min_confidence = 1.5;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.threads = 0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.max_lag = -1.0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.track_window = config.intervals[0] + 1.0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.track_period = 0.0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.engine = ENGINE_SIGN + 1;
+    assert(audiosync_config_validate(&config) < 0);
+    assert(engine_from_string("sign", &config.engine) == 0);
+    assert(config.engine == ENGINE_SIGN);
+    assert(audiosync_config_validate(&config) == 0);
+    assert(engine_from_string("fast", &config.engine) < 0);
+    config = DEFAULT_CONFIG;
+    config.transport = TRANSPORT_MEMFD + 1;
+    assert(audiosync_config_validate(&config) < 0);
+    assert(transport_from_string("memfd", &config.transport) == 0);
+    assert(config.transport == TRANSPORT_MEMFD);
+    assert(audiosync_config_validate(&config) == 0);
+    assert(transport_from_string("shm", &config.transport) < 0);
+    config = DEFAULT_CONFIG;
+    config.agreement_intervals = 1;
+    assert(audiosync_config_validate(&config) < 0);
+    config.agreement_intervals = config.n_intervals + 1;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.agreement_confidence = 0.0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.diag_files = 0;
+    assert(audiosync_config_validate(&config) < 0);
+    config = DEFAULT_CONFIG;
+    config.diag_decimation = 0;
+    assert(audiosync_config_validate(&config) < 0);
+
+    // An invalid configuration isn't applied.
+    printf(">> Test 3\n");
+    assert(audiosync_configure(&config) < 0);
+    audiosync_get_config(&config);
+    assert(config.max_lag == 0.0);
+
+    // Applying a new configuration updates the derived values.
+    printf(">> Test 4\n");
+    config = DEFAULT_CONFIG;
+    config.sample_rate = 16000;
+    config.n_intervals = 2;
+    config.intervals[0] = 1.5;
+    config.intervals[1] = 4;
+    config.max_lag = 0.5;
+    config.threads = 1;
+    assert(audiosync_configure(&config) == 0);
+    derived = get_config();
+    assert(derived->interv_sample[0] == 24000);
+    assert(derived->len_sample == 64000);
+    assert(derived->len_source == 128000);
+    assert(derived->max_lag == 8000);
+    assert(derived->track_period == 32000);
+    assert(derived->track_window == 8000);
+    assert(derived->agreement_tolerance == 32);
+    assert(strcmp(derived->sample_rate_str, "16000") == 0);
+    assert(strcmp(derived->max_seconds_str, "4") == 0);
+
+    // It can't be changed while it's acquired, like during a prefetch.
+    printf(">> Test 5\n");
+    assert(config_acquire() == derived);
+    config.max_lag = 1.0;
+    assert(audiosync_configure(&config) < 0);
+    assert(derived->max_lag == 8000);
+    config_release();
+    assert(audiosync_configure(&config) == 0);
+    assert(derived->max_lag == 16000);
+
+    return 0;
+}
@@ -2,10 +2,36 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
 #include <audiosync/cross_correlation.h>
 
 
+// The arguments of correlate_repeatedly.
+struct repeated {
+    double *source;
+    double *sample;
+    size_t len;
+    long lag;
+    int done;
+};
+
+// Correlates the same source and sample many times, checking the lag.
+static void *correlate_repeatedly(void *arg) {
+    struct repeated *r = arg;
+    long lag;
+    double coef;
+
+    for (int i = 0; i < 50; ++i) {
+        assert(cross_correlation(r->source, r->sample, r->len, &lag,
+                                 &coef) == 0);
+        assert(lag == r->lag);
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
 // Testing the cross_correlation function. These results can be compared to
 // matlab's implementation:
 // https://ch.mathworks.com/help/matlab/ref/xcorr.html
@@ -46,7 +72,7 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == 3);
-    assert(coef > MIN_CONFIDENCE);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
 
     // Similar to the test above, but the other way around.
     printf(">> Test 4\n");
@@ -57,7 +83,7 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == -3);
-    assert(coef > MIN_CONFIDENCE);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
 
     // Other simple tests
     printf(">> Test 5\n");
@@ -68,7 +94,7 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == -3);
-    assert(coef > MIN_CONFIDENCE);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
 
     printf(">> Test 6\n");
     double source6[] = { 0,0,0,0,0,1,2,3,4,-1,-3,-5,0,0 };
@@ -78,7 +104,7 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == 5);
-    assert(coef > MIN_CONFIDENCE);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
 
     // Using a sine wave with positive linear correlation (same function).
     printf(">> Test 7\n");
@@ -93,7 +119,7 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == 0);
-    assert(coef > MIN_CONFIDENCE);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
 
     // Using a sine wave with negative linear correlation.
     printf(">> Test 8\n");
@@ -110,7 +136,218 @@ int main() {
     printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
     assert(ret == 0);
     assert(lag == -1);
-    assert(coef < -MIN_CONFIDENCE);  // Leaving a margin for precision
+    assert(coef < -DEFAULT_MIN_CONFIDENCE);  // Leaving a margin for precision
+
+    // Same as test 6, but limiting the maximum lag below the actual one, and
+    // calculating the transforms in a single thread.
+    printf(">> Test 9\n");
+    struct xcorr_params params = XCORR_DEFAULT_PARAMS;
+    params.threads = 1;
+    length = sizeof(sample6) / sizeof(*sample6);
+    ret = cross_correlation_ex(source6, sample6, length, &params, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 5);
+    params.max_lag = 4;
+    ret = cross_correlation_ex(source6, sample6, length, &params, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(labs(lag) <= 4);
+
+    // The bounded correlation finds the same lags as the full one, but only
+    // near the provided center.
+    printf(">> Test 10\n");
+    length = sizeof(sample6) / sizeof(*sample6);
+    ret = bounded_correlation(source6, 2 * length, sample6, length, 4, 2,
+                              &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 5);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
+    ret = bounded_correlation(source6, 2 * length, sample6, length, 0, 2,
+                              &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(labs(lag) <= 2);
+
+    // Same as test 7, but with the buffers from a workspace, which is too
+    // small for the second call and thus ignored.
+    printf(">> Test 11\n");
+    struct xcorr_workspace ws;
+    assert(xcorr_workspace_init(&ws, 1000) == 0);
+    params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+    params.workspace = &ws;
+    ret = cross_correlation_ex(source7, sample7, 1000, &params, &lag, &coef);
+    printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+    assert(ret == 0);
+    assert(lag == 0);
+    assert(coef > DEFAULT_MIN_CONFIDENCE);
+    ws.len = 1;
+    ret = cross_correlation_ex(source7, sample7, 1000, &params, &lag, &coef);
+    assert(ret == 0);
+    assert(lag == 0);
+    ws.len = 1000;
+    xcorr_workspace_free(&ws);
+
+    // The autocorrelation isn't circular, and only its ratios matter.
+    printf(">> Test 12\n");
+    double data12[] = { 1,2,3 };
+    double auto12[3];
+    ret = autocorrelation(data12, 3, auto12);
+    printf(">> Returned %d: %f %f %f\n", ret, auto12[0], auto12[1],
+           auto12[2]);
+    assert(ret == 0);
+    assert(fabs(auto12[1] / auto12[0] - 8.0 / 14.0) < 1e-9);
+    assert(fabs(auto12[2] / auto12[0] - 3.0 / 14.0) < 1e-9);
+
+    // A sample preceded by as many zeros, declared as pre-padded, gives the
+    // same results without copying it, with and without a workspace.
+    printf(">> Test 13\n");
+    length = 1000;
+    double source13[length*2];
+    double padded13[length*2];
+    double *sample13 = padded13 + length;
+    long expected;
+    double expected_coef;
+    for (size_t i = 0; i < length*2; ++i)
+        source13[i] = (double) rand() / RAND_MAX - 0.5;
+    for (size_t i = 0; i < length; ++i)
+        padded13[i] = 0.0;
+    assert(xcorr_workspace_init(&ws, length) == 0);
+    const long lags13[] = { 37, -21 };
+    for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < length; ++j) {
+            const long pos = (long) j + lags13[i];
+            sample13[j] = pos >= 0 ? source13[pos] : 0.0;
+        }
+        params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+        ret = cross_correlation_ex(source13, sample13, length, &params,
+                                   &expected, &expected_coef);
+        assert(ret == 0);
+        assert(expected == lags13[i]);
+        params.flags = XCORR_PREPADDED;
+        ret = cross_correlation_ex(source13, sample13, length, &params, &lag,
+                                   &coef);
+        printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+        assert(ret == 0);
+        assert(lag == expected);
+        assert(coef == expected_coef);
+        params.workspace = &ws;
+        ret = cross_correlation_ex(source13, sample13, length, &params, &lag,
+                                   &coef);
+        assert(ret == 0);
+        assert(lag == expected);
+        assert(coef == expected_coef);
+    }
+    xcorr_workspace_free(&ws);
+
+    // Correlating the same sample with many sources gives the same results
+    // as one by one, ranked by their coefficient. The sample is taken from
+    // the second source, and the third one is a noisier version of it.
+    printf(">> Test 14\n");
+    double source14[3][length*2];
+    double *sources14[] = { source14[0], source14[1], source14[2] };
+    struct xcorr_match matches[3];
+    for (size_t i = 0; i < length*2; ++i) {
+        source14[0][i] = (double) rand() / RAND_MAX - 0.5;
+        source14[1][i] = (double) rand() / RAND_MAX - 0.5;
+        source14[2][i] = source14[1][i] + (double) rand() / RAND_MAX - 0.5;
+    }
+    for (size_t i = 0; i < length; ++i)
+        sample13[i] = source14[1][i + 37];
+    for (unsigned int threads = 1; threads <= 3; ++threads) {
+        params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+        params.threads = threads;
+        params.flags = threads == 3 ? XCORR_PREPADDED : 0;
+        ret = cross_correlation_many(sources14, 3, sample13, length, &params,
+                                     matches);
+        printf(">> Returned %d: best=%zu lag=%ld coef=%f\n", ret,
+               matches[0].index, matches[0].lag, matches[0].coefficient);
+        assert(ret == 3);
+        assert(matches[0].index == 1 && matches[0].lag == 37);
+        assert(matches[1].index == 2 && matches[1].lag == 37);
+        assert(matches[2].index == 0);
+        for (size_t i = 0; i < 3; ++i) {
+            ret = cross_correlation_ex(sources14[matches[i].index], sample13,
+                                       length, &params, &lag, &coef);
+            assert(ret == 0);
+            assert(matches[i].lag == lag);
+            assert(matches[i].coefficient == coef);
+        }
+    }
+
+    // The sample is found anywhere inside a long source, even if it's much
+    // quieter than the rest of the source.
+    printf(">> Test 15\n");
+    const size_t long_len = 50 * length;
+    double *long_source = malloc(long_len * sizeof(*long_source));
+    size_t position;
+    for (size_t i = 0; i < long_len; ++i)
+        long_source[i] = (double) rand() / RAND_MAX - 0.5;
+    const size_t positions15[] = { 31337, 0, long_len - length };
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < length; ++j) {
+            long_source[positions15[i] + j] *= 0.01;
+            sample13[j] = long_source[positions15[i] + j];
+        }
+        for (unsigned int threads = 1; threads <= 2; ++threads) {
+            params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+            params.threads = threads;
+            ret = long_correlation(long_source, long_len, sample13, length,
+                                   &params, &position, &coef);
+            printf(">> Returned %d: position=%zu coef=%f\n", ret, position,
+                   coef);
+            assert(ret == 0);
+            assert(position == positions15[i]);
+            assert(coef > 0.999);
+        }
+    }
+    assert(long_correlation(long_source, length - 1, sample13, length, NULL,
+                            &position, &coef) < 0);
+    free(long_source);
+
+    // With the source's transform calculated beforehand, the results are
+    // exactly the same, with and without the padding before the sample.
+    printf(">> Test 16\n");
+    double complex *spectrum = arena_alloc((length + 1) * sizeof(*spectrum));
+    assert(spectrum != NULL);
+    xcorr_spectrum(source13, length, spectrum);
+    for (size_t i = 0; i < length; ++i)
+        sample13[i] = source13[i + 37];
+    for (unsigned int flags = 0; flags <= XCORR_PREPADDED; ++flags) {
+        params = (struct xcorr_params) XCORR_DEFAULT_PARAMS;
+        params.flags = flags;
+        ret = cross_correlation_ex(source13, sample13, length, &params,
+                                   &expected, &expected_coef);
+        assert(ret == 0);
+        params.source_spectrum = spectrum;
+        ret = cross_correlation_ex(source13, sample13, length, &params, &lag,
+                                   &coef);
+        printf(">> Returned %d: lag=%ld coef=%f\n", ret, lag, coef);
+        assert(ret == 0);
+        assert(lag == 37 && lag == expected);
+        assert(coef == expected_coef);
+    }
+    arena_free(spectrum);
+
+    // The cached plans can be cleared and created again while another
+    // thread is correlating with them.
+    printf(">> Test 17\n");
+    struct repeated repeated = {
+        .source = source13,
+        .sample = sample13,
+        .len = length,
+        .lag = 37,
+    };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, correlate_repeatedly,
+                          &repeated) == 0);
+    while (!__atomic_load_n(&repeated.done, __ATOMIC_ACQUIRE)) {
+        xcorr_clear_plans();
+        assert(xcorr_prepare(length) == 0);
+    }
+    assert(pthread_join(thread, NULL) == 0);
+    xcorr_clear_plans();
 
     return 0;
 }
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/diag.h>
+
+#define LEN 4096
+#define LAG 100
+#define DECIMATION 16
+#define FILES 3
+
+
+// Reads the curve at the current position of `fp`, and returns its values,
+// which must be freed.
+static float *read_curve(FILE *fp, const char *name, size_t len) {
+    struct diag_curve curve;
+    assert(fread(&curve, sizeof(curve), 1, fp) == 1);
+    assert(strcmp(curve.name, name) == 0);
+    assert(curve.len == len);
+    float *values = malloc(len * sizeof(*values));
+    assert(fread(values, sizeof(*values), len, fp) == len);
+    return values;
+}
+
+// Testing that the curves of the cross-correlation are saved in a ring of
+// files, and that they can be read back.
+int main() {
+    char dir[] = "/tmp/audiosync_test_XXXXXX";
+    char path[sizeof(dir) + 32];
+    assert(mkdtemp(dir) != NULL);
+
+    double *source = malloc(2 * LEN * sizeof(*source));
+    double *sample = malloc(LEN * sizeof(*sample));
+    for (size_t i = 0; i < 2 * LEN; i++) {
+        source[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    memcpy(sample, source + LAG, LEN * sizeof(*sample));
+    long lag;
+    double coef;
+
+    // Nothing is saved unless there's a directory.
+    printf(">> Test 1\n");
+    struct audiosync_config config = DEFAULT_CONFIG;
+    assert(!diag_enabled());
+    assert(audiosync_configure(&config) == 0);
+    assert(!diag_enabled());
+
+    // Each cross-correlation is saved into the next file of the ring, so
+    // only the last ones are kept.
+    printf(">> Test 2\n");
+    snprintf(config.diag_dir, sizeof(config.diag_dir), "%s/diag", dir);
+    config.diag_files = FILES;
+    config.diag_decimation = DECIMATION;
+    assert(audiosync_configure(&config) == 0);
+    assert(diag_enabled());
+    for (int i = 0; i < FILES + 1; i++) {
+        assert(cross_correlation(source, sample, LEN, &lag, &coef) == 0);
+        assert(lag == LAG);
+    }
+    for (int i = 0; i < FILES + 1; i++) {
+        snprintf(path, sizeof(path), "%s/diag/diag-%04d.bin", dir, i);
+        assert((access(path, F_OK) == 0) == (i < FILES));
+    }
+
+    // The first file was replaced by the last dump, with its metadata, the
+    // peak candidates and the decimated curves.
+    printf(">> Test 3\n");
+    snprintf(path, sizeof(path), "%s/diag/diag-0000.bin", dir);
+    FILE *fp = fopen(path, "rb");
+    assert(fp != NULL);
+    struct diag_header header;
+    assert(fread(&header, sizeof(header), 1, fp) == 1);
+    assert(memcmp(header.magic, DIAG_MAGIC, sizeof(header.magic)) == 0);
+    assert(header.version == DIAG_VERSION);
+    assert(header.seq == FILES);
+    assert(header.sample_rate == DEFAULT_SAMPLE_RATE);
+    assert(header.sample_len == LEN);
+    assert(header.decimation == DECIMATION);
+    assert(header.lag == LAG);
+    assert(header.coefficient == coef);
+    assert(header.n_curves == 3);
+    assert(header.n_peaks > 0 && header.n_peaks <= DIAG_PEAKS);
+    struct diag_peak peaks[DIAG_PEAKS];
+    assert(fread(peaks, sizeof(*peaks), header.n_peaks, fp)
+           == header.n_peaks);
+    assert(peaks[0].lag == LAG);
+    for (size_t i = 1; i < header.n_peaks; i++) {
+        assert(fabs(peaks[i].value) <= fabs(peaks[i-1].value));
+        assert(peaks[i].lag != LAG);
+    }
+
+    // Each value of the curves is the one with the largest magnitude of its
+    // block.
+    printf(">> Test 4\n");
+    float *values = read_curve(fp, "source", 2 * LEN / DECIMATION);
+    for (size_t i = 0; i < 2 * LEN / DECIMATION; i++) {
+        double best = 0.0;
+        for (size_t j = i * DECIMATION; j < (i + 1) * DECIMATION; j++) {
+            if (fabs(source[j]) > fabs(best)) best = source[j];
+        }
+        assert(values[i] == (float) best);
+    }
+    free(values);
+    free(read_curve(fp, "sample", LEN / DECIMATION));
+    values = read_curve(fp, "correlation", 2 * LEN / DECIMATION);
+    assert(fabs(values[LAG / DECIMATION]) == fabs((float) peaks[0].value));
+    free(values);
+    assert(fgetc(fp) == EOF);
+    fclose(fp);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "%s/diag/diag-%04d.bin", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/diag", dir);
+    rmdir(path);
+    rmdir(dir);
+    free(source);
+    free(sample);
+
+    return 0;
+}
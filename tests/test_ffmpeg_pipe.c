@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/arena.h>
+#include <audiosync/config.h>
+#include <audiosync/ffmpeg_pipe.h>
+
+// The file is a second at a different rate than the configured one.
+#define FILE_RATE 44100
+#define RATE 16000
+// Frames that the resampler may add or remove at the ends.
+#define TOLERANCE 32
+// Exit code for CTest's SKIP_RETURN_CODE.
+#define SKIP 77
+
+
+// Returns whether ffmpeg is in one of the directories of $PATH.
+static int ffmpeg_installed() {
+    const char *env = getenv("PATH");
+    if (env == NULL) return 0;
+
+    char *dirs = strdup(env);
+    char path[1024];
+    int found = 0;
+    for (char *dir = strtok(dirs, ":"); dir && !found;
+            dir = strtok(NULL, ":")) {
+        snprintf(path, sizeof(path), "%s/ffmpeg", dir);
+        found = access(path, X_OK) == 0;
+    }
+    free(dirs);
+    return found;
+}
+
+static void put_u32(FILE *fp, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+static void put_u16(FILE *fp, uint16_t value) {
+    fwrite(&value, sizeof(value), 1, fp);
+}
+
+// Writes `len` frames of a positive tone into a mono WAV file of 64-bit
+// floats, so that none of its resampled frames are zero.
+static void write_wav(const char *path, size_t len, unsigned int rate) {
+    FILE *fp = fopen(path, "wb");
+    assert(fp != NULL);
+    const uint32_t data_size = len * sizeof(double);
+    fwrite("RIFF", 1, 4, fp);
+    put_u32(fp, 36 + data_size);
+    fwrite("WAVEfmt ", 1, 8, fp);
+    put_u32(fp, 16);
+    put_u16(fp, 3);  // IEEE float
+    put_u16(fp, 1);
+    put_u32(fp, rate);
+    put_u32(fp, rate * sizeof(double));
+    put_u16(fp, sizeof(double));
+    put_u16(fp, 8 * sizeof(double));
+    fwrite("data", 1, 4, fp);
+    put_u32(fp, data_size);
+    for (size_t i = 0; i < len; i++) {
+        const double value = 0.5 + 0.25 * sin(i * 2 * M_PI * 440 / rate);
+        fwrite(&value, sizeof(value), 1, fp);
+    }
+    assert(fclose(fp) == 0);
+}
+
+// Returns the number of frames before the zeroes that fill the buffer.
+static size_t decoded_frames(const double *buf, size_t len) {
+    while (len > 0 && buf[len - 1] == 0.0) len--;
+    return len;
+}
+
+// Testing that the decoded audio is resampled to the configured rate.
+int main() {
+    if (!ffmpeg_installed()) {
+        printf("ffmpeg isn't installed, skipping\n");
+        return SKIP;
+    }
+
+    char path[] = "/tmp/audiosync_test_XXXXXX.wav";
+    const int fd = mkstemps(path, 4);
+    assert(fd >= 0);
+    close(fd);
+    write_wav(path, FILE_RATE, FILE_RATE);
+
+    struct audiosync_config config = DEFAULT_CONFIG;
+    config.sample_rate = RATE;
+    assert(audiosync_configure(&config) == 0);
+
+    // Through a pipe, a second of the file is a second at the configured
+    // rate, and the rest of the buffer is left as zeroes.
+    printf(">> Test 1\n");
+    const size_t len = 2 * RATE;
+    double *buf = arena_alloc(len * sizeof(*buf));
+    assert(buf != NULL);
+    assert(ffmpeg_decode(path, buf, len) == 0);
+    size_t frames = decoded_frames(buf, len);
+    printf(">> Decoded %zu frames\n", frames);
+    assert(frames + TOLERANCE >= RATE && frames <= RATE + TOLERANCE);
+
+    // The same through the memfd transport.
+    printf(">> Test 2\n");
+    double *shared = arena_alloc_shared(len * sizeof(*shared));
+    assert(shared != NULL);
+    assert(ffmpeg_decode(path, shared, len) == 0);
+    frames = decoded_frames(shared, len);
+    assert(frames + TOLERANCE >= RATE && frames <= RATE + TOLERANCE);
+
+    // Only the frames requested are decoded when the file is longer.
+    printf(">> Test 3\n");
+    const size_t half = RATE / 2;
+    memset(shared, 0, len * sizeof(*shared));
+    assert(ffmpeg_decode(path, shared, half) == 0);
+    assert(decoded_frames(shared, len) == half);
+
+    arena_free(buf);
+    arena_free(shared);
+    unlink(path);
+
+    return 0;
+}
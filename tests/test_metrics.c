@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/metrics.h>
+
+#define LEN 4096
+#define SECOND 1000000000ULL
+
+
+// Returns the count of transforms of `len` frames.
+static uint64_t ffts(const struct audiosync_metrics *m, size_t len) {
+    for (size_t i = 0; i < METRICS_FFT_SIZES - 1; i++) {
+        if (m->ffts[i].len == len) return m->ffts[i].count;
+    }
+    return 0;
+}
+
+// Returns whether the file at `path` contains `line`.
+static int has_line(const char *path, const char *line) {
+    char buf[256];
+    int found = 0;
+    FILE *fp = fopen(path, "r");
+    assert(fp != NULL);
+    while (!found && fgets(buf, sizeof(buf), fp)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        found = strcmp(buf, line) == 0;
+    }
+    fclose(fp);
+    return found;
+}
+
+// Testing that the metrics are counted and exported correctly.
+int main() {
+    struct audiosync_metrics m;
+
+    // Everything is zero after a reset.
+    printf(">> Test 1\n");
+    metrics_add(runs, 3);
+    audiosync_reset_metrics();
+    audiosync_get_metrics(&m);
+    assert(m.runs == 0 && m.successes == 0 && m.alloc_bytes == 0);
+    assert(m.latency[STAGE_RUN].count == 0);
+
+    // The counters are added atomically.
+    printf(">> Test 2\n");
+    metrics_add(runs, 2);
+    metrics_add(bytes[STREAM_REFERENCE], 800);
+    audiosync_get_metrics(&m);
+    assert(m.runs == 2);
+    assert(m.bytes[STREAM_REFERENCE] == 800);
+    assert(m.bytes[STREAM_RECORDING] == 0);
+
+    // The latencies go to the bucket of their bound, and the longest ones
+    // to the last bucket.
+    printf(">> Test 3\n");
+    assert(metrics_bucket_bound(0) == METRICS_FIRST_BOUND);
+    assert(metrics_bucket_bound(3) == 8 * METRICS_FIRST_BOUND);
+    metrics_observe(STAGE_URL, metrics_now() - 3 * SECOND);
+    metrics_observe(STAGE_URL, metrics_now() - 1000 * SECOND);
+    audiosync_get_metrics(&m);
+    assert(m.latency[STAGE_URL].count == 2);
+    assert(m.latency[STAGE_URL].sum_ns >= 1003 * SECOND);
+    assert(m.latency[STAGE_URL].buckets[19] == 1);
+    assert(m.latency[STAGE_URL].buckets[METRICS_BUCKETS - 1] == 1);
+    assert(metrics_bucket_bound(18) < 3.0 && metrics_bucket_bound(19) > 3.0);
+
+    // Each length of the transforms has its own entry, until there's no
+    // more room.
+    printf(">> Test 4\n");
+    audiosync_reset_metrics();
+    for (size_t len = 1; len <= METRICS_FFT_SIZES + 4; len++) {
+        metrics_fft(len);
+        metrics_fft(len);
+    }
+    audiosync_get_metrics(&m);
+    assert(ffts(&m, 1) == 2);
+    assert(ffts(&m, METRICS_FFT_SIZES - 1) == 2);
+    assert(ffts(&m, METRICS_FFT_SIZES) == 0);
+    assert(m.ffts[METRICS_FFT_SIZES - 1].len == 0);
+    assert(m.ffts[METRICS_FFT_SIZES - 1].count == 2 * 5);
+
+    // A cross-correlation runs two forward transforms and an inverse one.
+    printf(">> Test 5\n");
+    audiosync_reset_metrics();
+    double *source = malloc(2 * LEN * sizeof(*source));
+    double *sample = malloc(LEN * sizeof(*sample));
+    for (size_t i = 0; i < 2 * LEN; i++) {
+        source[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    memcpy(sample, source + 100, LEN * sizeof(*sample));
+    long lag;
+    double coef;
+    assert(cross_correlation(source, sample, LEN, &lag, &coef) == 0);
+    assert(lag == 100);
+    audiosync_get_metrics(&m);
+    assert(ffts(&m, 2 * LEN) == 3);
+    assert(m.latency[STAGE_FFT].count == 2);
+    free(source);
+    free(sample);
+
+    // The Prometheus text has every metric, with cumulative buckets.
+    printf(">> Test 6\n");
+    char dir[] = "/tmp/audiosync_test_XXXXXX";
+    char path[sizeof(dir) + 32];
+    assert(mkdtemp(dir) != NULL);
+    snprintf(path, sizeof(path), "%s/audiosync.prom", dir);
+    audiosync_reset_metrics();
+    metrics_add(successes, 1);
+    metrics_add(reads[STREAM_RECORDING], 7);
+    metrics_fft(2 * LEN);
+    metrics_observe(STAGE_WAIT, metrics_now() - 3 * SECOND);
+    assert(audiosync_write_metrics(path) == 0);
+    assert(has_line(path, "audiosync_successes_total 1"));
+    assert(has_line(path, "audiosync_runs_total 0"));
+    assert(has_line(path, "audiosync_stream_reads_total{stream=\"recording\"}"
+                    " 7"));
+    assert(has_line(path, "audiosync_ffts_total{len=\"8192\"} 1"));
+    assert(has_line(path, "# TYPE audiosync_stage_seconds histogram"));
+    assert(has_line(path, "audiosync_stage_seconds_bucket{stage=\"wait\","
+                    "le=\"1.31072\"} 0"));
+    assert(has_line(path, "audiosync_stage_seconds_bucket{stage=\"wait\","
+                    "le=\"5.24288\"} 1"));
+    assert(has_line(path, "audiosync_stage_seconds_bucket{stage=\"wait\","
+                    "le=\"+Inf\"} 1"));
+    assert(has_line(path, "audiosync_stage_seconds_count{stage=\"wait\"} 1"));
+    assert(access(path, F_OK) == 0);
+    strcat(path, ".tmp");
+    assert(access(path, F_OK) < 0);
+    path[strlen(path) - 4] = '\0';
+    unlink(path);
+    rmdir(dir);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/periodicity.h>
+
+#define RATE 8000
+#define LEN (RATE * 20)
+// The repetitive reference has an intro, a loop of 1.5 seconds played 6
+// times, and then something else.
+#define INTRO (RATE * 4)
+#define PERIOD (RATE * 3 / 2)
+#define LOOPS 6
+
+
+static double noise() {
+    return (double) rand() / RAND_MAX - 0.5;
+}
+
+// Testing that the repetitions of a reference are detected, and that the
+// intervals that fit in them are ambiguous.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    config.sample_rate = RATE;
+    assert(audiosync_configure(&config) == 0);
+
+    double *ref = malloc(LEN * sizeof(*ref));
+    struct periodicity per;
+    srand(1234);
+
+    // Noise doesn't repeat.
+    printf(">> Test 1\n");
+    for (size_t i = 0; i < LEN; i++) {
+        ref[i] = noise();
+    }
+    assert(periodicity_analyze(ref, LEN, &per) == 0);
+    assert(per.n_periods == 0);
+    assert(!periodicity_ambiguous(&per, RATE));
+
+    // The loop is found, and the intervals are only ambiguous if they're
+    // shorter than the part that repeats (7.5 seconds).
+    printf(">> Test 2\n");
+    for (size_t i = INTRO + PERIOD; i < INTRO + LOOPS * PERIOD; i++) {
+        ref[i] = ref[i - PERIOD];
+    }
+    assert(periodicity_analyze(ref, LEN, &per) == 0);
+    printf(">> %zu periods, the first of %zu frames, repeated for %zu\n",
+           per.n_periods, per.periods[0], per.repeated);
+    assert(per.n_periods > 0);
+    assert(labs((long) per.periods[0] - PERIOD) <= RATE / 100);
+    assert(per.repeated >= (LOOPS - 1) * PERIOD);
+    assert(per.repeated <= (LOOPS - 1) * PERIOD + RATE);
+    assert(periodicity_ambiguous(&per, RATE * 6));
+    assert(!periodicity_ambiguous(&per, RATE * 10));
+
+    // The results are kept for the same reference.
+    printf(">> Test 3\n");
+    assert(periodicity_get(1, ref, LEN, &per) == 0);
+    assert(per.n_periods > 0);
+    for (size_t i = 0; i < LEN; i++) {
+        ref[i] = noise();
+    }
+    assert(periodicity_get(1, ref, LEN / 2, &per) == 0);
+    assert(per.n_periods > 0);
+    assert(periodicity_get(2, ref, LEN, &per) == 0);
+    assert(per.n_periods == 0);
+
+    free(ref);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/pool.h>
+
+#define MAX_TASKS 10000
+#define MAX_WORKERS 16
+
+
+// Times each task was run, and by which worker.
+static int runs[MAX_TASKS];
+static unsigned int workers[MAX_TASKS];
+
+static void task(void *ctx, unsigned int worker, size_t i) {
+    UNUSED(ctx);
+    __atomic_add_fetch(&runs[i], 1, __ATOMIC_RELAXED);
+    workers[i] = worker;
+}
+
+// The first tasks are much slower, so that the rest of the workers have to
+// steal them.
+static void slow_task(void *ctx, unsigned int worker, size_t i) {
+    if (i < 4) usleep(50000);
+    task(ctx, worker, i);
+}
+
+// Checks that every task was run exactly once by a valid worker.
+static void check(size_t n_tasks, unsigned int n_workers) {
+    for (size_t i = 0; i < n_tasks; i++) {
+        assert(runs[i] == 1);
+        assert(workers[i] < n_workers);
+    }
+}
+
+// Testing that the pool runs every task exactly once.
+int main() {
+    // A single worker runs everything.
+    printf(">> Test 1\n");
+    memset(runs, 0, sizeof(runs));
+    assert(pool_run(100, 1, &task, NULL) == 0);
+    check(100, 1);
+
+    // More tasks than workers, and the other way around.
+    printf(">> Test 2\n");
+    memset(runs, 0, sizeof(runs));
+    assert(pool_run(MAX_TASKS, MAX_WORKERS, &task, NULL) == 0);
+    check(MAX_TASKS, MAX_WORKERS);
+    memset(runs, 0, sizeof(runs));
+    assert(pool_run(3, MAX_WORKERS, &task, NULL) == 0);
+    check(3, MAX_WORKERS);
+
+    // No tasks at all.
+    printf(">> Test 3\n");
+    assert(pool_run(0, 4, &task, NULL) == 0);
+
+    // The tasks in the range of a slow worker are stolen by the rest.
+    printf(">> Test 4\n");
+    memset(runs, 0, sizeof(runs));
+    assert(pool_run(400, 4, &slow_task, NULL) == 0);
+    check(400, 4);
+    int stolen = 0;
+    for (size_t i = 4; i < 100; i++) {
+        if (workers[i] != 0) stolen = 1;
+    }
+    assert(stolen);
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/reference_cache.h>
+
+#define LEN 48000
+
+// Stores the same reference many times, as a thread.
+static void *store_repeatedly(void *arg) {
+    for (int i = 0; i < 20; i++) {
+        assert(refcache_store("title", arg, LEN) == 0);
+    }
+    return NULL;
+}
+
+// Testing that the references are saved and validated correctly by the
+// cache, in a temporary directory.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    char dir[] = "/tmp/audiosync_test_XXXXXX";
+    double *data = malloc(LEN * sizeof(*data));
+    const double *cached;
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(config.cache_dir, sizeof(config.cache_dir), "%s/nested/dir",
+             dir);
+    assert(audiosync_configure(&config) == 0);
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] = (double) i / LEN;
+    }
+
+    // Nothing is cached at first.
+    printf(">> Test 1\n");
+    assert(refcache_get("title", LEN) == NULL);
+
+    // After storing it, the same data is returned, aligned for FFTW.
+    printf(">> Test 2\n");
+    assert(refcache_store("title", data, LEN) == 0);
+    cached = refcache_get("title", LEN);
+    assert(cached != NULL);
+    assert((uintptr_t) cached % 64 == 0);
+    assert(memcmp(cached, data, LEN * sizeof(*data)) == 0);
+    refcache_release(cached);
+
+    // Shorter lengths can be used too, but not longer ones.
+    printf(">> Test 3\n");
+    cached = refcache_get("title", LEN / 2);
+    assert(cached != NULL);
+    refcache_release(cached);
+    assert(refcache_get("title", LEN + 1) == NULL);
+
+    // Other titles and sample rates aren't mixed up.
+    printf(">> Test 4\n");
+    assert(refcache_get("other title", LEN) == NULL);
+    config.sample_rate = 44100;
+    assert(audiosync_configure(&config) == 0);
+    assert(refcache_get("title", LEN) == NULL);
+
+    // Nothing is used if the cache is disabled.
+    printf(">> Test 5\n");
+    config.sample_rate = DEFAULT_SAMPLE_RATE;
+    config.reference_cache = 0;
+    assert(audiosync_configure(&config) == 0);
+    assert(refcache_get("title", LEN) == NULL);
+    assert(refcache_store("title", data, LEN) < 0);
+
+    // The spectra are saved for the intervals that fit in the reference, and
+    // they give the same results as transforming it.
+    printf(">> Test 6\n");
+    config.reference_cache = 1;
+    config.intervals[0] = 0.25;
+    config.intervals[1] = 0.5;
+    config.intervals[2] = 1.0;
+    config.n_intervals = 3;
+    config.track_window = 0.25;
+    assert(audiosync_configure(&config) == 0);
+    const size_t sample_len = LEN / 4;
+    double *sample = malloc(sample_len * sizeof(*sample));
+    long lag, expected;
+    double coef, expected_coef;
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] = (double) rand() / RAND_MAX - 0.5;
+    }
+    for (size_t i = 0; i < sample_len; i++) {
+        sample[i] = data[i + 1234];
+    }
+    assert(refcache_store("title", data, LEN) == 0);
+    cached = refcache_get("title", LEN);
+    assert(cached != NULL);
+    assert(refcache_spectrum(cached, sample_len) == NULL);
+    assert(refcache_store_spectra("title", cached, LEN, NULL, NULL) == 0);
+    assert(refcache_spectrum(cached, LEN / 2) != NULL);
+    assert(refcache_spectrum(cached, LEN) == NULL);
+    struct xcorr_params params = XCORR_DEFAULT_PARAMS;
+    assert(cross_correlation_ex((double *) cached, sample, sample_len,
+                                &params, &expected, &expected_coef) == 0);
+    params.source_spectrum = refcache_spectrum(cached, sample_len);
+    assert(params.source_spectrum != NULL);
+    assert(cross_correlation_ex((double *) cached, sample, sample_len,
+                                &params, &lag, &coef) == 0);
+    assert(lag == 1234 && lag == expected);
+    assert(coef == expected_coef);
+    refcache_release(cached);
+
+    // They're no longer used once the reference is replaced.
+    printf(">> Test 7\n");
+    assert(refcache_store("title", data, LEN) == 0);
+    cached = refcache_get("title", LEN);
+    assert(cached != NULL);
+    assert(refcache_spectrum(cached, sample_len) == NULL);
+    refcache_release(cached);
+    free(sample);
+
+    // Several threads can store the same reference at once, since each one
+    // writes its own temporary file.
+    printf(">> Test 8\n");
+    pthread_t threads[4];
+    for (size_t i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, store_repeatedly,
+                              data) == 0);
+    }
+    for (size_t i = 0; i < 4; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    cached = refcache_get("title", LEN);
+    assert(cached != NULL);
+    assert(memcmp(cached, data, LEN * sizeof(*data)) == 0);
+    refcache_release(cached);
+
+    // Cleaning up the temporary directory.
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    assert(system(command) == 0);
+    refcache_trim();
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/result_cache.h>
+
+#define LEN 48000
+
+
+// Testing the fingerprints and that the results are saved and found
+// correctly by the cache, in a temporary directory.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    char dir[] = "/tmp/audiosync_test_XXXXXX";
+    double *data = malloc(LEN * sizeof(*data));
+    uint64_t print, other;
+    long lag;
+
+    assert(mkdtemp(dir) != NULL);
+    snprintf(config.cache_dir, sizeof(config.cache_dir), "%s", dir);
+    assert(audiosync_configure(&config) == 0);
+    srand(1234);
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] = sin(i / 50.0) * ((double) rand() / RAND_MAX);
+    }
+
+    // The fingerprint is the same for the same data, and similar with a bit
+    // of noise or a different volume.
+    printf(">> Test 1\n");
+    print = fingerprint(data, LEN);
+    assert(print == fingerprint(data, LEN));
+    for (size_t i = 0; i < LEN; i++) {
+        data[i] = data[i] * 0.5 + 0.001 * ((double) rand() / RAND_MAX);
+    }
+    other = fingerprint(data, LEN);
+    printf(">> Distance: %d\n", __builtin_popcountll(print ^ other));
+    assert(__builtin_popcountll(print ^ other) < 8);
+
+    // Nothing is found at first, and the saved results are found with
+    // similar fingerprints.
+    printf(">> Test 2\n");
+    assert(resultcache_find("title", print, &lag) < 0);
+    assert(resultcache_store("title", print, 1234) == 0);
+    assert(resultcache_find("title", other, &lag) == 0);
+    assert(lag == 1234);
+    assert(resultcache_find("title", ~print, &lag) < 0);
+    assert(resultcache_find("other title", print, &lag) < 0);
+
+    // A similar fingerprint replaces the previous result.
+    printf(">> Test 3\n");
+    assert(resultcache_store("title", other, -50) == 0);
+    assert(resultcache_find("title", print, &lag) == 0);
+    assert(lag == -50);
+
+    // The results are saved in a file in the cache directory.
+    printf(">> Test 4\n");
+    char path[MAX_LONG_PATH + 16];
+    snprintf(path, sizeof(path), "%s/results.bin", dir);
+    FILE *fp = fopen(path, "rb");
+    assert(fp != NULL);
+    fclose(fp);
+
+    // Nothing is used if the cache is disabled.
+    printf(">> Test 5\n");
+    config.result_cache = 0;
+    assert(audiosync_configure(&config) == 0);
+    assert(resultcache_find("title", print, &lag) < 0);
+    assert(resultcache_store("title", print, 0) < 0);
+
+    // Cleaning up the temporary directory.
+    char command[128];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    assert(system(command) == 0);
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/ring.h>
+
+#define CAP 1000
+#define TOTAL 100000
+#define CHUNK 37
+
+
+static struct ring_event event = { 0 };
+
+// Producer thread writing the frames 0, 1, 2... in small chunks, waiting
+// when the ring is full.
+static void *producer(void *arg) {
+    struct ring *ring = arg;
+    size_t written = 0;
+    size_t avail;
+
+    while (written < TOTAL) {
+        double *dst = ring_write_ptr(ring, &avail);
+        if (avail == 0) {
+            ring_wait_space(ring, 100);
+            continue;
+        }
+        if (avail > CHUNK) avail = CHUNK;
+        if (avail > TOTAL - written) avail = TOTAL - written;
+        for (size_t i = 0; i < avail; i++) {
+            dst[i] = written + i;
+        }
+        ring_commit(ring, avail);
+        written += avail;
+    }
+    ring_close(ring);
+
+    return NULL;
+}
+
+// Testing the ring buffer with a producer and a consumer in different
+// threads, so that it wraps around many times.
+int main() {
+    struct ring ring;
+    double buf[CAP];
+    double window[CAP];
+    pthread_t th;
+    size_t pos = 0;
+    size_t wakeups = 0;
+
+    // The consumer waits for watermarks of half the capacity, checks that
+    // the frames are in order, and releases them.
+    printf(">> Test 1\n");
+    ring_init(&ring, buf, CAP, &event);
+    assert(pthread_create(&th, NULL, &producer, &ring) == 0);
+    while (pos < TOTAL) {
+        size_t target = pos + CAP / 2;
+        if (target > TOTAL) target = TOTAL;
+        ring_set_watermark(&ring, target);
+        while (1) {
+            unsigned int snapshot = event_snapshot(&event);
+            if (ring_count(&ring) >= target) break;
+            event_wait(&event, snapshot, -1);
+            wakeups++;
+        }
+
+        size_t n = ring_count(&ring) - pos;
+        ring_read(&ring, pos, window, n);
+        for (size_t i = 0; i < n; i++) {
+            assert(window[i] == (double) (pos + i));
+        }
+        pos += n;
+        ring_release(&ring, pos);
+    }
+    pthread_join(th, NULL);
+    assert(ring_is_closed(&ring));
+    assert(ring_count(&ring) == TOTAL);
+    // The consumer is only woken up at its watermarks, not after every
+    // chunk (spurious wakeups are possible but rare).
+    printf(">> %ld wakeups\n", wakeups);
+    assert(wakeups <= 2 * (TOTAL / (CAP / 2)));
+
+    // Linear usage: the data is kept at the start of the buffer when the
+    // frames aren't released.
+    printf(">> Test 2\n");
+    ring_init(&ring, buf, CAP, &event);
+    size_t avail;
+    double *dst = ring_write_ptr(&ring, &avail);
+    assert(dst == buf && avail == CAP);
+    dst[0] = 1.0;
+    dst[1] = 2.0;
+    ring_commit(&ring, 2);
+    dst = ring_write_ptr(&ring, &avail);
+    assert(dst == buf + 2 && avail == CAP - 2);
+    assert(ring_count(&ring) == 2);
+    assert(buf[0] == 1.0 && buf[1] == 2.0);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/session.h>
+
+#define RATE 8000
+#define BLOCK 80
+#define THRESHOLD 0.001
+#define GAP 2400
+// Frames fed to the detector at once, which aren't aligned to the blocks.
+#define CHUNK 1000
+
+// Fills `data` with tracks of noise separated by the silences in `gaps`.
+// Returns the total length.
+static size_t playlist(double *data, const size_t *tracks,
+                       const size_t *gaps, size_t n) {
+    size_t pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < tracks[i]; j++) {
+            data[pos++] = (double) rand() / RAND_MAX - 0.5;
+        }
+        for (size_t j = 0; j < gaps[i]; j++) {
+            // Some noise below the threshold.
+            data[pos++] = ((double) rand() / RAND_MAX - 0.5) * 1e-4;
+        }
+    }
+
+    return pos;
+}
+
+static void analyze(struct boundary_detector *det, const double *data,
+                    size_t len) {
+    for (size_t pos = 0; pos < len; pos += CHUNK) {
+        boundary_update(det, data + pos, len - pos < CHUNK ? len - pos
+                                                            : CHUNK);
+    }
+}
+
+
+// Testing the detection of the boundaries between tracks.
+int main() {
+    double *data = malloc(20 * RATE * sizeof(*data));
+    struct boundary_detector det;
+    size_t pos;
+    srand(1234);
+
+    // The beginning of the first track is a boundary, even after some
+    // silence, and the next tracks start after a long enough gap.
+    printf(">> Test 1\n");
+    const size_t tracks[] = { 3 * RATE, 4 * RATE, 2 * RATE };
+    const size_t gaps[] = { RATE / 2, RATE, 0 };
+    size_t len = playlist(data, tracks, gaps, 3);
+    boundary_init(&det, BLOCK, THRESHOLD, GAP);
+    analyze(&det, data, len);
+    assert(det.n_boundaries == 3);
+    assert(det.boundaries[0] == 0);
+    assert(det.boundaries[1] == 3 * RATE + RATE / 2);
+    assert(det.boundaries[2] == 7 * RATE + 3 * RATE / 2);
+
+    // The last boundary within a range.
+    printf(">> Test 2\n");
+    assert(boundary_last(&det, 0, len, &pos) == 0);
+    assert(pos == 7 * RATE + 3 * RATE / 2);
+    assert(boundary_last(&det, 0, 5 * RATE, &pos) == 0);
+    assert(pos == 3 * RATE + RATE / 2);
+    assert(boundary_last(&det, RATE, 3 * RATE, &pos) == -1);
+
+    // Shorter silences, like the pauses within a song, aren't boundaries.
+    printf(">> Test 3\n");
+    const size_t short_gaps[] = { GAP / 2, GAP - 2 * BLOCK, 0 };
+    len = playlist(data, tracks, short_gaps, 3);
+    boundary_init(&det, BLOCK, THRESHOLD, GAP);
+    analyze(&det, data, len);
+    assert(det.n_boundaries == 1);
+    assert(det.boundaries[0] == 0);
+
+    // Leading silence and positions not aligned to the blocks.
+    printf(">> Test 4\n");
+    const size_t silent_first[] = { 0, 2 * RATE };
+    const size_t silent_gaps[] = { RATE, 0 };
+    len = playlist(data, silent_first, silent_gaps, 2);
+    boundary_init(&det, BLOCK, THRESHOLD, GAP);
+    analyze(&det, data, len);
+    assert(det.n_boundaries == 1);
+    assert(det.boundaries[0] == RATE);
+
+    // Only the last boundaries are kept.
+    printf(">> Test 5\n");
+    size_t many[SESSION_MAX_BOUNDARIES + 2];
+    size_t many_gaps[SESSION_MAX_BOUNDARIES + 2];
+    for (size_t i = 0; i < SESSION_MAX_BOUNDARIES + 2; i++) {
+        many[i] = RATE / 2;
+        many_gaps[i] = RATE / 2;
+    }
+    len = playlist(data, many, many_gaps, SESSION_MAX_BOUNDARIES + 2);
+    boundary_init(&det, BLOCK, THRESHOLD, GAP);
+    analyze(&det, data, len);
+    assert(det.n_boundaries == SESSION_MAX_BOUNDARIES);
+    assert(det.boundaries[0] == 2 * RATE);
+    assert(det.boundaries[SESSION_MAX_BOUNDARIES - 1]
+           == (SESSION_MAX_BOUNDARIES + 1) * RATE);
+
+    free(data);
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/sign_correlation.h>
+
+#define LEN 16000
+#define BITS 1000
+
+
+static double noise() {
+    return (double) rand() / RAND_MAX - 0.5;
+}
+
+// The bits that differ, one at a time.
+static size_t naive_count(const uint64_t *a, const uint64_t *b, size_t off,
+                          size_t nbits) {
+    size_t count = 0;
+    for (size_t i = 0; i < nbits; i++) {
+        const int x = (a[i / 64] >> (i % 64)) & 1;
+        const int y = (b[(off + i) / 64] >> ((off + i) % 64)) & 1;
+        count += x != y;
+    }
+
+    return count;
+}
+
+static int cancel_always(void *ctx) {
+    UNUSED(ctx);
+    return 1;
+}
+
+// Testing the XOR/popcount kernels and the lags found with them.
+int main() {
+    double *source = malloc(2 * LEN * sizeof(*source));
+    double *sample = malloc(LEN * sizeof(*sample));
+    struct xcorr_params params = XCORR_DEFAULT_PARAMS;
+    long lag;
+    double coef;
+    srand(1234);
+
+    // Packing the signs, with and without decimation.
+    printf(">> Test 1\n");
+    const double data[] = { 1.0, -1.0, 2.0, 3.0, -4.0, -5.0, 0.5, 0.4 };
+    uint64_t bits[2];
+    assert(sign_words(8) == 2);
+    assert(sign_pack(data, 8, 1, bits) == 8);
+    assert(bits[0] == 0xcd && bits[1] == 0);
+    assert(sign_pack(data, 8, 2, bits) == 4);
+    assert(bits[0] == 0xb);
+
+    // Every kernel supported by the CPU counts the same bits as the naive
+    // loop, for any offset and length.
+    printf(">> Test 2\n");
+    uint64_t a[BITS / 64 + 2];
+    uint64_t b[2 * BITS / 64 + 2];
+    for (size_t i = 0; i < sizeof(a) / sizeof(*a); i++) {
+        a[i] = ((uint64_t) rand() << 33) ^ ((uint64_t) rand() << 11) ^ rand();
+    }
+    for (size_t i = 0; i < sizeof(b) / sizeof(*b); i++) {
+        b[i] = ((uint64_t) rand() << 33) ^ ((uint64_t) rand() << 11) ^ rand();
+    }
+    const sign_kernel_t best = sign_kernel();
+    for (int k = SIGN_KERNEL_SCALAR; k <= SIGN_KERNEL_AVX512; k++) {
+        if (sign_set_kernel(k) < 0) {
+            printf(">> Kernel %s not supported\n", sign_kernel_to_string(k));
+            continue;
+        }
+        printf(">> Kernel %s\n", sign_kernel_to_string(k));
+        for (size_t off = 0; off < BITS; off += 37) {
+            for (size_t nbits = 1; nbits <= BITS; nbits += 61) {
+                assert(sign_xor_count(a, b, off, nbits)
+                       == naive_count(a, b, off, nbits));
+            }
+        }
+    }
+    assert(sign_set_kernel(best) == 0);
+
+    // The lag of noise is found, in both directions, with the same results
+    // as the cross-correlation.
+    printf(">> Test 3\n");
+    for (size_t i = 0; i < 2 * LEN; i++) {
+        source[i] = noise();
+    }
+    const long lags[] = { 1234, 0, -777, LEN / 2 + 3 };
+    for (size_t i = 0; i < sizeof(lags) / sizeof(*lags); i++) {
+        for (size_t j = 0; j < LEN; j++) {
+            const long pos = (long) j + lags[i];
+            sample[j] = (pos >= 0 ? source[pos] : noise()) + 0.5 * noise();
+        }
+        for (unsigned int threads = 1; threads <= 2; threads++) {
+            params.threads = threads;
+            params.decimation = 4;
+            assert(sign_correlation(source, sample, LEN, &params, &lag,
+                                    &coef) == 0);
+            printf(">> Lag %ld with confidence %f\n", lag, coef);
+            assert(lag == lags[i]);
+            assert(coef > 0.8);
+        }
+        long fft_lag;
+        double fft_coef;
+        assert(cross_correlation(source, sample, LEN, &fft_lag,
+                                 &fft_coef) == 0);
+        assert(fft_lag == lag);
+        assert(fft_coef == coef);
+    }
+
+    // The maximum lag is respected.
+    printf(">> Test 4\n");
+    params.max_lag = 1000;
+    assert(sign_correlation(source, sample, LEN, &params, &lag, &coef) == 0);
+    assert(labs(lag) <= 1000);
+    assert(coef < 0.1);
+    params.max_lag = 0;
+
+    // A constant sample and a cancelled search fail.
+    printf(">> Test 5\n");
+    for (size_t i = 0; i < LEN; i++) {
+        sample[i] = 0.0;
+    }
+    assert(sign_correlation(source, sample, LEN, &params, &lag, &coef) < 0);
+    sample[0] = 1.0;
+    params.cancel = cancel_always;
+    assert(sign_correlation(source, sample, LEN, &params, &lag, &coef) < 0);
+
+    free(source);
+    free(sample);
+
+    return 0;
+}
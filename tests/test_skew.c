@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/cross_correlation.h>
+#include <audiosync/skew.h>
+
+#define RATE 8000
+#define LEN (RATE * 8)
+#define LAG 1000
+#define PPM 300.0
+
+
+// Obtains the value of the data at a fractional position with linear
+// interpolation.
+static double interpolate(const double *data, double x) {
+    const size_t i = x;
+    return data[i] + (x - i) * (data[i+1] - data[i]);
+}
+
+// Testing that the skew is estimated correctly from a recording that runs
+// slower than the reference, and that compensating it sharpens the peak.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    config.sample_rate = RATE;
+    config.threads = 1;
+    assert(audiosync_configure(&config) == 0);
+
+    double *source = malloc((2 * LEN + 1) * sizeof(*source));
+    double *sample = malloc(LEN * sizeof(*sample));
+    double *buf = malloc(LEN * sizeof(*buf));
+    long lag;
+    double coef, ppm, fit_lag;
+
+    // Smoothed noise, so that the interpolation is accurate.
+    srand(1234);
+    double prev = 0.0;
+    for (size_t i = 0; i < 2 * LEN + 1; i++) {
+        prev = 0.5 * prev + ((double) rand() / RAND_MAX - 0.5);
+        source[i] = prev;
+    }
+    for (size_t i = 0; i < LEN; i++) {
+        sample[i] = interpolate(source, LAG + i * (1.0 + PPM * 1e-6));
+    }
+
+    // The skew smears the peak of the whole sample.
+    printf(">> Test 1\n");
+    assert(cross_correlation(source, sample, LEN, &lag, &coef) == 0);
+    printf(">> Lag %ld with confidence %f\n", lag, coef);
+    assert(coef < config.min_confidence);
+
+    // The sub-windows obtain the skew and the lag at the beginning.
+    printf(">> Test 2\n");
+    assert(skew_estimate(source, sample, LEN, lag, &ppm, &fit_lag) == 0);
+    printf(">> Skew %f ppm, starting at %f\n", ppm, fit_lag);
+    assert(fabs(ppm - PPM) < 20.0);
+    assert(fabs(fit_lag - LAG) < 2.0);
+
+    // Compensating it obtains the lag with enough confidence.
+    printf(">> Test 3\n");
+    assert(skew_correlation(source, sample, LEN, NULL, buf, &lag, &coef,
+                            &ppm) == 0);
+    printf(">> Lag %ld with confidence %f\n", lag, coef);
+    assert(labs(lag - LAG) <= 1);
+    assert(coef >= config.min_confidence);
+
+    // Without skew, the estimation is close to zero and nothing changes.
+    printf(">> Test 4\n");
+    for (size_t i = 0; i < LEN; i++) {
+        sample[i] = source[LAG + i];
+    }
+    assert(skew_correlation(source, sample, LEN, NULL, buf, &lag, &coef,
+                            &ppm) == 0);
+    assert(lag == LAG);
+    assert(coef > 0.99);
+    assert(fabs(ppm) < 5.0);
+
+    free(source);
+    free(sample);
+    free(buf);
+
+    return 0;
+}
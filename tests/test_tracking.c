@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <audiosync/audiosync.h>
+#include <audiosync/config.h>
+#include <audiosync/ring.h>
+#include <audiosync/tracking.h>
+
+#define RATE 8000
+#define CAP_LEN (RATE * 12)
+#define SOURCE_LEN (CAP_LEN + RATE)
+// The recording starts 800 frames into the song, drifting a frame every
+// 4000, and then it jumps 1500 frames forward, like after a seek.
+#define START_LAG 800
+#define JUMP_POS (RATE * 6)
+#define JUMP_LAG 1500
+
+
+static long true_lag(size_t pos) {
+    return START_LAG + pos / 4000 + (pos >= JUMP_POS ? JUMP_LAG : 0);
+}
+
+// Writes the data into the ring until it has `len` frames.
+static void feed(struct ring *ring, const double *data, size_t len) {
+    while (ring_count(ring) < len) {
+        size_t avail;
+        double *ptr = ring_write_ptr(ring, &avail);
+        const size_t pos = ring_count(ring);
+        const size_t n = avail < len - pos ? avail : len - pos;
+        assert(n > 0);
+        memcpy(ptr, data + pos, n * sizeof(*ptr));
+        ring_commit(ring, n);
+    }
+}
+
+// Testing that the tracker follows a drifting lag, and that it finds it
+// again after a jump.
+int main() {
+    struct audiosync_config config = DEFAULT_CONFIG;
+    config.sample_rate = RATE;
+    config.intervals[0] = 0.5;
+    config.intervals[1] = 1;
+    config.n_intervals = 2;
+    config.track_period = 0.5;
+    config.track_window = 0.25;
+    config.threads = 1;
+    assert(audiosync_configure(&config) == 0);
+    const struct derived_config *derived = get_config();
+
+    double *source = malloc(SOURCE_LEN * sizeof(*source));
+    double *capture = malloc(CAP_LEN * sizeof(*capture));
+    srand(1234);
+    for (size_t i = 0; i < SOURCE_LEN; i++) {
+        source[i] = sin(i / 20.0) * ((double) rand() / RAND_MAX - 0.5);
+    }
+    for (size_t i = 0; i < CAP_LEN; i++) {
+        capture[i] = source[i + true_lag(i)];
+    }
+
+    // The rings are only as big as the tracker requires.
+    const size_t cap_size = derived->len_sample + tracker_headroom();
+    const size_t down_size = derived->len_source + tracker_headroom();
+    double *cap_buf = malloc(cap_size * sizeof(*cap_buf));
+    double *down_buf = malloc(down_size * sizeof(*down_buf));
+    struct ring_event event = { 0 };
+    struct ring cap_ring, down_ring;
+    ring_init(&cap_ring, cap_buf, cap_size, &event);
+    ring_init(&down_ring, down_buf, down_size, &event);
+
+    printf(">> Test 1\n");
+    struct tracker tr;
+    assert(tracker_init(&tr, START_LAG, derived->interv_sample[0]) == 0);
+    int lost = 0;
+    int found = 0;
+    while (1) {
+        size_t cap_len, down_len;
+        tracker_needed(&tr, &cap_len, &down_len);
+        if (cap_len > CAP_LEN) break;
+        assert(down_len <= SOURCE_LEN);
+        feed(&cap_ring, capture, cap_len);
+        feed(&down_ring, source, down_len);
+
+        const size_t pos = tr.pos;
+        const int ret = tracker_update(&tr, &cap_ring, &down_ring);
+        printf(">> pos=%zu ret=%d lag=%f truth=%ld confidence=%f\n", pos,
+               ret, tr.lag, true_lag(pos - 1), tr.confidence);
+
+        if (pos < JUMP_POS) {
+            // The drift is followed closely before the jump.
+            assert(ret == 0);
+            assert(fabs(tr.lag - true_lag(pos - 1)) <= 5.0);
+        } else if (pos - derived->track_window >= JUMP_POS && !found) {
+            // The lag is lost after the jump, until it's searched again.
+            if (ret < 0) {
+                lost++;
+            } else {
+                assert(lost > 0);
+                assert(fabs(tr.lag - true_lag(pos - 1)) <= 2.0);
+                found = 1;
+            }
+        } else if (found) {
+            // And then it's tracked as usual.
+            assert(ret == 0);
+            assert(fabs(tr.lag - true_lag(pos - 1)) <= 5.0);
+        }
+    }
+    assert(found);
+    assert(lost <= 4);
+
+    tracker_free(&tr);
+    free(cap_buf);
+    free(down_buf);
+    free(source);
+    free(capture);
+
+    return 0;
+}